@@ -29,12 +29,56 @@ int parse_args(int argc, char** argv, rtCfg* cfg) {
   struct arg_str* mtl_file =
       arg_str0(NULL, "mtl", "<file.mtl>", "Input MTL file (optional)");
   struct arg_lit* verbose = arg_lit0("v", "verbose", "Enable verbose logging");
+  struct arg_str* bvh =
+      arg_str0(NULL, "bvh", "<name>",
+               "BVH builder: sah, sbvh, median, lbvh, lbvh_sah, bvh4, "
+               "bvh8, compact, compact_q8, lazy, linear");
+  struct arg_int* leaf_size =
+      arg_int0(NULL, "leaf-size", "<int>", "Max faces per BVH leaf");
+  struct arg_int* bins =
+      arg_int0(NULL, "bins", "<int>", "SAH bins per axis (2-64)");
+  struct arg_dbl* split_budget =
+      arg_dbl0(NULL, "split-budget", "<float>",
+               "SBVH extra references per face (default: 0.3)");
+  struct arg_lit* two_level =
+      arg_lit0(NULL, "two-level", "One BVH per object under a top-level BVH");
+  struct arg_int* lod = arg_int0(
+      NULL, "lod", "<int>", "Coarser mesh levels per object for wide rays");
+  struct arg_str* bvh_cache = arg_str0(
+      NULL, "bvh-cache", "<file>", "Reuse or save the BVH in this file");
+  struct arg_lit* bvh_stats =
+      arg_lit0(NULL, "bvh-stats", "Log BVH quality statistics");
+  struct arg_int* stats_rays = arg_int0(
+      NULL, "stats-rays", "<int>", "Camera rays traced for --bvh-stats");
+  struct arg_int* packet =
+      arg_int0(NULL, "packet", "<int>",
+               "Camera rays per packet, 1..16 (1 = no packets)");
+  struct arg_lit* wavefront =
+      arg_lit0(NULL, "wavefront", "Trace in sorted batches, stage by stage");
+  struct arg_int* threads = arg_int0(
+      NULL, "threads", "<int>", "Render threads (default: one per CPU)");
+  struct arg_int* seed =
+      arg_int0(NULL, "seed", "<int>", "Sampler seed (default: 0)");
+  struct arg_lit* analytic = arg_lit0(
+      NULL, "analytic", "Intersect quads, discs and spheres analytically");
+  struct arg_int* spp = arg_int0(
+      NULL, "spp", "<int>", "Samples per pixel, most with --adaptive (64)");
+  struct arg_dbl* adaptive =
+      arg_dbl0(NULL, "adaptive", "<float>",
+               "Stop a pixel once its color is known to +-this (e.g. 0.01)");
+  struct arg_int* min_spp = arg_int0(
+      NULL, "min-spp", "<int>", "Samples per pixel before --adaptive stops");
   // clang-format: on
 
   struct arg_end* end = arg_end(20);
 
-  void*       argtable[] = { help,     width,    height,  output,
-                             obj_file, mtl_file, verbose, end };
+  void*       argtable[] = { help,      width,     height,       output,
+                             obj_file,  mtl_file,  verbose,      bvh,
+                             leaf_size, bins,      split_budget, two_level,
+                             lod,       bvh_cache, bvh_stats,    stats_rays,
+                             packet,    wavefront, threads,      seed,
+                             analytic,  spp,       adaptive,     min_spp,
+                             end };
   const char* progname   = "raytracer";
   int         errors     = arg_parse(argc, argv, argtable);
 
@@ -57,12 +101,30 @@ int parse_args(int argc, char** argv, rtCfg* cfg) {
   }
 
   // Assign values with defaults
-  cfg->width    = width->count ? *width->ival : DEFAULT_WIDTH;
-  cfg->height   = height->count ? *height->ival : DEFAULT_HEIGHT;
-  cfg->output   = output->count ? output->sval[0] : DEFAULT_OUTPUT;
-  cfg->obj_file = obj_file->count ? obj_file->sval[0] : NULL;
-  cfg->mtl_file = mtl_file->count ? mtl_file->sval[0] : NULL;
-  cfg->verbose  = verbose->count;
+  cfg->width         = width->count ? *width->ival : DEFAULT_WIDTH;
+  cfg->height        = height->count ? *height->ival : DEFAULT_HEIGHT;
+  cfg->output        = output->count ? output->sval[0] : DEFAULT_OUTPUT;
+  cfg->obj_file      = obj_file->count ? obj_file->sval[0] : NULL;
+  cfg->mtl_file      = mtl_file->count ? mtl_file->sval[0] : NULL;
+  cfg->verbose       = verbose->count;
+  cfg->bvh           = bvh->count ? bvh->sval[0] : DEFAULT_BVH;
+  cfg->bvh_leaf_size = leaf_size->count ? *leaf_size->ival : 0;
+  cfg->bvh_bins      = bins->count ? *bins->ival : 0;
+  cfg->bvh_split_budget =
+      split_budget->count ? (float)*split_budget->dval : -1.0f;
+  cfg->bvh_two_level  = two_level->count;
+  cfg->bvh_lod        = lod->count ? *lod->ival : 0;
+  cfg->bvh_cache      = bvh_cache->count ? bvh_cache->sval[0] : NULL;
+  cfg->bvh_stats      = bvh_stats->count;
+  cfg->bvh_stats_rays = stats_rays->count ? *stats_rays->ival : 0;
+  cfg->packet_size    = packet->count ? *packet->ival : 0;
+  cfg->wavefront      = wavefront->count;
+  cfg->threads        = threads->count ? *threads->ival : 0;
+  cfg->seed           = seed->count ? (unsigned)*seed->ival : 0;
+  cfg->analytic       = analytic->count;
+  cfg->samples        = spp->count ? *spp->ival : 0;
+  cfg->adaptive       = adaptive->count ? (float)*adaptive->dval : 0.0f;
+  cfg->min_samples    = min_spp->count ? *min_spp->ival : 0;
 
   if (!cfg->obj_file) {
     fprintf(stderr, "Error: --obj <file.obj> is required\n");
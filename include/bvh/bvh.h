@@ -2,9 +2,29 @@
 #define BVH_H
 #include <stdbool.h>
 #include <stdint.h>
+#include "raytracer.h"
 #include "wavefront.h"
 
 // bvh.h
+#define BVH_DEFAULT_LEAF_SIZE    4
+#define BVH_DEFAULT_BIN_COUNT    16
+#define BVH_MAX_BIN_COUNT        64
+#define BVH_DEFAULT_SPLIT_BUDGET 0.3f
+#define BVH_STATS_DEPTHS         64 // deeper leaves count in the last bucket
+#define BVH_STATS_LEAF_SIZES     32 // larger leaves count in the last bucket
+#define BVH_PACKET_MAX           16 // rays per bvh_intersect_packet() call
+
+typedef struct bvh_shape_s bvh_shape_t;
+
+// Builder tuning; strategies ignore the fields they have no use for
+typedef struct {
+  uint32_t           max_leaf_size; // faces per leaf
+  uint32_t           bin_count;     // SAH bins per axis
+  uint32_t           threads;       // build threads, 0 = one per CPU
+  float              split_budget;  // SBVH: extra references per face
+  const bvh_shape_t* shapes;        // per face (bvh_shape.h), NULL = none
+} bvh_build_params_t;
+
 typedef struct bvh_node_s {
   wf_vec3 bbox_min;
   wf_vec3 bbox_max;
@@ -21,12 +41,122 @@ typedef struct bvh_node_s {
   bool is_leaf;
 } bvh_node_t;
 
+typedef struct bvh_tri_buffer_s bvh_tri_buffer_t;
+
 typedef struct bvh_tree_s {
   bvh_node_t*           nodes;
   size_t                node_count;
   size_t                node_cap;
-  const wf_face*        faces; // pointer to original faces
-  const wf_scene_t*     scene; // pointer to scene (for vertex lookup)
-  const struct bvh_ops* ops;   // back-pointer to ops
+  uint32_t*             face_indices; // leaf ranges index into this array
+  size_t                index_count;  // > face_count if faces are duplicated
+  const wf_face*        faces;        // pointer to original faces
+  size_t                face_count;
+  wf_vec3               bbox_min;     // bounds of all faces
+  wf_vec3               bbox_max;
+  const wf_scene_t*     scene;        // pointer to scene (for vertex lookup)
+  const struct bvh_ops* ops;          // back-pointer to ops
+  void*                 priv;         // strategy-specific node data
+  bvh_tri_buffer_t*     tris;         // leaf-ordered triangles (bvh_tri.h)
+  const bvh_shape_t*    shapes;       // per face, NULL = all triangles
+  float                 sah_cost;     // bvh_refit() reference, 0 = unknown
 } bvh_tree_t;
+
+// Closest-hit result. Only geometric data is filled in by the traversal;
+// normals and other shading data are resolved from face_idx by the caller.
+typedef struct {
+  float    t;
+  float    u, v;     // barycentrics of the hit point on the face
+  uint32_t face_idx; // index into tree->faces
+  int      material_idx;
+} bvh_hit_t;
+
+// Tree quality report from bvh_stats(); the per-ray figures are filled in
+// by bvh_stats_trace()
+typedef struct {
+  size_t node_count;      // inner nodes and leaves
+  size_t leaf_count;
+  size_t max_depth;       // root at depth 0
+  size_t reference_count; // faces in leaves, > face_count with duplicates
+  size_t depth_histogram[BVH_STATS_DEPTHS];         // leaves per depth
+  size_t leaf_size_histogram[BVH_STATS_LEAF_SIZES]; // leaves per face count
+  float  sah_cost;      // relative to the root's surface area
+  double surface_area;  // summed over every node
+  size_t memory_bytes;  // tree, nodes, face indices and triangle buffer
+  size_t ray_count;     // rays traced, 0 if none were
+  double nodes_per_ray; // average nodes visited
+  double tris_per_ray;  // average triangles tested
+} bvh_stats_t;
+
+void        bvh_build_params_init(bvh_build_params_t* params);
+bvh_tree_t* bvh_create(const char* type, const wf_face* faces,
+                       size_t face_count, const wf_scene_t* scene,
+                       const bvh_build_params_t* params);
+// Like bvh_create(), but reuses the tree stored at cache_path when it was
+// written for the same faces, strategy and params; the file is mapped, not
+// read. Otherwise the tree is built and the file (re)written, which only
+// strategies with the binary node layout support. A NULL cache_path is the
+// same as bvh_create().
+bvh_tree_t* bvh_create_cached(const char* cache_path, const char* type,
+                              const wf_face* faces, size_t face_count,
+                              const wf_scene_t*         scene,
+                              const bvh_build_params_t* params);
+bool        bvh_intersect(const bvh_tree_t* tree, const ray_t* ray,
+                          float* t_hit);
+bool bvh_intersect_closest(const bvh_tree_t* tree, const ray_t* ray,
+                           float t_min, float t_max, bvh_hit_t* hit);
+// Occlusion query (shadow rays): true if anything lies in (t_min, t_max)
+bool bvh_occluded(const bvh_tree_t* tree, const ray_t* ray, float t_min,
+                  float t_max);
+// Packet queries: ray k is tested over (t_min, t_max[k]) and bit k of the
+// result is set if it hits (hits[k] then holds the closest hit) or is
+// occluded. Up to BVH_PACKET_MAX rays; packets whose rays share direction
+// signs (camera rays of one pixel, shadow rays toward one light) are traced
+// together by strategies that support it, anything else one ray at a time.
+uint32_t bvh_intersect_packet(const bvh_tree_t* tree, const ray_t* rays,
+                              uint32_t count, float t_min, const float* t_max,
+                              bvh_hit_t* hits);
+uint32_t bvh_occluded_packet(const bvh_tree_t* tree, const ray_t* rays,
+                             uint32_t count, float t_min, const float* t_max);
+// Batch queries over any number of independent rays (a wavefront stage):
+// ray i is tested over (t_min, t_max[i]) and hit[i] (hits[i] then holding
+// the closest hit) or occluded[i] set. On scenes too large for the cache,
+// strategies that support it keep several rays in flight and prefetch each
+// one's next nodes while the others are traced, hiding memory latency;
+// otherwise the rays are traced one after another. Return the number of
+// rays hit or occluded.
+size_t   bvh_intersect_stream(const bvh_tree_t* tree, const ray_t* rays,
+                              size_t count, float t_min, const float* t_max,
+                              bvh_hit_t* hits, bool* hit);
+size_t   bvh_occluded_stream(const bvh_tree_t* tree, const ray_t* rays,
+                             size_t count, float t_min, const float* t_max,
+                             bool* occluded);
+void     bvh_destroy(bvh_tree_t* tree);
+
+// Updates the tree after scene->vertices moved while the faces stayed the
+// same: bounds are refitted bottom-up in O(n) instead of rebuilding. With
+// rebuild_ratio > 0 the SAH cost is monitored, and once refitting has made
+// it worse than rebuild_ratio times the cost after the last build, the tree
+// is rebuilt in place. params (may be NULL) give the threads and any
+// rebuild's settings. Returns false if a rebuild failed; the tree then
+// still holds the refitted hierarchy.
+bool bvh_refit(bvh_tree_t* tree, const bvh_build_params_t* params,
+               float rebuild_ratio);
+
+// Re-encodes a tree built with the binary node layout ("median", "sah",
+// "lbvh", "lbvh_sah") as 32-byte depth-first nodes, or with quantize set as
+// 16-byte nodes holding 8-bit bounds relative to their parent. The tree
+// keeps working with the same API; returns false (tree untouched) if it is
+// not in the binary layout or memory runs out.
+bool bvh_compact(bvh_tree_t* tree, bool quantize);
+
+// Walks the tree and fills stats (clearing the per-ray figures). Strategies
+// expose their nodes through a common view, so the figures compare across
+// layouts; a wide node counts once with its leaves as separate nodes.
+// Returns false for strategies without a hierarchy ("linear").
+bool bvh_stats(const bvh_tree_t* tree, bvh_stats_t* stats);
+// Traces rays as closest-hit queries over (1e-4, inf) with a generic
+// front-to-back traversal and stores the average nodes visited and
+// triangles tested per ray. Returns false like bvh_stats().
+bool bvh_stats_trace(const bvh_tree_t* tree, const ray_t* rays, size_t count,
+                     bvh_stats_t* stats);
 #endif
@@ -0,0 +1,102 @@
+// bvh_build.h (internal)
+// Generic top-down builder for the binary bvh_node_t layout. A strategy only
+// supplies the split rule; recursion, node allocation and multi-threading are
+// handled here.
+#ifndef BVH_BUILD_H
+#define BVH_BUILD_H
+
+#include "bvh/bvh_util.h"
+
+// Below this many faces a build always runs on the calling thread
+#define BVH_PARALLEL_MIN_FACES 16384
+
+// Ranges of at least this many faces are bounded, binned and partitioned
+// by all the workers of the build, in fixed blocks
+#define BVH_RANGE_PARALLEL_MIN_FACES 65536
+
+// Relative cost of visiting a node vs. testing a triangle
+#define BVH_SAH_TRAVERSAL_COST 1.0f
+#define BVH_SAH_INTERSECT_COST 1.0f
+
+// Faces [start, end) of the index array, with their bounds
+typedef struct {
+  size_t  start;
+  size_t  end;
+  wf_vec3 bbox_min;
+  wf_vec3 bbox_max;
+  wf_vec3 centroid_min;
+  wf_vec3 centroid_max;
+} bvh_range_t;
+
+typedef struct bvh_build_ctx_s bvh_build_ctx_t;
+
+// Partitions ctx->face_indices over the range in place and returns the first
+// index of the right half; returning range->start or range->end makes the
+// range a leaf. Runs concurrently on disjoint ranges.
+typedef size_t (*bvh_split_fn)(const bvh_build_ctx_t* ctx,
+                               const bvh_range_t*     range);
+
+struct bvh_build_ctx_s {
+  const bvh_prim_info_t*    info;
+  uint32_t*                 face_indices;
+  const bvh_build_params_t* params;
+  bvh_split_fn              split;
+  unsigned                  workers; // for the largest ranges, 0 = 1
+};
+
+// Split rule of "sah", for strategies that split ranges the same way
+size_t bvh_sah_split(const bvh_build_ctx_t* ctx, const bvh_range_t* range);
+
+// Growable node array, one per build thread
+typedef struct {
+  bvh_node_t* nodes;
+  size_t      count;
+  size_t      cap;
+} bvh_node_array_t;
+
+// Worker count for a build: params->threads (0 = one per CPU), or 1 when
+// the mesh is too small to be worth it
+unsigned bvh_build_workers(const bvh_build_params_t* params,
+                           size_t                    face_count);
+
+// Index of a new node, UINT32_MAX if the array cannot grow
+uint32_t bvh_node_array_alloc(bvh_node_array_t* arr);
+
+// Workers that share the bounds and split of a range of `count` faces
+unsigned bvh_range_workers(const bvh_build_ctx_t* ctx, size_t count);
+
+// Faces [begin, end) of block `block` of `blocks` equal parts of a range
+static inline void bvh_range_block(const bvh_range_t* range, unsigned block,
+                                   unsigned blocks, size_t* begin,
+                                   size_t* end) {
+  size_t count = range->end - range->start;
+  *begin       = range->start + count * block / blocks;
+  *end         = range->start + count * (block + 1) / blocks;
+}
+
+// Bounds of ctx->face_indices[start, end)
+void bvh_range_init(const bvh_build_ctx_t* ctx, size_t start, size_t end,
+                    bvh_range_t* range);
+
+// Whether face f goes to the left of a bvh_range_partition()
+typedef bool (*bvh_face_side_fn)(const void* arg, uint32_t f);
+
+// Moves the faces of range->start..end that go left ahead of the others
+// and returns the first of the others. Ranges of
+// BVH_RANGE_PARALLEL_MIN_FACES or more are partitioned stably on their
+// workers, so the order does not depend on the thread count; smaller ones
+// are swapped in place.
+size_t bvh_range_partition(const bvh_build_ctx_t* ctx,
+                           const bvh_range_t* range, bvh_face_side_fn left,
+                           const void* arg);
+
+// Builds a complete tree over `faces` with the given split rule. Large
+// subtrees become tasks for a pool of params->threads workers, each filling
+// its own node array; the arrays are merged so that, as in a serial build,
+// the root is node 0 and every parent precedes its children.
+bvh_tree_t* bvh_build_binary(const wf_face* faces, size_t face_count,
+                             const wf_scene_t*         scene,
+                             const bvh_build_params_t* params,
+                             bvh_split_fn split, const struct bvh_ops* ops);
+
+#endif // BVH_BUILD_H
@@ -0,0 +1,30 @@
+// bvh_cache.h (internal)
+// On-disk cache for trees in the binary bvh_node_t layout. A file holds the
+// nodes and face_indices of one build, keyed by a hash of the triangles,
+// the strategy and its parameters, and is memory-mapped back so a cached
+// tree is used in place instead of being read or rebuilt.
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include "bvh/bvh.h"
+
+#define BVH_CACHE_VERSION 1
+
+// Identifies a build: strategy name, params and every face's vertices or
+// shape
+uint64_t bvh_cache_key(const char* type, const wf_face* faces,
+                       size_t face_count, const wf_scene_t* scene,
+                       const bvh_build_params_t* params);
+
+// Maps a cache file written for `key`; NULL if it is missing, stale or
+// fails validation. The tree still needs its bounds and triangle buffer.
+bvh_tree_t* bvh_cache_map(const char* path, uint64_t key,
+                          const struct bvh_ops* ops, const wf_face* faces,
+                          size_t face_count, const wf_scene_t* scene);
+
+// Writes a tree built by the strategy `ops`; false if the tree is not in
+// the binary layout or the file cannot be written
+bool bvh_cache_write(const bvh_tree_t* tree, const char* path, uint64_t key,
+                     const struct bvh_ops* ops);
+
+#endif // BVH_CACHE_H
@@ -0,0 +1,49 @@
+// bvh_lod.h
+// Geometry level of detail for ray cones. An object gets coarser versions
+// of its mesh, made by clustering vertices on ever wider grids, each with a
+// BLAS of its own. A TLAS instance carrying them traces a ray against the
+// coarsest level whose grid cell is no wider than the ray's cone footprint
+// where the ray enters the instance, so a vertex is never moved by more
+// than about the footprint (sqrt(3) cells). Hits closer to the ray origin
+// than that error are skipped on a coarse level: a ray leaving the full
+// mesh would otherwise hit the coarse version of the surface it starts on.
+// Thin rays (cone_width and cone_spread 0) always get the instance's own
+// BLAS.
+#ifndef BVH_LOD_H
+#define BVH_LOD_H
+
+#include "bvh/bvh.h"
+
+#define BVH_LOD_MAX 6 // coarser levels per object
+
+typedef struct bvh_lod_s bvh_lod_t;
+
+// Builds up to `levels` coarser versions of faces with bvh_create(type),
+// the grid cell doubling from twice the mean edge length. Stops early once
+// a level would drop fewer than a fifth of the previous level's triangles.
+// Shapes in params are ignored; give only triangle meshes. Returns NULL if
+// no level is worth building or memory runs out.
+bvh_lod_t* bvh_lod_create(const char* type, const wf_face* faces,
+                          size_t face_count, const wf_scene_t* scene,
+                          const bvh_build_params_t* params, uint32_t levels);
+void       bvh_lod_destroy(bvh_lod_t* lod);
+
+// Number of coarser levels, and the BLAS of level 1..count
+uint32_t          bvh_lod_count(const bvh_lod_t* lod);
+const bvh_tree_t* bvh_lod_level(const bvh_lod_t* lod, uint32_t level);
+
+// The coarsest level for a cone footprint of the given object-space width,
+// 0 for the full mesh
+uint32_t bvh_lod_select(const bvh_lod_t* lod, float footprint);
+// How far, in object space, level 0..count may be from the full mesh
+float    bvh_lod_error(const bvh_lod_t* lod, uint32_t level);
+
+// Vertex clustering: every vertex moves to the one nearest the mean of its
+// grid cell, and triangles left with fewer than three distinct corners are
+// dropped. Corners keep the vertex normal of their new vertex. Writes to
+// out (room for count) and returns the number of triangles kept, or 0 if
+// memory runs out.
+size_t bvh_lod_simplify(const wf_face* faces, size_t count,
+                        const wf_scene_t* scene, float cell, wf_face* out);
+
+#endif // BVH_LOD_H
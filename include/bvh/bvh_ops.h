@@ -5,13 +5,62 @@
 #include "bvh/bvh.h"
 #include "raytracer.h"
 
+#define BVH_MAX_CHILDREN 8
+
+// Layout-independent view of a node, for tools that walk the tree of any
+// strategy (bvh_stats())
+typedef struct {
+  wf_vec3  bbox_min;
+  wf_vec3  bbox_max;
+  uint32_t ref;   // strategy's handle of the node
+  uint32_t start; // leaf: first sorted position in face_indices
+  uint32_t count; // leaf: face count, 0 for an inner node
+} bvh_node_view_t;
+
 // BVH strategy interface (like Linux tcp_congestion_ops)
 struct bvh_ops {
   const char* name;
+  // params is never NULL, bvh_create() substitutes the defaults
   bvh_tree_t* (*build)(const wf_face* faces, size_t face_count,
-                       const wf_scene_t* scene);
+                       const wf_scene_t* scene,
+                       const bvh_build_params_t* params);
   void (*destroy)(bvh_tree_t* tree);
   bool (*intersect)(const bvh_tree_t* tree, const ray_t* ray, float* t_hit);
+  // nearest hit with t in (t_min, t_max)
+  bool (*intersect_closest)(const bvh_tree_t* tree, const ray_t* ray,
+                            float t_min, float t_max, bvh_hit_t* hit);
+  // any hit with t in (t_min, t_max), returning at the first one found
+  bool (*intersect_any)(const bvh_tree_t* tree, const ray_t* ray, float t_min,
+                        float t_max);
+  // Optional: update bounds in place after scene->vertices moved, using up
+  // to `threads` workers. bvh_refit() rebuilds trees without it.
+  bool (*refit)(bvh_tree_t* tree, unsigned threads);
+  // Optional: SAH cost relative to the root's surface area
+  float (*sah_cost)(const bvh_tree_t* tree);
+  // Optional: with node NULL, stores the root in children[0] and returns 1;
+  // otherwise stores the (up to BVH_MAX_CHILDREN) children of an inner node
+  // and returns their count, 0 for a leaf
+  uint32_t (*children)(const bvh_tree_t* tree, const bvh_node_view_t* node,
+                       bvh_node_view_t* children);
+  // Optional: bytes held by the nodes, wherever the layout keeps them
+  size_t (*node_memory)(const bvh_tree_t* tree);
+  // Optional: packet versions of intersect_closest and intersect_any, as
+  // bvh_intersect_packet() and bvh_occluded_packet(). Only called with
+  // 1..BVH_PACKET_MAX rays whose direction signs all agree.
+  uint32_t (*intersect_packet)(const bvh_tree_t* tree, const ray_t* rays,
+                               uint32_t count, float t_min,
+                               const float* t_max, bvh_hit_t* hits);
+  uint32_t (*occluded_packet)(const bvh_tree_t* tree, const ray_t* rays,
+                              uint32_t count, float t_min,
+                              const float* t_max);
+  // Optional: batch versions, as bvh_intersect_stream() and
+  // bvh_occluded_stream()
+  size_t (*intersect_stream)(const bvh_tree_t* tree, const ray_t* rays,
+                             size_t count, float t_min, const float* t_max,
+                             bvh_hit_t* hits, bool* hit);
+  size_t (*occluded_stream)(const bvh_tree_t* tree, const ray_t* rays,
+                            size_t count, float t_min, const float* t_max,
+                            bool* occluded);
 };
 
 // Auto-register macro (like Linux module_init)
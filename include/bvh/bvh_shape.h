@@ -0,0 +1,122 @@
+// bvh_shape.h
+// Analytic primitives stored in BVH leaves next to triangles: planar convex
+// quads, discs and spheres. A tree built with bvh_build_params_t.shapes set
+// has one bvh_shape_t per face; where the type is not a triangle, the shape
+// replaces the face's geometry and the face only supplies the material.
+// Shapes are fixed: refitting after vertices moved leaves them in place.
+#ifndef BVH_SHAPE_H
+#define BVH_SHAPE_H
+
+#include "algo.h"
+#include "bvh/bvh.h"
+
+typedef enum {
+  BVH_SHAPE_TRIANGLE = 0, // the face itself
+  BVH_SHAPE_QUAD,
+  BVH_SHAPE_DISC,
+  BVH_SHAPE_SPHERE,
+} bvh_shape_type_t;
+
+struct bvh_shape_s {
+  uint32_t type;      // bvh_shape_type_t
+  wf_vec3  origin;    // quad: first corner; disc, sphere: center
+  wf_vec3  edge1;     // quad: second corner - first; disc: unit normal
+  wf_vec3  edge2;     // quad: fourth corner - first
+  float    corner[2]; // quad: third corner = origin + (edge1, edge2) * corner
+  float    radius;    // disc, sphere
+};
+
+// The shape standing in for face i, NULL where the face is a triangle
+static inline const bvh_shape_t* bvh_shape_of(const bvh_shape_t* shapes,
+                                              size_t             i) {
+  return shapes && shapes[i].type != BVH_SHAPE_TRIANGLE ? &shapes[i] : NULL;
+}
+
+// Nearest hit with t > t_min, u and v being the quad's coordinates along
+// edge1 and edge2 (0 for discs and spheres). Quads use the Moller-Trumbore
+// arithmetic of the triangle test, with the far corner's two edges in
+// place of the hypotenuse.
+static inline bool bvh_shape_intersect(const bvh_shape_t* shape,
+                                       const ray_t* ray, float t_min,
+                                       float* t_out, float* u_out,
+                                       float* v_out) {
+  const float EPSILON = 1e-8f;
+  wf_vec3     s       = v3_sub(ray->origin, shape->origin);
+  float       u       = 0.0f;
+  float       v       = 0.0f;
+  float       t;
+
+  if (shape->type == BVH_SHAPE_SPHERE) {
+    float a    = v3_dot(ray->direction, ray->direction);
+    float b    = v3_dot(s, ray->direction);
+    float c    = v3_dot(s, s) - shape->radius * shape->radius;
+    float disc = b * b - a * c;
+    if (disc < 0.0f || a < EPSILON)
+      return false;
+    float root = sqrtf(disc);
+    t          = (-b - root) / a;
+    if (t <= t_min)
+      t = (-b + root) / a;
+  } else if (shape->type == BVH_SHAPE_DISC) {
+    float denom = v3_dot(shape->edge1, ray->direction);
+    if (denom > -EPSILON && denom < EPSILON)
+      return false;
+    t           = -v3_dot(shape->edge1, s) / denom;
+    wf_vec3 off = v3_add(s, v3_scale(t, ray->direction));
+    if (v3_dot(off, off) > shape->radius * shape->radius)
+      return false;
+  } else {
+    const wf_vec3* e1 = &shape->edge1;
+    const wf_vec3* e2 = &shape->edge2;
+    wf_vec3        h  = v3_cross(ray->direction, *e2);
+    float          a  = v3_dot(*e1, h);
+    if (a > -EPSILON && a < EPSILON)
+      return false;
+    float f = 1.0f / a;
+    u       = f * v3_dot(s, h);
+    if (u < 0.0f)
+      return false;
+    wf_vec3 q = v3_cross(s, *e1);
+    v         = f * v3_dot(ray->direction, q);
+    if (v < 0.0f)
+      return false;
+    // Inside the edges second -> third and third -> fourth corner
+    float cu = shape->corner[0];
+    float cv = shape->corner[1];
+    if ((cu - 1.0f) * v - cv * (u - 1.0f) < 0.0f
+        || -cu * (v - cv) - (1.0f - cv) * (u - cu) < 0.0f)
+      return false;
+    t = f * v3_dot(*e2, q);
+  }
+
+  if (!(t > t_min) || t <= EPSILON)
+    return false;
+  *t_out = t;
+  if (u_out)
+    *u_out = u;
+  if (v_out)
+    *v_out = v;
+  return true;
+}
+
+// Bounds and centroid of a shape
+void    bvh_shape_bbox(const bvh_shape_t* shape, wf_vec3* bbox_min,
+                       wf_vec3* bbox_max);
+wf_vec3 bvh_shape_centroid(const bvh_shape_t* shape);
+
+// Outward (sphere) or front-facing (quad, disc) unit normal at a point on
+// the shape
+wf_vec3 bvh_shape_normal(const bvh_shape_t* shape, const wf_vec3* point);
+
+// Finds shapes among the triangles of one object, as wf_scene_to_triangles()
+// emits them: a tessellated sphere becomes one sphere, a fan of triangles
+// over a polygon approximating a circle one disc, and two triangles forming
+// a planar convex quad one quad. Faces with smooth vertex normals are only
+// merged into spheres. Writes the primitives to faces and shapes (room for
+// count each, the face of a shape being its first triangle) and returns
+// their number.
+size_t bvh_shapes_detect(const wf_face* tris, size_t count,
+                         const wf_scene_t* scene, wf_face* faces,
+                         bvh_shape_t* shapes);
+
+#endif // BVH_SHAPE_H
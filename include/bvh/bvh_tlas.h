@@ -0,0 +1,66 @@
+// bvh_tlas.h
+// Two-level acceleration structure. Each object or mesh gets its own
+// bottom-level tree (BLAS), built by bvh_create() with any strategy, and a
+// top-level tree (TLAS) over instances places BLASes in the world with
+// affine transforms. Instances share their BLAS, so a repeated object costs
+// its geometry once; moving an instance only rebuilds the small top level.
+// An instance may carry coarser levels of its BLAS (bvh_lod.h), picked per
+// ray by the width of the ray's cone where it enters the instance.
+#ifndef BVH_TLAS_H
+#define BVH_TLAS_H
+
+#include "bvh/bvh.h"
+#include "bvh/bvh_lod.h"
+
+// Affine object-to-world transform, world = m * (object, 1)
+typedef struct {
+  float m[3][4];
+} bvh_xform_t;
+
+typedef struct {
+  const bvh_tree_t* blas; // not owned; any number of instances may share it
+  bvh_xform_t       xform;
+  const bvh_lod_t*  lod; // coarser versions of blas, not owned; NULL = none
+} bvh_instance_t;
+
+typedef struct {
+  bvh_hit_t hit;      // face_idx indexes the faces of the BLAS hit
+  uint32_t  instance; // index into the array given to bvh_tlas_update()
+  uint32_t  lod;      // level hit, 0 = the instance's own BLAS
+} bvh_tlas_hit_t;
+
+typedef struct bvh_tlas_s bvh_tlas_t;
+
+void bvh_xform_identity(bvh_xform_t* xform);
+
+// Builds the top level over instances (copied). Returns NULL if a transform
+// is singular or memory runs out.
+bvh_tlas_t* bvh_tlas_create(const bvh_instance_t* instances, size_t count);
+// Rebuilds the top level after instances moved, were added or removed.
+// BLASes are left alone; refit or rebuild them first if their geometry
+// changed. On failure the previous instances stay in place.
+bool bvh_tlas_update(bvh_tlas_t* tlas, const bvh_instance_t* instances,
+                     size_t count);
+void bvh_tlas_destroy(bvh_tlas_t* tlas);
+
+const bvh_instance_t* bvh_tlas_instance(const bvh_tlas_t* tlas,
+                                        uint32_t          instance);
+// The BLAS a hit is on: the instance's own or one of its LOD levels
+const bvh_tree_t* bvh_tlas_hit_blas(const bvh_tlas_t*     tlas,
+                                    const bvh_tlas_hit_t* hit);
+
+// Same contracts as bvh_intersect_closest() and bvh_occluded(), over every
+// instance. Distances are world-space; the ray's cone picks LOD levels.
+bool bvh_tlas_intersect_closest(const bvh_tlas_t* tlas, const ray_t* ray,
+                                float t_min, float t_max, bvh_tlas_hit_t* hit);
+bool bvh_tlas_occluded(const bvh_tlas_t* tlas, const ray_t* ray, float t_min,
+                       float t_max);
+
+// Maps an object-space normal of the instance to world space (unnormalized)
+wf_vec3 bvh_tlas_normal_to_world(const bvh_tlas_t* tlas, uint32_t instance,
+                                 wf_vec3 normal);
+// Maps a world-space point into the instance's object space
+wf_vec3 bvh_tlas_point_to_object(const bvh_tlas_t* tlas, uint32_t instance,
+                                 wf_vec3 point);
+
+#endif // BVH_TLAS_H
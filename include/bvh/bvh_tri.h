@@ -0,0 +1,325 @@
+// bvh_tri.h (internal)
+// Triangles copied out of the scene in face_indices (leaf) order, with the
+// edges the intersection test needs already computed. Stored as blocks of
+// BVH_TRI_BLOCK triangles in structure-of-arrays form, so a leaf's faces sit
+// next to each other and need no wf_face -> v_idx -> vertex lookups.
+#ifndef BVH_TRI_H
+#define BVH_TRI_H
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+#include "bvh/bvh.h"
+#include "bvh/bvh_shape.h"
+
+#define BVH_TRI_BLOCK 8
+
+// Triangle k lives in block k / BVH_TRI_BLOCK, lane k % BVH_TRI_BLOCK. A lane
+// holding an analytic shape (bvh_shape.h) keeps origin, edge1 and edge2 in
+// v0, e1 and e2, its radius in e2[0] for a disc or sphere.
+typedef struct {
+  float v0[3][BVH_TRI_BLOCK];
+  float e1[3][BVH_TRI_BLOCK]; // v1 - v0
+  float e2[3][BVH_TRI_BLOCK]; // v2 - v0
+} bvh_tri_block_t;
+
+struct bvh_tri_buffer_s {
+  bvh_tri_block_t* blocks;
+  size_t           block_count;
+  // Only for trees with shapes, NULL otherwise: each lane's
+  // bvh_shape_type_t by block, and quads' corner by sorted position
+  uint8_t (*types)[BVH_TRI_BLOCK];
+  float (*corners)[2];
+};
+
+// Builds tree->tris from tree->face_indices, split across `threads` workers
+bool bvh_tri_buffer_init(bvh_tree_t* tree, unsigned threads);
+// Copies the current vertex positions into an existing tree->tris
+void bvh_tri_buffer_fill(bvh_tree_t* tree, unsigned threads);
+// Same for sorted positions [begin, end) only, on the calling thread; safe
+// while other threads read triangles outside the range, as long as they
+// read them with bvh_tri_block_intersect_exact() (a SIMD register may
+// straddle the range's first and last blocks)
+void bvh_tri_buffer_fill_range(const bvh_tree_t* tree, size_t begin,
+                               size_t end);
+void bvh_tri_buffer_free(bvh_tree_t* tree);
+
+// Moller-Trumbore against sorted triangle k. Same arithmetic as
+// ray_intersects_triangle(), so both give bit-identical results.
+static inline bool bvh_tri_intersect(const bvh_tri_buffer_t* tris, uint32_t k,
+                                     const ray_t* ray, float* t_out,
+                                     float* u_out, float* v_out) {
+  const float            EPSILON = 1e-8f;
+  const bvh_tri_block_t* b       = &tris->blocks[k / BVH_TRI_BLOCK];
+  uint32_t               l       = k % BVH_TRI_BLOCK;
+  const wf_vec3*         d       = &ray->direction;
+  wf_vec3 e1 = { b->e1[0][l], b->e1[1][l], b->e1[2][l] };
+  wf_vec3 e2 = { b->e2[0][l], b->e2[1][l], b->e2[2][l] };
+
+  wf_vec3 h = { d->y * e2.z - d->z * e2.y, d->z * e2.x - d->x * e2.z,
+                d->x * e2.y - d->y * e2.x };
+  float   a = e1.x * h.x + e1.y * h.y + e1.z * h.z;
+  if (a > -EPSILON && a < EPSILON)
+    return false;
+
+  float   f = 1.0f / a;
+  wf_vec3 s = { ray->origin.x - b->v0[0][l], ray->origin.y - b->v0[1][l],
+                ray->origin.z - b->v0[2][l] };
+  float   u = f * (s.x * h.x + s.y * h.y + s.z * h.z);
+  if (u < 0.0f || u > 1.0f)
+    return false;
+
+  wf_vec3 q = { s.y * e1.z - s.z * e1.y, s.z * e1.x - s.x * e1.z,
+                s.x * e1.y - s.y * e1.x };
+  float   v = f * (d->x * q.x + d->y * q.y + d->z * q.z);
+  if (v < 0.0f || (u + v) > 1.0f)
+    return false;
+
+  float t = f * (e2.x * q.x + e2.y * q.y + e2.z * q.z);
+  if (t <= EPSILON)
+    return false;
+  *t_out = t;
+  if (u_out)
+    *u_out = u;
+  if (v_out)
+    *v_out = v;
+  return true;
+}
+
+#if defined(__AVX__) || defined(__SSE__)
+#if defined(__AVX__)
+#define BVH_TRI_SIMD_WIDTH 8
+typedef __m256 bvh_tri_vec_t;
+#define bvh_tri_vec_load     _mm256_loadu_ps
+#define bvh_tri_vec_store    _mm256_storeu_ps
+#define bvh_tri_vec_set1     _mm256_set1_ps
+#define bvh_tri_vec_add      _mm256_add_ps
+#define bvh_tri_vec_sub      _mm256_sub_ps
+#define bvh_tri_vec_mul      _mm256_mul_ps
+#define bvh_tri_vec_div      _mm256_div_ps
+#define bvh_tri_vec_or       _mm256_or_ps
+#define bvh_tri_vec_and      _mm256_and_ps
+#define bvh_tri_vec_andnot   _mm256_andnot_ps
+#define bvh_tri_vec_lt(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define bvh_tri_vec_gt(a, b) _mm256_cmp_ps(a, b, _CMP_GT_OQ)
+#define bvh_tri_vec_le(a, b) _mm256_cmp_ps(a, b, _CMP_LE_OQ)
+#define bvh_tri_vec_mask     _mm256_movemask_ps
+#else
+#define BVH_TRI_SIMD_WIDTH 4
+typedef __m128 bvh_tri_vec_t;
+#define bvh_tri_vec_load     _mm_loadu_ps
+#define bvh_tri_vec_store    _mm_storeu_ps
+#define bvh_tri_vec_set1     _mm_set1_ps
+#define bvh_tri_vec_add      _mm_add_ps
+#define bvh_tri_vec_sub      _mm_sub_ps
+#define bvh_tri_vec_mul      _mm_mul_ps
+#define bvh_tri_vec_div      _mm_div_ps
+#define bvh_tri_vec_or       _mm_or_ps
+#define bvh_tri_vec_and      _mm_and_ps
+#define bvh_tri_vec_andnot   _mm_andnot_ps
+#define bvh_tri_vec_lt(a, b) _mm_cmplt_ps(a, b)
+#define bvh_tri_vec_gt(a, b) _mm_cmpgt_ps(a, b)
+#define bvh_tri_vec_le(a, b) _mm_cmple_ps(a, b)
+#define bvh_tri_vec_mask     _mm_movemask_ps
+#endif
+
+// a.x * b.x + a.y * b.y + a.z * b.z, in the scalar test's order
+static inline bvh_tri_vec_t bvh_tri_vec_dot(const bvh_tri_vec_t* a,
+                                            const bvh_tri_vec_t* b) {
+  return bvh_tri_vec_add(
+      bvh_tri_vec_add(bvh_tri_vec_mul(a[0], b[0]), bvh_tri_vec_mul(a[1], b[1])),
+      bvh_tri_vec_mul(a[2], b[2]));
+}
+
+// a[i] * b[j] - a[j] * b[i]
+static inline bvh_tri_vec_t bvh_tri_vec_cross(const bvh_tri_vec_t* a,
+                                              const bvh_tri_vec_t* b, int i,
+                                              int j) {
+  return bvh_tri_vec_sub(bvh_tri_vec_mul(a[i], b[j]),
+                         bvh_tri_vec_mul(a[j], b[i]));
+}
+#endif
+
+// Those of `lanes` that hold shapes in block `block`
+static inline uint32_t bvh_tri_shape_lanes(const bvh_tri_buffer_t* tris,
+                                           uint32_t block, uint32_t lanes) {
+  uint32_t shapes = 0;
+  if (!tris->types)
+    return 0;
+  for (; lanes; lanes &= lanes - 1) {
+    uint32_t l = (uint32_t)__builtin_ctz(lanes);
+    if (tris->types[block][l] != BVH_SHAPE_TRIANGLE)
+      shapes |= 1u << l;
+  }
+  return shapes;
+}
+
+// The shapes among bvh_tri_block_intersect()'s lanes, one at a time
+static inline uint32_t bvh_tri_block_shapes(const bvh_tri_buffer_t* tris,
+                                            uint32_t block, uint32_t lanes,
+                                            const ray_t* ray, float t_min,
+                                            float t_max, float* t_out,
+                                            float* u_out, float* v_out) {
+  const bvh_tri_block_t* b    = &tris->blocks[block];
+  uint32_t               mask = 0;
+  for (; lanes; lanes &= lanes - 1) {
+    uint32_t    l     = (uint32_t)__builtin_ctz(lanes);
+    uint32_t    k     = block * BVH_TRI_BLOCK + l;
+    bvh_shape_t shape = {
+      .type   = tris->types[block][l],
+      .origin = { b->v0[0][l], b->v0[1][l], b->v0[2][l] },
+      .edge1  = { b->e1[0][l], b->e1[1][l], b->e1[2][l] },
+      .edge2  = { b->e2[0][l], b->e2[1][l], b->e2[2][l] },
+      .corner = { tris->corners[k][0], tris->corners[k][1] },
+      .radius = b->e2[0][l],
+    };
+    if (bvh_shape_intersect(&shape, ray, t_min, &t_out[l], &u_out[l],
+                            &v_out[l])
+        && t_out[l] < t_max)
+      mask |= 1u << l;
+  }
+  return mask;
+}
+
+// bvh_tri_intersect() on lane l of block `block` within (t_min, t_max)
+static inline bool bvh_tri_lane_intersect(const bvh_tri_buffer_t* tris,
+                                          uint32_t block, uint32_t l,
+                                          const ray_t* ray, float t_min,
+                                          float t_max, float* t_out,
+                                          float* u_out, float* v_out) {
+  return bvh_tri_intersect(tris, block * BVH_TRI_BLOCK + l, ray, &t_out[l],
+                           &u_out[l], &v_out[l])
+         && t_out[l] > t_min && t_out[l] < t_max;
+}
+
+// Moller-Trumbore against the lanes of block `block` set in `lanes`, one
+// SIMD register of triangles at a time and without branches. Returns the
+// mask of lanes hit with t in (t_min, t_max) and stores their t, u and v by
+// lane. Bit-identical to bvh_tri_intersect() on each lane. Lanes holding
+// shapes are tested last, as the registers store whole groups of lanes.
+// A register also loads the lanes around the ones asked for; with `exact`
+// (a constant in each caller) those are tested one at a time instead, so
+// no lane outside `lanes` is read, as another thread may be writing it.
+static inline uint32_t bvh_tri_block_test(const bvh_tri_buffer_t* tris,
+                                          uint32_t block, uint32_t lanes,
+                                          const ray_t* ray, float t_min,
+                                          float t_max, float* t_out,
+                                          float* u_out, float* v_out,
+                                          const bool exact) {
+  uint32_t mask   = 0;
+  uint32_t shapes = bvh_tri_shape_lanes(tris, block, lanes);
+  lanes &= ~shapes;
+#if defined(__AVX__) || defined(__SSE__)
+  const float            EPSILON = 1e-8f;
+  const bvh_tri_block_t* b       = &tris->blocks[block];
+  const bvh_tri_vec_t    eps     = bvh_tri_vec_set1(EPSILON);
+  const bvh_tri_vec_t    neg_eps = bvh_tri_vec_set1(-EPSILON);
+  const bvh_tri_vec_t    one     = bvh_tri_vec_set1(1.0f);
+  const bvh_tri_vec_t    zero    = bvh_tri_vec_set1(0.0f);
+  const bvh_tri_vec_t    d[3]    = { bvh_tri_vec_set1(ray->direction.x),
+                                     bvh_tri_vec_set1(ray->direction.y),
+                                     bvh_tri_vec_set1(ray->direction.z) };
+  const float*           o       = &ray->origin.x;
+
+  // Each register starts at the first lane left, moved back to stay inside
+  // the block, so a short leaf costs one register wherever it starts. A lane
+  // tested twice gets the same results both times.
+  while (lanes) {
+    uint32_t l = (uint32_t)__builtin_ctz(lanes);
+    if (l > BVH_TRI_BLOCK - BVH_TRI_SIMD_WIDTH)
+      l = BVH_TRI_BLOCK - BVH_TRI_SIMD_WIDTH;
+    uint32_t group = (lanes >> l) & ((1u << BVH_TRI_SIMD_WIDTH) - 1);
+    if (exact && group != (1u << BVH_TRI_SIMD_WIDTH) - 1) {
+      l = (uint32_t)__builtin_ctz(lanes);
+      lanes &= lanes - 1;
+      if (bvh_tri_lane_intersect(tris, block, l, ray, t_min, t_max, t_out,
+                                 u_out, v_out))
+        mask |= 1u << l;
+      continue;
+    }
+    lanes &= ~(group << l);
+    bvh_tri_vec_t e1[3], e2[3], s[3];
+    for (int axis = 0; axis < 3; ++axis) {
+      e1[axis] = bvh_tri_vec_load(&b->e1[axis][l]);
+      e2[axis] = bvh_tri_vec_load(&b->e2[axis][l]);
+      s[axis]  = bvh_tri_vec_sub(bvh_tri_vec_set1(o[axis]),
+                                 bvh_tri_vec_load(&b->v0[axis][l]));
+    }
+
+    bvh_tri_vec_t h[3] = { bvh_tri_vec_cross(d, e2, 1, 2),
+                           bvh_tri_vec_cross(d, e2, 2, 0),
+                           bvh_tri_vec_cross(d, e2, 0, 1) };
+    bvh_tri_vec_t q[3] = { bvh_tri_vec_cross(s, e1, 1, 2),
+                           bvh_tri_vec_cross(s, e1, 2, 0),
+                           bvh_tri_vec_cross(s, e1, 0, 1) };
+    bvh_tri_vec_t a    = bvh_tri_vec_dot(e1, h);
+    bvh_tri_vec_t f    = bvh_tri_vec_div(one, a);
+    bvh_tri_vec_t u    = bvh_tri_vec_mul(f, bvh_tri_vec_dot(s, h));
+    bvh_tri_vec_t v    = bvh_tri_vec_mul(f, bvh_tri_vec_dot(d, q));
+    bvh_tri_vec_t t    = bvh_tri_vec_mul(f, bvh_tri_vec_dot(e2, q));
+
+    // Rejected where the scalar test returns early; NaNs fail t > t_min
+    bvh_tri_vec_t miss =
+        bvh_tri_vec_and(bvh_tri_vec_gt(a, neg_eps), bvh_tri_vec_lt(a, eps));
+    miss = bvh_tri_vec_or(miss, bvh_tri_vec_lt(u, zero));
+    miss = bvh_tri_vec_or(miss, bvh_tri_vec_gt(u, one));
+    miss = bvh_tri_vec_or(miss, bvh_tri_vec_lt(v, zero));
+    miss = bvh_tri_vec_or(miss, bvh_tri_vec_gt(bvh_tri_vec_add(u, v), one));
+    miss = bvh_tri_vec_or(miss, bvh_tri_vec_le(t, eps));
+    bvh_tri_vec_t in_range =
+        bvh_tri_vec_and(bvh_tri_vec_gt(t, bvh_tri_vec_set1(t_min)),
+                        bvh_tri_vec_lt(t, bvh_tri_vec_set1(t_max)));
+    uint32_t hits =
+        (uint32_t)bvh_tri_vec_mask(bvh_tri_vec_andnot(miss, in_range)) & group;
+    if (!hits)
+      continue;
+    bvh_tri_vec_store(&t_out[l], t);
+    bvh_tri_vec_store(&u_out[l], u);
+    bvh_tri_vec_store(&v_out[l], v);
+    mask |= hits << l;
+  }
+#else
+  for (; lanes; lanes &= lanes - 1) {
+    uint32_t l = (uint32_t)__builtin_ctz(lanes);
+    if (bvh_tri_lane_intersect(tris, block, l, ray, t_min, t_max, t_out,
+                               u_out, v_out))
+      mask |= 1u << l;
+  }
+#endif
+  if (shapes)
+    mask |= bvh_tri_block_shapes(tris, block, shapes, ray, t_min, t_max, t_out,
+                                 u_out, v_out);
+  return mask;
+}
+
+static inline uint32_t bvh_tri_block_intersect(const bvh_tri_buffer_t* tris,
+                                               uint32_t block, uint32_t lanes,
+                                               const ray_t* ray, float t_min,
+                                               float t_max, float* t_out,
+                                               float* u_out, float* v_out) {
+  return bvh_tri_block_test(tris, block, lanes, ray, t_min, t_max, t_out,
+                            u_out, v_out, false);
+}
+
+// bvh_tri_block_intersect() reading only the lanes asked for, for trees
+// whose other leaves may be refilled meanwhile (bvh_lazy.c)
+static inline uint32_t bvh_tri_block_intersect_exact(
+    const bvh_tri_buffer_t* tris, uint32_t block, uint32_t lanes,
+    const ray_t* ray, float t_min, float t_max, float* t_out, float* u_out,
+    float* v_out) {
+  return bvh_tri_block_test(tris, block, lanes, ray, t_min, t_max, t_out,
+                            u_out, v_out, true);
+}
+
+// Lanes of block `block` holding sorted positions [start, end)
+static inline uint32_t bvh_tri_block_lanes(uint32_t block, uint32_t start,
+                                           uint32_t end) {
+  uint32_t first = block * BVH_TRI_BLOCK;
+  uint32_t lo    = start > first ? start - first : 0;
+  uint32_t hi    = end - first < BVH_TRI_BLOCK ? end - first : BVH_TRI_BLOCK;
+  return ((1u << hi) - 1) & ~((1u << lo) - 1);
+}
+
+#endif // BVH_TRI_H
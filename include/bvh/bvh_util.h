@@ -0,0 +1,240 @@
+// bvh_util.h (internal)
+// Helpers shared by the builders in src/bvh/bvh_algo.
+#ifndef BVH_UTIL_H
+#define BVH_UTIL_H
+
+#include <float.h>
+#include <math.h>
+#include "bvh/bvh.h"
+#include "bvh/bvh_ops.h"
+#include "bvh/bvh_shape.h"
+#include "bvh/bvh_tri.h"
+
+// Per-face bounds and centroids, computed once before a build
+typedef struct {
+  wf_vec3* centroids;
+  wf_vec3* face_min;
+  wf_vec3* face_max;
+  size_t   count;
+} bvh_prim_info_t;
+
+static inline void bvh_bbox_empty(wf_vec3* min, wf_vec3* max) {
+  *min = (wf_vec3){ FLT_MAX, FLT_MAX, FLT_MAX };
+  *max = (wf_vec3){ -FLT_MAX, -FLT_MAX, -FLT_MAX };
+}
+
+// Plain comparisons compile to minss/maxss; fminf/fmaxf are libm calls
+// unless NaN handling is relaxed, which dominated build profiles
+static inline float bvh_minf(float a, float b) { return b < a ? b : a; }
+static inline float bvh_maxf(float a, float b) { return b > a ? b : a; }
+
+// Expand a bounding box to include another
+static inline void bvh_bbox_expand(wf_vec3* min, wf_vec3* max,
+                                   const wf_vec3* bmin, const wf_vec3* bmax) {
+  min->x = bvh_minf(min->x, bmin->x);
+  min->y = bvh_minf(min->y, bmin->y);
+  min->z = bvh_minf(min->z, bmin->z);
+  max->x = bvh_maxf(max->x, bmax->x);
+  max->y = bvh_maxf(max->y, bmax->y);
+  max->z = bvh_maxf(max->z, bmax->z);
+}
+
+// Surface area of a box, 0 for an empty one
+static inline float bvh_bbox_area(const wf_vec3* min, const wf_vec3* max) {
+  float dx = max->x - min->x;
+  float dy = max->y - min->y;
+  float dz = max->z - min->z;
+  if (dx < 0.0f || dy < 0.0f || dz < 0.0f)
+    return 0.0f;
+  return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+// Bounds and centroid of a face, or of the shape standing in for it when
+// shape is not NULL (see bvh_shape_of())
+void    bvh_face_bbox(const wf_face* face, const bvh_shape_t* shape,
+                      const wf_scene_t* scene, wf_vec3* bbox_min,
+                      wf_vec3* bbox_max);
+wf_vec3 bvh_face_centroid(const wf_face* face, const bvh_shape_t* shape,
+                          const wf_scene_t* scene);
+
+// Fills the per-face arrays, split across `threads` workers; shapes may be
+// NULL
+bool bvh_prim_info_init(bvh_prim_info_t* info, const wf_face* faces,
+                        const bvh_shape_t* shapes, size_t face_count,
+                        const wf_scene_t* scene, unsigned threads);
+void bvh_prim_info_free(bvh_prim_info_t* info);
+
+// Per-ray constants for slab tests. Near and far planes are picked once from
+// the direction signs, so boxes need no per-axis swap or division.
+typedef struct {
+  float    org[3];
+  float    inv_dir[3];
+  uint32_t neg[3]; // 1 where the direction is negative
+} bvh_ray_prep_t;
+
+static inline void bvh_ray_prep_init(bvh_ray_prep_t* r, const ray_t* ray) {
+  for (int axis = 0; axis < 3; ++axis) {
+    float d = (&ray->direction.x)[axis];
+    // Avoid inf * 0 = NaN for rays parallel to a slab
+    if (fabsf(d) < 1e-20f)
+      d = d < 0.0f ? -1e-20f : 1e-20f;
+    r->org[axis]     = (&ray->origin.x)[axis];
+    r->inv_dir[axis] = 1.0f / d;
+    r->neg[axis]     = d < 0.0f;
+  }
+}
+
+// Clips [t_min, t_max] against the box; on a hit stores the entry distance
+static inline bool bvh_ray_prep_slab(const bvh_ray_prep_t* r,
+                                     const float* bmin, const float* bmax,
+                                     float t_min, float t_max,
+                                     float* t_near) {
+  for (int axis = 0; axis < 3; ++axis) {
+    float lo = r->neg[axis] ? bmax[axis] : bmin[axis];
+    float hi = r->neg[axis] ? bmin[axis] : bmax[axis];
+    t_min    = bvh_maxf(t_min, (lo - r->org[axis]) * r->inv_dir[axis]);
+    t_max    = bvh_minf(t_max, (hi - r->org[axis]) * r->inv_dir[axis]);
+  }
+  *t_near = t_min;
+  return t_min <= t_max;
+}
+
+// Tests the faces of a leaf, sorted positions [start, start + count), and
+// narrows best to the nearest hit in (t_min, best->t). Returns true on
+// improvement; best->face_idx is then a sorted position until the traversal
+// is done and calls bvh_hit_resolve(). With `exact` (a constant in each
+// caller) no triangle outside the leaf is read.
+static inline bool bvh_leaf_closest(const bvh_tree_t* tree, uint32_t start,
+                                    uint32_t count, const ray_t* ray,
+                                    float t_min, bvh_hit_t* best,
+                                    const bool exact) {
+  bool     found = false;
+  uint32_t end   = start + count;
+  for (uint32_t block = start / BVH_TRI_BLOCK; block * BVH_TRI_BLOCK < end;
+       ++block) {
+    float    t[BVH_TRI_BLOCK], u[BVH_TRI_BLOCK], v[BVH_TRI_BLOCK];
+    uint32_t hits = bvh_tri_block_test(
+        tree->tris, block, bvh_tri_block_lanes(block, start, end), ray, t_min,
+        best->t, t, u, v, exact);
+    // Nearest hit, the lowest position on ties like a scalar loop.
+    // face_idx is a sorted position until the caller resolves it.
+    for (; hits; hits &= hits - 1) {
+      uint32_t l = (uint32_t)__builtin_ctz(hits);
+      if (t[l] < best->t) {
+        best->t        = t[l];
+        best->u        = u[l];
+        best->v        = v[l];
+        best->face_idx = block * BVH_TRI_BLOCK + l;
+        found          = true;
+      }
+    }
+  }
+  return found;
+}
+
+static inline bool bvh_leaf_intersect(const bvh_tree_t* tree, uint32_t start,
+                                      uint32_t count, const ray_t* ray,
+                                      float t_min, bvh_hit_t* best) {
+  return bvh_leaf_closest(tree, start, count, ray, t_min, best, false);
+}
+
+// For trees whose other leaves may be refilled meanwhile (bvh_lazy.c)
+static inline bool bvh_leaf_intersect_exact(const bvh_tree_t* tree,
+                                            uint32_t start, uint32_t count,
+                                            const ray_t* ray, float t_min,
+                                            bvh_hit_t* best) {
+  return bvh_leaf_closest(tree, start, count, ray, t_min, best, true);
+}
+
+// Maps a hit from bvh_leaf_intersect() back to its wf_face
+static inline void bvh_hit_resolve(const bvh_tree_t* tree, bvh_hit_t* hit) {
+  hit->face_idx     = tree->face_indices[hit->face_idx];
+  hit->material_idx = tree->faces[hit->face_idx].material_idx;
+}
+
+// True if any face of the leaf is hit with t in (t_min, t_max); `exact`
+// as for bvh_leaf_closest()
+static inline bool bvh_leaf_any(const bvh_tree_t* tree, uint32_t start,
+                                uint32_t count, const ray_t* ray, float t_min,
+                                float t_max, const bool exact) {
+  uint32_t end = start + count;
+  for (uint32_t block = start / BVH_TRI_BLOCK; block * BVH_TRI_BLOCK < end;
+       ++block) {
+    float t[BVH_TRI_BLOCK], u[BVH_TRI_BLOCK], v[BVH_TRI_BLOCK];
+    if (bvh_tri_block_test(tree->tris, block,
+                           bvh_tri_block_lanes(block, start, end), ray, t_min,
+                           t_max, t, u, v, exact))
+      return true;
+  }
+  return false;
+}
+
+static inline bool bvh_leaf_occluded(const bvh_tree_t* tree, uint32_t start,
+                                     uint32_t count, const ray_t* ray,
+                                     float t_min, float t_max) {
+  return bvh_leaf_any(tree, start, count, ray, t_min, t_max, false);
+}
+
+static inline bool bvh_leaf_occluded_exact(const bvh_tree_t* tree,
+                                           uint32_t start, uint32_t count,
+                                           const ray_t* ray, float t_min,
+                                           float t_max) {
+  return bvh_leaf_any(tree, start, count, ray, t_min, t_max, true);
+}
+
+// Closest-hit traversal over the binary bvh_node_t layout (root at node 0),
+// usable as the intersect_closest op of any builder producing that layout.
+// Visits children nearest first and skips boxes behind the best hit.
+bool bvh_binary_intersect_closest(const bvh_tree_t* tree, const ray_t* ray,
+                                  float t_min, float t_max, bvh_hit_t* hit);
+
+// Any-hit counterpart, the intersect_any op for the same layout
+bool bvh_binary_intersect_any(const bvh_tree_t* tree, const ray_t* ray,
+                              float t_min, float t_max);
+
+// The same traversal started at node `root` over (t_min, best->t): returns
+// true if best improved or, with any, if the ray is occluded. best->t must
+// be initialized and the hit is left unresolved.
+bool bvh_binary_subtree(const bvh_tree_t* tree, const ray_t* ray,
+                        uint32_t root, float t_min, bvh_hit_t* best,
+                        bool any);
+
+// Recomputes the bounds of every node from the current vertex positions,
+// the refit op for the same layout. Duplicated references (sbvh) get the
+// full face bounds, as their clipped bounds cannot be recovered.
+bool bvh_binary_refit(bvh_tree_t* tree, unsigned threads);
+
+// SAH cost of the tree relative to its root area, the sah_cost op
+float bvh_binary_sah_cost(const bvh_tree_t* tree);
+
+// Node views and node memory for the same layout, the children and
+// node_memory ops
+uint32_t bvh_binary_children(const bvh_tree_t*      tree,
+                             const bvh_node_view_t* node,
+                             bvh_node_view_t*       children);
+size_t   bvh_binary_node_memory(const bvh_tree_t* tree);
+
+// Packet traversal for the same layout (bvh_packet.c), the
+// intersect_packet and occluded_packet ops
+uint32_t bvh_binary_intersect_packet(const bvh_tree_t* tree,
+                                     const ray_t* rays, uint32_t count,
+                                     float t_min, const float* t_max,
+                                     bvh_hit_t* hits);
+uint32_t bvh_binary_occluded_packet(const bvh_tree_t* tree,
+                                    const ray_t* rays, uint32_t count,
+                                    float t_min, const float* t_max);
+
+// Stream traversal for the same layout (bvh_stream.c), the
+// intersect_stream and occluded_stream ops
+size_t bvh_binary_intersect_stream(const bvh_tree_t* tree, const ray_t* rays,
+                                   size_t count, float t_min,
+                                   const float* t_max, bvh_hit_t* hits,
+                                   bool* hit);
+size_t bvh_binary_occluded_stream(const bvh_tree_t* tree, const ray_t* rays,
+                                  size_t count, float t_min,
+                                  const float* t_max, bool* occluded);
+
+// Frees nodes, face_indices and the tree itself
+void bvh_binary_destroy(bvh_tree_t* tree);
+
+#endif // BVH_UTIL_H
@@ -1,6 +1,8 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include "algo.h" // wf_vec3 etc
 
 typedef struct camera camera_t;
@@ -30,13 +32,42 @@ typedef struct {
   float focus_distance; // Distance to focal plane (for DoF)
 } ortho_dof_params_t;
 
+// Where a camera ray crosses the image and the lens
+typedef struct {
+  float u, v;           // image position, [0,1]x[0,1]
+  float lens_u, lens_v; // lens position, [0,1)x[0,1); (0.5, 0.5) is the center
+} camera_sample_t;
+
+// A batch of camera rays as a structure of arrays, each with room for the
+// whole batch: ray i leaves (ox[i], oy[i], oz[i]) along the unit vector
+// (dx[i], dy[i], dz[i])
+typedef struct {
+  float* ox;
+  float* oy;
+  float* oz;
+  float* dx;
+  float* dy;
+  float* dz;
+} camera_rays_t;
+
 // user create camera
 camera_t* camera_create(projection_type_t type, wf_vec3 position,
                         wf_vec3 target, wf_vec3 up,
                         const void* params); // class related parameter
 
 wf_vec3 camera_get_position(const camera_t* cam);
+// Direction through (u, v) from the lens center
 wf_vec3 camera_get_ray_direction(const camera_t* cam, float u, float v);
 void    camera_destroy(camera_t* cam);
 
+// Optional setup for a width x height image: projections with costly
+// directions (fisheye, spherical) tabulate them at the pixel corners and
+// interpolate from then on. Not thread-safe; call before rendering.
+// Returns false if the table could not be built, the camera still works.
+bool camera_prepare(camera_t* cam, int width, int height);
+// Rays for `count` samples, written to index 0..count-1 of out. Reads the
+// camera only, so threads may share it.
+void camera_generate_rays(const camera_t* cam, const camera_sample_t* samples,
+                          size_t count, const camera_rays_t* out);
+
 #endif
@@ -11,8 +11,15 @@ struct camera_projection_ops {
 
   // init private data
   void* (*init)(wf_vec3 pos, wf_vec3 target, wf_vec3 up, const void* params);
-  // generate ray direction
+  // generate ray direction through the lens center
   wf_vec3 (*get_ray_direction)(const void* priv, float u, float v);
+  // generate a batch of rays from the camera at pos (optional, falls back
+  // to get_ray_direction from pos)
+  void (*generate_rays)(const void* priv, wf_vec3 pos,
+                        const camera_sample_t* samples, size_t count,
+                        const camera_rays_t* out);
+  // tabulate directions for a width x height image (optional)
+  bool (*prepare)(void* priv, int width, int height);
   // clean up
   void (*exit)(void* priv);
 };
@@ -25,6 +32,62 @@ struct camera_projection_ops {
 
 void camera_register_projection(const struct camera_projection_ops* ops);
 
+// Directions at the (width + 1) x (height + 1) pixel corners of the image,
+// NULL if out of memory
+wf_vec3* camera_direction_table(const void* priv,
+                                wf_vec3 (*direction)(const void* priv, float u,
+                                                     float v),
+                                int width, int height);
+
+// Bilinear lookup of (u, v) in a corner table, renormalized. Directions a
+// pixel apart are close, so this is off by a small fraction of a pixel.
+static inline wf_vec3 camera_table_lookup(const wf_vec3* table, int width,
+                                          int height, float u, float v) {
+  float fx = fminf(fmaxf(u, 0.0f), 1.0f) * (float)width;
+  float fy = fminf(fmaxf(v, 0.0f), 1.0f) * (float)height;
+  int   x  = (int)fx < width ? (int)fx : width - 1;
+  int   y  = (int)fy < height ? (int)fy : height - 1;
+  fx -= (float)x;
+  fy -= (float)y;
+
+  const wf_vec3* row0 = table + (size_t)y * (width + 1) + x;
+  const wf_vec3* row1 = row0 + width + 1;
+  wf_vec3        top  = v3_add(v3_scale(1.0f - fx, row0[0]),
+                               v3_scale(fx, row0[1]));
+  wf_vec3        bot  = v3_add(v3_scale(1.0f - fx, row1[0]),
+                               v3_scale(fx, row1[1]));
+  return v3_normalize(v3_add(v3_scale(1.0f - fy, top), v3_scale(fy, bot)));
+}
+
+// Shirley's concentric map of a lens sample in [0,1)^2 onto the unit disk:
+// uniform, continuous, and (0.5, 0.5) goes to the center
+static inline void camera_lens_disk(float lens_u, float lens_v, float* x,
+                                    float* y) {
+  float a = 2.0f * lens_u - 1.0f;
+  float b = 2.0f * lens_v - 1.0f;
+  if (a == 0.0f && b == 0.0f) {
+    *x = *y = 0.0f;
+  } else if (fabsf(a) > fabsf(b)) {
+    float phi = (float)M_PI_4 * (b / a);
+    *x        = a * cosf(phi);
+    *y        = a * sinf(phi);
+  } else {
+    float phi = (float)M_PI_2 - (float)M_PI_4 * (a / b);
+    *x        = b * cosf(phi);
+    *y        = b * sinf(phi);
+  }
+}
+
+static inline void camera_rays_store(const camera_rays_t* out, size_t i,
+                                     wf_vec3 origin, wf_vec3 direction) {
+  out->ox[i] = origin.x;
+  out->oy[i] = origin.y;
+  out->oz[i] = origin.z;
+  out->dx[i] = direction.x;
+  out->dy[i] = direction.y;
+  out->dz[i] = direction.z;
+}
+
 // projection strategy register table
 static const struct camera_projection_ops* s_projections[6] = { 0 };
 
@@ -2,18 +2,37 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
-#define DEFAULT_WIDTH  800
-#define DEFAULT_HEIGHT 600
-#define DEFAULT_OUTPUT "output.png"
+#define DEFAULT_WIDTH   800
+#define DEFAULT_HEIGHT  600
+#define DEFAULT_OUTPUT  "output.png"
+#define DEFAULT_BVH     "sah"
+#define DEFAULT_SPP     64 // samples per pixel
+#define DEFAULT_MIN_SPP 8  // samples before --adaptive may stop a pixel
 
 typedef struct {
   int         width;
   int         height;
   const char* output;
-  int         samples;
+  int         samples; // per pixel, 0 = DEFAULT_SPP; the most with adaptive
   int         verbose;
   const char* obj_file;
   const char* mtl_file;
+  const char* bvh;              // bvh_ops strategy name
+  int         bvh_leaf_size;    // 0 = builder default
+  int         bvh_bins;         // 0 = builder default
+  float       bvh_split_budget; // < 0 = builder default
+  int         bvh_two_level;    // per-object BVHs under a top-level tree
+  int         bvh_lod;          // coarser mesh levels per object, 0 = none
+  const char* bvh_cache;        // BVH cache file, NULL = always build
+  int         bvh_stats;        // log a BVH quality report
+  int         bvh_stats_rays;   // camera rays traced for the report
+  int         packet_size;      // camera rays per packet, 0 = one at a time
+  int         wavefront;        // batched wavefront integrator
+  int         threads;          // render threads, 0 = one per CPU
+  unsigned    seed;             // sampler seed, same seed same image
+  int         analytic;         // quads, discs and spheres as analytic shapes
+  float       adaptive;         // 95% interval to stop a pixel at, 0 = off
+  int         min_samples;      // adaptive samples per pixel, 0 = default
 } rtCfg;
 
 #endif // CONFIG_H
@@ -0,0 +1,62 @@
+// parallel.h
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Body of a parallel region, called once by every worker
+typedef void (*parallel_fn)(void* arg, unsigned worker, unsigned worker_count);
+
+// Body of a parallel loop, called on disjoint [begin, end) chunks
+typedef void (*parallel_range_fn)(void* arg, size_t begin, size_t end);
+
+// Number of online CPUs (at least 1)
+unsigned parallel_cpu_count(void);
+
+// Runs fn on `workers` threads and waits for all of them. The caller is
+// worker 0; if a thread cannot be spawned its share runs on the caller.
+void parallel_run(unsigned workers, parallel_fn fn, void* arg);
+
+// Splits [0, count) into chunks of at least `grain` items, handed out to
+// `workers` threads on demand
+void parallel_for(unsigned workers, size_t count, size_t grain,
+                  parallel_range_fn fn, void* arg);
+
+// Persistent worker threads running batches of tasks. Each worker has a
+// deque of task indices: it takes tasks from the front of its own and, once
+// that runs dry, steals the back half of another worker's.
+typedef struct parallel_pool_s parallel_pool_t;
+
+// Body of a pool task, with the index of the worker running it
+typedef void (*parallel_task_fn)(void* arg, size_t task, unsigned worker);
+
+// Starts `workers` - 1 threads, the caller of parallel_pool_run() being
+// worker 0; 0 = one per CPU. Fewer workers if threads cannot be spawned,
+// NULL if memory runs out.
+parallel_pool_t* parallel_pool_create(unsigned workers);
+void             parallel_pool_destroy(parallel_pool_t* pool);
+// Number of workers, 1 for a NULL pool
+unsigned         parallel_pool_workers(const parallel_pool_t* pool);
+
+// Runs tasks [0, count) (count < 2^32) and waits for them. Worker w starts
+// with the w-th contiguous share of the tasks, in order. A NULL pool runs
+// every task on the caller as worker 0.
+void parallel_pool_run(parallel_pool_t* pool, size_t count,
+                       parallel_task_fn fn, void* arg);
+
+// parallel_for() on the threads of a pool, one task per chunk of `grain`
+void parallel_pool_for(parallel_pool_t* pool, size_t count, size_t grain,
+                       parallel_range_fn fn, void* arg);
+
+// Stable LSD radix sort on the low `key_bits` bits of keys, permuting values
+// alongside. Returns false if the scratch buffers cannot be allocated.
+bool parallel_radix_sort(unsigned workers, uint64_t* keys, uint32_t* values,
+                         size_t count, unsigned key_bits);
+// The same on the threads of a pool
+bool parallel_pool_radix_sort(parallel_pool_t* pool, uint64_t* keys,
+                              uint32_t* values, size_t count,
+                              unsigned key_bits);
+
+#endif // PARALLEL_H
@@ -4,9 +4,14 @@
 #include "config.h"
 #include "wavefront.h"
 
+// A ray and the cone around it: the cone is cone_width wide at the origin
+// and widens by cone_spread per unit of distance (unit directions). Both 0
+// for a thin ray, which always sees full-detail geometry.
 typedef struct {
   wf_vec3 origin;
   wf_vec3 direction;
+  float   cone_width;
+  float   cone_spread;
 } ray_t;
 
 int render_scene(const rtCfg* cfg);
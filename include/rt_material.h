@@ -9,6 +9,7 @@ typedef struct {
   brdf_t* brdf;
   float   opacity;
   float   ior;
+  float   cone_spread; // radians a reflected ray cone widens by (lobe width)
 } rt_material_t;
 
 rt_material_t* rt_material_from_wf(const wf_material_t* wf_mat);
@@ -13,12 +13,19 @@ typedef void (*acc_add_fn)(accumulator_t* self, const wf_vec3* color,
                            int index);
 // 获取最终颜色
 typedef wf_vec3 (*acc_get_fn)(const accumulator_t* self);
+// 已累加的样本数
+typedef int (*acc_count_fn)(const accumulator_t* self);
+// 样本方差（每个通道，无偏估计），少于两个样本时为 0。平均累加器用 Welford
+// 在线算法，不必保存样本
+typedef wf_vec3 (*acc_variance_fn)(const accumulator_t* self);
 
 struct accumulator_s {
-  void*       data;
-  acc_init_fn init;
-  acc_add_fn  add;
-  acc_get_fn  get;
+  void*           data;
+  acc_init_fn     init;
+  acc_add_fn      add;
+  acc_get_fn      get;
+  acc_count_fn    count;
+  acc_variance_fn variance;
 };
 
 accumulator_t* accumulator_create_average(void);
@@ -3,21 +3,58 @@
 #define SAMPLER_H
 
 #include <stddef.h>
+#include <stdint.h>
+
+// Dimensions of a pixel sample's random numbers (sampler_uniform())
+enum {
+  SAMPLER_DIM_PIXEL_U = 0, // position within the pixel
+  SAMPLER_DIM_PIXEL_V,
+  SAMPLER_DIM_LENS_U, // position on the lens
+  SAMPLER_DIM_LENS_V,
+};
 
 typedef struct sampler_s sampler_t;
 
-// 生成一个 [0,1)x[0,1) 的样本点
-typedef void (*sample_gen_fn)(const sampler_t* self, size_t sample_index,
-                              float* u, float* v);
+// 生成一个 [0,1)x[0,1) 的样本点: sample `sample_index` of pixel `pixel`
+// (y * width + x). The point only depends on the sampler, the pixel and
+// the index, never on what was generated before.
+typedef void (*sample_gen_fn)(const sampler_t* self, size_t pixel,
+                              size_t sample_index, float* u, float* v);
+// 新建一个同类型、同 spp 的采样器
+typedef sampler_t* (*sample_create_fn)(const sampler_t* self);
 
 struct sampler_s {
-  void*         data;
-  sample_gen_fn generate;
+  void*            data;
+  sample_gen_fn    generate;
+  sample_create_fn create_like;
+  uint32_t         seed; // 0 after creation
 };
 
 sampler_t* sampler_create_regular_grid(int spp); // spp = samples per pixel
 sampler_t* sampler_create_random(int spp);
 sampler_t* sampler_create_jittered(int spp);
 void       sampler_destroy(sampler_t* sampler);
+// Another sampler of the same kind, spp and seed, e.g. one per thread;
+// NULL if memory runs out (as for every creator)
+sampler_t* sampler_clone(const sampler_t* sampler);
+
+// PCG output permutation of an LCG step: a well-mixed 32-bit hash
+static inline uint32_t sampler_pcg_hash(uint32_t x) {
+  uint32_t state = x * 747796405u + 2891336453u;
+  uint32_t word  = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+  return (word >> 22u) ^ word;
+}
+
+// Counter-based random number in [0, 1): a hash of the seed, pixel, sample
+// index and dimension, with no state, so every thread and tile order sees
+// the same value for the same key
+static inline float sampler_uniform(uint32_t seed, uint32_t pixel,
+                                    uint32_t sample, uint32_t dim) {
+  uint32_t h = sampler_pcg_hash(seed);
+  h          = sampler_pcg_hash(h + pixel);
+  h          = sampler_pcg_hash(h + sample);
+  h          = sampler_pcg_hash(h + dim);
+  return (float)(h >> 8) * (1.0f / 16777216.0f); // 24 bits, exact in float
+}
 
 #endif
@@ -1,13 +1,23 @@
 // bvh.c
 #include "bvh/bvh.h"
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include "bvh/bvh_build.h"
+#include "bvh/bvh_cache.h"
 #include "bvh/bvh_ops.h"
+#include "bvh/bvh_shape.h"
+#include "bvh/bvh_tri.h"
 #include "wavefront.h"
 
+#define MAX_BVH_OPS 16
+// Stream ops only pay off once nodes miss the cache; smaller trees stay
+// resident and are traced one ray at a time
+#define STREAM_MIN_FACES (1u << 18)
+
 // Registry (static array for simplicity)
-static const struct bvh_ops* s_bvh_registry[8] = { 0 };
-static size_t                s_registry_count  = 0;
+static const struct bvh_ops* s_bvh_registry[MAX_BVH_OPS] = { 0 };
+static size_t                s_registry_count            = 0;
 
 void bvh_register_ops(const struct bvh_ops* ops) {
   if (s_registry_count < sizeof(s_bvh_registry) / sizeof(s_bvh_registry[0])) {
@@ -27,22 +37,247 @@ const struct bvh_ops* bvh_get_ops(const char* name) {
 }
 
 // Public API
+void bvh_build_params_init(bvh_build_params_t* params) {
+  params->max_leaf_size = BVH_DEFAULT_LEAF_SIZE;
+  params->bin_count     = BVH_DEFAULT_BIN_COUNT;
+  params->threads       = 0;
+  params->split_budget  = BVH_DEFAULT_SPLIT_BUDGET;
+  params->shapes        = NULL;
+}
+
+// Caller's params with out-of-range fields replaced by the defaults
+static void resolve_params(const bvh_build_params_t* params,
+                           bvh_build_params_t*       p) {
+  bvh_build_params_init(p);
+  if (params) {
+    p->threads      = params->threads;
+    p->split_budget = params->split_budget > 0.0f ? params->split_budget : 0.0f;
+    p->shapes       = params->shapes;
+    if (params->max_leaf_size > 0)
+      p->max_leaf_size = params->max_leaf_size;
+    if (params->bin_count >= 2)
+      p->bin_count = params->bin_count < BVH_MAX_BIN_COUNT ? params->bin_count
+                                                           : BVH_MAX_BIN_COUNT;
+  }
+}
+
+// Bounds of all faces, whatever node layout the strategy uses
+static void tree_bounds(bvh_tree_t* tree) {
+  bvh_bbox_empty(&tree->bbox_min, &tree->bbox_max);
+  for (size_t i = 0; i < tree->face_count; ++i) {
+    wf_vec3 fmin, fmax;
+    bvh_face_bbox(&tree->faces[i], bvh_shape_of(tree->shapes, i), tree->scene,
+                  &fmin, &fmax);
+    bvh_bbox_expand(&tree->bbox_min, &tree->bbox_max, &fmin, &fmax);
+  }
+}
+
+// Bounds and, for trees with leaf ranges, the precomputed triangles their
+// traversal uses
+static bvh_tree_t* finish_tree(bvh_tree_t* tree, const bvh_build_params_t* p) {
+  if (!tree)
+    return NULL;
+  tree->shapes = p->shapes;
+  tree_bounds(tree);
+  if (tree->face_indices
+      && !bvh_tri_buffer_init(tree, bvh_build_workers(p, tree->face_count))) {
+    tree->ops->destroy(tree);
+    return NULL;
+  }
+  return tree;
+}
+
 bvh_tree_t* bvh_create(const char* type, const wf_face* faces,
-                       size_t face_count, const wf_scene_t* scene) {
+                       size_t face_count, const wf_scene_t* scene,
+                       const bvh_build_params_t* params) {
   const struct bvh_ops* ops = bvh_get_ops(type);
   if (!ops)
     return NULL;
-  return ops->build(faces, face_count, scene);
+
+  bvh_build_params_t p;
+  resolve_params(params, &p);
+  return finish_tree(ops->build(faces, face_count, scene, &p), &p);
+}
+
+bvh_tree_t* bvh_create_cached(const char* cache_path, const char* type,
+                              const wf_face* faces, size_t face_count,
+                              const wf_scene_t*         scene,
+                              const bvh_build_params_t* params) {
+  const struct bvh_ops* ops = bvh_get_ops(type);
+  if (!ops)
+    return NULL;
+  if (!cache_path)
+    return bvh_create(type, faces, face_count, scene, params);
+
+  bvh_build_params_t p;
+  resolve_params(params, &p);
+  uint64_t    key  = bvh_cache_key(ops->name, faces, face_count, scene, &p);
+  bvh_tree_t* tree = bvh_cache_map(cache_path, key, ops, faces, face_count,
+                                   scene);
+  if (tree)
+    return finish_tree(tree, &p);
+
+  // Missing, stale or corrupt: build, and replace the file for next time
+  tree = finish_tree(ops->build(faces, face_count, scene, &p), &p);
+  if (tree)
+    bvh_cache_write(tree, cache_path, key, ops);
+  return tree;
 }
 
 bool bvh_intersect(const bvh_tree_t* tree, const ray_t* ray, float* t_hit) {
   if (!tree || !tree->ops)
     return false;
-  return tree->ops->intersect(tree, ray, t_hit);
+  if (tree->ops->intersect)
+    return tree->ops->intersect(tree, ray, t_hit);
+
+  bvh_hit_t hit;
+  if (!bvh_intersect_closest(tree, ray, 0.0f, INFINITY, &hit))
+    return false;
+  if (t_hit)
+    *t_hit = hit.t;
+  return true;
+}
+
+bool bvh_intersect_closest(const bvh_tree_t* tree, const ray_t* ray,
+                           float t_min, float t_max, bvh_hit_t* hit) {
+  if (!tree || !tree->ops || !tree->ops->intersect_closest)
+    return false;
+  return tree->ops->intersect_closest(tree, ray, t_min, t_max, hit);
+}
+
+bool bvh_occluded(const bvh_tree_t* tree, const ray_t* ray, float t_min,
+                  float t_max) {
+  if (!tree || !tree->ops)
+    return false;
+  if (tree->ops->intersect_any)
+    return tree->ops->intersect_any(tree, ray, t_min, t_max);
+  return bvh_intersect_closest(tree, ray, t_min, t_max, NULL);
+}
+
+// Rays the packet ops can take together: one octant of directions
+static bool packet_coherent(const ray_t* rays, uint32_t count) {
+  const wf_vec3* d0 = &rays[0].direction;
+  for (uint32_t k = 1; k < count; ++k) {
+    const wf_vec3* d = &rays[k].direction;
+    if ((d->x < 0.0f) != (d0->x < 0.0f) || (d->y < 0.0f) != (d0->y < 0.0f)
+        || (d->z < 0.0f) != (d0->z < 0.0f))
+      return false;
+  }
+  return true;
+}
+
+uint32_t bvh_intersect_packet(const bvh_tree_t* tree, const ray_t* rays,
+                              uint32_t count, float t_min, const float* t_max,
+                              bvh_hit_t* hits) {
+  if (!tree || !tree->ops || count == 0)
+    return 0;
+  if (tree->ops->intersect_packet && count <= BVH_PACKET_MAX
+      && packet_coherent(rays, count))
+    return tree->ops->intersect_packet(tree, rays, count, t_min, t_max, hits);
+
+  uint32_t mask = 0;
+  for (uint32_t k = 0; k < count && k < BVH_PACKET_MAX; ++k) {
+    if (bvh_intersect_closest(tree, &rays[k], t_min, t_max[k], &hits[k]))
+      mask |= 1u << k;
+  }
+  return mask;
+}
+
+uint32_t bvh_occluded_packet(const bvh_tree_t* tree, const ray_t* rays,
+                             uint32_t count, float t_min, const float* t_max) {
+  if (!tree || !tree->ops || count == 0)
+    return 0;
+  if (tree->ops->occluded_packet && count <= BVH_PACKET_MAX
+      && packet_coherent(rays, count))
+    return tree->ops->occluded_packet(tree, rays, count, t_min, t_max);
+
+  uint32_t mask = 0;
+  for (uint32_t k = 0; k < count && k < BVH_PACKET_MAX; ++k) {
+    if (bvh_occluded(tree, &rays[k], t_min, t_max[k]))
+      mask |= 1u << k;
+  }
+  return mask;
+}
+
+size_t bvh_intersect_stream(const bvh_tree_t* tree, const ray_t* rays,
+                            size_t count, float t_min, const float* t_max,
+                            bvh_hit_t* hits, bool* hit) {
+  if (tree && tree->ops && tree->ops->intersect_stream
+      && tree->face_count >= STREAM_MIN_FACES)
+    return tree->ops->intersect_stream(tree, rays, count, t_min, t_max, hits,
+                                       hit);
+
+  size_t hit_count = 0;
+  for (size_t i = 0; i < count; ++i) {
+    hit[i] = bvh_intersect_closest(tree, &rays[i], t_min, t_max[i], &hits[i]);
+    hit_count += hit[i];
+  }
+  return hit_count;
+}
+
+size_t bvh_occluded_stream(const bvh_tree_t* tree, const ray_t* rays,
+                           size_t count, float t_min, const float* t_max,
+                           bool* occluded) {
+  if (tree && tree->ops && tree->ops->occluded_stream
+      && tree->face_count >= STREAM_MIN_FACES)
+    return tree->ops->occluded_stream(tree, rays, count, t_min, t_max,
+                                      occluded);
+
+  size_t occluded_count = 0;
+  for (size_t i = 0; i < count; ++i) {
+    occluded[i] = bvh_occluded(tree, &rays[i], t_min, t_max[i]);
+    occluded_count += occluded[i];
+  }
+  return occluded_count;
 }
 
 void bvh_destroy(bvh_tree_t* tree) {
   if (tree && tree->ops) {
+    bvh_tri_buffer_free(tree);
     tree->ops->destroy(tree);
   }
 }
+
+// Replaces the tree's contents with a fresh build of the same strategy
+static bool rebuild_in_place(bvh_tree_t* tree, const bvh_build_params_t* p) {
+  bvh_tree_t* fresh = bvh_create(tree->ops->name, tree->faces,
+                                 tree->face_count, tree->scene, p);
+  if (!fresh)
+    return false;
+  bvh_tree_t old = *tree;
+  *tree          = *fresh;
+  *fresh         = old;
+  bvh_destroy(fresh); // frees the old contents
+  if (tree->ops->sah_cost)
+    tree->sah_cost = tree->ops->sah_cost(tree);
+  return true;
+}
+
+bool bvh_refit(bvh_tree_t* tree, const bvh_build_params_t* params,
+               float rebuild_ratio) {
+  if (!tree || !tree->ops)
+    return false;
+
+  bvh_build_params_t p;
+  resolve_params(params, &p);
+  p.shapes                  = tree->shapes; // the faces stay the same
+  const struct bvh_ops* ops = tree->ops;
+  if (!ops->refit)
+    return rebuild_in_place(tree, &p);
+
+  bool monitor = rebuild_ratio > 0.0f && ops->sah_cost;
+  // Until the first refit the bounds are still the ones built
+  if (monitor && tree->sah_cost <= 0.0f)
+    tree->sah_cost = ops->sah_cost(tree);
+
+  unsigned workers = bvh_build_workers(&p, tree->face_count);
+  if (!ops->refit(tree, workers))
+    return rebuild_in_place(tree, &p);
+  if (tree->tris)
+    bvh_tri_buffer_fill(tree, workers);
+  tree_bounds(tree);
+
+  if (monitor && ops->sah_cost(tree) > rebuild_ratio * tree->sah_cost)
+    return rebuild_in_place(tree, &p);
+  return true;
+}
@@ -0,0 +1,512 @@
+// bvh_compact.c
+// Compact node formats for large scenes. bvh_compact() rewrites a binary
+// tree depth-first so the left child always directly follows its parent
+// and only the right child needs an index. Nodes are either 32 bytes with
+// full-precision bounds (two per 64-byte cache line) or, quantized, 16 bytes
+// with bounds stored as 8-bit steps across the parent's box.
+// "compact" and "compact_q8" build with "sah" and convert straight away.
+#include <stdlib.h>
+#include <string.h>
+#include "bvh/bvh_ops.h"
+#include "bvh/bvh_util.h"
+
+static struct bvh_ops compact_ops;
+static struct bvh_ops compact_q8_ops;
+
+#define COMPACT_BASE_BUILDER "sah"
+#define COMPACT_ALIGN        32
+#define COMPACT_STACK_SIZE   64
+#define QUANT_STEPS          255
+
+// Inner node: count == 0, left child is the next node, offset the right one.
+// Leaf: count faces starting at face_indices[offset].
+typedef struct {
+  float    bbox_min[3];
+  float    bbox_max[3];
+  uint32_t offset;
+  uint32_t count;
+} compact_node_t;
+
+// Same, with bounds in QUANT_STEPS steps of the parent's (decoded) box,
+// rounded outwards so every child stays inside its parent
+typedef struct {
+  uint8_t  qmin[3];
+  uint8_t  qmax[3];
+  uint16_t pad;
+  uint32_t offset;
+  uint32_t count;
+} compact_qnode_t;
+
+typedef struct {
+  compact_node_t*  nodes;  // full-precision format, or NULL
+  compact_qnode_t* qnodes; // quantized format, or NULL
+  size_t           node_count;
+  float            root_min[3]; // frame the quantized root is encoded in
+  float            root_max[3];
+} compact_bvh_t;
+
+// Box decoded from a quantized node, kept on the traversal stack
+typedef struct {
+  float bmin[3];
+  float bmax[3];
+} compact_box_t;
+
+// The end points decode exactly, so a child touching its parent's box
+// cannot come out a rounding error short of it
+static inline float dequantize(uint8_t q, float lo, float hi) {
+  if (q == QUANT_STEPS)
+    return hi;
+  return lo + (float)q * ((hi - lo) * (1.0f / QUANT_STEPS));
+}
+
+static void decode_box(const compact_qnode_t* q, const compact_box_t* parent,
+                       compact_box_t* out) {
+  for (int axis = 0; axis < 3; ++axis) {
+    float lo        = parent->bmin[axis];
+    float hi        = parent->bmax[axis];
+    out->bmin[axis] = dequantize(q->qmin[axis], lo, hi);
+    out->bmax[axis] = dequantize(q->qmax[axis], lo, hi);
+  }
+}
+
+// Rounds the box outwards onto the parent's grid, checking against the
+// decoded values so the result holds under decode_box()'s arithmetic
+static void encode_box(const wf_vec3* bmin, const wf_vec3* bmax,
+                       const compact_box_t* parent, compact_qnode_t* q) {
+  for (int axis = 0; axis < 3; ++axis) {
+    float lo     = parent->bmin[axis];
+    float hi     = parent->bmax[axis];
+    float extent = hi - lo;
+    float cmin   = (&bmin->x)[axis];
+    float cmax   = (&bmax->x)[axis];
+    int   qmin   = 0;
+    int   qmax   = QUANT_STEPS;
+    if (extent > 0.0f) {
+      float fmin = (cmin - lo) / extent * QUANT_STEPS;
+      float fmax = (cmax - lo) / extent * QUANT_STEPS;
+      qmin       = fmin <= 0.0f ? 0 : (int)bvh_minf(fmin, QUANT_STEPS);
+      qmax       = fmax <= 0.0f ? 0 : (int)ceilf(bvh_minf(fmax, QUANT_STEPS));
+    }
+    while (qmin > 0 && dequantize((uint8_t)qmin, lo, hi) > cmin)
+      --qmin;
+    while (qmax < QUANT_STEPS && dequantize((uint8_t)qmax, lo, hi) < cmax)
+      ++qmax;
+    q->qmin[axis] = (uint8_t)qmin;
+    q->qmax[axis] = (uint8_t)qmax;
+  }
+  q->pad = 0;
+}
+
+typedef struct {
+  compact_bvh_t*    out;
+  const bvh_node_t* bin;
+  size_t            next; // next free output slot
+} convert_ctx_t;
+
+// Writes the binary subtree at bin_idx depth-first, returning its slot.
+// `parent` is the decoded box the quantized node is encoded against.
+static uint32_t convert_node(convert_ctx_t* ctx, uint32_t bin_idx,
+                             const compact_box_t* parent) {
+  const bvh_node_t* src = &ctx->bin[bin_idx];
+  uint32_t          idx = (uint32_t)ctx->next++;
+
+  compact_box_t box;
+  uint32_t      offset = src->is_leaf ? src->leaf.start : 0;
+  uint32_t      count  = src->is_leaf ? src->leaf.count : 0;
+  if (ctx->out->qnodes) {
+    encode_box(&src->bbox_min, &src->bbox_max, parent, &ctx->out->qnodes[idx]);
+    decode_box(&ctx->out->qnodes[idx], parent, &box);
+  } else {
+    memcpy(box.bmin, &src->bbox_min.x, sizeof(box.bmin));
+    memcpy(box.bmax, &src->bbox_max.x, sizeof(box.bmax));
+    memcpy(ctx->out->nodes[idx].bbox_min, box.bmin, sizeof(box.bmin));
+    memcpy(ctx->out->nodes[idx].bbox_max, box.bmax, sizeof(box.bmax));
+  }
+
+  if (!src->is_leaf) {
+    convert_node(ctx, src->internal.left, &box); // lands at idx + 1
+    offset = convert_node(ctx, src->internal.right, &box);
+  }
+  if (ctx->out->qnodes) {
+    ctx->out->qnodes[idx].offset = offset;
+    ctx->out->qnodes[idx].count  = count;
+  } else {
+    ctx->out->nodes[idx].offset = offset;
+    ctx->out->nodes[idx].count  = count;
+  }
+  return idx;
+}
+
+bool bvh_compact(bvh_tree_t* tree, bool quantize) {
+  if (!tree || !tree->nodes || tree->priv || tree->node_count == 0)
+    return false;
+
+  compact_bvh_t* c = calloc(1, sizeof(compact_bvh_t));
+  if (!c)
+    return false;
+  size_t node_size = quantize ? sizeof(compact_qnode_t)
+                              : sizeof(compact_node_t);
+  void*  mem       = NULL;
+  if (posix_memalign(&mem, COMPACT_ALIGN, tree->node_count * node_size)) {
+    free(c);
+    return false;
+  }
+  if (quantize)
+    c->qnodes = mem;
+  else
+    c->nodes = mem;
+  c->node_count = tree->node_count;
+
+  // The root is encoded against its own box
+  memcpy(c->root_min, &tree->nodes[0].bbox_min.x, sizeof(c->root_min));
+  memcpy(c->root_max, &tree->nodes[0].bbox_max.x, sizeof(c->root_max));
+  compact_box_t root;
+  memcpy(root.bmin, c->root_min, sizeof(root.bmin));
+  memcpy(root.bmax, c->root_max, sizeof(root.bmax));
+
+  convert_ctx_t ctx = { .out = c, .bin = tree->nodes, .next = 0 };
+  convert_node(&ctx, 0, &root);
+
+  free(tree->nodes);
+  tree->nodes    = NULL;
+  tree->node_cap = 0;
+  tree->priv     = c;
+  tree->ops      = quantize ? &compact_q8_ops : &compact_ops;
+  return true;
+}
+
+// Closest-hit or, with `any` (a constant in each caller), any-hit traversal
+// of the subtree at `root`, entered at root_t_near. A child that finds the
+// stack full is traversed by a recursive call instead of being dropped.
+// Returns true if best improved or, for `any`, on the first hit.
+static inline bool compact_subtree(const bvh_tree_t*     tree,
+                                   const bvh_ray_prep_t* r, const ray_t* ray,
+                                   uint32_t root, float root_t_near,
+                                   float t_min, bvh_hit_t* best,
+                                   const bool any) {
+  const compact_bvh_t*  c     = (const compact_bvh_t*)tree->priv;
+  const compact_node_t* nodes = c->nodes;
+
+  struct {
+    uint32_t node;
+    float    t_near;
+  } stack[COMPACT_STACK_SIZE];
+  uint32_t stack_ptr        = 0;
+  bool     found            = false;
+  stack[stack_ptr].node     = root;
+  stack[stack_ptr++].t_near = root_t_near;
+
+  while (stack_ptr > 0) {
+    --stack_ptr;
+    if (stack[stack_ptr].t_near >= best->t)
+      continue; // a closer hit was found after this node was pushed
+    uint32_t              idx  = stack[stack_ptr].node;
+    const compact_node_t* node = &nodes[idx];
+    if (node->count > 0) {
+      if (any && bvh_leaf_occluded(tree, node->offset, node->count, ray,
+                                   t_min, best->t))
+        return true;
+      if (!any)
+        found |= bvh_leaf_intersect(tree, node->offset, node->count, ray,
+                                    t_min, best);
+      continue;
+    }
+
+    uint32_t child[2] = { idx + 1, node->offset };
+    float    t[2];
+    bool     hit_child[2];
+    for (int k = 0; k < 2; ++k) {
+      hit_child[k] = bvh_ray_prep_slab(r, nodes[child[k]].bbox_min,
+                                       nodes[child[k]].bbox_max, t_min,
+                                       best->t, &t[k]);
+    }
+
+    // Push the farther child first so the nearer one is visited first
+    int near     = hit_child[1] && (!hit_child[0] || t[1] < t[0]);
+    int order[2] = { 1 - near, near };
+    for (int k = 0; k < 2; ++k) {
+      int c = order[k];
+      if (!hit_child[c])
+        continue;
+      if (stack_ptr < COMPACT_STACK_SIZE) {
+        stack[stack_ptr].node     = child[c];
+        stack[stack_ptr++].t_near = t[c];
+      } else if (compact_subtree(tree, r, ray, child[c], t[c], t_min, best,
+                                 any)) {
+        if (any)
+          return true;
+        found = true;
+      }
+    }
+  }
+  return found;
+}
+
+static inline bool compact_traverse(const bvh_tree_t* tree, const ray_t* ray,
+                                    float t_min, float t_max, bvh_hit_t* hit,
+                                    const bool any) {
+  const compact_bvh_t*  c     = (const compact_bvh_t*)tree->priv;
+  const compact_node_t* nodes = c->nodes;
+  bvh_ray_prep_t        r;
+  float                 t_near;
+  bvh_ray_prep_init(&r, ray);
+  if (!bvh_ray_prep_slab(&r, nodes[0].bbox_min, nodes[0].bbox_max, t_min,
+                         t_max, &t_near))
+    return false;
+
+  bvh_hit_t best  = { .t = t_max };
+  bool      found = compact_subtree(tree, &r, ray, 0, t_near, t_min, &best,
+                                    any);
+  if (found && hit) {
+    bvh_hit_resolve(tree, &best);
+    *hit = best;
+  }
+  return found;
+}
+
+// Same for quantized nodes, decoding child boxes on the way down; root_box
+// is the decoded box of `root`
+static inline bool compact_q8_subtree(const bvh_tree_t*     tree,
+                                      const bvh_ray_prep_t* r,
+                                      const ray_t* ray, uint32_t root,
+                                      const compact_box_t* root_box,
+                                      float root_t_near, float t_min,
+                                      bvh_hit_t* best, const bool any) {
+  const compact_bvh_t*   c      = (const compact_bvh_t*)tree->priv;
+  const compact_qnode_t* qnodes = c->qnodes;
+
+  struct {
+    uint32_t      node;
+    float         t_near;
+    compact_box_t box; // decoded bounds of node
+  } stack[COMPACT_STACK_SIZE];
+  uint32_t stack_ptr        = 0;
+  bool     found            = false;
+  stack[stack_ptr].node     = root;
+  stack[stack_ptr].box      = *root_box;
+  stack[stack_ptr++].t_near = root_t_near;
+
+  while (stack_ptr > 0) {
+    --stack_ptr;
+    if (stack[stack_ptr].t_near >= best->t)
+      continue; // a closer hit was found after this node was pushed
+    uint32_t               idx  = stack[stack_ptr].node;
+    compact_box_t          box  = stack[stack_ptr].box;
+    const compact_qnode_t* node = &qnodes[idx];
+    if (node->count > 0) {
+      if (any && bvh_leaf_occluded(tree, node->offset, node->count, ray,
+                                   t_min, best->t))
+        return true;
+      if (!any)
+        found |= bvh_leaf_intersect(tree, node->offset, node->count, ray,
+                                    t_min, best);
+      continue;
+    }
+
+    uint32_t      child[2] = { idx + 1, node->offset };
+    compact_box_t child_box[2];
+    float         t[2];
+    bool          hit_child[2];
+    for (int k = 0; k < 2; ++k) {
+      decode_box(&qnodes[child[k]], &box, &child_box[k]);
+      hit_child[k] = bvh_ray_prep_slab(r, child_box[k].bmin,
+                                       child_box[k].bmax, t_min, best->t,
+                                       &t[k]);
+    }
+
+    // Push the farther child first so the nearer one is visited first
+    int near     = hit_child[1] && (!hit_child[0] || t[1] < t[0]);
+    int order[2] = { 1 - near, near };
+    for (int k = 0; k < 2; ++k) {
+      int c = order[k];
+      if (!hit_child[c])
+        continue;
+      if (stack_ptr < COMPACT_STACK_SIZE) {
+        stack[stack_ptr].node   = child[c];
+        stack[stack_ptr].t_near = t[c];
+        stack[stack_ptr++].box  = child_box[c];
+      } else if (compact_q8_subtree(tree, r, ray, child[c], &child_box[c],
+                                    t[c], t_min, best, any)) {
+        if (any)
+          return true;
+        found = true;
+      }
+    }
+  }
+  return found;
+}
+
+static inline bool compact_q8_traverse(const bvh_tree_t* tree,
+                                       const ray_t* ray, float t_min,
+                                       float t_max, bvh_hit_t* hit,
+                                       const bool any) {
+  const compact_bvh_t* c = (const compact_bvh_t*)tree->priv;
+  bvh_ray_prep_t       r;
+  bvh_ray_prep_init(&r, ray);
+
+  compact_box_t frame, root_box;
+  float         t_near;
+  memcpy(frame.bmin, c->root_min, sizeof(frame.bmin));
+  memcpy(frame.bmax, c->root_max, sizeof(frame.bmax));
+  decode_box(&c->qnodes[0], &frame, &root_box);
+  if (!bvh_ray_prep_slab(&r, root_box.bmin, root_box.bmax, t_min, t_max,
+                         &t_near))
+    return false;
+
+  bvh_hit_t best  = { .t = t_max };
+  bool      found = compact_q8_subtree(tree, &r, ray, 0, &root_box, t_near,
+                                       t_min, &best, any);
+  if (found && hit) {
+    bvh_hit_resolve(tree, &best);
+    *hit = best;
+  }
+  return found;
+}
+
+static bool compact_intersect_closest(const bvh_tree_t* tree,
+                                      const ray_t* ray, float t_min,
+                                      float t_max, bvh_hit_t* hit) {
+  return compact_traverse(tree, ray, t_min, t_max, hit, false);
+}
+
+static bool compact_intersect_any(const bvh_tree_t* tree, const ray_t* ray,
+                                  float t_min, float t_max) {
+  return compact_traverse(tree, ray, t_min, t_max, NULL, true);
+}
+
+static bool compact_q8_intersect_closest(const bvh_tree_t* tree,
+                                         const ray_t* ray, float t_min,
+                                         float t_max, bvh_hit_t* hit) {
+  return compact_q8_traverse(tree, ray, t_min, t_max, hit, false);
+}
+
+static bool compact_q8_intersect_any(const bvh_tree_t* tree, const ray_t* ray,
+                                     float t_min, float t_max) {
+  return compact_q8_traverse(tree, ray, t_min, t_max, NULL, true);
+}
+
+static void compact_destroy(bvh_tree_t* tree) {
+  if (tree) {
+    compact_bvh_t* c = (compact_bvh_t*)tree->priv;
+    if (c) {
+      free(c->nodes);
+      free(c->qnodes);
+    }
+    free(c);
+    bvh_binary_destroy(tree);
+  }
+}
+
+static void view_set_box(bvh_node_view_t* view, const float* bmin,
+                         const float* bmax) {
+  view->bbox_min = (wf_vec3){ bmin[0], bmin[1], bmin[2] };
+  view->bbox_max = (wf_vec3){ bmax[0], bmax[1], bmax[2] };
+}
+
+// Both formats: views carry the decoded box of the node, which for the
+// quantized one is the frame its children are decoded in
+static uint32_t compact_children(const bvh_tree_t*      tree,
+                                 const bvh_node_view_t* node,
+                                 bvh_node_view_t*       children) {
+  const compact_bvh_t* c = (const compact_bvh_t*)tree->priv;
+  uint32_t             child[2];
+  uint32_t             n;
+  if (!node) {
+    child[0] = 0;
+    n        = 1;
+  } else if (node->count > 0) {
+    return 0;
+  } else {
+    child[0] = node->ref + 1;
+    child[1] = c->nodes ? c->nodes[node->ref].offset
+                        : c->qnodes[node->ref].offset;
+    n        = 2;
+  }
+
+  compact_box_t frame;
+  if (node) {
+    memcpy(frame.bmin, &node->bbox_min.x, sizeof(frame.bmin));
+    memcpy(frame.bmax, &node->bbox_max.x, sizeof(frame.bmax));
+  } else {
+    memcpy(frame.bmin, c->root_min, sizeof(frame.bmin));
+    memcpy(frame.bmax, c->root_max, sizeof(frame.bmax));
+  }
+  for (uint32_t k = 0; k < n; ++k) {
+    bvh_node_view_t* view = &children[k];
+    view->ref             = child[k];
+    if (c->nodes) {
+      const compact_node_t* cn = &c->nodes[child[k]];
+      view_set_box(view, cn->bbox_min, cn->bbox_max);
+      view->start = cn->offset;
+      view->count = cn->count;
+    } else {
+      const compact_qnode_t* q = &c->qnodes[child[k]];
+      compact_box_t          box;
+      decode_box(q, &frame, &box);
+      view_set_box(view, box.bmin, box.bmax);
+      view->start = q->offset;
+      view->count = q->count;
+    }
+    if (view->count == 0)
+      view->start = 0;
+  }
+  return n;
+}
+
+static size_t compact_node_memory(const bvh_tree_t* tree) {
+  const compact_bvh_t* c = (const compact_bvh_t*)tree->priv;
+  return sizeof(*c)
+         + c->node_count
+               * (c->nodes ? sizeof(compact_node_t) : sizeof(compact_qnode_t));
+}
+
+static bvh_tree_t* compact_build_common(const wf_face* faces,
+                                        size_t face_count,
+                                        const wf_scene_t*         scene,
+                                        const bvh_build_params_t* params,
+                                        bool                      quantize) {
+  const struct bvh_ops* base = bvh_get_ops(COMPACT_BASE_BUILDER);
+  if (!base)
+    return NULL;
+  bvh_tree_t* tree = base->build(faces, face_count, scene, params);
+  if (tree && !bvh_compact(tree, quantize)) {
+    base->destroy(tree);
+    return NULL;
+  }
+  return tree;
+}
+
+static bvh_tree_t* compact_build(const wf_face* faces, size_t face_count,
+                                 const wf_scene_t*         scene,
+                                 const bvh_build_params_t* params) {
+  return compact_build_common(faces, face_count, scene, params, false);
+}
+
+static bvh_tree_t* compact_q8_build(const wf_face* faces, size_t face_count,
+                                    const wf_scene_t*         scene,
+                                    const bvh_build_params_t* params) {
+  return compact_build_common(faces, face_count, scene, params, true);
+}
+
+static struct bvh_ops compact_ops = {
+  .name              = "compact",
+  .build             = compact_build,
+  .destroy           = compact_destroy,
+  .intersect_closest = compact_intersect_closest,
+  .intersect_any     = compact_intersect_any,
+  .children          = compact_children,
+  .node_memory       = compact_node_memory,
+};
+
+static struct bvh_ops compact_q8_ops = {
+  .name              = "compact_q8",
+  .build             = compact_q8_build,
+  .destroy           = compact_destroy,
+  .intersect_closest = compact_q8_intersect_closest,
+  .intersect_any     = compact_q8_intersect_any,
+  .children          = compact_children,
+  .node_memory       = compact_node_memory,
+};
+
+BVH_OPS_REGISTER(compact_ops)
+BVH_OPS_REGISTER(compact_q8_ops)
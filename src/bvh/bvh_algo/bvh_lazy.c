@@ -0,0 +1,300 @@
+// bvh_lazy.c
+// On-demand builder ("lazy"): the tree starts as a single deferred node
+// over every face, and a deferred node is split with the "sah" rule the
+// first time a ray reaches it. Parts of the scene no ray enters are never
+// built, so the first pixels come after one O(n) pass instead of a full
+// build. Queries may run on any number of threads: the thread that reaches
+// a deferred node first claims and splits it while others wait for that
+// node only, and as each split permutes only its own face range, disjoint
+// subtrees expand concurrently.
+#include <sched.h>
+#include <stdlib.h>
+#include "bvh/bvh_build.h"
+#include "bvh/bvh_ops.h"
+
+static struct bvh_ops lazy_ops;
+
+#define LAZY_STACK_SIZE 64
+
+// Node states; only DEFERRED -> BUSY -> LEAF or INNER transitions happen
+enum { LAZY_DEFERRED, LAZY_BUSY, LAZY_LEAF, LAZY_INNER };
+
+// Faces [start, start + count) of face_indices; once INNER, the children
+// are left and left + 1
+typedef struct {
+  float    bbox_min[3];
+  float    bbox_max[3];
+  uint32_t start;
+  uint32_t count;
+  uint32_t left;
+  uint32_t state;
+} lazy_node_t;
+
+typedef struct {
+  lazy_node_t*       nodes;      // room for the 2n - 1 nodes of a full tree
+  size_t             node_cap;
+  size_t             node_count; // allocated so far, updated atomically
+  bvh_prim_info_t    info;       // kept for the splits still to come
+  bvh_build_params_t params;
+  bvh_build_ctx_t    ctx;
+} lazy_bvh_t;
+
+static void lazy_node_init(lazy_node_t* node, const bvh_range_t* range) {
+  node->bbox_min[0] = range->bbox_min.x;
+  node->bbox_min[1] = range->bbox_min.y;
+  node->bbox_min[2] = range->bbox_min.z;
+  node->bbox_max[0] = range->bbox_max.x;
+  node->bbox_max[1] = range->bbox_max.y;
+  node->bbox_max[2] = range->bbox_max.z;
+  node->start       = (uint32_t)range->start;
+  node->count       = (uint32_t)(range->end - range->start);
+  node->left        = 0;
+  node->state       = LAZY_DEFERRED;
+}
+
+static void lazy_destroy(bvh_tree_t* tree) {
+  if (tree) {
+    lazy_bvh_t* lazy = (lazy_bvh_t*)tree->priv;
+    if (lazy) {
+      free(lazy->nodes);
+      bvh_prim_info_free(&lazy->info);
+    }
+    free(lazy);
+    bvh_binary_destroy(tree);
+  }
+}
+
+static bvh_tree_t* lazy_build(const wf_face* faces, size_t face_count,
+                              const wf_scene_t*         scene,
+                              const bvh_build_params_t* params) {
+  if (face_count == 0 || face_count > UINT32_MAX / 2)
+    return NULL;
+
+  bvh_tree_t* tree = calloc(1, sizeof(bvh_tree_t));
+  lazy_bvh_t* lazy = calloc(1, sizeof(lazy_bvh_t));
+  if (!tree || !lazy) {
+    free(tree);
+    free(lazy);
+    return NULL;
+  }
+  tree->priv = lazy;
+
+  // calloc'd, so the pages of nodes that are never split never get touched
+  lazy->node_cap     = 2 * face_count - 1;
+  lazy->nodes        = calloc(lazy->node_cap, sizeof(lazy_node_t));
+  tree->face_indices = malloc(face_count * sizeof(uint32_t));
+  if (!lazy->nodes || !tree->face_indices
+      || !bvh_prim_info_init(&lazy->info, faces, params->shapes, face_count,
+                             scene, bvh_build_workers(params, face_count))) {
+    lazy_destroy(tree);
+    return NULL;
+  }
+  for (size_t i = 0; i < face_count; ++i)
+    tree->face_indices[i] = (uint32_t)i;
+
+  lazy->params = *params;
+  lazy->ctx    = (bvh_build_ctx_t){ .info         = &lazy->info,
+                                    .face_indices = tree->face_indices,
+                                    .params       = &lazy->params,
+                                    .split        = bvh_sah_split };
+
+  bvh_range_t root;
+  bvh_range_init(&lazy->ctx, 0, face_count, &root);
+  lazy_node_init(&lazy->nodes[0], &root);
+  lazy->node_count = 1;
+
+  tree->index_count = face_count;
+  tree->faces       = faces;
+  tree->face_count  = face_count;
+  tree->scene       = scene;
+  tree->ops         = &lazy_ops;
+  return tree;
+}
+
+// Splits a deferred node, or waits for the thread splitting it, and returns
+// its final state
+static uint32_t lazy_expand(const bvh_tree_t* tree, lazy_node_t* node) {
+  lazy_bvh_t* lazy     = (lazy_bvh_t*)tree->priv;
+  uint32_t    deferred = LAZY_DEFERRED;
+  if (!__atomic_compare_exchange_n(&node->state, &deferred, LAZY_BUSY, false,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+    uint32_t state;
+    while ((state = __atomic_load_n(&node->state, __ATOMIC_ACQUIRE))
+           == LAZY_BUSY)
+      sched_yield();
+    return state;
+  }
+
+  bvh_range_t range;
+  size_t      start = node->start;
+  size_t      end   = start + node->count;
+  bvh_range_init(&lazy->ctx, start, end, &range);
+  size_t mid = lazy->ctx.split(&lazy->ctx, &range);
+  if (mid <= start || mid >= end) {
+    __atomic_store_n(&node->state, LAZY_LEAF, __ATOMIC_RELEASE);
+    return LAZY_LEAF;
+  }
+
+  // The split reordered faces [start, end), which no other thread reads
+  // until the node is published below
+  bvh_tri_buffer_fill_range(tree, start, end);
+  bvh_range_t child;
+  size_t      left = __atomic_fetch_add(&lazy->node_count, 2,
+                                        __ATOMIC_RELAXED);
+  bvh_range_init(&lazy->ctx, start, mid, &child);
+  lazy_node_init(&lazy->nodes[left], &child);
+  bvh_range_init(&lazy->ctx, mid, end, &child);
+  lazy_node_init(&lazy->nodes[left + 1], &child);
+  node->left = (uint32_t)left;
+  __atomic_store_n(&node->state, LAZY_INNER, __ATOMIC_RELEASE);
+  return LAZY_INNER;
+}
+
+// Closest-hit or, with `any` (a constant in each caller), any-hit traversal
+// of the subtree at `root`, nearest child first, expanding deferred nodes
+// on the way. A child that finds the stack full is traversed by a recursive
+// call. Returns true if best improved or, for `any`, on the first hit.
+static inline bool lazy_subtree(const bvh_tree_t*     tree,
+                                const bvh_ray_prep_t* r, const ray_t* ray,
+                                uint32_t root, float root_t_near, float t_min,
+                                bvh_hit_t* best, const bool any) {
+  lazy_node_t* nodes = ((lazy_bvh_t*)tree->priv)->nodes;
+  struct {
+    uint32_t node;
+    float    t_near;
+  } stack[LAZY_STACK_SIZE];
+  uint32_t stack_ptr        = 0;
+  bool     found            = false;
+  stack[stack_ptr].node     = root;
+  stack[stack_ptr++].t_near = root_t_near;
+
+  while (stack_ptr > 0) {
+    --stack_ptr;
+    if (stack[stack_ptr].t_near >= best->t)
+      continue; // a closer hit was found after this node was pushed
+    lazy_node_t* node  = &nodes[stack[stack_ptr].node];
+    uint32_t     state = __atomic_load_n(&node->state, __ATOMIC_ACQUIRE);
+    if (state < LAZY_LEAF)
+      state = lazy_expand(tree, node);
+    if (state == LAZY_LEAF) {
+      // Exact: a SIMD register around the leaf would read lanes that the
+      // split of a neighbouring node may be refilling
+      if (any && bvh_leaf_occluded_exact(tree, node->start, node->count, ray,
+                                         t_min, best->t))
+        return true;
+      if (!any)
+        found |= bvh_leaf_intersect_exact(tree, node->start, node->count, ray,
+                                          t_min, best);
+      continue;
+    }
+
+    uint32_t child[2] = { node->left, node->left + 1 };
+    float    t[2];
+    bool     hit_child[2];
+    for (int k = 0; k < 2; ++k) {
+      hit_child[k] = bvh_ray_prep_slab(r, nodes[child[k]].bbox_min,
+                                       nodes[child[k]].bbox_max, t_min,
+                                       best->t, &t[k]);
+    }
+
+    // Push the farther child first so the nearer one is visited first
+    int near     = hit_child[1] && (!hit_child[0] || t[1] < t[0]);
+    int order[2] = { 1 - near, near };
+    for (int k = 0; k < 2; ++k) {
+      int c = order[k];
+      if (!hit_child[c])
+        continue;
+      if (stack_ptr < LAZY_STACK_SIZE) {
+        stack[stack_ptr].node     = child[c];
+        stack[stack_ptr++].t_near = t[c];
+      } else if (lazy_subtree(tree, r, ray, child[c], t[c], t_min, best,
+                              any)) {
+        if (any)
+          return true;
+        found = true;
+      }
+    }
+  }
+  return found;
+}
+
+static inline bool lazy_traverse(const bvh_tree_t* tree, const ray_t* ray,
+                                 float t_min, float t_max, bvh_hit_t* hit,
+                                 const bool any) {
+  const lazy_node_t* root = &((const lazy_bvh_t*)tree->priv)->nodes[0];
+  bvh_ray_prep_t     r;
+  float              t_near;
+  bvh_ray_prep_init(&r, ray);
+  if (!bvh_ray_prep_slab(&r, root->bbox_min, root->bbox_max, t_min, t_max,
+                         &t_near))
+    return false;
+
+  bvh_hit_t best  = { .t = t_max };
+  bool      found = lazy_subtree(tree, &r, ray, 0, t_near, t_min, &best, any);
+  if (found && hit) {
+    bvh_hit_resolve(tree, &best);
+    *hit = best;
+  }
+  return found;
+}
+
+static bool lazy_intersect_closest(const bvh_tree_t* tree, const ray_t* ray,
+                                   float t_min, float t_max, bvh_hit_t* hit) {
+  return lazy_traverse(tree, ray, t_min, t_max, hit, false);
+}
+
+static bool lazy_intersect_any(const bvh_tree_t* tree, const ray_t* ray,
+                               float t_min, float t_max) {
+  return lazy_traverse(tree, ray, t_min, t_max, NULL, true);
+}
+
+// Only what has been built so far: deferred nodes show up as leaves over
+// their whole range. Not safe while other threads are still tracing.
+static uint32_t lazy_children(const bvh_tree_t*      tree,
+                              const bvh_node_view_t* node,
+                              bvh_node_view_t*       children) {
+  const lazy_node_t* nodes = ((const lazy_bvh_t*)tree->priv)->nodes;
+  uint32_t           idx[2];
+  uint32_t           n;
+  if (!node) {
+    idx[0] = 0;
+    n      = 1;
+  } else if (nodes[node->ref].state != LAZY_INNER) {
+    return 0;
+  } else {
+    idx[0] = nodes[node->ref].left;
+    idx[1] = idx[0] + 1;
+    n      = 2;
+  }
+  for (uint32_t k = 0; k < n; ++k) {
+    const lazy_node_t* ln    = &nodes[idx[k]];
+    bool               inner = ln->state == LAZY_INNER;
+
+    children[k].bbox_min = (wf_vec3){ ln->bbox_min[0], ln->bbox_min[1],
+                                      ln->bbox_min[2] };
+    children[k].bbox_max = (wf_vec3){ ln->bbox_max[0], ln->bbox_max[1],
+                                      ln->bbox_max[2] };
+    children[k].ref      = idx[k];
+    children[k].start    = inner ? 0 : ln->start;
+    children[k].count    = inner ? 0 : ln->count;
+  }
+  return n;
+}
+
+static size_t lazy_node_memory(const bvh_tree_t* tree) {
+  const lazy_bvh_t* lazy = (const lazy_bvh_t*)tree->priv;
+  return sizeof(*lazy) + lazy->node_count * sizeof(lazy_node_t)
+         + lazy->info.count * 3 * sizeof(wf_vec3);
+}
+
+static struct bvh_ops lazy_ops = {
+  .name              = "lazy",
+  .build             = lazy_build,
+  .destroy           = lazy_destroy,
+  .intersect_closest = lazy_intersect_closest,
+  .intersect_any     = lazy_intersect_any,
+  .children          = lazy_children,
+  .node_memory       = lazy_node_memory,
+};
+
+BVH_OPS_REGISTER(lazy_ops)
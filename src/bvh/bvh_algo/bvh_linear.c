@@ -0,0 +1,112 @@
+// bvh_linear.c
+// Brute-force strategy: no hierarchy at all, every face is tested against
+// every ray. Kept as the reference the real builders are checked against.
+#include <math.h>
+#include <stdlib.h>
+#include "algo.h"
+#include "bvh/bvh_ops.h"
+#include "bvh/bvh_shape.h"
+
+static struct bvh_ops linear_ops;
+
+static bvh_tree_t* linear_build(const wf_face* faces, size_t face_count,
+                                const wf_scene_t*         scene,
+                                const bvh_build_params_t* params) {
+  (void)params;
+  if (face_count == 0)
+    return NULL;
+
+  bvh_tree_t* tree = calloc(1, sizeof(bvh_tree_t));
+  if (!tree)
+    return NULL;
+  tree->faces      = faces;
+  tree->face_count = face_count;
+  tree->scene      = scene;
+  tree->ops        = &linear_ops;
+  return tree;
+}
+
+// Face i against the ray: the shape standing in for it, or its triangle
+static bool linear_face_intersect(const bvh_tree_t* tree, size_t i,
+                                  const ray_t* ray, float t_min, float* t,
+                                  float* u, float* v) {
+  const bvh_shape_t* shape = bvh_shape_of(tree->shapes, i);
+  if (shape)
+    return bvh_shape_intersect(shape, ray, t_min, t, u, v);
+
+  const wf_face* face = &tree->faces[i];
+  const wf_vec3* v0   = &tree->scene->vertices[face->vertices[0].v_idx];
+  const wf_vec3* v1   = &tree->scene->vertices[face->vertices[1].v_idx];
+  const wf_vec3* v2   = &tree->scene->vertices[face->vertices[2].v_idx];
+  return ray_intersects_triangle(ray, v0, v1, v2, t, u, v);
+}
+
+static bool linear_intersect_closest(const bvh_tree_t* tree, const ray_t* ray,
+                                     float t_min, float t_max,
+                                     bvh_hit_t* hit) {
+  if (!tree)
+    return false;
+
+  float    closest_t = t_max;
+  float    best_u    = 0.0f;
+  float    best_v    = 0.0f;
+  uint32_t best_face = 0;
+  bool     found     = false;
+
+  for (size_t i = 0; i < tree->face_count; ++i) {
+    float t, u, v;
+    if (linear_face_intersect(tree, i, ray, t_min, &t, &u, &v) && t > t_min
+        && t < closest_t) {
+      closest_t = t;
+      best_face = (uint32_t)i;
+      best_u    = u;
+      best_v    = v;
+      found     = true;
+    }
+  }
+
+  if (found && hit) {
+    hit->t            = closest_t;
+    hit->u            = best_u;
+    hit->v            = best_v;
+    hit->face_idx     = best_face;
+    hit->material_idx = tree->faces[best_face].material_idx;
+  }
+  return found;
+}
+
+static bool linear_intersect_any(const bvh_tree_t* tree, const ray_t* ray,
+                                 float t_min, float t_max) {
+  if (!tree)
+    return false;
+
+  for (size_t i = 0; i < tree->face_count; ++i) {
+    float t;
+    if (linear_face_intersect(tree, i, ray, t_min, &t, NULL, NULL)
+        && t > t_min && t < t_max)
+      return true;
+  }
+  return false;
+}
+
+static void linear_destroy(bvh_tree_t* tree) {
+  free(tree);
+}
+
+// Faces are read straight from the scene, so there is nothing to update
+static bool linear_refit(bvh_tree_t* tree, unsigned threads) {
+  (void)tree;
+  (void)threads;
+  return true;
+}
+
+static struct bvh_ops linear_ops = {
+  .name              = "linear",
+  .build             = linear_build,
+  .destroy           = linear_destroy,
+  .intersect_closest = linear_intersect_closest,
+  .intersect_any     = linear_intersect_any,
+  .refit             = linear_refit,
+};
+
+BVH_OPS_REGISTER(linear_ops)
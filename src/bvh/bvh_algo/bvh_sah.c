@@ -0,0 +1,242 @@
+// bvh_sah.c
+// Binned surface area heuristic builder: face centroids are dropped into
+// params->bin_count bins per axis and the bin boundary with the lowest
+// estimated traversal cost becomes the split plane. Binning and the
+// partition are both linear, so the whole build stays O(n log n). The top
+// ranges, where a single thread would otherwise bin and partition the whole
+// mesh, are split by all workers of the build.
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+#include "algo.h"
+#include "bvh/bvh_build.h"
+#include "bvh/bvh_ops.h"
+#include "parallel.h"
+
+static struct bvh_ops sah_ops;
+
+typedef struct {
+  wf_vec3  bbox_min;
+  wf_vec3  bbox_max;
+  uint32_t count;
+} sah_bin_t;
+
+// Bins of every axis; an axis whose centroids have no extent gets scale 0
+// and no bins
+typedef struct {
+  float    lo[3];
+  float    scale[3]; // bins per unit of centroid coordinate
+  uint32_t bin_count;
+} sah_grid_t;
+
+typedef sah_bin_t sah_bins_t[3][BVH_MAX_BIN_COUNT];
+
+static inline uint32_t bin_index(float c, float cmin, float scale,
+                                 uint32_t bin_count) {
+  int b = (int)((c - cmin) * scale);
+  if (b < 0)
+    b = 0;
+  return (uint32_t)b < bin_count ? (uint32_t)b : bin_count - 1;
+}
+
+static inline uint32_t face_bin(const bvh_build_ctx_t* ctx,
+                                const sah_grid_t* grid, int axis, uint32_t f) {
+  return bin_index((&ctx->info->centroids[f].x)[axis], grid->lo[axis],
+                   grid->scale[axis], grid->bin_count);
+}
+
+// Drops faces [begin, end) into the bins of every axis
+static void bin_faces(const bvh_build_ctx_t* ctx, const sah_grid_t* grid,
+                      size_t begin, size_t end, sah_bins_t bins) {
+  for (int axis = 0; axis < 3; ++axis) {
+    for (uint32_t b = 0; b < grid->bin_count; ++b) {
+      bvh_bbox_empty(&bins[axis][b].bbox_min, &bins[axis][b].bbox_max);
+      bins[axis][b].count = 0;
+    }
+  }
+  for (size_t i = begin; i < end; ++i) {
+    uint32_t f = ctx->face_indices[i];
+    for (int axis = 0; axis < 3; ++axis) {
+      if (grid->scale[axis] <= 0.0f)
+        continue;
+      sah_bin_t* bin = &bins[axis][face_bin(ctx, grid, axis, f)];
+      bvh_bbox_expand(&bin->bbox_min, &bin->bbox_max,
+                      &ctx->info->face_min[f], &ctx->info->face_max[f]);
+      bin->count++;
+    }
+  }
+}
+
+// A large range is binned by ctx->workers, each over one block of it
+typedef struct {
+  const bvh_build_ctx_t* ctx;
+  const bvh_range_t*     range;
+  const sah_grid_t*      grid;
+  sah_bins_t*            bins; // per block
+} sah_job_t;
+
+static void bin_worker(void* arg, unsigned worker, unsigned worker_count) {
+  sah_job_t* job = (sah_job_t*)arg;
+  size_t     begin, end;
+  bvh_range_block(job->range, worker, worker_count, &begin, &end);
+  bin_faces(job->ctx, job->grid, begin, end, job->bins[worker]);
+}
+
+// Bins the range on all its workers; false if there is no memory for the
+// per-block bins
+static bool bin_range(const bvh_build_ctx_t* ctx, const bvh_range_t* range,
+                      const sah_grid_t* grid, sah_bins_t bins) {
+  unsigned workers = bvh_range_workers(ctx, range->end - range->start);
+  if (workers <= 1) {
+    bin_faces(ctx, grid, range->start, range->end, bins);
+    return true;
+  }
+
+  sah_job_t job = { .ctx = ctx, .range = range, .grid = grid };
+  job.bins      = malloc(workers * sizeof(sah_bins_t));
+  if (!job.bins)
+    return false;
+  parallel_run(workers, bin_worker, &job);
+
+  memcpy(bins, job.bins[0], sizeof(sah_bins_t));
+  for (unsigned w = 1; w < workers; ++w) {
+    for (int axis = 0; axis < 3; ++axis) {
+      for (uint32_t b = 0; b < grid->bin_count; ++b) {
+        const sah_bin_t* part = &job.bins[w][axis][b];
+        bvh_bbox_expand(&bins[axis][b].bbox_min, &bins[axis][b].bbox_max,
+                        &part->bbox_min, &part->bbox_max);
+        bins[axis][b].count += part->count;
+      }
+    }
+  }
+  free(job.bins);
+  return true;
+}
+
+// Finds the cheapest binned split of the range. Returns false if making a
+// leaf is cheaper than any split, or if no plane separates the centroids.
+// Ranges above max_leaf_size always take the best split available.
+static bool find_split(const bvh_build_ctx_t* ctx, const bvh_range_t* range,
+                       const sah_grid_t* grid, int* axis_out,
+                       uint32_t* bin_out) {
+  uint32_t   bin_count = grid->bin_count;
+  sah_bins_t bins;
+  float      right_area[BVH_MAX_BIN_COUNT];
+  uint32_t   right_count[BVH_MAX_BIN_COUNT];
+
+  size_t count       = range->end - range->start;
+  float  parent_area = bvh_bbox_area(&range->bbox_min, &range->bbox_max);
+  // Costs are kept scaled by the parent area to avoid dividing by it
+  float  best_cost   = count <= ctx->params->max_leaf_size
+                           ? BVH_SAH_INTERSECT_COST * (float)count * parent_area
+                           : FLT_MAX;
+  bool   found       = false;
+
+  if (!bin_range(ctx, range, grid, bins))
+    return false;
+
+  for (int axis = 0; axis < 3; ++axis) {
+    if (grid->scale[axis] <= 0.0f)
+      continue;
+
+    // Sweep from the right: area/count of everything above boundary b
+    wf_vec3  rmin, rmax;
+    uint32_t rcount = 0;
+    bvh_bbox_empty(&rmin, &rmax);
+    for (uint32_t b = bin_count - 1; b > 0; --b) {
+      bvh_bbox_expand(&rmin, &rmax, &bins[axis][b].bbox_min,
+                      &bins[axis][b].bbox_max);
+      rcount += bins[axis][b].count;
+      right_area[b - 1]  = bvh_bbox_area(&rmin, &rmax);
+      right_count[b - 1] = rcount;
+    }
+
+    // Sweep from the left and evaluate each boundary
+    wf_vec3  lmin, lmax;
+    uint32_t lcount = 0;
+    bvh_bbox_empty(&lmin, &lmax);
+    for (uint32_t b = 0; b + 1 < bin_count; ++b) {
+      bvh_bbox_expand(&lmin, &lmax, &bins[axis][b].bbox_min,
+                      &bins[axis][b].bbox_max);
+      lcount += bins[axis][b].count;
+      if (lcount == 0 || right_count[b] == 0)
+        continue;
+
+      float cost = BVH_SAH_TRAVERSAL_COST * parent_area
+                   + BVH_SAH_INTERSECT_COST
+                         * (bvh_bbox_area(&lmin, &lmax) * (float)lcount
+                            + right_area[b] * (float)right_count[b]);
+      if (cost < best_cost) {
+        best_cost = cost;
+        *axis_out = axis;
+        *bin_out  = b;
+        found     = true;
+      }
+    }
+  }
+  return found;
+}
+
+// Partition predicate: faces in bins [0, split] of the axis go left
+typedef struct {
+  const bvh_build_ctx_t* ctx;
+  const sah_grid_t*      grid;
+  int                    axis;
+  uint32_t               split;
+} sah_side_t;
+
+static bool sah_goes_left(const void* arg, uint32_t f) {
+  const sah_side_t* side = (const sah_side_t*)arg;
+  return face_bin(side->ctx, side->grid, side->axis, f) <= side->split;
+}
+
+// Split rule (bvh_split_fn): partition at the cheapest bin boundary
+size_t bvh_sah_split(const bvh_build_ctx_t* ctx, const bvh_range_t* range) {
+  size_t     start = range->start;
+  size_t     end   = range->end;
+  int        axis  = -1;
+  uint32_t   split = 0;
+  sah_grid_t grid  = { .bin_count = ctx->params->bin_count };
+  for (int a = 0; a < 3; ++a) {
+    float extent  = (&range->centroid_max.x)[a] - (&range->centroid_min.x)[a];
+    grid.lo[a]    = (&range->centroid_min.x)[a];
+    grid.scale[a] = extent > 0.0f ? (float)grid.bin_count / extent : 0.0f;
+  }
+
+  if (!find_split(ctx, range, &grid, &axis, &split)) {
+    if (end - start <= ctx->params->max_leaf_size)
+      return start; // leaf
+    // Leaf would be too big but no plane separates the centroids
+    return start + (end - start) / 2;
+  }
+
+  sah_side_t side = {
+    .ctx = ctx, .grid = &grid, .axis = axis, .split = split
+  };
+  return bvh_range_partition(ctx, range, sah_goes_left, &side);
+}
+
+static bvh_tree_t* sah_build(const wf_face* faces, size_t face_count,
+                             const wf_scene_t*         scene,
+                             const bvh_build_params_t* params) {
+  return bvh_build_binary(faces, face_count, scene, params, bvh_sah_split,
+                          &sah_ops);
+}
+
+static struct bvh_ops sah_ops = {
+  .name              = "sah",
+  .build             = sah_build,
+  .destroy           = bvh_binary_destroy,
+  .intersect_closest = bvh_binary_intersect_closest,
+  .intersect_any     = bvh_binary_intersect_any,
+  .refit             = bvh_binary_refit,
+  .sah_cost          = bvh_binary_sah_cost,
+  .children          = bvh_binary_children,
+  .node_memory       = bvh_binary_node_memory,
+  .intersect_packet  = bvh_binary_intersect_packet,
+  .occluded_packet   = bvh_binary_occluded_packet,
+  .intersect_stream  = bvh_binary_intersect_stream,
+  .occluded_stream   = bvh_binary_occluded_stream,
+};
+
+BVH_OPS_REGISTER(sah_ops)
@@ -0,0 +1,527 @@
+// bvh_sbvh.c
+// Spatial split BVH (Stich et al. 2009). Besides binned object splits, each
+// node considers splitting space itself: faces straddling the plane are
+// clipped and referenced from both children, which removes the overlap that
+// long or large faces (walls, floors) cause in object-partition trees. Only
+// params->split_budget * face_count extra references may be created, and
+// spatial splits are only tried where the best object split overlaps.
+// Builds are serial and noticeably slower than "sah"; the tree is better.
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bvh/bvh_build.h"
+#include "bvh/bvh_ops.h"
+
+static struct bvh_ops sbvh_ops;
+
+// Spatial splits are tried when the object split children overlap by more
+// than this fraction of the root's surface area
+#define SBVH_ALPHA 1e-5f
+
+// Deeper ranges become leaves regardless of size, keeping the tree within
+// what the binary traversal stack can hold
+#define SBVH_MAX_DEPTH 48
+
+// Face reference with its (possibly clipped) bounds
+typedef struct {
+  uint32_t face;
+  wf_vec3  bbox_min;
+  wf_vec3  bbox_max;
+} sbvh_ref_t;
+
+typedef struct {
+  wf_vec3  bbox_min;
+  wf_vec3  bbox_max;
+  uint32_t count;   // object bins: faces; spatial bins: references entering
+  uint32_t exits;   // spatial bins: references leaving
+} sbvh_bin_t;
+
+typedef struct {
+  float    cost; // scaled by the node's area, like the sah builder
+  int      axis;
+  bool     spatial;
+  uint32_t bin;  // object split: last bin on the left
+  float    pos;  // spatial split: plane position
+  wf_vec3  left_min, left_max, right_min, right_max;
+  uint32_t left_count, right_count;
+} sbvh_split_t;
+
+typedef struct {
+  const wf_face*            faces;
+  const wf_scene_t*         scene;
+  const bvh_build_params_t* params;
+  bvh_node_array_t          nodes;
+  uint32_t*                 indices; // leaf references, face_indices to be
+  size_t                    index_count;
+  size_t                    index_cap;
+  size_t                    ref_total; // references alive in the build
+  size_t                    ref_limit;
+  float                     root_area;
+  bool                      failed;
+} sbvh_ctx_t;
+
+static inline float axis_of(const wf_vec3* v, int axis) {
+  return (&v->x)[axis];
+}
+
+static inline void bbox_intersect(wf_vec3* min, wf_vec3* max,
+                                  const wf_vec3* bmin, const wf_vec3* bmax) {
+  min->x = bvh_maxf(min->x, bmin->x);
+  min->y = bvh_maxf(min->y, bmin->y);
+  min->z = bvh_maxf(min->z, bmin->z);
+  max->x = bvh_minf(max->x, bmax->x);
+  max->y = bvh_minf(max->y, bmax->y);
+  max->z = bvh_minf(max->z, bmax->z);
+}
+
+static inline uint32_t bin_of(float c, float lo, float scale,
+                              uint32_t bin_count) {
+  int b = (int)((c - lo) * scale);
+  if (b < 0)
+    b = 0;
+  return (uint32_t)b < bin_count ? (uint32_t)b : bin_count - 1;
+}
+
+static inline wf_vec3 ref_centroid(const sbvh_ref_t* ref) {
+  return (wf_vec3){ 0.5f * (ref->bbox_min.x + ref->bbox_max.x),
+                    0.5f * (ref->bbox_min.y + ref->bbox_max.y),
+                    0.5f * (ref->bbox_min.z + ref->bbox_max.z) };
+}
+
+// Splits a reference at the plane axis = pos by clipping its triangle:
+// vertices and edge crossings on each side bound that half, which is then
+// kept inside the reference's current box. Analytic shapes are not
+// clipped, their box is only cut at the plane.
+static void split_reference(const sbvh_ctx_t* ctx, const sbvh_ref_t* ref,
+                            int axis, float pos, sbvh_ref_t* left,
+                            sbvh_ref_t* right) {
+  if (bvh_shape_of(ctx->params->shapes, ref->face)) {
+    *left                      = *ref;
+    *right                     = *ref;
+    (&left->bbox_max.x)[axis]  = pos;
+    (&right->bbox_min.x)[axis] = pos;
+    return;
+  }
+
+  const wf_face* face = &ctx->faces[ref->face];
+  left->face          = ref->face;
+  right->face         = ref->face;
+  bvh_bbox_empty(&left->bbox_min, &left->bbox_max);
+  bvh_bbox_empty(&right->bbox_min, &right->bbox_max);
+
+  for (int i = 0; i < 3; ++i) {
+    const wf_vec3* v0 = &ctx->scene->vertices[face->vertices[i].v_idx];
+    const wf_vec3* v1 =
+        &ctx->scene->vertices[face->vertices[(i + 1) % 3].v_idx];
+    float p0 = axis_of(v0, axis);
+    float p1 = axis_of(v1, axis);
+
+    if (p0 <= pos)
+      bvh_bbox_expand(&left->bbox_min, &left->bbox_max, v0, v0);
+    if (p0 >= pos)
+      bvh_bbox_expand(&right->bbox_min, &right->bbox_max, v0, v0);
+
+    if ((p0 < pos && p1 > pos) || (p0 > pos && p1 < pos)) {
+      float   t = (pos - p0) / (p1 - p0);
+      wf_vec3 x = { v0->x + (v1->x - v0->x) * t, v0->y + (v1->y - v0->y) * t,
+                    v0->z + (v1->z - v0->z) * t };
+      (&x.x)[axis] = pos;
+      bvh_bbox_expand(&left->bbox_min, &left->bbox_max, &x, &x);
+      bvh_bbox_expand(&right->bbox_min, &right->bbox_max, &x, &x);
+    }
+  }
+
+  (&left->bbox_max.x)[axis]  = pos;
+  (&right->bbox_min.x)[axis] = pos;
+  bbox_intersect(&left->bbox_min, &left->bbox_max, &ref->bbox_min,
+                 &ref->bbox_max);
+  bbox_intersect(&right->bbox_min, &right->bbox_max, &ref->bbox_min,
+                 &ref->bbox_max);
+}
+
+// Sweeps bins from both ends and keeps the cheapest boundary in best
+static void sweep_bins(const sbvh_bin_t* bins, uint32_t bin_count, int axis,
+                       bool spatial, float lo, float width, float node_area,
+                       sbvh_split_t* best) {
+  wf_vec3  rmin[BVH_MAX_BIN_COUNT], rmax[BVH_MAX_BIN_COUNT];
+  uint32_t rcount[BVH_MAX_BIN_COUNT];
+  wf_vec3  min, max;
+  uint32_t count = 0;
+
+  bvh_bbox_empty(&min, &max);
+  for (uint32_t b = bin_count - 1; b > 0; --b) {
+    bvh_bbox_expand(&min, &max, &bins[b].bbox_min, &bins[b].bbox_max);
+    count += spatial ? bins[b].exits : bins[b].count;
+    rmin[b - 1]   = min;
+    rmax[b - 1]   = max;
+    rcount[b - 1] = count;
+  }
+
+  bvh_bbox_empty(&min, &max);
+  count = 0;
+  for (uint32_t b = 0; b + 1 < bin_count; ++b) {
+    bvh_bbox_expand(&min, &max, &bins[b].bbox_min, &bins[b].bbox_max);
+    count += bins[b].count;
+    if (count == 0 || rcount[b] == 0)
+      continue;
+
+    float cost = BVH_SAH_TRAVERSAL_COST * node_area
+                 + BVH_SAH_INTERSECT_COST
+                       * (bvh_bbox_area(&min, &max) * (float)count
+                          + bvh_bbox_area(&rmin[b], &rmax[b])
+                                * (float)rcount[b]);
+    if (cost < best->cost) {
+      best->cost        = cost;
+      best->axis        = axis;
+      best->spatial     = spatial;
+      best->bin         = b;
+      best->pos         = lo + width * (float)(b + 1);
+      best->left_min    = min;
+      best->left_max    = max;
+      best->right_min   = rmin[b];
+      best->right_max   = rmax[b];
+      best->left_count  = count;
+      best->right_count = rcount[b];
+    }
+  }
+}
+
+static void find_object_split(const sbvh_ctx_t* ctx, const sbvh_ref_t* refs,
+                              uint32_t count, const wf_vec3* cmin,
+                              const wf_vec3* cmax, float node_area,
+                              sbvh_split_t* best) {
+  uint32_t   bin_count = ctx->params->bin_count;
+  sbvh_bin_t bins[BVH_MAX_BIN_COUNT];
+
+  for (int axis = 0; axis < 3; ++axis) {
+    float lo     = axis_of(cmin, axis);
+    float extent = axis_of(cmax, axis) - lo;
+    if (extent <= 0.0f)
+      continue;
+    float scale = (float)bin_count / extent;
+
+    for (uint32_t b = 0; b < bin_count; ++b) {
+      bvh_bbox_empty(&bins[b].bbox_min, &bins[b].bbox_max);
+      bins[b].count = 0;
+      bins[b].exits = 0;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+      wf_vec3  c = ref_centroid(&refs[i]);
+      uint32_t b = bin_of(axis_of(&c, axis), lo, scale, bin_count);
+      bvh_bbox_expand(&bins[b].bbox_min, &bins[b].bbox_max,
+                      &refs[i].bbox_min, &refs[i].bbox_max);
+      bins[b].count++;
+    }
+    sweep_bins(bins, bin_count, axis, false, lo, extent / (float)bin_count,
+               node_area, best);
+  }
+}
+
+static void find_spatial_split(const sbvh_ctx_t* ctx, const sbvh_ref_t* refs,
+                               uint32_t count, const wf_vec3* node_min,
+                               const wf_vec3* node_max, float node_area,
+                               sbvh_split_t* best) {
+  uint32_t   bin_count = ctx->params->bin_count;
+  sbvh_bin_t bins[BVH_MAX_BIN_COUNT];
+
+  for (int axis = 0; axis < 3; ++axis) {
+    float lo     = axis_of(node_min, axis);
+    float extent = axis_of(node_max, axis) - lo;
+    if (extent <= 0.0f)
+      continue;
+    float width = extent / (float)bin_count;
+    float scale = (float)bin_count / extent;
+
+    for (uint32_t b = 0; b < bin_count; ++b) {
+      bvh_bbox_empty(&bins[b].bbox_min, &bins[b].bbox_max);
+      bins[b].count = 0;
+      bins[b].exits = 0;
+    }
+    // Chop every reference into the bins it spans
+    for (uint32_t i = 0; i < count; ++i) {
+      uint32_t first = bin_of(axis_of(&refs[i].bbox_min, axis), lo, scale,
+                              bin_count);
+      uint32_t last  = bin_of(axis_of(&refs[i].bbox_max, axis), lo, scale,
+                              bin_count);
+      sbvh_ref_t rest = refs[i];
+      for (uint32_t b = first; b < last; ++b) {
+        sbvh_ref_t part;
+        split_reference(ctx, &rest, axis, lo + width * (float)(b + 1), &part,
+                        &rest);
+        bvh_bbox_expand(&bins[b].bbox_min, &bins[b].bbox_max,
+                        &part.bbox_min, &part.bbox_max);
+      }
+      bvh_bbox_expand(&bins[last].bbox_min, &bins[last].bbox_max,
+                      &rest.bbox_min, &rest.bbox_max);
+      bins[first].count++;
+      bins[last].exits++;
+    }
+    sweep_bins(bins, bin_count, axis, true, lo, width, node_area, best);
+  }
+}
+
+// Object partition: refs whose centroid bin is at most split->bin go left
+static void partition_object(const sbvh_ctx_t* ctx, sbvh_ref_t* refs,
+                             uint32_t count, const wf_vec3* cmin,
+                             const wf_vec3* cmax, const sbvh_split_t* split,
+                             sbvh_ref_t* left, uint32_t* left_count,
+                             sbvh_ref_t* right, uint32_t* right_count) {
+  uint32_t bin_count = ctx->params->bin_count;
+  int      axis      = split->axis;
+  float    lo        = axis_of(cmin, axis);
+  float    scale     = (float)bin_count / (axis_of(cmax, axis) - lo);
+
+  *left_count  = 0;
+  *right_count = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    wf_vec3 c = ref_centroid(&refs[i]);
+    if (bin_of(axis_of(&c, axis), lo, scale, bin_count) <= split->bin)
+      left[(*left_count)++] = refs[i];
+    else
+      right[(*right_count)++] = refs[i];
+  }
+}
+
+// Spatial partition. A straddling reference is split only if that beats
+// moving it whole into either child ("reference unsplitting").
+static void partition_spatial(sbvh_ctx_t* ctx, sbvh_ref_t* refs,
+                              uint32_t count, const sbvh_split_t* split,
+                              sbvh_ref_t* left, uint32_t* left_count,
+                              sbvh_ref_t* right, uint32_t* right_count) {
+  int      axis = split->axis;
+  float    pos  = split->pos;
+  wf_vec3  lmin = split->left_min, lmax = split->left_max;
+  wf_vec3  rmin = split->right_min, rmax = split->right_max;
+  uint32_t nl   = split->left_count;
+  uint32_t nr   = split->right_count;
+
+  *left_count  = 0;
+  *right_count = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    const sbvh_ref_t* ref = &refs[i];
+    if (axis_of(&ref->bbox_max, axis) <= pos) {
+      left[(*left_count)++] = *ref;
+      continue;
+    }
+    if (axis_of(&ref->bbox_min, axis) >= pos) {
+      right[(*right_count)++] = *ref;
+      continue;
+    }
+
+    wf_vec3 ulmin = lmin, ulmax = lmax, urmin = rmin, urmax = rmax;
+    bvh_bbox_expand(&ulmin, &ulmax, &ref->bbox_min, &ref->bbox_max);
+    bvh_bbox_expand(&urmin, &urmax, &ref->bbox_min, &ref->bbox_max);
+    float split_cost = bvh_bbox_area(&lmin, &lmax) * (float)nl
+                       + bvh_bbox_area(&rmin, &rmax) * (float)nr;
+    float left_cost  = bvh_bbox_area(&ulmin, &ulmax) * (float)nl
+                      + bvh_bbox_area(&rmin, &rmax) * (float)(nr - 1);
+    float right_cost = bvh_bbox_area(&lmin, &lmax) * (float)(nl - 1)
+                       + bvh_bbox_area(&urmin, &urmax) * (float)nr;
+
+    if (left_cost < split_cost && left_cost <= right_cost) {
+      left[(*left_count)++] = *ref;
+      lmin                  = ulmin;
+      lmax                  = ulmax;
+      nr--;
+    } else if (right_cost < split_cost) {
+      right[(*right_count)++] = *ref;
+      rmin                    = urmin;
+      rmax                    = urmax;
+      nl--;
+    } else {
+      split_reference(ctx, ref, axis, pos, &left[*left_count],
+                      &right[*right_count]);
+      (*left_count)++;
+      (*right_count)++;
+      ctx->ref_total++;
+    }
+  }
+}
+
+static bool push_indices(sbvh_ctx_t* ctx, const sbvh_ref_t* refs,
+                         uint32_t count) {
+  if (ctx->index_count + count > ctx->index_cap) {
+    size_t cap = ctx->index_cap ? ctx->index_cap * 2 : 1024;
+    while (cap < ctx->index_count + count)
+      cap *= 2;
+    uint32_t* indices = realloc(ctx->indices, cap * sizeof(uint32_t));
+    if (!indices)
+      return false;
+    ctx->indices   = indices;
+    ctx->index_cap = cap;
+  }
+  for (uint32_t i = 0; i < count; ++i)
+    ctx->indices[ctx->index_count++] = refs[i].face;
+  return true;
+}
+
+// Builds a node over refs (which it consumes) and returns its index
+static uint32_t build_node(sbvh_ctx_t* ctx, sbvh_ref_t* refs, uint32_t count,
+                           int depth) {
+  uint32_t idx = bvh_node_array_alloc(&ctx->nodes);
+  if (idx == UINT32_MAX) {
+    ctx->failed = true;
+    free(refs);
+    return idx;
+  }
+
+  wf_vec3 bmin, bmax, cmin, cmax;
+  bvh_bbox_empty(&bmin, &bmax);
+  bvh_bbox_empty(&cmin, &cmax);
+  for (uint32_t i = 0; i < count; ++i) {
+    wf_vec3 c = ref_centroid(&refs[i]);
+    bvh_bbox_expand(&bmin, &bmax, &refs[i].bbox_min, &refs[i].bbox_max);
+    bvh_bbox_expand(&cmin, &cmax, &c, &c);
+  }
+  float node_area = bvh_bbox_area(&bmin, &bmax);
+
+  sbvh_split_t best = { .cost = count <= ctx->params->max_leaf_size
+                                    ? BVH_SAH_INTERSECT_COST * (float)count
+                                          * node_area
+                                    : FLT_MAX,
+                        .axis = -1 };
+  if (depth < SBVH_MAX_DEPTH && count > 1) {
+    find_object_split(ctx, refs, count, &cmin, &cmax, node_area, &best);
+
+    // Spatial splits only pay off where object split children overlap
+    wf_vec3 omin = best.left_min, omax = best.left_max;
+    bbox_intersect(&omin, &omax, &best.right_min, &best.right_max);
+    if (best.axis >= 0
+        && bvh_bbox_area(&omin, &omax) > SBVH_ALPHA * ctx->root_area) {
+      sbvh_split_t spatial = best;
+      find_spatial_split(ctx, refs, count, &bmin, &bmax, node_area,
+                         &spatial);
+      size_t extra = spatial.left_count + spatial.right_count - count;
+      if (spatial.spatial && ctx->ref_total + extra <= ctx->ref_limit)
+        best = spatial;
+    }
+  }
+
+  sbvh_ref_t* left        = NULL;
+  sbvh_ref_t* right       = NULL;
+  uint32_t    left_count  = 0;
+  uint32_t    right_count = 0;
+  bool        leaf        = best.axis < 0
+                && (count <= ctx->params->max_leaf_size
+                    || depth >= SBVH_MAX_DEPTH);
+  if (!leaf) {
+    left  = malloc(count * sizeof(sbvh_ref_t));
+    right = malloc(count * sizeof(sbvh_ref_t));
+    if (!left || !right) {
+      ctx->failed = true;
+      leaf        = true;
+    } else if (best.axis < 0) {
+      // Too big for a leaf but no plane separates the centroids
+      left_count  = count / 2;
+      right_count = count - left_count;
+      memcpy(left, refs, left_count * sizeof(sbvh_ref_t));
+      memcpy(right, refs + left_count, right_count * sizeof(sbvh_ref_t));
+    } else if (best.spatial) {
+      partition_spatial(ctx, refs, count, &best, left, &left_count, right,
+                        &right_count);
+    } else {
+      partition_object(ctx, refs, count, &cmin, &cmax, &best, left,
+                       &left_count, right, &right_count);
+    }
+    if (!leaf && (left_count == 0 || right_count == 0)) {
+      // Unsplitting moved everything to one side; split by position
+      left_count  = count / 2;
+      right_count = count - left_count;
+      memcpy(left, refs, left_count * sizeof(sbvh_ref_t));
+      memcpy(right, refs + left_count, right_count * sizeof(sbvh_ref_t));
+    }
+  }
+
+  if (leaf) {
+    free(left);
+    free(right);
+    bvh_node_t* node = &ctx->nodes.nodes[idx];
+    node->is_leaf    = true;
+    node->leaf.start = (uint32_t)ctx->index_count;
+    node->leaf.count = count;
+    node->bbox_min   = bmin;
+    node->bbox_max   = bmax;
+    if (!push_indices(ctx, refs, count))
+      ctx->failed = true;
+    free(refs);
+    return idx;
+  }
+
+  free(refs);
+  uint32_t left_idx  = build_node(ctx, left, left_count, depth + 1);
+  uint32_t right_idx = build_node(ctx, right, right_count, depth + 1);
+
+  bvh_node_t* node     = &ctx->nodes.nodes[idx];
+  node->is_leaf        = false;
+  node->internal.left  = left_idx;
+  node->internal.right = right_idx;
+  node->bbox_min       = bmin;
+  node->bbox_max       = bmax;
+  return idx;
+}
+
+static bvh_tree_t* sbvh_build(const wf_face* faces, size_t face_count,
+                              const wf_scene_t*         scene,
+                              const bvh_build_params_t* params) {
+  if (face_count == 0)
+    return NULL;
+
+  sbvh_ref_t* refs = malloc(face_count * sizeof(sbvh_ref_t));
+  bvh_tree_t* tree = calloc(1, sizeof(bvh_tree_t));
+  if (!refs || !tree) {
+    free(refs);
+    free(tree);
+    return NULL;
+  }
+
+  sbvh_ctx_t ctx = { .faces = faces, .scene = scene, .params = params };
+  wf_vec3    root_min, root_max;
+  bvh_bbox_empty(&root_min, &root_max);
+  for (size_t i = 0; i < face_count; ++i) {
+    refs[i].face = (uint32_t)i;
+    bvh_face_bbox(&faces[i], bvh_shape_of(params->shapes, i), scene,
+                  &refs[i].bbox_min, &refs[i].bbox_max);
+    bvh_bbox_expand(&root_min, &root_max, &refs[i].bbox_min,
+                    &refs[i].bbox_max);
+  }
+  ctx.root_area = bvh_bbox_area(&root_min, &root_max);
+  ctx.ref_total = face_count;
+  ctx.ref_limit = face_count + (size_t)(params->split_budget * face_count);
+
+  build_node(&ctx, refs, (uint32_t)face_count, 0); // root is node 0
+  if (ctx.failed || !ctx.nodes.nodes) {
+    free(ctx.nodes.nodes);
+    free(ctx.indices);
+    free(tree);
+    return NULL;
+  }
+
+  tree->nodes        = ctx.nodes.nodes;
+  tree->node_count   = ctx.nodes.count;
+  tree->node_cap     = ctx.nodes.cap;
+  tree->face_indices = ctx.indices;
+  tree->index_count  = ctx.index_count;
+  tree->faces        = faces;
+  tree->face_count   = face_count;
+  tree->scene        = scene;
+  tree->ops          = &sbvh_ops;
+  return tree;
+}
+
+static struct bvh_ops sbvh_ops = {
+  .name              = "sbvh",
+  .build             = sbvh_build,
+  .destroy           = bvh_binary_destroy,
+  .intersect_closest = bvh_binary_intersect_closest,
+  .intersect_any     = bvh_binary_intersect_any,
+  .refit             = bvh_binary_refit,
+  .sah_cost          = bvh_binary_sah_cost,
+  .children          = bvh_binary_children,
+  .node_memory       = bvh_binary_node_memory,
+  .intersect_packet  = bvh_binary_intersect_packet,
+  .occluded_packet   = bvh_binary_occluded_packet,
+  .intersect_stream  = bvh_binary_intersect_stream,
+  .occluded_stream   = bvh_binary_occluded_stream,
+};
+
+BVH_OPS_REGISTER(sbvh_ops)
@@ -0,0 +1,456 @@
+// bvh_wide.c
+// Wide BVHs ("bvh4", "bvh8"): a binary SAH tree is collapsed so that every
+// node holds up to 4 or 8 children. Child bounds are stored as structure of
+// arrays, one lane per child, so a ray is tested against all children of a
+// node with a single SIMD slab test (SSE for 4 lanes, AVX for 8; plain C on
+// targets without them).
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+#include "bvh/bvh_ops.h"
+#include "bvh/bvh_util.h"
+
+static struct bvh_ops bvh4_ops;
+static struct bvh_ops bvh8_ops;
+
+// Binary builder whose output is collapsed
+#define WIDE_BASE_BUILDER "sah"
+
+#define WIDE_MAX_WIDTH  8
+#define WIDE_STACK_SIZE 256
+
+// Lanes of a node, each `width` words long: child bounds per axis, then the
+// child reference and face count (0 for an inner node, > 0 for a leaf).
+// Unused child slots get inverted bounds so the slab test always misses.
+enum {
+  LANE_MIN_X,
+  LANE_MIN_Y,
+  LANE_MIN_Z,
+  LANE_MAX_X,
+  LANE_MAX_Y,
+  LANE_MAX_Z,
+  LANE_CHILD,
+  LANE_COUNT,
+  LANES_PER_NODE
+};
+
+typedef union {
+  float    f;
+  uint32_t u;
+} wide_word_t;
+
+typedef struct {
+  uint32_t     width;
+  wide_word_t* words; // node i starts at words[i * LANES_PER_NODE * width]
+  size_t       node_count;
+  size_t       node_cap;
+} wide_bvh_t;
+
+// Ray data shared by every node test
+typedef struct {
+  float    org[3];
+  float    inv_dir[3];
+  uint32_t near_lane[3]; // LANE_MIN_* or LANE_MAX_* depending on the sign
+  uint32_t far_lane[3];
+  float    t_min;
+} wide_ray_t;
+
+static inline wide_word_t* wide_node(const wide_bvh_t* wide, size_t idx) {
+  return &wide->words[idx * LANES_PER_NODE * wide->width];
+}
+
+static uint32_t wide_alloc_node(wide_bvh_t* wide) {
+  size_t stride = LANES_PER_NODE * wide->width;
+  if (wide->node_count >= wide->node_cap) {
+    size_t       cap   = wide->node_cap ? wide->node_cap * 2 : 64;
+    wide_word_t* words = realloc(wide->words, cap * stride * sizeof(*words));
+    if (!words)
+      return UINT32_MAX;
+    wide->words    = words;
+    wide->node_cap = cap;
+  }
+  return (uint32_t)wide->node_count++;
+}
+
+// Converts the binary subtree at bin_idx into a wide node (and its
+// descendants), returning its index or UINT32_MAX if memory ran out
+static uint32_t collapse_node(wide_bvh_t* wide, const bvh_node_t* bin,
+                              uint32_t bin_idx) {
+  uint32_t idx = wide_alloc_node(wide);
+  if (idx == UINT32_MAX)
+    return UINT32_MAX;
+
+  // Repeatedly open the inner child with the largest surface area
+  uint32_t kids[WIDE_MAX_WIDTH];
+  uint32_t kid_count = 0;
+  if (bin[bin_idx].is_leaf) {
+    kids[kid_count++] = bin_idx; // only for a root that is a leaf
+  } else {
+    kids[kid_count++] = bin[bin_idx].internal.left;
+    kids[kid_count++] = bin[bin_idx].internal.right;
+  }
+  while (kid_count < wide->width) {
+    int   best      = -1;
+    float best_area = -1.0f;
+    for (uint32_t k = 0; k < kid_count; ++k) {
+      const bvh_node_t* n    = &bin[kids[k]];
+      float             area = bvh_bbox_area(&n->bbox_min, &n->bbox_max);
+      if (!n->is_leaf && area > best_area) {
+        best      = (int)k;
+        best_area = area;
+      }
+    }
+    if (best < 0)
+      break;
+    const bvh_node_t* open = &bin[kids[best]];
+    kids[best]             = open->internal.left;
+    kids[kid_count++]      = open->internal.right;
+  }
+
+  uint32_t w = wide->width;
+  for (uint32_t k = 0; k < w; ++k) {
+    wide_word_t* node = wide_node(wide, idx);
+    if (k >= kid_count) {
+      node[LANE_MIN_X * w + k].f = FLT_MAX;
+      node[LANE_MIN_Y * w + k].f = FLT_MAX;
+      node[LANE_MIN_Z * w + k].f = FLT_MAX;
+      node[LANE_MAX_X * w + k].f = -FLT_MAX;
+      node[LANE_MAX_Y * w + k].f = -FLT_MAX;
+      node[LANE_MAX_Z * w + k].f = -FLT_MAX;
+      node[LANE_CHILD * w + k].u = 0;
+      node[LANE_COUNT * w + k].u = 0;
+      continue;
+    }
+
+    const bvh_node_t* kid = &bin[kids[k]];
+    node[LANE_MIN_X * w + k].f = kid->bbox_min.x;
+    node[LANE_MIN_Y * w + k].f = kid->bbox_min.y;
+    node[LANE_MIN_Z * w + k].f = kid->bbox_min.z;
+    node[LANE_MAX_X * w + k].f = kid->bbox_max.x;
+    node[LANE_MAX_Y * w + k].f = kid->bbox_max.y;
+    node[LANE_MAX_Z * w + k].f = kid->bbox_max.z;
+    if (kid->is_leaf) {
+      node[LANE_CHILD * w + k].u = kid->leaf.start;
+      node[LANE_COUNT * w + k].u = kid->leaf.count;
+    } else {
+      // May realloc wide->words, so the node is looked up again afterwards
+      uint32_t child = collapse_node(wide, bin, kids[k]);
+      if (child == UINT32_MAX)
+        return UINT32_MAX;
+      node                       = wide_node(wide, idx);
+      node[LANE_CHILD * w + k].u = child;
+      node[LANE_COUNT * w + k].u = 0;
+    }
+  }
+  return idx;
+}
+
+static bvh_tree_t* wide_build(const wf_face* faces, size_t face_count,
+                              const wf_scene_t*         scene,
+                              const bvh_build_params_t* params, uint32_t width,
+                              const struct bvh_ops* ops) {
+  const struct bvh_ops* base = bvh_get_ops(WIDE_BASE_BUILDER);
+  if (!base)
+    return NULL;
+  bvh_tree_t* tree = base->build(faces, face_count, scene, params);
+  if (!tree)
+    return NULL;
+
+  wide_bvh_t* wide = calloc(1, sizeof(wide_bvh_t));
+  if (wide) {
+    wide->width = width;
+    if (collapse_node(wide, tree->nodes, 0) == UINT32_MAX) {
+      free(wide->words);
+      free(wide);
+      wide = NULL;
+    }
+  }
+  if (!wide) {
+    bvh_binary_destroy(tree);
+    return NULL;
+  }
+
+  // Keep face_indices (wide leaves use the same ranges), drop binary nodes
+  free(tree->nodes);
+  tree->nodes      = NULL;
+  tree->node_count = 0;
+  tree->node_cap   = 0;
+  tree->priv       = wide;
+  tree->ops        = ops;
+  return tree;
+}
+
+static void wide_destroy(bvh_tree_t* tree) {
+  if (tree) {
+    wide_bvh_t* wide = (wide_bvh_t*)tree->priv;
+    if (wide)
+      free(wide->words);
+    free(wide);
+    bvh_binary_destroy(tree);
+  }
+}
+
+static void wide_ray_init(wide_ray_t* r, const ray_t* ray, float t_min) {
+  for (int axis = 0; axis < 3; ++axis) {
+    float d = (&ray->direction.x)[axis];
+    // Avoid inf * 0 = NaN for rays parallel to a slab
+    if (fabsf(d) < 1e-20f)
+      d = d < 0.0f ? -1e-20f : 1e-20f;
+    r->org[axis]       = (&ray->origin.x)[axis];
+    r->inv_dir[axis]   = 1.0f / d;
+    r->near_lane[axis] = d < 0.0f ? LANE_MAX_X + axis : LANE_MIN_X + axis;
+    r->far_lane[axis]  = d < 0.0f ? LANE_MIN_X + axis : LANE_MAX_X + axis;
+  }
+  r->t_min = t_min;
+}
+
+// Slab test of lanes [lane0, lane0 + 4) of a node; returns the hit mask and
+// stores the entry distances
+static inline uint32_t hit4(const wide_word_t* node, uint32_t w, uint32_t lane0,
+                            const wide_ray_t* r, float t_max, float* t_near) {
+#if defined(__SSE__)
+  __m128 tn = _mm_set1_ps(r->t_min);
+  __m128 tf = _mm_set1_ps(t_max);
+  for (int axis = 0; axis < 3; ++axis) {
+    __m128 org = _mm_set1_ps(r->org[axis]);
+    __m128 inv = _mm_set1_ps(r->inv_dir[axis]);
+    __m128 lo  = _mm_loadu_ps(&node[r->near_lane[axis] * w + lane0].f);
+    __m128 hi  = _mm_loadu_ps(&node[r->far_lane[axis] * w + lane0].f);
+    tn         = _mm_max_ps(tn, _mm_mul_ps(_mm_sub_ps(lo, org), inv));
+    tf         = _mm_min_ps(tf, _mm_mul_ps(_mm_sub_ps(hi, org), inv));
+  }
+  _mm_storeu_ps(t_near, tn);
+  return (uint32_t)_mm_movemask_ps(_mm_cmple_ps(tn, tf));
+#else
+  uint32_t mask = 0;
+  for (uint32_t k = 0; k < 4; ++k) {
+    float tn = r->t_min;
+    float tf = t_max;
+    for (int axis = 0; axis < 3; ++axis) {
+      float lo = node[r->near_lane[axis] * w + lane0 + k].f;
+      float hi = node[r->far_lane[axis] * w + lane0 + k].f;
+      tn       = bvh_maxf(tn, (lo - r->org[axis]) * r->inv_dir[axis]);
+      tf       = bvh_minf(tf, (hi - r->org[axis]) * r->inv_dir[axis]);
+    }
+    t_near[k] = tn;
+    if (tn <= tf)
+      mask |= 1u << k;
+  }
+  return mask;
+#endif
+}
+
+static inline uint32_t hit8(const wide_word_t* node, const wide_ray_t* r,
+                            float t_max, float* t_near) {
+#if defined(__AVX__)
+  __m256 tn = _mm256_set1_ps(r->t_min);
+  __m256 tf = _mm256_set1_ps(t_max);
+  for (int axis = 0; axis < 3; ++axis) {
+    __m256 org = _mm256_set1_ps(r->org[axis]);
+    __m256 inv = _mm256_set1_ps(r->inv_dir[axis]);
+    __m256 lo  = _mm256_loadu_ps(&node[r->near_lane[axis] * 8].f);
+    __m256 hi  = _mm256_loadu_ps(&node[r->far_lane[axis] * 8].f);
+    tn         = _mm256_max_ps(tn, _mm256_mul_ps(_mm256_sub_ps(lo, org), inv));
+    tf         = _mm256_min_ps(tf, _mm256_mul_ps(_mm256_sub_ps(hi, org), inv));
+  }
+  _mm256_storeu_ps(t_near, tn);
+  return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(tn, tf, _CMP_LE_OQ));
+#else
+  return hit4(node, 8, 0, r, t_max, t_near)
+         | hit4(node, 8, 4, r, t_max, t_near + 4) << 4;
+#endif
+}
+
+typedef struct {
+  uint32_t node;
+  float    t_near;
+} wide_stack_entry_t;
+
+// Shared by both widths and both query kinds; `width` and `any` are
+// constants in each caller, so the lane arithmetic, the choice of slab test
+// and the any-hit early exit fold away. Traverses the subtree at `root`; a
+// child that finds the stack full is traversed by a recursive call instead
+// of being dropped. Returns true if best improved or, for `any`, on the
+// first hit.
+static inline bool wide_subtree(const bvh_tree_t* tree, const wide_ray_t* r,
+                                const ray_t* ray, wide_stack_entry_t root,
+                                bvh_hit_t* best, const uint32_t width,
+                                const bool any) {
+  const wide_bvh_t*  wide = (const wide_bvh_t*)tree->priv;
+  wide_stack_entry_t stack[WIDE_STACK_SIZE];
+  uint32_t           stack_ptr = 0;
+  bool               found     = false;
+  stack[stack_ptr++]           = root;
+
+  while (stack_ptr > 0) {
+    wide_stack_entry_t entry = stack[--stack_ptr];
+    if (entry.t_near >= best->t)
+      continue; // a closer hit was found after this node was pushed
+
+    const wide_word_t* node = wide_node(wide, entry.node);
+    float              t_near[WIDE_MAX_WIDTH];
+    uint32_t           mask = width == 8 ? hit8(node, r, best->t, t_near)
+                                         : hit4(node, 4, 0, r, best->t, t_near);
+
+    // Leaves are tested right away, inner children are queued by distance
+    wide_stack_entry_t inner[WIDE_MAX_WIDTH];
+    uint32_t           inner_count = 0;
+    for (; mask; mask &= mask - 1) {
+      uint32_t k     = (uint32_t)__builtin_ctz(mask);
+      uint32_t child = node[LANE_CHILD * width + k].u;
+      uint32_t count = node[LANE_COUNT * width + k].u;
+      if (any && count > 0) {
+        if (bvh_leaf_occluded(tree, child, count, ray, r->t_min, best->t))
+          return true;
+      } else if (count > 0) {
+        found |= bvh_leaf_intersect(tree, child, count, ray, r->t_min, best);
+      } else {
+        // Insertion sort, farthest first so the nearest is popped first
+        uint32_t j = inner_count++;
+        while (j > 0 && inner[j - 1].t_near < t_near[k]) {
+          inner[j] = inner[j - 1];
+          --j;
+        }
+        inner[j] = (wide_stack_entry_t){ child, t_near[k] };
+      }
+    }
+    for (uint32_t i = 0; i < inner_count; ++i) {
+      if (inner[i].t_near >= best->t)
+        continue;
+      if (stack_ptr < WIDE_STACK_SIZE) {
+        stack[stack_ptr++] = inner[i];
+      } else if (wide_subtree(tree, r, ray, inner[i], best, width, any)) {
+        if (any)
+          return true;
+        found = true;
+      }
+    }
+  }
+  return found;
+}
+
+static inline bool wide_intersect(const bvh_tree_t* tree, const ray_t* ray,
+                                  float t_min, float t_max, bvh_hit_t* hit,
+                                  const uint32_t width, const bool any) {
+  wide_ray_t         r;
+  wide_stack_entry_t root = { 0, t_min };
+  wide_ray_init(&r, ray, t_min);
+
+  bvh_hit_t best  = { .t = t_max };
+  bool      found = wide_subtree(tree, &r, ray, root, &best, width, any);
+  if (found && hit) {
+    bvh_hit_resolve(tree, &best);
+    *hit = best;
+  }
+  return found;
+}
+
+static bool bvh4_intersect_closest(const bvh_tree_t* tree, const ray_t* ray,
+                                   float t_min, float t_max, bvh_hit_t* hit) {
+  return wide_intersect(tree, ray, t_min, t_max, hit, 4, false);
+}
+
+static bool bvh4_intersect_any(const bvh_tree_t* tree, const ray_t* ray,
+                               float t_min, float t_max) {
+  return wide_intersect(tree, ray, t_min, t_max, NULL, 4, true);
+}
+
+static bool bvh8_intersect_closest(const bvh_tree_t* tree, const ray_t* ray,
+                                   float t_min, float t_max, bvh_hit_t* hit) {
+  return wide_intersect(tree, ray, t_min, t_max, hit, 8, false);
+}
+
+static bool bvh8_intersect_any(const bvh_tree_t* tree, const ray_t* ray,
+                               float t_min, float t_max) {
+  return wide_intersect(tree, ray, t_min, t_max, NULL, 8, true);
+}
+
+// Leaves are lanes rather than nodes, so their views have ref 0. The root
+// view is node 0 with the union of its lanes' bounds.
+static uint32_t wide_children(const bvh_tree_t*      tree,
+                              const bvh_node_view_t* node,
+                              bvh_node_view_t*       children) {
+  const wide_bvh_t* wide = (const wide_bvh_t*)tree->priv;
+  uint32_t          w    = wide->width;
+  if (node && node->count > 0)
+    return 0;
+
+  const wide_word_t* words = wide_node(wide, node ? node->ref : 0);
+  bvh_node_view_t    view[WIDE_MAX_WIDTH];
+  uint32_t           n = 0;
+  for (uint32_t k = 0; k < w; ++k) {
+    bvh_node_view_t* v = &view[n];
+    v->bbox_min        = (wf_vec3){ words[LANE_MIN_X * w + k].f,
+                                    words[LANE_MIN_Y * w + k].f,
+                                    words[LANE_MIN_Z * w + k].f };
+    v->bbox_max        = (wf_vec3){ words[LANE_MAX_X * w + k].f,
+                                    words[LANE_MAX_Y * w + k].f,
+                                    words[LANE_MAX_Z * w + k].f };
+    if (v->bbox_min.x > v->bbox_max.x)
+      continue; // unused slot
+    uint32_t child = words[LANE_CHILD * w + k].u;
+    v->count       = words[LANE_COUNT * w + k].u;
+    v->ref         = v->count > 0 ? 0 : child;
+    v->start       = v->count > 0 ? child : 0;
+    ++n;
+  }
+
+  if (node) {
+    memcpy(children, view, n * sizeof(*view));
+    return n;
+  }
+  children[0].ref   = 0;
+  children[0].start = 0;
+  children[0].count = 0;
+  bvh_bbox_empty(&children[0].bbox_min, &children[0].bbox_max);
+  for (uint32_t k = 0; k < n; ++k)
+    bvh_bbox_expand(&children[0].bbox_min, &children[0].bbox_max,
+                    &view[k].bbox_min, &view[k].bbox_max);
+  return 1;
+}
+
+static size_t wide_node_memory(const bvh_tree_t* tree) {
+  const wide_bvh_t* wide = (const wide_bvh_t*)tree->priv;
+  return sizeof(*wide)
+         + wide->node_cap * LANES_PER_NODE * wide->width * sizeof(wide_word_t);
+}
+
+static bvh_tree_t* bvh4_build(const wf_face* faces, size_t face_count,
+                              const wf_scene_t*         scene,
+                              const bvh_build_params_t* params) {
+  return wide_build(faces, face_count, scene, params, 4, &bvh4_ops);
+}
+
+static bvh_tree_t* bvh8_build(const wf_face* faces, size_t face_count,
+                              const wf_scene_t*         scene,
+                              const bvh_build_params_t* params) {
+  return wide_build(faces, face_count, scene, params, 8, &bvh8_ops);
+}
+
+static struct bvh_ops bvh4_ops = {
+  .name              = "bvh4",
+  .build             = bvh4_build,
+  .destroy           = wide_destroy,
+  .intersect_closest = bvh4_intersect_closest,
+  .intersect_any     = bvh4_intersect_any,
+  .children          = wide_children,
+  .node_memory       = wide_node_memory,
+};
+
+static struct bvh_ops bvh8_ops = {
+  .name              = "bvh8",
+  .build             = bvh8_build,
+  .destroy           = wide_destroy,
+  .intersect_closest = bvh8_intersect_closest,
+  .intersect_any     = bvh8_intersect_any,
+  .children          = wide_children,
+  .node_memory       = wide_node_memory,
+};
+
+BVH_OPS_REGISTER(bvh4_ops)
+BVH_OPS_REGISTER(bvh8_ops)
@@ -0,0 +1,472 @@
+// bvh_build.c
+#include "bvh/bvh_build.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bvh/bvh_ops.h"
+#include "parallel.h"
+
+// Subtrees smaller than this are never handed to another worker
+#define BVH_TASK_MIN_FACES 1024
+
+// Marks a child reference that names a task rather than a local node
+#define TASK_REF_BIT 0x80000000u
+
+unsigned bvh_build_workers(const bvh_build_params_t* params,
+                           size_t                    face_count) {
+  if (face_count < BVH_PARALLEL_MIN_FACES)
+    return 1;
+  return params->threads ? params->threads : parallel_cpu_count();
+}
+
+uint32_t bvh_node_array_alloc(bvh_node_array_t* arr) {
+  if (arr->count >= arr->cap) {
+    size_t      cap   = arr->cap ? arr->cap * 2 : 64;
+    bvh_node_t* nodes = realloc(arr->nodes, cap * sizeof(bvh_node_t));
+    if (!nodes)
+      return UINT32_MAX;
+    arr->nodes = nodes;
+    arr->cap   = cap;
+  }
+  return (uint32_t)(arr->count++);
+}
+
+unsigned bvh_range_workers(const bvh_build_ctx_t* ctx, size_t count) {
+  if (ctx->workers <= 1 || count < BVH_RANGE_PARALLEL_MIN_FACES)
+    return 1;
+  return ctx->workers;
+}
+
+// Bounds of faces [begin, end), kept in range
+static void range_bounds(const bvh_build_ctx_t* ctx, size_t begin,
+                         size_t end, bvh_range_t* range) {
+  bvh_bbox_empty(&range->bbox_min, &range->bbox_max);
+  bvh_bbox_empty(&range->centroid_min, &range->centroid_max);
+  for (size_t i = begin; i < end; ++i) {
+    uint32_t f = ctx->face_indices[i];
+    bvh_bbox_expand(&range->bbox_min, &range->bbox_max,
+                    &ctx->info->face_min[f], &ctx->info->face_max[f]);
+    bvh_bbox_expand(&range->centroid_min, &range->centroid_max,
+                    &ctx->info->centroids[f], &ctx->info->centroids[f]);
+  }
+}
+
+typedef struct {
+  const bvh_build_ctx_t* ctx;
+  const bvh_range_t*     range;
+  bvh_range_t*           parts; // bounds of each worker's block
+} range_job_t;
+
+static void range_worker(void* arg, unsigned worker, unsigned worker_count) {
+  range_job_t* job = (range_job_t*)arg;
+  size_t       begin, end;
+  bvh_range_block(job->range, worker, worker_count, &begin, &end);
+  range_bounds(job->ctx, begin, end, &job->parts[worker]);
+}
+
+void bvh_range_init(const bvh_build_ctx_t* ctx, size_t start, size_t end,
+                    bvh_range_t* range) {
+  range->start = start;
+  range->end   = end;
+
+  unsigned     workers = bvh_range_workers(ctx, end - start);
+  bvh_range_t* parts =
+      workers > 1 ? malloc(workers * sizeof(bvh_range_t)) : NULL;
+  if (!parts) {
+    range_bounds(ctx, start, end, range);
+    return;
+  }
+
+  range_job_t job = { .ctx = ctx, .range = range, .parts = parts };
+  parallel_run(workers, range_worker, &job);
+  bvh_bbox_empty(&range->bbox_min, &range->bbox_max);
+  bvh_bbox_empty(&range->centroid_min, &range->centroid_max);
+  for (unsigned w = 0; w < workers; ++w) {
+    bvh_bbox_expand(&range->bbox_min, &range->bbox_max, &parts[w].bbox_min,
+                    &parts[w].bbox_max);
+    bvh_bbox_expand(&range->centroid_min, &range->centroid_max,
+                    &parts[w].centroid_min, &parts[w].centroid_max);
+  }
+  free(parts);
+}
+
+// A large range is partitioned in blocks: each counts its left faces, then
+// scatters its faces to their offsets in a scratch copy of the range
+typedef struct {
+  const bvh_build_ctx_t* ctx;
+  const bvh_range_t*     range;
+  bvh_face_side_fn       goes_left;
+  const void*            arg;
+  uint32_t*              scratch;
+  size_t*                left;  // per block: faces going left, then
+  size_t*                right; // where its left and right faces go
+} partition_job_t;
+
+static void count_worker(void* p, unsigned worker, unsigned worker_count) {
+  partition_job_t* job = (partition_job_t*)p;
+  size_t           begin, end, left = 0;
+  bvh_range_block(job->range, worker, worker_count, &begin, &end);
+  for (size_t i = begin; i < end; ++i)
+    left += job->goes_left(job->arg, job->ctx->face_indices[i]);
+  job->left[worker] = left;
+}
+
+static void scatter_worker(void* p, unsigned worker, unsigned worker_count) {
+  partition_job_t* job   = (partition_job_t*)p;
+  size_t           left  = job->left[worker];
+  size_t           right = job->right[worker];
+  size_t           begin, end;
+  bvh_range_block(job->range, worker, worker_count, &begin, &end);
+  for (size_t i = begin; i < end; ++i) {
+    uint32_t f = job->ctx->face_indices[i];
+    if (job->goes_left(job->arg, f))
+      job->scratch[left++] = f;
+    else
+      job->scratch[right++] = f;
+  }
+}
+
+static void copy_worker(void* p, unsigned worker, unsigned worker_count) {
+  partition_job_t* job = (partition_job_t*)p;
+  size_t           begin, end;
+  bvh_range_block(job->range, worker, worker_count, &begin, &end);
+  memcpy(&job->ctx->face_indices[begin],
+         &job->scratch[begin - job->range->start],
+         (end - begin) * sizeof(uint32_t));
+}
+
+// Stable partition on the range's workers; false, leaving the range alone,
+// without scratch memory
+static bool partition_blocks(const bvh_build_ctx_t* ctx,
+                             const bvh_range_t* range,
+                             bvh_face_side_fn goes_left, const void* arg,
+                             size_t* mid) {
+  size_t          count   = range->end - range->start;
+  unsigned        workers = bvh_range_workers(ctx, count);
+  partition_job_t job     = {
+    .ctx = ctx, .range = range, .goes_left = goes_left, .arg = arg
+  };
+  job.scratch = malloc(count * sizeof(uint32_t));
+  job.left    = malloc(workers * sizeof(size_t));
+  job.right   = malloc(workers * sizeof(size_t));
+  if (!job.scratch || !job.left || !job.right) {
+    free(job.scratch);
+    free(job.left);
+    free(job.right);
+    return false;
+  }
+
+  parallel_run(workers, count_worker, &job);
+  size_t left_total = 0;
+  for (unsigned w = 0; w < workers; ++w)
+    left_total += job.left[w];
+  size_t left = 0, right = left_total;
+  for (unsigned w = 0; w < workers; ++w) {
+    size_t begin, end;
+    bvh_range_block(range, w, workers, &begin, &end);
+    size_t n     = job.left[w];
+    job.left[w]  = left;
+    job.right[w] = right;
+    left += n;
+    right += end - begin - n;
+  }
+  parallel_run(workers, scatter_worker, &job);
+  parallel_run(workers, copy_worker, &job);
+
+  free(job.scratch);
+  free(job.left);
+  free(job.right);
+  *mid = range->start + left_total;
+  return true;
+}
+
+size_t bvh_range_partition(const bvh_build_ctx_t* ctx,
+                           const bvh_range_t* range, bvh_face_side_fn left,
+                           const void* arg) {
+  size_t mid;
+  if (range->end - range->start >= BVH_RANGE_PARALLEL_MIN_FACES
+      && partition_blocks(ctx, range, left, arg, &mid))
+    return mid;
+
+  size_t i = range->start;
+  size_t j = range->end;
+  while (i < j) {
+    uint32_t f = ctx->face_indices[i];
+    if (left(arg, f)) {
+      ++i;
+    } else {
+      ctx->face_indices[i] = ctx->face_indices[--j];
+      ctx->face_indices[j] = f;
+    }
+  }
+  return i;
+}
+
+// One subtree built by a single worker into its own node array
+typedef struct {
+  size_t   start;
+  size_t   end;
+  unsigned worker; // whose node array holds the subtree
+  size_t   offset; // index of the subtree root in that array
+  size_t   count;  // nodes in the subtree (excluding spawned tasks)
+  size_t   base;   // index of the subtree root after merging
+} build_task_t;
+
+typedef struct {
+  const bvh_build_ctx_t* ctx;
+  bvh_node_array_t*      arrays; // one per worker
+  size_t                 spawn_threshold;
+
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  build_task_t*   tasks;
+  size_t          task_count;
+  size_t          task_cap;
+  size_t          next_task; // first task not yet claimed
+  size_t          running;
+  bool            failed; // a node array could not grow
+} build_pool_t;
+
+// Queues [start, end) and returns the task id, UINT32_MAX if the task list
+// cannot grow
+static uint32_t spawn_task(build_pool_t* pool, size_t start, size_t end) {
+  pthread_mutex_lock(&pool->lock);
+  if (pool->task_count >= pool->task_cap) {
+    size_t        cap   = pool->task_cap ? pool->task_cap * 2 : 64;
+    build_task_t* tasks = realloc(pool->tasks, cap * sizeof(build_task_t));
+    if (!tasks) {
+      pthread_mutex_unlock(&pool->lock);
+      return UINT32_MAX;
+    }
+    pool->tasks    = tasks;
+    pool->task_cap = cap;
+  }
+  uint32_t id     = (uint32_t)pool->task_count++;
+  pool->tasks[id] = (build_task_t){ .start = start, .end = end };
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+  return id;
+}
+
+// Builds [start, end) into arr. With a pool, ranges of at least
+// spawn_threshold faces on the right-hand side become new tasks and the
+// parent stores TASK_REF_BIT | task id instead of a node index. Returns
+// UINT32_MAX if arr cannot grow.
+static uint32_t build_recursive(const bvh_build_ctx_t* ctx,
+                                bvh_node_array_t* arr, build_pool_t* pool,
+                                size_t start, size_t end) {
+  // Parent is allocated before its children so the root comes first
+  uint32_t idx = bvh_node_array_alloc(arr);
+  if (idx == UINT32_MAX)
+    return UINT32_MAX;
+
+  bvh_range_t range;
+  bvh_range_init(ctx, start, end, &range);
+  size_t mid = ctx->split(ctx, &range);
+
+  if (mid <= start || mid >= end) {
+    bvh_node_t* node = &arr->nodes[idx];
+    node->is_leaf    = true;
+    node->leaf.start = (uint32_t)start;
+    node->leaf.count = (uint32_t)(end - start);
+    node->bbox_min   = range.bbox_min;
+    node->bbox_max   = range.bbox_max;
+    return idx;
+  }
+
+  uint32_t right_idx = UINT32_MAX;
+  if (pool && end - mid >= pool->spawn_threshold)
+    right_idx = spawn_task(pool, mid, end);
+  bool spawned = right_idx != UINT32_MAX;
+  if (spawned)
+    right_idx |= TASK_REF_BIT;
+
+  // Build children (may realloc arr->nodes, so fetch the node afterwards)
+  uint32_t left_idx = build_recursive(ctx, arr, pool, start, mid);
+  if (left_idx == UINT32_MAX)
+    return UINT32_MAX;
+  if (!spawned)
+    right_idx = build_recursive(ctx, arr, pool, mid, end);
+  if (right_idx == UINT32_MAX)
+    return UINT32_MAX;
+
+  bvh_node_t* node     = &arr->nodes[idx];
+  node->is_leaf        = false;
+  node->internal.left  = left_idx;
+  node->internal.right = right_idx;
+  node->bbox_min       = range.bbox_min;
+  node->bbox_max       = range.bbox_max;
+  return idx;
+}
+
+static void build_worker(void* arg, unsigned worker, unsigned worker_count) {
+  (void)worker_count;
+  build_pool_t*     pool = (build_pool_t*)arg;
+  bvh_node_array_t* arr  = &pool->arrays[worker];
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (pool->next_task == pool->task_count && pool->running > 0)
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    if (pool->next_task == pool->task_count)
+      break; // nothing queued and nothing running that could spawn more
+
+    size_t id    = pool->next_task++;
+    size_t start = pool->tasks[id].start;
+    size_t end   = pool->tasks[id].end;
+    pool->running++;
+    pthread_mutex_unlock(&pool->lock);
+
+    size_t offset = arr->count;
+    bool   built  = build_recursive(pool->ctx, arr, pool, start, end)
+                 != UINT32_MAX;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->failed |= !built;
+    pool->tasks[id].worker = worker;
+    pool->tasks[id].offset = offset;
+    pool->tasks[id].count  = arr->count - offset;
+    pool->running--;
+    if (pool->running == 0)
+      pthread_cond_broadcast(&pool->cond);
+  }
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static inline uint32_t remap_child(const build_pool_t* pool,
+                                   const build_task_t* task, uint32_t child) {
+  if (child & TASK_REF_BIT)
+    return (uint32_t)pool->tasks[child & ~TASK_REF_BIT].base;
+  return (uint32_t)(task->base + (child - task->offset));
+}
+
+typedef struct {
+  build_pool_t* pool;
+  bvh_node_t*   nodes;
+} merge_ctx_t;
+
+static void merge_tasks(void* arg, size_t begin, size_t end) {
+  merge_ctx_t*  m    = (merge_ctx_t*)arg;
+  build_pool_t* pool = m->pool;
+  for (size_t t = begin; t < end; ++t) {
+    const build_task_t*     task = &pool->tasks[t];
+    const bvh_node_array_t* arr  = &pool->arrays[task->worker];
+    for (size_t j = 0; j < task->count; ++j) {
+      bvh_node_t node = arr->nodes[task->offset + j];
+      if (!node.is_leaf) {
+        node.internal.left  = remap_child(pool, task, node.internal.left);
+        node.internal.right = remap_child(pool, task, node.internal.right);
+      }
+      m->nodes[task->base + j] = node;
+    }
+  }
+}
+
+static bool build_parallel(const bvh_build_ctx_t* ctx, size_t face_count,
+                           unsigned workers, bvh_node_t** nodes_out,
+                           size_t* count_out) {
+  build_pool_t pool = { 0 };
+  pool.ctx          = ctx;
+  pool.arrays       = calloc(workers, sizeof(bvh_node_array_t));
+  if (!pool.arrays)
+    return false;
+  pool.spawn_threshold = face_count / ((size_t)workers * 16);
+  if (pool.spawn_threshold < BVH_TASK_MIN_FACES)
+    pool.spawn_threshold = BVH_TASK_MIN_FACES;
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.cond, NULL);
+
+  if (spawn_task(&pool, 0, face_count) == 0) // task 0 is the root
+    parallel_run(workers, build_worker, &pool);
+  else
+    pool.failed = true;
+
+  // Tasks are spawned by their parent's task, so numbering them in creation
+  // order keeps parents ahead of children in the merged array
+  size_t total = 0;
+  for (size_t t = 0; t < pool.task_count; ++t) {
+    pool.tasks[t].base = total;
+    total += pool.tasks[t].count;
+  }
+
+  bvh_node_t* nodes = NULL;
+  if (!pool.failed)
+    nodes = malloc(total * sizeof(bvh_node_t));
+  if (nodes) {
+    merge_ctx_t m = { .pool = &pool, .nodes = nodes };
+    parallel_for(workers, pool.task_count, 16, merge_tasks, &m);
+  }
+
+  for (unsigned w = 0; w < workers; ++w)
+    free(pool.arrays[w].nodes);
+  free(pool.arrays);
+  free(pool.tasks);
+  pthread_mutex_destroy(&pool.lock);
+  pthread_cond_destroy(&pool.cond);
+
+  *nodes_out = nodes;
+  *count_out = total;
+  return nodes != NULL;
+}
+
+bvh_tree_t* bvh_build_binary(const wf_face* faces, size_t face_count,
+                             const wf_scene_t*         scene,
+                             const bvh_build_params_t* params,
+                             bvh_split_fn split, const struct bvh_ops* ops) {
+  if (face_count == 0)
+    return NULL;
+
+  unsigned        workers = bvh_build_workers(params, face_count);
+  bvh_prim_info_t info;
+  if (!bvh_prim_info_init(&info, faces, params->shapes, face_count, scene,
+                          workers))
+    return NULL;
+
+  uint32_t*   face_indices = malloc(face_count * sizeof(uint32_t));
+  bvh_tree_t* tree         = calloc(1, sizeof(bvh_tree_t));
+  if (!face_indices || !tree) {
+    free(face_indices);
+    free(tree);
+    bvh_prim_info_free(&info);
+    return NULL;
+  }
+  for (size_t i = 0; i < face_count; ++i) {
+    face_indices[i] = (uint32_t)i;
+  }
+
+  bvh_build_ctx_t ctx = {
+    .info = &info, .face_indices = face_indices, .params = params,
+    .split = split, .workers = workers
+  };
+
+  bool ok = true;
+  if (workers > 1) {
+    ok = build_parallel(&ctx, face_count, workers, &tree->nodes,
+                        &tree->node_count);
+    tree->node_cap = tree->node_count;
+  } else {
+    bvh_node_array_t arr = { 0 };
+    // The root is node 0
+    ok = build_recursive(&ctx, &arr, NULL, 0, face_count) == 0;
+    tree->nodes      = arr.nodes;
+    tree->node_count = arr.count;
+    tree->node_cap   = arr.cap;
+  }
+  bvh_prim_info_free(&info);
+
+  if (!ok) {
+    free(tree->nodes);
+    free(face_indices);
+    free(tree);
+    return NULL;
+  }
+
+  tree->face_indices = face_indices; // leaves refer to the sorted order
+  tree->index_count  = face_count;
+  tree->faces        = faces;
+  tree->face_count   = face_count;
+  tree->scene        = scene;
+  tree->ops          = ops;
+  return tree;
+}
@@ -0,0 +1,271 @@
+// bvh_cache.c
+// File layout: a header, then node_count bvh_node_t and index_count face
+// indices, each array starting at a CACHE_ALIGN boundary. Mappings are
+// private, so refitting a cached tree copies only the pages it touches.
+#include "bvh/bvh_cache.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bvh/bvh_ops.h"
+#include "bvh/bvh_shape.h"
+
+#define CACHE_MAGIC        "RTBVHC1"
+#define CACHE_ALIGN        64
+#define CACHE_BUILDER_SIZE 32
+
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME  0x100000001b3ull
+
+typedef struct {
+  char     magic[8];
+  uint32_t version;
+  uint32_t node_size; // sizeof(bvh_node_t) of the writer
+  uint64_t key;
+  char     builder[CACHE_BUILDER_SIZE];
+  uint64_t face_count;
+  uint64_t node_count;
+  uint64_t index_count;
+  uint64_t node_offset;
+  uint64_t index_offset;
+  uint64_t file_size;
+} cache_header_t;
+
+// A mapped tree: the strategy's ops with destroy releasing the mapping
+typedef struct {
+  struct bvh_ops ops;
+  void*          map;
+  size_t         map_size;
+} cache_map_t;
+
+static inline uint64_t hash_word(uint64_t h, uint32_t word) {
+  return (h ^ word) * FNV_PRIME;
+}
+
+static uint64_t hash_string(uint64_t h, const char* s) {
+  for (; *s; ++s)
+    h = hash_word(h, (unsigned char)*s);
+  return hash_word(h, 0);
+}
+
+static inline uint64_t hash_float(uint64_t h, float f) {
+  uint32_t word;
+  memcpy(&word, &f, sizeof(word));
+  return hash_word(h, word);
+}
+
+static uint64_t hash_shape(uint64_t h, const bvh_shape_t* shape) {
+  const wf_vec3* v[3] = { &shape->origin, &shape->edge1, &shape->edge2 };
+  h                   = hash_word(h, shape->type);
+  for (int k = 0; k < 3; ++k) {
+    h = hash_float(h, v[k]->x);
+    h = hash_float(h, v[k]->y);
+    h = hash_float(h, v[k]->z);
+  }
+  h = hash_float(h, shape->corner[0]);
+  h = hash_float(h, shape->corner[1]);
+  return hash_float(h, shape->radius);
+}
+
+uint64_t bvh_cache_key(const char* type, const wf_face* faces,
+                       size_t face_count, const wf_scene_t* scene,
+                       const bvh_build_params_t* params) {
+  uint64_t h = hash_word(FNV_OFFSET, BVH_CACHE_VERSION);
+  h          = hash_string(h, type);
+  h          = hash_word(h, params->max_leaf_size);
+  h          = hash_word(h, params->bin_count);
+  h          = hash_float(h, params->split_budget);
+  h          = hash_word(h, (uint32_t)face_count);
+  h          = hash_word(h, (uint32_t)((uint64_t)face_count >> 32));
+  for (size_t i = 0; i < face_count; ++i) {
+    for (int k = 0; k < 3; ++k) {
+      const wf_vec3* v = &scene->vertices[faces[i].vertices[k].v_idx];
+      h                = hash_float(h, v->x);
+      h                = hash_float(h, v->y);
+      h                = hash_float(h, v->z);
+    }
+    h = hash_word(h, (uint32_t)faces[i].material_idx);
+
+    const bvh_shape_t* shape = bvh_shape_of(params->shapes, i);
+    if (shape)
+      h = hash_shape(h, shape);
+  }
+  return h;
+}
+
+static inline uint64_t align_up(uint64_t offset) {
+  return (offset + CACHE_ALIGN - 1) & ~(uint64_t)(CACHE_ALIGN - 1);
+}
+
+static bool header_valid(const cache_header_t* hdr, size_t file_size,
+                         uint64_t key, const struct bvh_ops* ops,
+                         size_t face_count) {
+  if (memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) != 0
+      || hdr->version != BVH_CACHE_VERSION
+      || hdr->node_size != sizeof(bvh_node_t) || hdr->key != key
+      || hdr->face_count != face_count || hdr->file_size != file_size
+      || hdr->node_count == 0 || hdr->index_count < face_count
+      || hdr->index_count > UINT32_MAX)
+    return false;
+  if (strncmp(hdr->builder, ops->name, sizeof(hdr->builder)) != 0)
+    return false;
+  if (hdr->node_offset % CACHE_ALIGN || hdr->index_offset % CACHE_ALIGN
+      || hdr->node_offset < sizeof(cache_header_t)
+      || hdr->node_offset > hdr->index_offset
+      || hdr->index_offset > file_size)
+    return false;
+  // Both arrays inside the file, written so that nothing can overflow
+  return hdr->node_count <= (hdr->index_offset - hdr->node_offset)
+                                / sizeof(bvh_node_t)
+         && hdr->index_count
+                <= (file_size - hdr->index_offset) / sizeof(uint32_t);
+}
+
+// Everything traversal relies on: children after their parent (so there
+// are no cycles), leaf ranges and face indices in bounds
+static bool tree_valid(const bvh_node_t* nodes, size_t node_count,
+                       const uint32_t* indices, size_t index_count,
+                       size_t face_count) {
+  for (size_t i = 0; i < node_count; ++i) {
+    unsigned char is_leaf;
+    memcpy(&is_leaf, &nodes[i].is_leaf, 1);
+    if (is_leaf > 1)
+      return false;
+    if (is_leaf) {
+      uint64_t end = (uint64_t)nodes[i].leaf.start + nodes[i].leaf.count;
+      if (end > index_count)
+        return false;
+    } else if (nodes[i].internal.left <= i || nodes[i].internal.right <= i
+               || nodes[i].internal.left >= node_count
+               || nodes[i].internal.right >= node_count) {
+      return false;
+    }
+  }
+  for (size_t k = 0; k < index_count; ++k) {
+    if (indices[k] >= face_count)
+      return false;
+  }
+  return true;
+}
+
+static void cache_destroy(bvh_tree_t* tree) {
+  if (tree) {
+    cache_map_t* m = (cache_map_t*)tree->priv;
+    munmap(m->map, m->map_size);
+    free(m);
+    free(tree);
+  }
+}
+
+bvh_tree_t* bvh_cache_map(const char* path, uint64_t key,
+                          const struct bvh_ops* ops, const wf_face* faces,
+                          size_t face_count, const wf_scene_t* scene) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(cache_header_t)) {
+    close(fd);
+    return NULL;
+  }
+  size_t size = (size_t)st.st_size;
+  void*  map  = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  const cache_header_t* hdr     = (const cache_header_t*)map;
+  bvh_node_t*           nodes   = NULL;
+  uint32_t*             indices = NULL;
+  if (header_valid(hdr, size, key, ops, face_count)) {
+    nodes   = (bvh_node_t*)((char*)map + hdr->node_offset);
+    indices = (uint32_t*)((char*)map + hdr->index_offset);
+    if (!tree_valid(nodes, hdr->node_count, indices, hdr->index_count,
+                    face_count))
+      nodes = NULL;
+  }
+
+  cache_map_t* m    = nodes ? malloc(sizeof(cache_map_t)) : NULL;
+  bvh_tree_t*  tree = m ? calloc(1, sizeof(bvh_tree_t)) : NULL;
+  if (!tree) {
+    free(m);
+    munmap(map, size);
+    return NULL;
+  }
+  m->ops         = *ops;
+  m->ops.destroy = cache_destroy;
+  m->map         = map;
+  m->map_size    = size;
+
+  tree->nodes        = nodes;
+  tree->node_count   = hdr->node_count;
+  tree->face_indices = indices;
+  tree->index_count  = hdr->index_count;
+  tree->faces        = faces;
+  tree->face_count   = face_count;
+  tree->scene        = scene;
+  tree->ops          = &m->ops;
+  tree->priv         = m;
+  return tree;
+}
+
+static bool write_padded(FILE* f, const void* data, size_t size,
+                         uint64_t* offset) {
+  static const char zeros[CACHE_ALIGN] = { 0 };
+  uint64_t          pad                = align_up(*offset) - *offset;
+  if (fwrite(zeros, 1, pad, f) != pad || fwrite(data, 1, size, f) != size)
+    return false;
+  *offset += pad + size;
+  return true;
+}
+
+bool bvh_cache_write(const bvh_tree_t* tree, const char* path, uint64_t key,
+                     const struct bvh_ops* ops) {
+  // Only the binary layout; wide and compact nodes live in tree->priv
+  if (!tree || !tree->nodes || tree->priv || !tree->face_indices
+      || strlen(ops->name) >= CACHE_BUILDER_SIZE)
+    return false;
+
+  cache_header_t hdr = { .magic = CACHE_MAGIC };
+  hdr.version        = BVH_CACHE_VERSION;
+  hdr.node_size      = sizeof(bvh_node_t);
+  hdr.key            = key;
+  memcpy(hdr.builder, ops->name, strlen(ops->name) + 1);
+  hdr.face_count   = tree->face_count;
+  hdr.node_count   = tree->node_count;
+  hdr.index_count  = tree->index_count;
+  hdr.node_offset  = align_up(sizeof(hdr));
+  hdr.index_offset = align_up(hdr.node_offset
+                              + tree->node_count * sizeof(bvh_node_t));
+  hdr.file_size    = hdr.index_offset + tree->index_count * sizeof(uint32_t);
+
+  // Written next to the target and renamed over it, so readers never see
+  // a partial file
+  size_t len = strlen(path) + 32;
+  char*  tmp = malloc(len);
+  if (!tmp)
+    return false;
+  snprintf(tmp, len, "%s.%ld.tmp", path, (long)getpid());
+  FILE* f = fopen(tmp, "wb");
+  if (!f) {
+    free(tmp);
+    return false;
+  }
+
+  uint64_t offset = 0;
+  bool     ok =
+      write_padded(f, &hdr, sizeof(hdr), &offset)
+      && write_padded(f, tree->nodes, tree->node_count * sizeof(bvh_node_t),
+                      &offset)
+      && write_padded(f, tree->face_indices,
+                      tree->index_count * sizeof(uint32_t), &offset);
+  ok = fclose(f) == 0 && ok;
+  ok = ok && rename(tmp, path) == 0;
+  if (!ok)
+    remove(tmp);
+  free(tmp);
+  return ok;
+}
@@ -0,0 +1,218 @@
+// bvh_lod.c
+// Vertex clustering runs on the vertices the faces use: they are sorted by
+// grid cell, and each run of one cell picks its representative. Every
+// level is simplified from the full mesh, so errors do not compound.
+#include "bvh/bvh_lod.h"
+#include <stdlib.h>
+#include <string.h>
+#include "bvh/bvh_util.h"
+
+#define LOD_FIRST_CELL 2.0f // first grid cell, in mean edge lengths
+#define LOD_MIN_DROP   0.2f // share of triangles a level must drop
+#define LOD_CELL_BITS  21   // grid coordinate bits per axis in a key
+
+struct bvh_lod_s {
+  uint32_t    count;
+  bvh_tree_t* blas[BVH_LOD_MAX];
+  wf_face*    faces[BVH_LOD_MAX]; // the trees point into them
+  float       cell[BVH_LOD_MAX];  // grid cell of each level
+};
+
+typedef struct {
+  uint64_t key; // grid cell
+  uint32_t v;   // vertex index
+} lod_vertex_t;
+
+static int compare_vertex(const void* a, const void* b) {
+  const lod_vertex_t* x = a;
+  const lod_vertex_t* y = b;
+  if (x->key != y->key)
+    return x->key < y->key ? -1 : 1;
+  return (x->v > y->v) - (x->v < y->v);
+}
+
+static inline uint64_t cell_of(float p, float lo, float inv_cell) {
+  uint64_t c    = (uint64_t)((p - lo) * inv_cell);
+  uint64_t maxc = ((uint64_t)1 << LOD_CELL_BITS) - 1;
+  return c < maxc ? c : maxc;
+}
+
+static float mean_edge(const wf_face* faces, size_t count,
+                       const wf_scene_t* scene) {
+  double sum = 0.0;
+  for (size_t i = 0; i < count; ++i) {
+    const wf_face* f = &faces[i];
+    for (int k = 0; k < 3; ++k) {
+      const wf_vec3* a = &scene->vertices[f->vertices[k].v_idx];
+      const wf_vec3* b = &scene->vertices[f->vertices[(k + 1) % 3].v_idx];
+      sum += v3_length(v3_sub(*b, *a));
+    }
+  }
+  return count ? (float)(sum / (3.0 * (double)count)) : 0.0f;
+}
+
+size_t bvh_lod_simplify(const wf_face* faces, size_t count,
+                        const wf_scene_t* scene, float cell, wf_face* out) {
+  if (count == 0 || !(cell > 0.0f))
+    return 0;
+
+  int     max_v = 0;
+  wf_vec3 lo, hi;
+  bvh_bbox_empty(&lo, &hi);
+  for (size_t i = 0; i < count; ++i) {
+    for (int k = 0; k < 3; ++k) {
+      int v = faces[i].vertices[k].v_idx;
+      max_v = v > max_v ? v : max_v;
+      bvh_bbox_expand(&lo, &hi, &scene->vertices[v], &scene->vertices[v]);
+    }
+  }
+
+  // rep[v]: the vertex v moves to, UINT32_MAX while v is unused; vn[v]:
+  // the first normal a corner at v carries
+  size_t        n    = (size_t)max_v + 1;
+  uint32_t*     rep  = malloc(n * sizeof(uint32_t));
+  int*          vn   = malloc(n * sizeof(int));
+  lod_vertex_t* used = malloc(n * sizeof(lod_vertex_t));
+  if (!rep || !vn || !used) {
+    free(rep);
+    free(vn);
+    free(used);
+    return 0;
+  }
+  memset(rep, 0xff, n * sizeof(uint32_t));
+
+  float  inv_cell   = 1.0f / cell;
+  size_t used_count = 0;
+  for (size_t i = 0; i < count; ++i) {
+    for (int k = 0; k < 3; ++k) {
+      int v = faces[i].vertices[k].v_idx;
+      if (rep[v] != UINT32_MAX)
+        continue;
+      const wf_vec3* p   = &scene->vertices[v];
+      rep[v]             = (uint32_t)v;
+      vn[v]              = faces[i].vertices[k].vn_idx;
+      used[used_count++] = (lod_vertex_t){
+        .key = cell_of(p->x, lo.x, inv_cell) << (2 * LOD_CELL_BITS)
+               | cell_of(p->y, lo.y, inv_cell) << LOD_CELL_BITS
+               | cell_of(p->z, lo.z, inv_cell),
+        .v   = (uint32_t)v
+      };
+    }
+  }
+  qsort(used, used_count, sizeof(lod_vertex_t), compare_vertex);
+
+  for (size_t start = 0; start < used_count;) {
+    size_t  end  = start;
+    wf_vec3 mean = v3_zero();
+    for (; end < used_count && used[end].key == used[start].key; ++end)
+      mean = v3_add(mean, scene->vertices[used[end].v]);
+    mean = v3_scale(1.0f / (float)(end - start), mean);
+
+    uint32_t best      = used[start].v;
+    float    best_dist = INFINITY;
+    for (size_t j = start; j < end; ++j) {
+      float d = v3_length_sq(v3_sub(scene->vertices[used[j].v], mean));
+      if (d < best_dist) {
+        best_dist = d;
+        best      = used[j].v;
+      }
+    }
+    for (size_t j = start; j < end; ++j)
+      rep[used[j].v] = best;
+    start = end;
+  }
+
+  size_t kept = 0;
+  for (size_t i = 0; i < count; ++i) {
+    uint32_t a = rep[faces[i].vertices[0].v_idx];
+    uint32_t b = rep[faces[i].vertices[1].v_idx];
+    uint32_t c = rep[faces[i].vertices[2].v_idx];
+    if (a == b || b == c || a == c)
+      continue;
+    wf_face* f            = &out[kept++];
+    *f                    = faces[i];
+    f->vertices[0].v_idx  = (int)a;
+    f->vertices[1].v_idx  = (int)b;
+    f->vertices[2].v_idx  = (int)c;
+    f->vertices[0].vn_idx = vn[a];
+    f->vertices[1].vn_idx = vn[b];
+    f->vertices[2].vn_idx = vn[c];
+  }
+
+  free(rep);
+  free(vn);
+  free(used);
+  return kept;
+}
+
+bvh_lod_t* bvh_lod_create(const char* type, const wf_face* faces,
+                          size_t face_count, const wf_scene_t* scene,
+                          const bvh_build_params_t* params, uint32_t levels) {
+  bvh_lod_t* lod = calloc(1, sizeof(bvh_lod_t));
+  if (!lod)
+    return NULL;
+
+  bvh_build_params_t p;
+  if (params)
+    p = *params;
+  else
+    bvh_build_params_init(&p);
+  p.shapes = NULL;
+
+  float  cell = LOD_FIRST_CELL * mean_edge(faces, face_count, scene);
+  size_t prev = face_count;
+  for (uint32_t k = 0; k < levels && k < BVH_LOD_MAX; ++k, cell *= 2.0f) {
+    wf_face* out = malloc((face_count ? face_count : 1) * sizeof(wf_face));
+    size_t   n   = out ? bvh_lod_simplify(faces, face_count, scene, cell, out)
+                       : 0;
+    if (n == 0 || (float)n > (1.0f - LOD_MIN_DROP) * (float)prev) {
+      free(out);
+      break;
+    }
+    bvh_tree_t* blas = bvh_create(type, out, n, scene, &p);
+    if (!blas) {
+      free(out);
+      break;
+    }
+    lod->blas[lod->count]  = blas;
+    lod->faces[lod->count] = out;
+    lod->cell[lod->count]  = cell;
+    lod->count++;
+    prev = n;
+  }
+
+  if (lod->count == 0) {
+    free(lod);
+    return NULL;
+  }
+  return lod;
+}
+
+void bvh_lod_destroy(bvh_lod_t* lod) {
+  if (lod) {
+    for (uint32_t k = 0; k < lod->count; ++k) {
+      bvh_destroy(lod->blas[k]);
+      free(lod->faces[k]);
+    }
+    free(lod);
+  }
+}
+
+uint32_t bvh_lod_count(const bvh_lod_t* lod) {
+  return lod ? lod->count : 0;
+}
+
+const bvh_tree_t* bvh_lod_level(const bvh_lod_t* lod, uint32_t level) {
+  return lod->blas[level - 1];
+}
+
+uint32_t bvh_lod_select(const bvh_lod_t* lod, float footprint) {
+  uint32_t level = lod->count;
+  while (level > 0 && lod->cell[level - 1] > footprint)
+    --level;
+  return level;
+}
+
+float bvh_lod_error(const bvh_lod_t* lod, uint32_t level) {
+  return level ? sqrtf(3.0f) * lod->cell[level - 1] : 0.0f;
+}
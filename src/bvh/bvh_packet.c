@@ -0,0 +1,294 @@
+// bvh_packet.c
+// Packet traversal for the binary bvh_node_t layout. Up to BVH_PACKET_MAX
+// rays with the same direction signs share one stack: a node is first
+// checked against interval bounds of the whole packet (a conservative
+// frustum test costing one scalar slab test), then every ray is slab-tested
+// at once, four or eight lanes per SIMD instruction. Rays whose closest hit
+// so far lies before the node drop out of it, and the node is skipped once
+// no ray is left. Once fewer than PACKET_MIN_ACTIVE rays enter a node, the
+// packet no longer pays for itself and they continue one at a time.
+#include <float.h>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+#include "bvh/bvh_util.h"
+
+#define PACKET_STACK_SIZE 64
+#define PACKET_MIN_ACTIVE 2
+
+// Lanes are tested in groups of this many
+#if defined(__AVX__)
+#define PACKET_LANE_PAD 8
+#else
+#define PACKET_LANE_PAD 4
+#endif
+
+typedef struct {
+  float    org[3][BVH_PACKET_MAX];
+  float    inv_dir[3][BVH_PACKET_MAX];
+  float    t_max[BVH_PACKET_MAX]; // shrinks to the closest hit so far
+  uint32_t neg[3];                // direction signs, shared by every ray
+  float    org_min[3], org_max[3]; // interval bounds over the packet
+  float    inv_min[3], inv_max[3];
+  float    dir_sum[3]; // unnormalized mean direction, for child order
+  float    t_min;
+  uint32_t lanes; // count rounded up to PACKET_LANE_PAD
+} packet_t;
+
+static void packet_init(packet_t* p, const ray_t* rays, uint32_t count,
+                        float t_min, const float* t_max) {
+  bvh_ray_prep_t r;
+  p->t_min = t_min;
+  p->lanes = (count + PACKET_LANE_PAD - 1) / PACKET_LANE_PAD;
+  p->lanes *= PACKET_LANE_PAD;
+  for (int axis = 0; axis < 3; ++axis) {
+    p->org_min[axis] = p->inv_min[axis] = FLT_MAX;
+    p->org_max[axis] = p->inv_max[axis] = -FLT_MAX;
+    p->dir_sum[axis] = 0.0f;
+  }
+  for (uint32_t k = 0; k < p->lanes; ++k) {
+    // Padding lanes copy ray 0 but can never enter a box
+    uint32_t i = k < count ? k : 0;
+    bvh_ray_prep_init(&r, &rays[i]);
+    p->t_max[k] = k < count ? t_max[i] : -FLT_MAX;
+    for (int axis = 0; axis < 3; ++axis) {
+      p->org[axis][k]     = r.org[axis];
+      p->inv_dir[axis][k] = r.inv_dir[axis];
+      p->org_min[axis]    = bvh_minf(p->org_min[axis], r.org[axis]);
+      p->org_max[axis]    = bvh_maxf(p->org_max[axis], r.org[axis]);
+      p->inv_min[axis]    = bvh_minf(p->inv_min[axis], r.inv_dir[axis]);
+      p->inv_max[axis]    = bvh_maxf(p->inv_max[axis], r.inv_dir[axis]);
+    }
+  }
+  for (uint32_t k = 0; k < count; ++k) {
+    for (int axis = 0; axis < 3; ++axis)
+      p->dir_sum[axis] += (&rays[k].direction.x)[axis];
+  }
+  for (int axis = 0; axis < 3; ++axis)
+    p->neg[axis] = (&rays[0].direction.x)[axis] < 0.0f;
+}
+
+// Bounds of a * b over a in [a0, a1], b in [b0, b1]
+static inline void interval_mul(float a0, float a1, float b0, float b1,
+                                float* lo, float* hi) {
+  float p0 = a0 * b0, p1 = a0 * b1, p2 = a1 * b0, p3 = a1 * b1;
+  *lo      = bvh_minf(bvh_minf(p0, p1), bvh_minf(p2, p3));
+  *hi      = bvh_maxf(bvh_maxf(p0, p1), bvh_maxf(p2, p3));
+}
+
+// False only if no ray of the packet can enter the box: every ray enters
+// no earlier than the largest lower bound of the per-axis entry distances
+// and leaves no later than the smallest upper bound of the exit distances
+static inline bool packet_interval_hit(const packet_t* p, const float* bmin,
+                                       const float* bmax, float t_max) {
+  float t_enter = p->t_min;
+  float t_leave = t_max;
+  for (int axis = 0; axis < 3; ++axis) {
+    float near = p->neg[axis] ? bmax[axis] : bmin[axis];
+    float far  = p->neg[axis] ? bmin[axis] : bmax[axis];
+    float lo, hi, unused;
+    interval_mul(near - p->org_max[axis], near - p->org_min[axis],
+                 p->inv_min[axis], p->inv_max[axis], &lo, &unused);
+    t_enter = bvh_maxf(t_enter, lo);
+    interval_mul(far - p->org_max[axis], far - p->org_min[axis],
+                 p->inv_min[axis], p->inv_max[axis], &unused, &hi);
+    t_leave = bvh_minf(t_leave, hi);
+  }
+  return t_enter <= t_leave;
+}
+
+// Mask of the rays entering the box within (t_min, t_max[lane])
+static inline uint32_t packet_slab(const packet_t* p, const float* bmin,
+                                   const float* bmax) {
+  float near[3], far[3];
+  for (int axis = 0; axis < 3; ++axis) {
+    near[axis] = p->neg[axis] ? bmax[axis] : bmin[axis];
+    far[axis]  = p->neg[axis] ? bmin[axis] : bmax[axis];
+  }
+
+  uint32_t mask = 0;
+#if defined(__AVX__)
+  for (uint32_t l = 0; l < p->lanes; l += 8) {
+    __m256 tn = _mm256_set1_ps(p->t_min);
+    __m256 tf = _mm256_loadu_ps(&p->t_max[l]);
+    for (int axis = 0; axis < 3; ++axis) {
+      __m256 org = _mm256_loadu_ps(&p->org[axis][l]);
+      __m256 inv = _mm256_loadu_ps(&p->inv_dir[axis][l]);
+      __m256 lo  = _mm256_set1_ps(near[axis]);
+      __m256 hi  = _mm256_set1_ps(far[axis]);
+      tn = _mm256_max_ps(tn, _mm256_mul_ps(_mm256_sub_ps(lo, org), inv));
+      tf = _mm256_min_ps(tf, _mm256_mul_ps(_mm256_sub_ps(hi, org), inv));
+    }
+    mask |= (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(tn, tf, _CMP_LE_OQ))
+            << l;
+  }
+#elif defined(__SSE__)
+  for (uint32_t l = 0; l < p->lanes; l += 4) {
+    __m128 tn = _mm_set1_ps(p->t_min);
+    __m128 tf = _mm_loadu_ps(&p->t_max[l]);
+    for (int axis = 0; axis < 3; ++axis) {
+      __m128 org = _mm_loadu_ps(&p->org[axis][l]);
+      __m128 inv = _mm_loadu_ps(&p->inv_dir[axis][l]);
+      __m128 lo  = _mm_set1_ps(near[axis]);
+      __m128 hi  = _mm_set1_ps(far[axis]);
+      tn         = _mm_max_ps(tn, _mm_mul_ps(_mm_sub_ps(lo, org), inv));
+      tf         = _mm_min_ps(tf, _mm_mul_ps(_mm_sub_ps(hi, org), inv));
+    }
+    mask |= (uint32_t)_mm_movemask_ps(_mm_cmple_ps(tn, tf)) << l;
+  }
+#else
+  for (uint32_t k = 0; k < p->lanes; ++k) {
+    float tn = p->t_min;
+    float tf = p->t_max[k];
+    for (int axis = 0; axis < 3; ++axis) {
+      tn = bvh_maxf(tn, (near[axis] - p->org[axis][k]) * p->inv_dir[axis][k]);
+      tf = bvh_minf(tf, (far[axis] - p->org[axis][k]) * p->inv_dir[axis][k]);
+    }
+    if (tn <= tf)
+      mask |= 1u << k;
+  }
+#endif
+  return mask;
+}
+
+static inline float packet_max_t(const packet_t* p, uint32_t active) {
+  float t = -FLT_MAX;
+  for (; active; active &= active - 1)
+    t = bvh_maxf(t, p->t_max[__builtin_ctz(active)]);
+  return t;
+}
+
+// Distance of a box's center from the first ray's origin along the
+// packet's mean direction (both scaled, only the order matters)
+static inline float packet_order_key(const packet_t* p, const bvh_node_t* n) {
+  const float* bmin = &n->bbox_min.x;
+  const float* bmax = &n->bbox_max.x;
+  float        key  = 0.0f;
+  for (int axis = 0; axis < 3; ++axis)
+    key += (bmin[axis] + bmax[axis] - 2.0f * p->org[axis][0])
+           * p->dir_sum[axis];
+  return key;
+}
+
+// Traverses the subtree at `root` for the rays in *live; `any` is a
+// constant in each caller. Rays that hit (closest, stored in best) or are
+// occluded (any) are added to *result, and occluded ones leave *live. A
+// child that finds the stack full is traversed by a recursive call.
+// A ray whose closest hit improves updates p->t_max.
+static inline void packet_subtree(const bvh_tree_t* tree, packet_t* p,
+                                  const ray_t* rays, uint32_t root,
+                                  bvh_hit_t* best, uint32_t* live,
+                                  uint32_t* result, const bool any) {
+  const bvh_node_t* nodes = tree->nodes;
+  uint32_t          stack[PACKET_STACK_SIZE];
+  uint32_t          stack_ptr = 0;
+  stack[stack_ptr++]          = root;
+
+  while (stack_ptr > 0) {
+    const bvh_node_t* node = &nodes[stack[--stack_ptr]];
+    if (!packet_interval_hit(p, &node->bbox_min.x, &node->bbox_max.x,
+                             packet_max_t(p, *live)))
+      continue;
+    uint32_t active = packet_slab(p, &node->bbox_min.x, &node->bbox_max.x)
+                      & *live;
+    if (!active)
+      continue;
+
+    if (node->is_leaf) {
+      for (; active; active &= active - 1) {
+        uint32_t k = (uint32_t)__builtin_ctz(active);
+        if (any) {
+          if (bvh_leaf_occluded(tree, node->leaf.start, node->leaf.count,
+                                &rays[k], p->t_min, p->t_max[k])) {
+            *result |= 1u << k;
+            *live &= ~(1u << k);
+            p->t_max[k] = -FLT_MAX;
+          }
+        } else if (bvh_leaf_intersect(tree, node->leaf.start,
+                                      node->leaf.count, &rays[k], p->t_min,
+                                      &best[k])) {
+          *result |= 1u << k;
+          p->t_max[k] = best[k].t;
+        }
+      }
+      if (any && !*live)
+        return; // every ray is occluded
+      continue;
+    }
+
+    if ((uint32_t)__builtin_popcount(active) < PACKET_MIN_ACTIVE) {
+      for (; active; active &= active - 1) {
+        uint32_t  k      = (uint32_t)__builtin_ctz(active);
+        uint32_t  idx    = (uint32_t)(node - nodes);
+        bvh_hit_t single = { .t = p->t_max[k] };
+        if (!bvh_binary_subtree(tree, &rays[k], idx, p->t_min,
+                                any ? &single : &best[k], any))
+          continue;
+        *result |= 1u << k;
+        if (any) {
+          *live &= ~(1u << k);
+          p->t_max[k] = -FLT_MAX;
+        } else {
+          p->t_max[k] = best[k].t;
+        }
+      }
+      if (any && !*live)
+        return;
+      continue;
+    }
+
+    // Push the farther child first so the nearer one is visited first
+    uint32_t child[2] = { node->internal.left, node->internal.right };
+    int      near     = packet_order_key(p, &nodes[child[1]])
+                     < packet_order_key(p, &nodes[child[0]]);
+    int      order[2] = { 1 - near, near };
+    for (int k = 0; k < 2; ++k) {
+      if (stack_ptr < PACKET_STACK_SIZE) {
+        stack[stack_ptr++] = child[order[k]];
+      } else {
+        packet_subtree(tree, p, rays, child[order[k]], best, live, result,
+                       any);
+        if (any && !*live)
+          return;
+      }
+    }
+  }
+}
+
+uint32_t bvh_binary_intersect_packet(const bvh_tree_t* tree,
+                                     const ray_t* rays, uint32_t count,
+                                     float t_min, const float* t_max,
+                                     bvh_hit_t* hits) {
+  if (!tree || tree->node_count == 0)
+    return 0;
+  packet_t  p;
+  bvh_hit_t best[BVH_PACKET_MAX];
+  uint32_t  live   = (1u << count) - 1;
+  uint32_t  result = 0;
+  packet_init(&p, rays, count, t_min, t_max);
+  for (uint32_t k = 0; k < count; ++k)
+    best[k].t = t_max[k];
+
+  packet_subtree(tree, &p, rays, 0, best, &live, &result, false);
+  for (uint32_t m = result; m; m &= m - 1) {
+    uint32_t k = (uint32_t)__builtin_ctz(m);
+    bvh_hit_resolve(tree, &best[k]);
+    hits[k] = best[k];
+  }
+  return result;
+}
+
+uint32_t bvh_binary_occluded_packet(const bvh_tree_t* tree,
+                                    const ray_t* rays, uint32_t count,
+                                    float t_min, const float* t_max) {
+  if (!tree || tree->node_count == 0)
+    return 0;
+  packet_t p;
+  uint32_t live   = (1u << count) - 1;
+  uint32_t result = 0;
+  packet_init(&p, rays, count, t_min, t_max);
+  packet_subtree(tree, &p, rays, 0, NULL, &live, &result, true);
+  return result;
+}
@@ -0,0 +1,114 @@
+// bvh_refit.c
+// Refit and SAH cost for the binary bvh_node_t layout. A refit keeps the
+// topology and leaf ranges and only recomputes bounds from the current
+// vertex positions, leaves first, in O(n).
+#include <stdlib.h>
+#include "bvh/bvh_build.h"
+#include "parallel.h"
+
+// Subtrees handed to each refit worker; more than one evens out imbalance
+#define BVH_REFIT_TASKS_PER_WORKER 8
+
+static void refit_leaf(const bvh_tree_t* tree, bvh_node_t* node) {
+  bvh_bbox_empty(&node->bbox_min, &node->bbox_max);
+  for (uint32_t k = node->leaf.start; k < node->leaf.start + node->leaf.count;
+       ++k) {
+    uint32_t f = tree->face_indices[k];
+    wf_vec3  fmin, fmax;
+    bvh_face_bbox(&tree->faces[f], bvh_shape_of(tree->shapes, f), tree->scene,
+                  &fmin, &fmax);
+    bvh_bbox_expand(&node->bbox_min, &node->bbox_max, &fmin, &fmax);
+  }
+}
+
+// Bounds of an inner node from its (already refitted) children
+static void refit_inner(const bvh_tree_t* tree, bvh_node_t* node) {
+  const bvh_node_t* left  = &tree->nodes[node->internal.left];
+  const bvh_node_t* right = &tree->nodes[node->internal.right];
+  node->bbox_min          = left->bbox_min;
+  node->bbox_max          = left->bbox_max;
+  bvh_bbox_expand(&node->bbox_min, &node->bbox_max, &right->bbox_min,
+                  &right->bbox_max);
+}
+
+static void refit_subtree(const bvh_tree_t* tree, uint32_t idx) {
+  bvh_node_t* node = &tree->nodes[idx];
+  if (node->is_leaf) {
+    refit_leaf(tree, node);
+    return;
+  }
+  refit_subtree(tree, node->internal.left);
+  refit_subtree(tree, node->internal.right);
+  refit_inner(tree, node);
+}
+
+typedef struct {
+  const bvh_tree_t* tree;
+  const uint32_t*   roots;
+} refit_job_t;
+
+static void refit_range(void* arg, size_t begin, size_t end) {
+  refit_job_t* job = (refit_job_t*)arg;
+  for (size_t i = begin; i < end; ++i)
+    refit_subtree(job->tree, job->roots[i]);
+}
+
+bool bvh_binary_refit(bvh_tree_t* tree, unsigned threads) {
+  if (!tree || tree->node_count == 0)
+    return true;
+  if (threads <= 1) {
+    refit_subtree(tree, 0);
+    return true;
+  }
+
+  // Open nodes breadth-first until there are enough subtrees to share out.
+  // queue[0, head) are the opened nodes, queue[head, count) the subtrees.
+  size_t    target = (size_t)threads * BVH_REFIT_TASKS_PER_WORKER;
+  size_t    cap    = 2 * target + 1;
+  uint32_t* queue  = malloc(cap * sizeof(uint32_t));
+  if (!queue)
+    return false;
+  size_t head = 0, count = 0;
+  queue[count++] = 0;
+  while (head < count && count - head < target && count + 2 <= cap) {
+    const bvh_node_t* node = &tree->nodes[queue[head++]];
+    if (!node->is_leaf) {
+      queue[count++] = node->internal.left;
+      queue[count++] = node->internal.right;
+    }
+  }
+
+  refit_job_t job = { .tree = tree, .roots = queue + head };
+  parallel_for(threads, count - head, 1, refit_range, &job);
+
+  // Children come after their parent in the queue, so going backwards
+  // every opened node sees final child bounds
+  for (size_t i = head; i-- > 0;) {
+    bvh_node_t* node = &tree->nodes[queue[i]];
+    if (node->is_leaf)
+      refit_leaf(tree, node);
+    else
+      refit_inner(tree, node);
+  }
+  free(queue);
+  return true;
+}
+
+float bvh_binary_sah_cost(const bvh_tree_t* tree) {
+  if (!tree || tree->node_count == 0)
+    return 0.0f;
+  float root_area = bvh_bbox_area(&tree->nodes[0].bbox_min,
+                                  &tree->nodes[0].bbox_max);
+  if (root_area <= 0.0f)
+    return 0.0f;
+
+  double cost = 0.0;
+  for (size_t i = 0; i < tree->node_count; ++i) {
+    const bvh_node_t* node = &tree->nodes[i];
+    float area = bvh_bbox_area(&node->bbox_min, &node->bbox_max);
+    cost += area
+            * (node->is_leaf ? BVH_SAH_INTERSECT_COST * (float)node->leaf.count
+                             : BVH_SAH_TRAVERSAL_COST);
+  }
+  return (float)(cost / root_area);
+}
@@ -0,0 +1,376 @@
+// bvh_shape.c
+// Bounds and normals of analytic shapes, and their detection in meshes.
+// Detection relies on the order wf_scene_to_triangles() emits triangles
+// in: the fan of a polygon and the two halves of a quad come one after
+// another.
+#include "bvh/bvh_shape.h"
+#include <stdlib.h>
+#include "bvh/bvh_util.h"
+
+#define SHAPE_TOLERANCE  1e-3f // relative distance error of a fit
+#define SHAPE_SPHERE_MIN 32    // triangles of the coarsest sphere
+#define SHAPE_SPHERE_SAG 0.02f // triangle centroids below the surface, relative
+#define SHAPE_DISC_MIN   12    // rim vertices of the coarsest disc
+#define SHAPE_COVERAGE   0.9f  // mesh area against the shape's, at least
+
+void bvh_shape_bbox(const bvh_shape_t* shape, wf_vec3* bbox_min,
+                    wf_vec3* bbox_max) {
+  const wf_vec3* c = &shape->origin;
+  float          r = shape->radius;
+  if (shape->type == BVH_SHAPE_QUAD) {
+    wf_vec3 far = v3_add(
+        *c, v3_add(v3_scale(shape->corner[0], shape->edge1),
+                   v3_scale(shape->corner[1], shape->edge2)));
+    wf_vec3 p1  = v3_add(*c, shape->edge1);
+    wf_vec3 p3  = v3_add(*c, shape->edge2);
+    bvh_bbox_empty(bbox_min, bbox_max);
+    bvh_bbox_expand(bbox_min, bbox_max, c, c);
+    bvh_bbox_expand(bbox_min, bbox_max, &p1, &p1);
+    bvh_bbox_expand(bbox_min, bbox_max, &far, &far);
+    bvh_bbox_expand(bbox_min, bbox_max, &p3, &p3);
+    return;
+  }
+
+  wf_vec3 ext = { r, r, r };
+  if (shape->type == BVH_SHAPE_DISC) {
+    // A circle reaches r * sin(angle between the axis and the normal)
+    const wf_vec3* n = &shape->edge1;
+    ext.x            = r * sqrtf(bvh_maxf(0.0f, 1.0f - n->x * n->x));
+    ext.y            = r * sqrtf(bvh_maxf(0.0f, 1.0f - n->y * n->y));
+    ext.z            = r * sqrtf(bvh_maxf(0.0f, 1.0f - n->z * n->z));
+  }
+  *bbox_min = v3_sub(*c, ext);
+  *bbox_max = v3_add(*c, ext);
+}
+
+wf_vec3 bvh_shape_centroid(const bvh_shape_t* shape) {
+  wf_vec3 min, max;
+  bvh_shape_bbox(shape, &min, &max);
+  return v3_scale(0.5f, v3_add(min, max));
+}
+
+wf_vec3 bvh_shape_normal(const bvh_shape_t* shape, const wf_vec3* point) {
+  switch (shape->type) {
+  case BVH_SHAPE_SPHERE:
+    return v3_normalize(v3_sub(*point, shape->origin));
+  case BVH_SHAPE_DISC:
+    return shape->edge1;
+  default:
+    return v3_normalize(v3_cross(shape->edge1, shape->edge2));
+  }
+}
+
+static inline const wf_vec3* corner_pos(const wf_scene_t* scene,
+                                        const wf_face* f, int k) {
+  return &scene->vertices[f->vertices[k].v_idx];
+}
+
+// Corner of f using vertex v_idx, -1 if none does
+static int corner_of(const wf_face* f, int v_idx) {
+  for (int k = 0; k < 3; ++k) {
+    if (f->vertices[k].v_idx == v_idx)
+      return k;
+  }
+  return -1;
+}
+
+// True if every corner of a and b has a's first vertex normal, or none has
+// one: a shape's normal replaces them
+static bool same_normals(const wf_face* a, const wf_face* b,
+                         const wf_scene_t* scene) {
+  const wf_face* faces[2] = { a, b };
+  int            n0       = a->vertices[0].vn_idx;
+  for (int i = 0; i < 2; ++i) {
+    for (int k = 0; k < 3; ++k) {
+      int n = faces[i]->vertices[k].vn_idx;
+      if ((n < 0) != (n0 < 0))
+        return false;
+      if (n >= 0 && n != n0
+          && (scene->normals[n].x != scene->normals[n0].x
+              || scene->normals[n].y != scene->normals[n0].y
+              || scene->normals[n].z != scene->normals[n0].z))
+        return false;
+    }
+  }
+  return true;
+}
+
+static float tri_area(const wf_vec3* a, const wf_vec3* b, const wf_vec3* c) {
+  return 0.5f * v3_length(v3_cross(v3_sub(*b, *a), v3_sub(*c, *a)));
+}
+
+// Least-squares sphere through the vertices: |p|^2 = 2 c.p + k is linear in
+// (c, k). Points are taken relative to their mean for conditioning.
+static bool sphere_lsq(const wf_face* tris, size_t count,
+                       const wf_scene_t* scene, wf_vec3* center,
+                       float* radius) {
+  double mean[3] = { 0.0, 0.0, 0.0 };
+  for (size_t i = 0; i < count; ++i) {
+    for (int k = 0; k < 3; ++k) {
+      const wf_vec3* p = corner_pos(scene, &tris[i], k);
+      mean[0] += p->x;
+      mean[1] += p->y;
+      mean[2] += p->z;
+    }
+  }
+  for (int a = 0; a < 3; ++a)
+    mean[a] /= (double)(3 * count);
+
+  // Normal equations, augmented with the right-hand side
+  double m[4][5] = { { 0.0 } };
+  for (size_t i = 0; i < count; ++i) {
+    for (int k = 0; k < 3; ++k) {
+      const wf_vec3* p      = corner_pos(scene, &tris[i], k);
+      double         row[5] = { 2.0 * (p->x - mean[0]), 2.0 * (p->y - mean[1]),
+                                2.0 * (p->z - mean[2]), 1.0, 0.0 };
+      row[4] = 0.25 * (row[0] * row[0] + row[1] * row[1] + row[2] * row[2]);
+      for (int r = 0; r < 4; ++r) {
+        for (int c = 0; c < 5; ++c)
+          m[r][c] += row[r] * row[c];
+      }
+    }
+  }
+
+  // Gauss-Jordan with partial pivoting
+  for (int c = 0; c < 4; ++c) {
+    int pivot = c;
+    for (int r = c + 1; r < 4; ++r) {
+      if (fabs(m[r][c]) > fabs(m[pivot][c]))
+        pivot = r;
+    }
+    if (fabs(m[pivot][c]) < 1e-12)
+      return false;
+    for (int k = 0; k < 5; ++k) {
+      double tmp  = m[c][k];
+      m[c][k]     = m[pivot][k];
+      m[pivot][k] = tmp;
+    }
+    for (int r = 0; r < 4; ++r) {
+      if (r == c)
+        continue;
+      double f = m[r][c] / m[c][c];
+      for (int k = c; k < 5; ++k)
+        m[r][k] -= f * m[c][k];
+    }
+  }
+
+  double c[3] = { m[0][4] / m[0][0], m[1][4] / m[1][1], m[2][4] / m[2][2] };
+  double r2   = m[3][4] / m[3][3] + c[0] * c[0] + c[1] * c[1] + c[2] * c[2];
+  if (r2 <= 0.0)
+    return false;
+  *center = (wf_vec3){ (float)(c[0] + mean[0]), (float)(c[1] + mean[1]),
+                       (float)(c[2] + mean[2]) };
+  *radius = (float)sqrt(r2);
+  return true;
+}
+
+// The whole object as one sphere: every vertex on it, no triangle sagging
+// far below it (which would be a coarse polyhedron, not a tessellation) and
+// the surface covered
+static bool fit_sphere(const wf_face* tris, size_t count,
+                       const wf_scene_t* scene, bvh_shape_t* shape) {
+  wf_vec3 c;
+  float   r;
+  if (count < SHAPE_SPHERE_MIN || !sphere_lsq(tris, count, scene, &c, &r))
+    return false;
+
+  float area = 0.0f;
+  for (size_t i = 0; i < count; ++i) {
+    if (tris[i].material_idx != tris[0].material_idx)
+      return false;
+    const wf_vec3* p[3] = { corner_pos(scene, &tris[i], 0),
+                            corner_pos(scene, &tris[i], 1),
+                            corner_pos(scene, &tris[i], 2) };
+    for (int k = 0; k < 3; ++k) {
+      if (fabsf(v3_length(v3_sub(*p[k], c)) - r) > SHAPE_TOLERANCE * r)
+        return false;
+    }
+    wf_vec3 centroid =
+        v3_scale(1.0f / 3.0f, v3_add(*p[0], v3_add(*p[1], *p[2])));
+    if (v3_length(v3_sub(centroid, c)) < (1.0f - SHAPE_SPHERE_SAG) * r)
+      return false;
+    area += tri_area(p[0], p[1], p[2]);
+  }
+  if (area < SHAPE_COVERAGE * 4.0f * (float)M_PI * r * r)
+    return false;
+
+  *shape = (bvh_shape_t){ .type = BVH_SHAPE_SPHERE, .origin = c, .radius = r };
+  return true;
+}
+
+// Length of the fan starting at tris[0] around vertex `hub`: each next
+// triangle has the hub and, in winding order after it, the previous
+// triangle's last vertex. closed is set when the fan wraps around.
+static size_t fan_length(const wf_face* tris, size_t count, int hub,
+                         const wf_scene_t* scene, bool* closed) {
+  int k     = corner_of(&tris[0], hub);
+  int first = tris[0].vertices[(k + 1) % 3].v_idx;
+  int last  = tris[0].vertices[(k + 2) % 3].v_idx;
+  *closed   = false;
+
+  size_t n = 1;
+  for (; n < count && !*closed; ++n) {
+    const wf_face* f = &tris[n];
+    k                = corner_of(f, hub);
+    if (k < 0 || f->vertices[(k + 1) % 3].v_idx != last
+        || f->material_idx != tris[0].material_idx
+        || !same_normals(&tris[0], f, scene))
+      break;
+    last    = f->vertices[(k + 2) % 3].v_idx;
+    *closed = last == first;
+  }
+  return n;
+}
+
+// A fan of n triangles around `hub` as one disc. A closed fan has the hub
+// at the center; an open one is a polygon's fan, the hub being one of the
+// polygon's corners. Either way the rim must lie on a circle and the fan
+// cover it.
+static bool fit_disc(const wf_face* tris, size_t n, int hub, bool closed,
+                     const wf_scene_t* scene, bvh_shape_t* shape) {
+  size_t rim_count = closed ? n : n + 2;
+  if (rim_count < SHAPE_DISC_MIN)
+    return false;
+  wf_vec3* rim = malloc(rim_count * sizeof(wf_vec3));
+  if (!rim)
+    return false;
+
+  // Rim vertices in order: the first triangle's two, then each next one's
+  // new vertex, and for a polygon the hub too
+  const wf_vec3* h    = &scene->vertices[hub];
+  float          area = 0.0f;
+  wf_vec3        normal;
+  for (size_t i = 0; i < n; ++i) {
+    int            k = corner_of(&tris[i], hub);
+    const wf_vec3* a = corner_pos(scene, &tris[i], (k + 1) % 3);
+    const wf_vec3* b = corner_pos(scene, &tris[i], (k + 2) % 3);
+    if (i == 0) {
+      rim[0] = *a;
+      normal = v3_normalize(v3_cross(v3_sub(*a, *h), v3_sub(*b, *h)));
+    }
+    if (i + 1 < n || !closed)
+      rim[i + 1] = *b;
+    area += tri_area(h, a, b);
+  }
+  wf_vec3 c = *h;
+  if (!closed) {
+    rim[n + 1] = *h;
+    c          = v3_zero();
+    for (size_t i = 0; i < rim_count; ++i)
+      c = v3_add(c, rim[i]);
+    c = v3_scale(1.0f / (float)rim_count, c);
+  }
+
+  float r = 0.0f;
+  for (size_t i = 0; i < rim_count; ++i)
+    r += v3_length(v3_sub(rim[i], c));
+  r /= (float)rim_count;
+
+  bool fits = r > 0.0f && v3_length_sq(normal) > 0.0f;
+  for (size_t i = 0; fits && i < rim_count; ++i) {
+    wf_vec3 d = v3_sub(rim[i], c);
+    fits      = fabsf(v3_length(d) - r) <= SHAPE_TOLERANCE * r
+           && fabsf(v3_dot(d, normal)) <= SHAPE_TOLERANCE * r;
+  }
+  free(rim);
+
+  // The regular polygon on the rim bounds what any fan over it covers
+  float polygon = 0.5f * (float)rim_count * r * r
+                  * sinf(2.0f * (float)M_PI / (float)rim_count);
+  if (!fits || area < SHAPE_COVERAGE * polygon)
+    return false;
+
+  *shape = (bvh_shape_t){
+    .type = BVH_SHAPE_DISC, .origin = c, .edge1 = normal, .radius = r
+  };
+  return true;
+}
+
+// The longest fan from tris[0] that fits a disc; 0 if none does
+static size_t detect_disc(const wf_face* tris, size_t count,
+                          const wf_scene_t* scene, bvh_shape_t* shape) {
+  size_t best = 0;
+  if (!same_normals(&tris[0], &tris[0], scene))
+    return 0;
+  for (int k = 0; k < 3; ++k) {
+    int         hub = tris[0].vertices[k].v_idx;
+    bool        closed;
+    size_t      n = fan_length(tris, count, hub, scene, &closed);
+    bvh_shape_t disc;
+    if (n > best && fit_disc(tris, n, hub, closed, scene, &disc)) {
+      best   = n;
+      *shape = disc;
+    }
+  }
+  return best;
+}
+
+// t0 and t1 sharing a diagonal, with consistent winding, as one planar
+// convex quad. Corners in order are t0's corner off the diagonal, the next
+// two of t0 being the diagonal's ends, and t1's corner off it in between.
+static bool detect_quad(const wf_face* t0, const wf_face* t1,
+                        const wf_scene_t* scene, bvh_shape_t* shape) {
+  if (t0->material_idx != t1->material_idx || !same_normals(t0, t1, scene))
+    return false;
+
+  for (int k = 0; k < 3; ++k) {
+    int a = t0->vertices[k].v_idx;
+    int s = t0->vertices[(k + 1) % 3].v_idx;
+    int j = corner_of(t1, t0->vertices[(k + 2) % 3].v_idx);
+    if (j < 0 || t1->vertices[(j + 1) % 3].v_idx != s
+        || t1->vertices[(j + 2) % 3].v_idx == a)
+      continue;
+
+    // The far corner in the basis of the edges from the first corner
+    wf_vec3 p0  = scene->vertices[a];
+    wf_vec3 e1  = v3_sub(*corner_pos(scene, t0, (k + 1) % 3), p0);
+    wf_vec3 e2  = v3_sub(*corner_pos(scene, t0, (k + 2) % 3), p0);
+    wf_vec3 w   = v3_sub(*corner_pos(scene, t1, (j + 2) % 3), p0);
+    float   g11 = v3_dot(e1, e1);
+    float   g12 = v3_dot(e1, e2);
+    float   g22 = v3_dot(e2, e2);
+    float   det = g11 * g22 - g12 * g12;
+    if (det <= 1e-12f * g11 * g22)
+      return false;
+    float cu = (g22 * v3_dot(e1, w) - g12 * v3_dot(e2, w)) / det;
+    float cv = (g11 * v3_dot(e2, w) - g12 * v3_dot(e1, w)) / det;
+
+    // In the plane, and convex: beyond the diagonal, inside both edges
+    wf_vec3 off = v3_sub(w, v3_add(v3_scale(cu, e1), v3_scale(cv, e2)));
+    if (v3_length(off) > SHAPE_TOLERANCE * v3_length(w) || cu <= 0.0f
+        || cv <= 0.0f || cu + cv <= 1.0f)
+      return false;
+
+    *shape = (bvh_shape_t){ .type   = BVH_SHAPE_QUAD,
+                            .origin = p0,
+                            .edge1  = e1,
+                            .edge2  = e2,
+                            .corner = { cu, cv } };
+    return true;
+  }
+  return false;
+}
+
+size_t bvh_shapes_detect(const wf_face* tris, size_t count,
+                         const wf_scene_t* scene, wf_face* faces,
+                         bvh_shape_t* shapes) {
+  if (count > 0 && fit_sphere(tris, count, scene, &shapes[0])) {
+    faces[0] = tris[0];
+    return 1;
+  }
+
+  size_t out = 0;
+  for (size_t i = 0; i < count;) {
+    bvh_shape_t shape = { .type = BVH_SHAPE_TRIANGLE };
+    size_t      used  = detect_disc(&tris[i], count - i, scene, &shape);
+    if (used == 0 && i + 1 < count
+        && detect_quad(&tris[i], &tris[i + 1], scene, &shape))
+      used = 2;
+    if (used == 0)
+      used = 1;
+    faces[out]    = tris[i];
+    shapes[out++] = shape;
+    i += used;
+  }
+  return out;
+}
@@ -0,0 +1,211 @@
+// bvh_stats.c
+// Tree quality report. Everything is computed over the bvh_node_view_t
+// children op, so one walk and one traversal serve every node layout, and
+// the binary layout's view lives here too.
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bvh/bvh_build.h"
+#include "bvh/bvh_ops.h"
+
+typedef struct {
+  bvh_node_view_t view;
+  float           t_near; // traversal: entry distance
+  uint32_t        depth;  // walk: root at 0
+} stats_entry_t;
+
+// Growable stack; the walk is not bounded by any layout's maximum depth
+typedef struct {
+  stats_entry_t* items;
+  size_t         count;
+  size_t         cap;
+} stats_stack_t;
+
+static bool stack_reserve(stats_stack_t* s, size_t extra) {
+  if (s->count + extra <= s->cap)
+    return true;
+  size_t cap = s->cap ? s->cap * 2 : 64;
+  while (cap < s->count + extra)
+    cap *= 2;
+  stats_entry_t* items = realloc(s->items, cap * sizeof(*items));
+  if (!items)
+    return false;
+  s->items = items;
+  s->cap   = cap;
+  return true;
+}
+
+static void binary_view(const bvh_node_t* node, uint32_t idx,
+                        bvh_node_view_t* view) {
+  view->bbox_min = node->bbox_min;
+  view->bbox_max = node->bbox_max;
+  view->ref      = idx;
+  view->start    = node->is_leaf ? node->leaf.start : 0;
+  view->count    = node->is_leaf ? node->leaf.count : 0;
+}
+
+uint32_t bvh_binary_children(const bvh_tree_t*      tree,
+                             const bvh_node_view_t* node,
+                             bvh_node_view_t*       children) {
+  if (!node) {
+    binary_view(&tree->nodes[0], 0, &children[0]);
+    return 1;
+  }
+  const bvh_node_t* n = &tree->nodes[node->ref];
+  if (n->is_leaf)
+    return 0;
+  binary_view(&tree->nodes[n->internal.left], n->internal.left, &children[0]);
+  binary_view(&tree->nodes[n->internal.right], n->internal.right,
+              &children[1]);
+  return 2;
+}
+
+size_t bvh_binary_node_memory(const bvh_tree_t* tree) {
+  size_t count = tree->node_cap > tree->node_count ? tree->node_cap
+                                                   : tree->node_count;
+  return count * sizeof(bvh_node_t);
+}
+
+static bool stats_supported(const bvh_tree_t* tree) {
+  return tree && tree->ops->children && tree->face_indices && tree->tris;
+}
+
+bool bvh_stats(const bvh_tree_t* tree, bvh_stats_t* stats) {
+  if (!stats_supported(tree))
+    return false;
+  memset(stats, 0, sizeof(*stats));
+
+  stats_stack_t stack = { 0 };
+  if (!stack_reserve(&stack, 1))
+    return false;
+  tree->ops->children(tree, NULL, &stack.items[0].view);
+  stack.items[0].depth = 0;
+  stack.count          = 1;
+
+  float root_area = bvh_bbox_area(&stack.items[0].view.bbox_min,
+                                  &stack.items[0].view.bbox_max);
+
+  double cost = 0.0;
+  while (stack.count > 0) {
+    stats_entry_t   e = stack.items[--stack.count];
+    bvh_node_view_t children[BVH_MAX_CHILDREN];
+    uint32_t        n    = tree->ops->children(tree, &e.view, children);
+    float           area = bvh_bbox_area(&e.view.bbox_min, &e.view.bbox_max);
+
+    stats->node_count++;
+    stats->surface_area += area;
+    if (e.depth > stats->max_depth)
+      stats->max_depth = e.depth;
+    if (n == 0) {
+      size_t depth = e.depth < BVH_STATS_DEPTHS ? e.depth
+                                                : BVH_STATS_DEPTHS - 1;
+      size_t size  = e.view.count < BVH_STATS_LEAF_SIZES
+                         ? e.view.count
+                         : BVH_STATS_LEAF_SIZES - 1;
+      stats->leaf_count++;
+      stats->reference_count += e.view.count;
+      stats->depth_histogram[depth]++;
+      stats->leaf_size_histogram[size]++;
+      cost += (double)area * BVH_SAH_INTERSECT_COST * e.view.count;
+      continue;
+    }
+
+    cost += (double)area * BVH_SAH_TRAVERSAL_COST;
+    if (!stack_reserve(&stack, n)) {
+      free(stack.items);
+      return false;
+    }
+    for (uint32_t k = 0; k < n; ++k) {
+      stack.items[stack.count].view    = children[k];
+      stack.items[stack.count++].depth = e.depth + 1;
+    }
+  }
+  free(stack.items);
+
+  const bvh_tri_buffer_t* tris = tree->tris;
+
+  stats->sah_cost = root_area > 0.0f ? (float)(cost / root_area) : 0.0f;
+  stats->memory_bytes =
+      sizeof(bvh_tree_t) + tree->index_count * sizeof(uint32_t)
+      + sizeof(bvh_tri_buffer_t) + tris->block_count * sizeof(bvh_tri_block_t)
+      + (tris->types ? tris->block_count * sizeof(*tris->types)
+                           + tree->index_count * sizeof(*tris->corners)
+                     : 0)
+      + (tree->ops->node_memory ? tree->ops->node_memory(tree) : 0);
+  return true;
+}
+
+// Closest-hit traversal nearest child first, counting what it touches
+static void trace_counted(const bvh_tree_t* tree, const ray_t* ray,
+                          stats_stack_t* stack, size_t* nodes,
+                          size_t* tris) {
+  const float    t_min = 1e-4f;
+  bvh_ray_prep_t r;
+  bvh_ray_prep_init(&r, ray);
+  bvh_hit_t best = { .t = INFINITY };
+
+  bvh_node_view_t root;
+  float           t_near;
+  tree->ops->children(tree, NULL, &root);
+  stack->count = 0;
+  if (!bvh_ray_prep_slab(&r, &root.bbox_min.x, &root.bbox_max.x, t_min,
+                         best.t, &t_near))
+    return;
+  stack->items[0].view   = root;
+  stack->items[0].t_near = t_near;
+  stack->count           = 1;
+
+  while (stack->count > 0) {
+    stats_entry_t e = stack->items[--stack->count];
+    if (e.t_near >= best.t)
+      continue;
+    ++*nodes;
+    bvh_node_view_t children[BVH_MAX_CHILDREN];
+    uint32_t        n = tree->ops->children(tree, &e.view, children);
+    if (n == 0) {
+      *tris += e.view.count;
+      bvh_leaf_intersect(tree, e.view.start, e.view.count, ray, t_min, &best);
+      continue;
+    }
+
+    // Insertion sort, farthest first so the nearest is popped first
+    stats_entry_t hits[BVH_MAX_CHILDREN];
+    uint32_t      hit_count = 0;
+    for (uint32_t k = 0; k < n; ++k) {
+      if (!bvh_ray_prep_slab(&r, &children[k].bbox_min.x,
+                             &children[k].bbox_max.x, t_min, best.t, &t_near))
+        continue;
+      uint32_t j = hit_count++;
+      while (j > 0 && hits[j - 1].t_near < t_near) {
+        hits[j] = hits[j - 1];
+        --j;
+      }
+      hits[j].view   = children[k];
+      hits[j].t_near = t_near;
+    }
+    if (!stack_reserve(stack, hit_count))
+      return; // counted so far; the stack keeps its previous capacity
+    memcpy(&stack->items[stack->count], hits, hit_count * sizeof(*hits));
+    stack->count += hit_count;
+  }
+}
+
+bool bvh_stats_trace(const bvh_tree_t* tree, const ray_t* rays, size_t count,
+                     bvh_stats_t* stats) {
+  if (!stats_supported(tree))
+    return false;
+  stats_stack_t stack = { 0 };
+  if (!stack_reserve(&stack, 1))
+    return false;
+
+  size_t nodes = 0;
+  size_t tris  = 0;
+  for (size_t i = 0; i < count; ++i)
+    trace_counted(tree, &rays[i], &stack, &nodes, &tris);
+  free(stack.items);
+
+  stats->ray_count     = count;
+  stats->nodes_per_ray = count ? (double)nodes / (double)count : 0.0;
+  stats->tris_per_ray  = count ? (double)tris / (double)count : 0.0;
+  return true;
+}
@@ -0,0 +1,218 @@
+// bvh_stream.c
+// Stream traversal for the binary bvh_node_t layout. A batch of independent
+// rays is traced STREAM_LANES at a time, each lane a small state machine
+// (its own stack, prepared ray and best hit) that processes one node per
+// turn. After a turn the lane prefetches what its next node will touch,
+// the children to slab-test or the leaf's triangles, and the next lanes
+// run while that memory arrives. Every ray visits the same nodes in the
+// same order as bvh_binary_intersect_closest(), so the hits are identical.
+#include <string.h>
+#include "bvh/bvh_util.h"
+
+#define STREAM_LANES      8 // rays in flight
+#define STREAM_STACK_SIZE 64
+
+typedef struct {
+  bvh_ray_prep_t r;
+  bvh_hit_t      best;
+  uint32_t       ray; // index into the batch
+  bool           found;
+  uint32_t       stack_ptr;
+  struct {
+    uint32_t node;
+    float    t_near;
+  } stack[STREAM_STACK_SIZE];
+} stream_lane_t;
+
+typedef struct {
+  const bvh_tree_t* tree;
+  const ray_t*      rays;
+  size_t            count;
+  size_t            next; // first ray not yet started
+  float             t_min;
+  const float*      t_max;
+  bvh_hit_t*        hits;
+  bool*             result; // hit, or occluded for any
+  bool              any;
+} stream_t;
+
+// Prefetches what popping the lane's top entry will read
+static inline void stream_prefetch(const stream_t* s,
+                                   const stream_lane_t* lane) {
+  if (lane->stack_ptr == 0)
+    return;
+  const bvh_node_t* node =
+      &s->tree->nodes[lane->stack[lane->stack_ptr - 1].node];
+  if (node->is_leaf) {
+    const bvh_tri_block_t* blocks = s->tree->tris->blocks;
+    __builtin_prefetch(&blocks[node->leaf.start / BVH_TRI_BLOCK]);
+    __builtin_prefetch(
+        &blocks[(node->leaf.start + node->leaf.count - 1) / BVH_TRI_BLOCK]);
+  } else {
+    __builtin_prefetch(&s->tree->nodes[node->internal.left]);
+    __builtin_prefetch(&s->tree->nodes[node->internal.right]);
+  }
+}
+
+// Stores the lane's result and starts the next ray of the batch on it;
+// false once the batch is exhausted
+static bool stream_next_ray(stream_t* s, stream_lane_t* lane, bool started) {
+  if (started) {
+    s->result[lane->ray] = lane->found;
+    if (lane->found && !s->any) {
+      bvh_hit_resolve(s->tree, &lane->best);
+      s->hits[lane->ray] = lane->best;
+    }
+  }
+
+  const bvh_node_t* root = &s->tree->nodes[0];
+  while (s->next < s->count) {
+    uint32_t     i   = (uint32_t)s->next++;
+    const ray_t* ray = &s->rays[i];
+    float        t_near;
+    bvh_ray_prep_init(&lane->r, ray);
+    if (!bvh_ray_prep_slab(&lane->r, &root->bbox_min.x, &root->bbox_max.x,
+                           s->t_min, s->t_max[i], &t_near)) {
+      s->result[i] = false;
+      continue;
+    }
+    lane->ray             = i;
+    lane->best            = (bvh_hit_t){ .t = s->t_max[i] };
+    lane->found           = false;
+    lane->stack[0].node   = 0;
+    lane->stack[0].t_near = t_near;
+    lane->stack_ptr       = 1;
+    return true;
+  }
+  return false;
+}
+
+// One node of the lane's traversal, the loop body of binary_traverse() in
+// bvh_util.c; `any` is a constant in each caller. Returns false when the
+// lane's ray is done.
+static inline bool stream_step(const stream_t* s, stream_lane_t* lane,
+                               const bool any) {
+  const bvh_node_t* nodes = s->tree->nodes;
+  const ray_t*      ray   = &s->rays[lane->ray];
+  const float       t_min = s->t_min;
+  bvh_hit_t*        best  = &lane->best;
+
+  --lane->stack_ptr;
+  if (lane->stack[lane->stack_ptr].t_near >= best->t)
+    return lane->stack_ptr > 0; // a closer hit was found after the push
+  const bvh_node_t* node = &nodes[lane->stack[lane->stack_ptr].node];
+  if (node->is_leaf) {
+    if (any) {
+      if (bvh_leaf_occluded(s->tree, node->leaf.start, node->leaf.count, ray,
+                            t_min, best->t)) {
+        lane->found = true;
+        return false;
+      }
+    } else {
+      lane->found |= bvh_leaf_intersect(s->tree, node->leaf.start,
+                                        node->leaf.count, ray, t_min, best);
+    }
+    return lane->stack_ptr > 0;
+  }
+
+  uint32_t child[2] = { node->internal.left, node->internal.right };
+  float    t[2];
+  bool     hit_child[2];
+  for (int k = 0; k < 2; ++k) {
+    hit_child[k] = bvh_ray_prep_slab(&lane->r, &nodes[child[k]].bbox_min.x,
+                                     &nodes[child[k]].bbox_max.x, t_min,
+                                     best->t, &t[k]);
+  }
+
+  // Push the farther child first so the nearer one is visited first
+  int near     = hit_child[1] && (!hit_child[0] || t[1] < t[0]);
+  int order[2] = { 1 - near, near };
+  for (int k = 0; k < 2; ++k) {
+    int c = order[k];
+    if (!hit_child[c])
+      continue;
+    if (lane->stack_ptr < STREAM_STACK_SIZE) {
+      lane->stack[lane->stack_ptr].node     = child[c];
+      lane->stack[lane->stack_ptr++].t_near = t[c];
+    } else if (bvh_binary_subtree(s->tree, ray, child[c], t_min, best,
+                                  any)) {
+      // The stack is full: this child is traversed right away
+      lane->found = true;
+      if (any)
+        return false;
+    }
+  }
+  return lane->stack_ptr > 0;
+}
+
+static inline void stream_run(stream_t* s, const bool any) {
+  stream_lane_t lanes[STREAM_LANES];
+  uint32_t      active = 0;
+  for (; active < STREAM_LANES; ++active) {
+    if (!stream_next_ray(s, &lanes[active], false))
+      break;
+  }
+
+  // Round robin; a finished lane takes the next ray, and the last lane
+  // moves into the slot of one that has nothing left to take
+  while (active > 0) {
+    for (uint32_t k = 0; k < active;) {
+      stream_lane_t* lane = &lanes[k];
+      if (stream_step(s, lane, any)) {
+        stream_prefetch(s, lane);
+        ++k;
+      } else if (stream_next_ray(s, lane, true)) {
+        stream_prefetch(s, lane);
+        ++k;
+      } else if (k != --active) {
+        *lane = lanes[active];
+      }
+    }
+  }
+}
+
+size_t bvh_binary_intersect_stream(const bvh_tree_t* tree, const ray_t* rays,
+                                   size_t count, float t_min,
+                                   const float* t_max, bvh_hit_t* hits,
+                                   bool* hit) {
+  if (!tree || tree->node_count == 0) {
+    memset(hit, 0, count * sizeof(bool));
+    return 0;
+  }
+  stream_t s = { .tree   = tree,
+                 .rays   = rays,
+                 .count  = count,
+                 .t_min  = t_min,
+                 .t_max  = t_max,
+                 .hits   = hits,
+                 .result = hit,
+                 .any    = false };
+  stream_run(&s, false);
+
+  size_t hit_count = 0;
+  for (size_t i = 0; i < count; ++i)
+    hit_count += hit[i];
+  return hit_count;
+}
+
+size_t bvh_binary_occluded_stream(const bvh_tree_t* tree, const ray_t* rays,
+                                  size_t count, float t_min,
+                                  const float* t_max, bool* occluded) {
+  if (!tree || tree->node_count == 0) {
+    memset(occluded, 0, count * sizeof(bool));
+    return 0;
+  }
+  stream_t s = { .tree   = tree,
+                 .rays   = rays,
+                 .count  = count,
+                 .t_min  = t_min,
+                 .t_max  = t_max,
+                 .result = occluded,
+                 .any    = true };
+  stream_run(&s, true);
+
+  size_t occluded_count = 0;
+  for (size_t i = 0; i < count; ++i)
+    occluded_count += occluded[i];
+  return occluded_count;
+}
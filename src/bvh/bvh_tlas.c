@@ -0,0 +1,395 @@
+// bvh_tlas.c
+// Top level: a binary bvh_node_t tree over instance bounds, whose leaves
+// hand the ray, moved into object space, to the instances' BLASes.
+#include "bvh/bvh_tlas.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bvh/bvh_build.h"
+
+// Instances per top-level leaf
+#define TLAS_LEAF_SIZE 2
+
+// Top-level depth limit, within the traversal stack below
+#define TLAS_MAX_DEPTH 48
+#define TLAS_STACK_SIZE 64
+
+typedef struct {
+  bvh_instance_t inst;
+  bvh_xform_t    inv;      // world to object
+  bool           identity; // rays are used as they are
+  float          scale;    // largest stretch of the transform
+  wf_vec3        bbox_min; // world-space bounds
+  wf_vec3        bbox_max;
+  wf_vec3        centroid;
+} tlas_inst_t;
+
+struct bvh_tlas_s {
+  tlas_inst_t*     instances;
+  size_t           instance_count;
+  uint32_t*        order; // leaf ranges index into this array
+  bvh_node_array_t nodes; // root at node 0, empty without instances
+};
+
+void bvh_xform_identity(bvh_xform_t* xform) {
+  memset(xform, 0, sizeof(*xform));
+  xform->m[0][0] = 1.0f;
+  xform->m[1][1] = 1.0f;
+  xform->m[2][2] = 1.0f;
+}
+
+static bool xform_is_identity(const bvh_xform_t* xform) {
+  bvh_xform_t id;
+  bvh_xform_identity(&id);
+  return memcmp(xform, &id, sizeof(id)) == 0;
+}
+
+static wf_vec3 xform_point(const bvh_xform_t* x, const wf_vec3* p) {
+  return (wf_vec3){
+    x->m[0][0] * p->x + x->m[0][1] * p->y + x->m[0][2] * p->z + x->m[0][3],
+    x->m[1][0] * p->x + x->m[1][1] * p->y + x->m[1][2] * p->z + x->m[1][3],
+    x->m[2][0] * p->x + x->m[2][1] * p->y + x->m[2][2] * p->z + x->m[2][3]
+  };
+}
+
+static wf_vec3 xform_vector(const bvh_xform_t* x, const wf_vec3* v) {
+  return (wf_vec3){ x->m[0][0] * v->x + x->m[0][1] * v->y + x->m[0][2] * v->z,
+                    x->m[1][0] * v->x + x->m[1][1] * v->y + x->m[1][2] * v->z,
+                    x->m[2][0] * v->x + x->m[2][1] * v->y
+                        + x->m[2][2] * v->z };
+}
+
+// Inverse of an affine transform, false if it is singular
+static bool xform_invert(const bvh_xform_t* x, bvh_xform_t* inv) {
+  const float(*m)[4] = x->m;
+  float c00          = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+  float c01          = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+  float c02          = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+  float det          = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+  if (fabsf(det) < 1e-20f)
+    return false;
+  float r = 1.0f / det;
+
+  inv->m[0][0] = c00 * r;
+  inv->m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * r;
+  inv->m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * r;
+  inv->m[1][0] = c01 * r;
+  inv->m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * r;
+  inv->m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * r;
+  inv->m[2][0] = c02 * r;
+  inv->m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * r;
+  inv->m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * r;
+
+  wf_vec3 t    = { m[0][3], m[1][3], m[2][3] };
+  wf_vec3 it   = xform_vector(inv, &t);
+  inv->m[0][3] = -it.x;
+  inv->m[1][3] = -it.y;
+  inv->m[2][3] = -it.z;
+  return true;
+}
+
+static bool tlas_inst_init(tlas_inst_t* ti, const bvh_instance_t* inst) {
+  ti->inst     = *inst;
+  ti->identity = xform_is_identity(&inst->xform);
+  if (!xform_invert(&inst->xform, &ti->inv))
+    return false;
+
+  // About the most the transform stretches a length by, so cone widths
+  // divided by it are not overestimated in object space
+  const float(*m)[4] = inst->xform.m;
+  ti->scale          = 0.0f;
+  for (int c = 0; c < 3; ++c) {
+    wf_vec3 axis = { m[0][c], m[1][c], m[2][c] };
+    ti->scale    = bvh_maxf(ti->scale, v3_length(axis));
+  }
+
+  // World bounds: the transformed corners of the BLAS bounds
+  const bvh_tree_t* blas  = inst->blas;
+  bool              empty = !blas || blas->bbox_min.x > blas->bbox_max.x;
+  bvh_bbox_empty(&ti->bbox_min, &ti->bbox_max);
+  for (int c = 0; !empty && c < 8; ++c) {
+    wf_vec3 p = { c & 1 ? blas->bbox_max.x : blas->bbox_min.x,
+                  c & 2 ? blas->bbox_max.y : blas->bbox_min.y,
+                  c & 4 ? blas->bbox_max.z : blas->bbox_min.z };
+    p         = xform_point(&inst->xform, &p);
+    bvh_bbox_expand(&ti->bbox_min, &ti->bbox_max, &p, &p);
+  }
+  ti->centroid = (wf_vec3){ 0.5f * (ti->bbox_min.x + ti->bbox_max.x),
+                            0.5f * (ti->bbox_min.y + ti->bbox_max.y),
+                            0.5f * (ti->bbox_min.z + ti->bbox_max.z) };
+  return true;
+}
+
+static inline float centroid_of(const bvh_tlas_t* tlas, uint32_t i,
+                                 int axis) {
+  return (&tlas->instances[i].centroid.x)[axis];
+}
+
+// Quickselect: order[start, end) is rearranged so that order[mid] holds the
+// median centroid on the axis, with no larger one before it
+static void select_median(bvh_tlas_t* tlas, ptrdiff_t lo, ptrdiff_t hi,
+                          ptrdiff_t mid, int axis) {
+  uint32_t* order = tlas->order;
+  while (hi - lo > 1) {
+    float     pivot = centroid_of(tlas, order[lo + (hi - lo) / 2], axis);
+    ptrdiff_t i = lo, j = hi - 1;
+    while (i <= j) {
+      while (centroid_of(tlas, order[i], axis) < pivot)
+        ++i;
+      while (centroid_of(tlas, order[j], axis) > pivot)
+        --j;
+      if (i <= j) {
+        uint32_t tmp = order[i];
+        order[i++]   = order[j];
+        order[j--]   = tmp;
+      }
+    }
+    // Now [lo, j] <= pivot <= [i, hi), anything in between equals it
+    if (mid <= j)
+      hi = j + 1;
+    else if (mid >= i)
+      lo = i;
+    else
+      return;
+  }
+}
+
+// Median split on the widest centroid axis
+static uint32_t build_node(bvh_tlas_t* tlas, size_t start, size_t end,
+                           int depth) {
+  uint32_t idx = bvh_node_array_alloc(&tlas->nodes);
+
+  wf_vec3 bmin, bmax, cmin, cmax;
+  bvh_bbox_empty(&bmin, &bmax);
+  bvh_bbox_empty(&cmin, &cmax);
+  for (size_t i = start; i < end; ++i) {
+    const tlas_inst_t* ti = &tlas->instances[tlas->order[i]];
+    bvh_bbox_expand(&bmin, &bmax, &ti->bbox_min, &ti->bbox_max);
+    bvh_bbox_expand(&cmin, &cmax, &ti->centroid, &ti->centroid);
+  }
+
+  if (end - start <= TLAS_LEAF_SIZE || depth >= TLAS_MAX_DEPTH) {
+    bvh_node_t* node = &tlas->nodes.nodes[idx];
+    node->is_leaf    = true;
+    node->leaf.start = (uint32_t)start;
+    node->leaf.count = (uint32_t)(end - start);
+    node->bbox_min   = bmin;
+    node->bbox_max   = bmax;
+    return idx;
+  }
+
+  wf_vec3 extent = { cmax.x - cmin.x, cmax.y - cmin.y, cmax.z - cmin.z };
+  int     axis   = extent.x >= extent.y && extent.x >= extent.z ? 0
+                   : extent.y >= extent.z                     ? 1
+                                                              : 2;
+  size_t  mid    = start + (end - start) / 2;
+  select_median(tlas, (ptrdiff_t)start, (ptrdiff_t)end, (ptrdiff_t)mid, axis);
+
+  uint32_t left  = build_node(tlas, start, mid, depth + 1);
+  uint32_t right = build_node(tlas, mid, end, depth + 1);
+
+  bvh_node_t* node     = &tlas->nodes.nodes[idx];
+  node->is_leaf        = false;
+  node->internal.left  = left;
+  node->internal.right = right;
+  node->bbox_min       = bmin;
+  node->bbox_max       = bmax;
+  return idx;
+}
+
+bool bvh_tlas_update(bvh_tlas_t* tlas, const bvh_instance_t* instances,
+                     size_t count) {
+  tlas_inst_t* inst  = malloc((count ? count : 1) * sizeof(tlas_inst_t));
+  uint32_t*    order = malloc((count ? count : 1) * sizeof(uint32_t));
+  if (!inst || !order) {
+    free(inst);
+    free(order);
+    return false;
+  }
+  // A tree over count instances has at most 2 count - 1 nodes; reserving
+  // them here keeps build_node() from running out halfway
+  size_t node_cap = count ? 2 * count - 1 : 0;
+  if (node_cap > tlas->nodes.cap) {
+    bvh_node_t* nodes = realloc(tlas->nodes.nodes,
+                                node_cap * sizeof(bvh_node_t));
+    if (!nodes) {
+      free(inst);
+      free(order);
+      return false;
+    }
+    tlas->nodes.nodes = nodes;
+    tlas->nodes.cap   = node_cap;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    if (!tlas_inst_init(&inst[i], &instances[i])) {
+      free(inst);
+      free(order);
+      return false;
+    }
+    order[i] = (uint32_t)i;
+  }
+
+  free(tlas->instances);
+  free(tlas->order);
+  tlas->instances      = inst;
+  tlas->instance_count = count;
+  tlas->order          = order;
+  tlas->nodes.count    = 0; // the node array is reused
+  if (count > 0)
+    build_node(tlas, 0, count, 0);
+  return true;
+}
+
+bvh_tlas_t* bvh_tlas_create(const bvh_instance_t* instances, size_t count) {
+  bvh_tlas_t* tlas = calloc(1, sizeof(bvh_tlas_t));
+  if (!tlas)
+    return NULL;
+  if (!bvh_tlas_update(tlas, instances, count)) {
+    free(tlas);
+    return NULL;
+  }
+  return tlas;
+}
+
+void bvh_tlas_destroy(bvh_tlas_t* tlas) {
+  if (tlas) {
+    free(tlas->instances);
+    free(tlas->order);
+    free(tlas->nodes.nodes);
+    free(tlas);
+  }
+}
+
+const bvh_instance_t* bvh_tlas_instance(const bvh_tlas_t* tlas,
+                                        uint32_t          instance) {
+  return &tlas->instances[instance].inst;
+}
+
+// The ray in the instance's object space. The direction is not normalized,
+// so distances along it are the same as in world space.
+static inline const ray_t* object_ray(const tlas_inst_t* ti, const ray_t* ray,
+                                      ray_t* local) {
+  if (ti->identity)
+    return ray;
+  *local           = *ray;
+  local->origin    = xform_point(&ti->inv, &ray->origin);
+  local->direction = xform_vector(&ti->inv, &ray->direction);
+  return local;
+}
+
+// The LOD level of the instance for the ray's cone where it enters the
+// instance's bounds; false if the ray misses them
+static inline bool instance_level(const tlas_inst_t*    ti,
+                                  const bvh_ray_prep_t* prep, const ray_t* ray,
+                                  float t_min, float t_max, uint32_t* level) {
+  *level = 0;
+  if (!ti->inst.lod || (ray->cone_width <= 0.0f && ray->cone_spread <= 0.0f))
+    return true;
+  float t_enter;
+  if (!bvh_ray_prep_slab(prep, &ti->bbox_min.x, &ti->bbox_max.x, t_min,
+                         t_max, &t_enter))
+    return false;
+  float width = ray->cone_width + ray->cone_spread * t_enter;
+  *level      = bvh_lod_select(ti->inst.lod, width / ti->scale);
+  return true;
+}
+
+static bool tlas_traverse(const bvh_tlas_t* tlas, const ray_t* ray,
+                          float t_min, float t_max, bvh_tlas_hit_t* hit,
+                          bool any) {
+  if (tlas->nodes.count == 0)
+    return false;
+
+  bvh_ray_prep_t prep;
+  bvh_ray_prep_init(&prep, ray);
+
+  uint32_t stack[TLAS_STACK_SIZE];
+  uint32_t stack_ptr = 0;
+  stack[stack_ptr++] = 0;
+  bool found         = false;
+
+  while (stack_ptr > 0) {
+    const bvh_node_t* node = &tlas->nodes.nodes[stack[--stack_ptr]];
+    float             t_near;
+    if (!bvh_ray_prep_slab(&prep, &node->bbox_min.x, &node->bbox_max.x, t_min,
+                           t_max, &t_near))
+      continue;
+
+    if (!node->is_leaf) {
+      stack[stack_ptr++] = node->internal.right;
+      stack[stack_ptr++] = node->internal.left;
+      continue;
+    }
+    for (uint32_t k = node->leaf.start;
+         k < node->leaf.start + node->leaf.count; ++k) {
+      const tlas_inst_t* ti = &tlas->instances[tlas->order[k]];
+      ray_t              local;
+      const ray_t*       r = object_ray(ti, ray, &local);
+      uint32_t           level;
+      if (!instance_level(ti, &prep, ray, t_min, t_max, &level))
+        continue;
+      const bvh_tree_t* blas    = ti->inst.blas;
+      float             t_start = t_min;
+      if (level) {
+        blas    = bvh_lod_level(ti->inst.lod, level);
+        t_start = t_min + bvh_lod_error(ti->inst.lod, level) * ti->scale;
+      }
+      if (any) {
+        if (bvh_occluded(blas, r, t_start, t_max))
+          return true;
+        continue;
+      }
+      bvh_hit_t h;
+      if (bvh_intersect_closest(blas, r, t_start, t_max, &h)) {
+        t_max         = h.t; // later instances must be closer
+        hit->hit      = h;
+        hit->instance = tlas->order[k];
+        hit->lod      = level;
+        found         = true;
+      }
+    }
+  }
+  return found;
+}
+
+bool bvh_tlas_intersect_closest(const bvh_tlas_t* tlas, const ray_t* ray,
+                                float t_min, float t_max,
+                                bvh_tlas_hit_t* hit) {
+  bvh_tlas_hit_t best;
+  if (!tlas || !tlas_traverse(tlas, ray, t_min, t_max, &best, false))
+    return false;
+  if (hit)
+    *hit = best;
+  return true;
+}
+
+bool bvh_tlas_occluded(const bvh_tlas_t* tlas, const ray_t* ray, float t_min,
+                       float t_max) {
+  return tlas && tlas_traverse(tlas, ray, t_min, t_max, NULL, true);
+}
+
+const bvh_tree_t* bvh_tlas_hit_blas(const bvh_tlas_t*     tlas,
+                                    const bvh_tlas_hit_t* hit) {
+  const bvh_instance_t* inst = &tlas->instances[hit->instance].inst;
+  return hit->lod ? bvh_lod_level(inst->lod, hit->lod) : inst->blas;
+}
+
+wf_vec3 bvh_tlas_normal_to_world(const bvh_tlas_t* tlas, uint32_t instance,
+                                 wf_vec3 normal) {
+  const tlas_inst_t* ti = &tlas->instances[instance];
+  if (ti->identity)
+    return normal;
+  // Normals transform with the inverse transpose
+  const float(*m)[4] = ti->inv.m;
+  return (wf_vec3){
+    m[0][0] * normal.x + m[1][0] * normal.y + m[2][0] * normal.z,
+    m[0][1] * normal.x + m[1][1] * normal.y + m[2][1] * normal.z,
+    m[0][2] * normal.x + m[1][2] * normal.y + m[2][2] * normal.z
+  };
+}
+
+wf_vec3 bvh_tlas_point_to_object(const bvh_tlas_t* tlas, uint32_t instance,
+                                 wf_vec3 point) {
+  const tlas_inst_t* ti = &tlas->instances[instance];
+  return ti->identity ? point : xform_point(&ti->inv, &point);
+}
@@ -0,0 +1,112 @@
+// bvh_tri.c
+#include "bvh/bvh_tri.h"
+#include <stdlib.h>
+#include <string.h>
+#include "parallel.h"
+
+#define BVH_TRI_ALIGN 32
+
+// Sorted position k from a shape, in the lane layout of bvh_tri.h
+static void fill_shape(bvh_tri_buffer_t* tris, size_t k,
+                       const bvh_shape_t* shape) {
+  bvh_tri_block_t* b     = &tris->blocks[k / BVH_TRI_BLOCK];
+  uint32_t         l     = (uint32_t)(k % BVH_TRI_BLOCK);
+  bool             round = shape->type != BVH_SHAPE_QUAD;
+  b->v0[0][l]            = shape->origin.x;
+  b->v0[1][l]            = shape->origin.y;
+  b->v0[2][l]            = shape->origin.z;
+  b->e1[0][l]            = shape->edge1.x;
+  b->e1[1][l]            = shape->edge1.y;
+  b->e1[2][l]            = shape->edge1.z;
+  b->e2[0][l]            = round ? shape->radius : shape->edge2.x;
+  b->e2[1][l]            = round ? 0.0f : shape->edge2.y;
+  b->e2[2][l]            = round ? 0.0f : shape->edge2.z;
+
+  tris->types[k / BVH_TRI_BLOCK][l] = (uint8_t)shape->type;
+  tris->corners[k][0]               = shape->corner[0];
+  tris->corners[k][1]               = shape->corner[1];
+}
+
+static void fill_blocks(void* arg, size_t begin, size_t end) {
+  bvh_tree_t* tree = (bvh_tree_t*)arg;
+  for (size_t k = begin; k < end; ++k) {
+    uint32_t           f     = tree->face_indices[k];
+    const bvh_shape_t* shape = bvh_shape_of(tree->shapes, f);
+    if (shape) {
+      fill_shape(tree->tris, k, shape);
+      continue;
+    }
+
+    bvh_tri_block_t* b    = &tree->tris->blocks[k / BVH_TRI_BLOCK];
+    uint32_t         l    = (uint32_t)(k % BVH_TRI_BLOCK);
+    const wf_face*   face = &tree->faces[f];
+    const wf_vec3*   v0   = &tree->scene->vertices[face->vertices[0].v_idx];
+    const wf_vec3*   v1   = &tree->scene->vertices[face->vertices[1].v_idx];
+    const wf_vec3*   v2   = &tree->scene->vertices[face->vertices[2].v_idx];
+    b->v0[0][l]           = v0->x;
+    b->v0[1][l]           = v0->y;
+    b->v0[2][l]           = v0->z;
+    b->e1[0][l]           = v1->x - v0->x;
+    b->e1[1][l]           = v1->y - v0->y;
+    b->e1[2][l]           = v1->z - v0->z;
+    b->e2[0][l]           = v2->x - v0->x;
+    b->e2[1][l]           = v2->y - v0->y;
+    b->e2[2][l]           = v2->z - v0->z;
+    if (tree->tris->types)
+      tree->tris->types[k / BVH_TRI_BLOCK][l] = BVH_SHAPE_TRIANGLE;
+  }
+}
+
+bool bvh_tri_buffer_init(bvh_tree_t* tree, unsigned threads) {
+  bvh_tri_buffer_t* tris = calloc(1, sizeof(bvh_tri_buffer_t));
+  if (!tris)
+    return false;
+  tris->block_count = (tree->index_count + BVH_TRI_BLOCK - 1) / BVH_TRI_BLOCK;
+  if (tris->block_count == 0) {
+    tree->tris = tris; // no faces, nothing to lay out
+    return true;
+  }
+
+  size_t bytes = tris->block_count * sizeof(bvh_tri_block_t);
+  void*  mem   = NULL;
+  if (posix_memalign(&mem, BVH_TRI_ALIGN, bytes)) {
+    free(tris);
+    return false;
+  }
+  tris->blocks = mem;
+  // Padding lanes stay zero: degenerate triangles that are never hit
+  memset(&tris->blocks[tris->block_count - 1], 0, sizeof(bvh_tri_block_t));
+
+  if (tree->shapes) {
+    tris->types   = calloc(tris->block_count, sizeof(*tris->types));
+    tris->corners = malloc(tree->index_count * sizeof(*tris->corners));
+    if (!tris->types || !tris->corners) {
+      tree->tris = tris;
+      bvh_tri_buffer_free(tree);
+      return false;
+    }
+  }
+
+  tree->tris = tris;
+  bvh_tri_buffer_fill(tree, threads);
+  return true;
+}
+
+void bvh_tri_buffer_fill(bvh_tree_t* tree, unsigned threads) {
+  parallel_for(threads, tree->index_count, 4096, fill_blocks, tree);
+}
+
+void bvh_tri_buffer_fill_range(const bvh_tree_t* tree, size_t begin,
+                               size_t end) {
+  fill_blocks((void*)tree, begin, end);
+}
+
+void bvh_tri_buffer_free(bvh_tree_t* tree) {
+  if (tree->tris) {
+    free(tree->tris->blocks);
+    free(tree->tris->types);
+    free(tree->tris->corners);
+    free(tree->tris);
+    tree->tris = NULL;
+  }
+}
@@ -0,0 +1,204 @@
+// bvh_util.c
+#include "bvh/bvh_util.h"
+#include <stdlib.h>
+#include "algo.h"
+#include "parallel.h"
+
+// Compute bounding box of a single face
+void bvh_face_bbox(const wf_face* face, const bvh_shape_t* shape,
+                   const wf_scene_t* scene, wf_vec3* bbox_min,
+                   wf_vec3* bbox_max) {
+  if (shape) {
+    bvh_shape_bbox(shape, bbox_min, bbox_max);
+    return;
+  }
+  wf_vec3 min = { FLT_MAX, FLT_MAX, FLT_MAX };
+  wf_vec3 max = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+  for (int i = 0; i < 3; ++i) {
+    const wf_vec3* v = &scene->vertices[face->vertices[i].v_idx];
+    min.x            = bvh_minf(min.x, v->x);
+    min.y            = bvh_minf(min.y, v->y);
+    min.z            = bvh_minf(min.z, v->z);
+    max.x            = bvh_maxf(max.x, v->x);
+    max.y            = bvh_maxf(max.y, v->y);
+    max.z            = bvh_maxf(max.z, v->z);
+  }
+  *bbox_min = min;
+  *bbox_max = max;
+}
+
+// Compute centroid of a face
+wf_vec3 bvh_face_centroid(const wf_face* face, const bvh_shape_t* shape,
+                          const wf_scene_t* scene) {
+  if (shape)
+    return bvh_shape_centroid(shape);
+  wf_vec3 c = v3_zero();
+  for (int i = 0; i < 3; ++i) {
+    c = v3_add(c, scene->vertices[face->vertices[i].v_idx]);
+  }
+  return v3_scale(1.0f / 3.0f, c);
+}
+
+typedef struct {
+  bvh_prim_info_t*   info;
+  const wf_face*     faces;
+  const bvh_shape_t* shapes;
+  const wf_scene_t*  scene;
+} prim_info_job_t;
+
+static void prim_info_range(void* arg, size_t begin, size_t end) {
+  prim_info_job_t* job = (prim_info_job_t*)arg;
+  for (size_t i = begin; i < end; ++i) {
+    const bvh_shape_t* shape = bvh_shape_of(job->shapes, i);
+    job->info->centroids[i] =
+        bvh_face_centroid(&job->faces[i], shape, job->scene);
+    bvh_face_bbox(&job->faces[i], shape, job->scene, &job->info->face_min[i],
+                  &job->info->face_max[i]);
+  }
+}
+
+bool bvh_prim_info_init(bvh_prim_info_t* info, const wf_face* faces,
+                        const bvh_shape_t* shapes, size_t face_count,
+                        const wf_scene_t* scene, unsigned threads) {
+  info->count     = face_count;
+  info->centroids = malloc(face_count * sizeof(wf_vec3));
+  info->face_min  = malloc(face_count * sizeof(wf_vec3));
+  info->face_max  = malloc(face_count * sizeof(wf_vec3));
+  if (!info->centroids || !info->face_min || !info->face_max) {
+    bvh_prim_info_free(info);
+    return false;
+  }
+
+  prim_info_job_t job = { .info   = info,
+                          .faces  = faces,
+                          .shapes = shapes,
+                          .scene  = scene };
+  parallel_for(threads, face_count, 4096, prim_info_range, &job);
+  return true;
+}
+
+void bvh_prim_info_free(bvh_prim_info_t* info) {
+  free(info->centroids);
+  free(info->face_min);
+  free(info->face_max);
+  info->centroids = NULL;
+  info->face_min  = NULL;
+  info->face_max  = NULL;
+}
+
+// Traversal stack entries; deeper trees fall back to recursion
+#define BINARY_STACK_SIZE 64
+
+// Closest-hit or, with `any` (a constant in each caller), any-hit traversal
+// of the subtree at `root`, entered at root_t_near. Children are slab-tested
+// when their parent is expanded and visited nearest first, and nodes entered
+// beyond the best hit so far are skipped. A child that finds the stack full
+// is traversed by a recursive call instead of being dropped. Returns true if
+// best improved or, for `any`, on the first hit.
+static inline bool binary_traverse(const bvh_tree_t*     tree,
+                                   const bvh_ray_prep_t* r, const ray_t* ray,
+                                   uint32_t root, float root_t_near,
+                                   float t_min, bvh_hit_t* best,
+                                   const bool any) {
+  const bvh_node_t* nodes = tree->nodes;
+  struct {
+    uint32_t node;
+    float    t_near;
+  } stack[BINARY_STACK_SIZE];
+  uint32_t stack_ptr        = 0;
+  bool     found            = false;
+  stack[stack_ptr].node     = root;
+  stack[stack_ptr++].t_near = root_t_near;
+
+  while (stack_ptr > 0) {
+    --stack_ptr;
+    if (stack[stack_ptr].t_near >= best->t)
+      continue; // a closer hit was found after this node was pushed
+    const bvh_node_t* node = &nodes[stack[stack_ptr].node];
+    if (node->is_leaf) {
+      if (any && bvh_leaf_occluded(tree, node->leaf.start, node->leaf.count,
+                                   ray, t_min, best->t))
+        return true; // any blocker will do
+      if (!any)
+        found |= bvh_leaf_intersect(tree, node->leaf.start, node->leaf.count,
+                                    ray, t_min, best);
+      continue;
+    }
+
+    uint32_t child[2] = { node->internal.left, node->internal.right };
+    float    t[2];
+    bool     hit_child[2];
+    for (int k = 0; k < 2; ++k) {
+      hit_child[k] = bvh_ray_prep_slab(r, &nodes[child[k]].bbox_min.x,
+                                       &nodes[child[k]].bbox_max.x, t_min,
+                                       best->t, &t[k]);
+    }
+
+    // Push the farther child first so the nearer one is visited first
+    int near     = hit_child[1] && (!hit_child[0] || t[1] < t[0]);
+    int order[2] = { 1 - near, near };
+    for (int k = 0; k < 2; ++k) {
+      int c = order[k];
+      if (!hit_child[c])
+        continue;
+      if (stack_ptr < BINARY_STACK_SIZE) {
+        stack[stack_ptr].node     = child[c];
+        stack[stack_ptr++].t_near = t[c];
+      } else if (binary_traverse(tree, r, ray, child[c], t[c], t_min, best,
+                                 any)) {
+        if (any)
+          return true;
+        found = true;
+      }
+    }
+  }
+  return found;
+}
+
+bool bvh_binary_subtree(const bvh_tree_t* tree, const ray_t* ray,
+                        uint32_t root, float t_min, bvh_hit_t* best,
+                        bool any) {
+  bvh_ray_prep_t r;
+  float          t_near;
+  bvh_ray_prep_init(&r, ray);
+  if (!bvh_ray_prep_slab(&r, &tree->nodes[root].bbox_min.x,
+                         &tree->nodes[root].bbox_max.x, t_min, best->t,
+                         &t_near))
+    return false;
+  if (any)
+    return binary_traverse(tree, &r, ray, root, t_near, t_min, best, true);
+  return binary_traverse(tree, &r, ray, root, t_near, t_min, best, false);
+}
+
+bool bvh_binary_intersect_closest(const bvh_tree_t* tree, const ray_t* ray,
+                                  float t_min, float t_max, bvh_hit_t* hit) {
+  if (!tree || tree->node_count == 0)
+    return false;
+
+  bvh_hit_t best = { .t = t_max };
+  if (!bvh_binary_subtree(tree, ray, 0, t_min, &best, false))
+    return false;
+  if (hit) {
+    bvh_hit_resolve(tree, &best);
+    *hit = best;
+  }
+  return true;
+}
+
+bool bvh_binary_intersect_any(const bvh_tree_t* tree, const ray_t* ray,
+                              float t_min, float t_max) {
+  if (!tree || tree->node_count == 0)
+    return false;
+
+  bvh_hit_t best = { .t = t_max };
+  return bvh_binary_subtree(tree, ray, 0, t_min, &best, true);
+}
+
+void bvh_binary_destroy(bvh_tree_t* tree) {
+  if (tree) {
+    free(tree->nodes);
+    free(tree->face_indices);
+    free(tree);
+  }
+}
@@ -58,6 +58,49 @@ wf_vec3 camera_get_ray_direction(const camera_t* cam, float u, float v) {
   return cam->ops->get_ray_direction(cam->priv, u, v);
 }
 
+bool camera_prepare(camera_t* cam, int width, int height) {
+  if (width <= 0 || height <= 0)
+    return false;
+  if (!cam->ops->prepare)
+    return true;
+  if (!cam->ops->prepare(cam->priv, width, height)) {
+    log_error("no direction table for [%s], computing directions",
+              cam->ops->name);
+    return false;
+  }
+  return true;
+}
+
+void camera_generate_rays(const camera_t* cam, const camera_sample_t* samples,
+                          size_t count, const camera_rays_t* out) {
+  if (cam->ops->generate_rays) {
+    cam->ops->generate_rays(cam->priv, cam->position, samples, count, out);
+    return;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    wf_vec3 d =
+        cam->ops->get_ray_direction(cam->priv, samples[i].u, samples[i].v);
+    camera_rays_store(out, i, cam->position, d);
+  }
+}
+
+wf_vec3* camera_direction_table(const void* priv,
+                                wf_vec3 (*direction)(const void* priv, float u,
+                                                     float v),
+                                int width, int height) {
+  size_t   cols  = (size_t)width + 1;
+  wf_vec3* table = malloc(cols * ((size_t)height + 1) * sizeof(wf_vec3));
+  if (!table)
+    return NULL;
+  for (int y = 0; y <= height; ++y) {
+    for (int x = 0; x <= width; ++x) {
+      table[(size_t)y * cols + x] =
+          direction(priv, (float)x / (float)width, (float)y / (float)height);
+    }
+  }
+  return table;
+}
+
 void camera_destroy(camera_t* cam) {
   if (cam) {
     if (cam->ops && cam->ops->exit)
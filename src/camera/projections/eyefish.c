@@ -6,6 +6,8 @@ typedef struct {
   wf_vec3 forward, up, right;
   float fov_radius; // Maximum viewing angle radius (in radians), typically π/2
                     // or π
+  wf_vec3* table; // directions at pixel corners, NULL until prepared
+  int table_width, table_height;
 } fisheye_priv_t;
 
 typedef struct {
@@ -61,7 +63,35 @@ static wf_vec3 fisheye_get_ray_direction(const void* priv, float u, float v) {
   return v3_normalize(world_dir);
 }
 
+static bool fisheye_prepare(void* priv, int width, int height) {
+  fisheye_priv_t* p = (fisheye_priv_t*)priv;
+  wf_vec3*        table =
+      camera_direction_table(p, fisheye_get_ray_direction, width, height);
+  if (!table)
+    return false;
+  free(p->table);
+  p->table        = table;
+  p->table_width  = width;
+  p->table_height = height;
+  return true;
+}
+
+static void fisheye_generate_rays(const void* priv, wf_vec3 pos,
+                                  const camera_sample_t* samples, size_t count,
+                                  const camera_rays_t* out) {
+  const fisheye_priv_t* p = (const fisheye_priv_t*)priv;
+  for (size_t i = 0; i < count; ++i) {
+    float   u = samples[i].u;
+    float   v = samples[i].v;
+    wf_vec3 d = p->table ? camera_table_lookup(p->table, p->table_width,
+                                               p->table_height, u, v)
+                         : fisheye_get_ray_direction(p, u, v);
+    camera_rays_store(out, i, pos, d);
+  }
+}
+
 static void fisheye_exit(void* priv) {
+  free(((fisheye_priv_t*)priv)->table);
   free(priv);
 }
 
@@ -70,6 +100,8 @@ static struct camera_projection_ops fisheye_ops = {
   .name              = "fisheye",
   .init              = fisheye_init,
   .get_ray_direction = fisheye_get_ray_direction,
+  .generate_rays     = fisheye_generate_rays,
+  .prepare           = fisheye_prepare,
   .exit              = fisheye_exit,
 };
 
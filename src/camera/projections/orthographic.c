@@ -37,6 +37,20 @@ static wf_vec3 ortho_get_ray_direction(const void* priv, float u, float v) {
   return p->forward; // Direction remains constant
 }
 
+// The rays leave the image plane through the camera position
+static void ortho_generate_rays(const void* priv, wf_vec3 pos,
+                                const camera_sample_t* samples, size_t count,
+                                const camera_rays_t* out) {
+  const ortho_priv_t* p = (const ortho_priv_t*)priv;
+  for (size_t i = 0; i < count; ++i) {
+    float   x      = (2.0f * samples[i].u - 1.0f) * p->half_width;
+    float   y      = (1.0f - 2.0f * samples[i].v) * p->half_height;
+    wf_vec3 origin = v3_add(pos, v3_add(v3_scale(x, p->right),
+                                        v3_scale(-y, p->up)));
+    camera_rays_store(out, i, origin, p->forward);
+  }
+}
+
 static void ortho_exit(void* priv) {
   free(priv);
 }
@@ -46,6 +60,7 @@ static struct camera_projection_ops ortho_ops = {
   .name              = "orthographic",
   .init              = ortho_init,
   .get_ray_direction = ortho_get_ray_direction,
+  .generate_rays     = ortho_generate_rays,
   .exit              = ortho_exit,
 };
 
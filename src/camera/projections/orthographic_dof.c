@@ -3,40 +3,16 @@
 #include <stdlib.h>
 #include "camera/camera_ops.h"
 
-// Reuse RNG utilities (you can move these to a shared utils file)
-static inline uint32_t xorshift32(uint32_t* state) {
-  uint32_t x = *state;
-  x ^= x << 13;
-  x ^= x >> 17;
-  x ^= x << 5;
-  return *state = x;
-}
-
-static inline float rand_float(uint32_t* state) {
-  return (float)(xorshift32(state) & 0xFFFFFF) / (float)0x1000000;
-}
-
-static wf_vec3 random_in_unit_disk(uint32_t* state) {
-  wf_vec3 p;
-  do {
-    p.x = 2.0f * rand_float(state) - 1.0f;
-    p.y = 2.0f * rand_float(state) - 1.0f;
-  } while (p.x * p.x + p.y * p.y >= 1.0f);
-  p.z = 0.0f;
-  return p;
-}
-
 // Private data for orthographic DoF camera
 typedef struct {
-  wf_vec3  position;
-  wf_vec3  forward;
-  wf_vec3  up;
-  wf_vec3  right;
-  float    half_width;
-  float    half_height;
-  float    aperture;
-  float    focus_distance;
-  uint32_t rng_state;
+  wf_vec3 position;
+  wf_vec3 forward;
+  wf_vec3 up;
+  wf_vec3 right;
+  float   half_width;
+  float   half_height;
+  float   aperture;
+  float   focus_distance;
 } ortho_dof_priv_t;
 
 // Initialize orthographic DoF camera
@@ -59,36 +35,55 @@ static void* ortho_dof_init(wf_vec3 pos, wf_vec3 target, wf_vec3 up,
   priv->half_height    = p->height * 0.5f;
   priv->aperture       = p->aperture;
   priv->focus_distance = p->focus_distance;
-  priv->rng_state      = 54321; // Different seed from perspective DoF
 
   return priv;
 }
 
-// Generate ray with orthographic DoF
-static wf_vec3 ortho_dof_get_ray_direction(const void* priv, float u, float v) {
-  ortho_dof_priv_t* p = (ortho_dof_priv_t*)priv;
-  p->rng_state ^= (uint32_t)((u * 10000.0f) + (v * 1000.0f));
-
+// Ray through (u, v) from lens position (lens_u, lens_v). The image point
+// is the center of a lens of its own: rays leave the lens around it and
+// meet again on the focal plane, focus_distance ahead of it.
+static wf_vec3 ortho_dof_ray(const ortho_dof_priv_t* p, float u, float v,
+                             float lens_u, float lens_v, wf_vec3* origin) {
   // Compute ray origin offset on image plane (orthographic)
   float x = (2.0f * u - 1.0f) * p->half_width;
   float y = (1.0f - 2.0f * v) * p->half_height;
 
-  wf_vec3 image_point = v3_add(v3_scale(x, p->right), v3_scale(-y, p->up));
+  wf_vec3 image_point =
+      v3_add(p->position, v3_add(v3_scale(x, p->right), v3_scale(-y, p->up)));
+  *origin = image_point;
+  if (!(p->aperture > 0.0f))
+    return p->forward;
+
+  // Apply DoF: sample lens, shift origin and aim at the focal point
+  float dx, dy;
+  camera_lens_disk(lens_u, lens_v, &dx, &dy);
+  wf_vec3 lens_offset =
+      v3_scale(0.5f * p->aperture,
+               v3_add(v3_scale(dx, p->right), v3_scale(dy, p->up)));
+  *origin = v3_add(image_point, lens_offset);
+  return v3_normalize(
+      v3_sub(v3_scale(p->focus_distance, p->forward), lens_offset));
+}
 
-  wf_vec3 ray_origin = p->position;
+// Orthographic rays are parallel through the lens center
+static wf_vec3 ortho_dof_get_ray_direction(const void* priv, float u, float v) {
+  (void)u;
+  (void)v;
+  const ortho_dof_priv_t* p = (const ortho_dof_priv_t*)priv;
+  return p->forward;
+}
 
-  // Apply DoF: sample lens and shift origin
-  if (p->aperture > 0.0f) {
-    wf_vec3 rd = random_in_unit_disk(&p->rng_state);
-    wf_vec3 lens_offset =
-        v3_scale(0.5f * p->aperture,
-                 v3_add(v3_scale(rd.x, p->right), v3_scale(rd.y, p->up)));
-    ray_origin = v3_add(p->position, lens_offset);
+static void ortho_dof_generate_rays(const void* priv, wf_vec3 pos,
+                                    const camera_sample_t* samples,
+                                    size_t count, const camera_rays_t* out) {
+  (void)pos; // rays leave from the lens around the stored position
+  const ortho_dof_priv_t* p = (const ortho_dof_priv_t*)priv;
+  for (size_t i = 0; i < count; ++i) {
+    const camera_sample_t* s = &samples[i];
+    wf_vec3                origin;
+    wf_vec3 d = ortho_dof_ray(p, s->u, s->v, s->lens_u, s->lens_v, &origin);
+    camera_rays_store(out, i, origin, d);
   }
-
-  // In orthographic DoF, ray direction is always forward
-  // The "focus" is simulated by shifting the origin, not the direction
-  return p->forward;
 }
 
 static void ortho_dof_exit(void* priv) {
@@ -100,6 +95,7 @@ static struct camera_projection_ops ortho_dof_ops = {
   .name              = "orthographic_dof",
   .init              = ortho_dof_init,
   .get_ray_direction = ortho_dof_get_ray_direction,
+  .generate_rays     = ortho_dof_generate_rays,
   .exit              = ortho_dof_exit,
 };
 
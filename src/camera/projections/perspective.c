@@ -44,6 +44,15 @@ static wf_vec3 perspective_get_ray_direction(const void* priv, float u,
   return v3_normalize(dir);
 }
 
+static void perspective_generate_rays(const void* priv, wf_vec3 pos,
+                                      const camera_sample_t* samples,
+                                      size_t count, const camera_rays_t* out) {
+  for (size_t i = 0; i < count; ++i) {
+    wf_vec3 d = perspective_get_ray_direction(priv, samples[i].u, samples[i].v);
+    camera_rays_store(out, i, pos, d);
+  }
+}
+
 static void perspective_exit(void* priv) {
   free(priv);
 }
@@ -53,6 +62,7 @@ static struct camera_projection_ops perspective_ops = {
   .name              = "perspective",
   .init              = perspective_init,
   .get_ray_direction = perspective_get_ray_direction,
+  .generate_rays     = perspective_generate_rays,
   .exit              = perspective_exit,
 };
 
@@ -3,42 +3,16 @@
 #include <stdlib.h>
 #include "camera/camera_ops.h"
 
-// Lightweight pseudo-random number generator (Xorshift32)
-static inline uint32_t xorshift32(uint32_t* state) {
-  uint32_t x = *state;
-  x ^= x << 13;
-  x ^= x >> 17;
-  x ^= x << 5;
-  return *state = x;
-}
-
-// Generate random float in [0, 1)
-static inline float rand_float(uint32_t* state) {
-  return (float)(xorshift32(state) & 0xFFFFFF) / (float)0x1000000;
-}
-
-// Uniform random point inside unit disk (rejection sampling)
-static wf_vec3 random_in_unit_disk(uint32_t* state) {
-  wf_vec3 p;
-  do {
-    p.x = 2.0f * rand_float(state) - 1.0f;
-    p.y = 2.0f * rand_float(state) - 1.0f;
-  } while (p.x * p.x + p.y * p.y >= 1.0f);
-  p.z = 0.0f;
-  return p;
-}
-
 // Private data for DoF camera
 typedef struct {
-  wf_vec3  position;
-  wf_vec3  forward;
-  wf_vec3  up;
-  wf_vec3  right;
-  float    tan_half_fov_y;
-  float    aspect_ratio;
-  float    aperture;
-  float    focus_distance;
-  uint32_t rng_state; // Per-camera RNG state
+  wf_vec3 position;
+  wf_vec3 forward;
+  wf_vec3 up;
+  wf_vec3 right;
+  float   tan_half_fov_y;
+  float   aspect_ratio;
+  float   aperture;
+  float   focus_distance;
 } dof_priv_t;
 
 // Initialize DoF camera from parameters
@@ -60,41 +34,52 @@ static void* dof_init(wf_vec3 pos, wf_vec3 target, wf_vec3 up,
   priv->tan_half_fov_y = tanf(p->fov_y_rad * 0.5f);
   priv->aperture       = p->aperture;
   priv->focus_distance = p->focus_distance;
-  priv->rng_state      = 12345; // Initial seed
 
   return priv;
 }
 
-// Generate ray direction with depth of field effect
-static wf_vec3 dof_get_ray_direction(const void* priv, float u, float v) {
-  dof_priv_t* p = (dof_priv_t*)priv;
-
-  // Perturb RNG state based on pixel coordinates for variance
-  p->rng_state ^= (uint32_t)((u * 10000.0f) + (v * 1000.0f));
-
+// Ray through (u, v) from lens position (lens_u, lens_v): from the sampled
+// point of the lens to the point of the focal plane that (u, v) sees
+static wf_vec3 dof_ray(const dof_priv_t* p, float u, float v, float lens_u,
+                       float lens_v, wf_vec3* origin) {
   // Compute ray direction through image plane at focal distance
   float x = (2.0f * u - 1.0f) * p->aspect_ratio * p->tan_half_fov_y;
   float y = (1.0f - 2.0f * v) * p->tan_half_fov_y;
 
-  wf_vec3 ray_dir_at_focus =
-      v3_add(v3_scale(x, p->right),
-             v3_add(v3_scale(-y, p->up),
-                    v3_scale(p->focus_distance, p->forward)));
-
-  wf_vec3 ray_origin = p->position;
+  wf_vec3 ray_dir_at_focus = v3_scale(
+      p->focus_distance,
+      v3_add(v3_scale(x, p->right), v3_add(v3_scale(-y, p->up), p->forward)));
 
-  // If aperture > 0, sample a random point on the lens
+  // If aperture > 0, shift the origin to the lens sample
+  wf_vec3 offset = v3_zero();
   if (p->aperture > 0.0f) {
-    wf_vec3 rd = random_in_unit_disk(&p->rng_state);
-    wf_vec3 offset =
-        v3_scale(0.5f * p->aperture,
-                 v3_add(v3_scale(rd.x, p->right), v3_scale(rd.y, p->up)));
-    ray_origin = v3_add(p->position, offset);
+    float dx, dy;
+    camera_lens_disk(lens_u, lens_v, &dx, &dy);
+    offset = v3_scale(0.5f * p->aperture,
+                      v3_add(v3_scale(dx, p->right), v3_scale(dy, p->up)));
   }
+  *origin = v3_add(p->position, offset);
 
   // Final ray direction: from sampled origin to point on focal plane
-  wf_vec3 direction = v3_sub(ray_dir_at_focus, v3_sub(ray_origin, p->position));
-  return v3_normalize(direction);
+  return v3_normalize(v3_sub(ray_dir_at_focus, offset));
+}
+
+static wf_vec3 dof_get_ray_direction(const void* priv, float u, float v) {
+  wf_vec3 origin;
+  return dof_ray((const dof_priv_t*)priv, u, v, 0.5f, 0.5f, &origin);
+}
+
+static void dof_generate_rays(const void* priv, wf_vec3 pos,
+                              const camera_sample_t* samples, size_t count,
+                              const camera_rays_t* out) {
+  (void)pos; // rays leave from the lens around the stored position
+  const dof_priv_t* p = (const dof_priv_t*)priv;
+  for (size_t i = 0; i < count; ++i) {
+    const camera_sample_t* s = &samples[i];
+    wf_vec3                origin;
+    wf_vec3 d = dof_ray(p, s->u, s->v, s->lens_u, s->lens_v, &origin);
+    camera_rays_store(out, i, origin, d);
+  }
 }
 
 // Cleanup private data
@@ -108,6 +93,7 @@ static struct camera_projection_ops dof_ops = {
   .name              = "perspective_dof",
   .init              = dof_init,
   .get_ray_direction = dof_get_ray_direction,
+  .generate_rays     = dof_generate_rays,
   .exit              = dof_exit,
 };
 
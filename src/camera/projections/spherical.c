@@ -3,7 +3,9 @@
 #include "camera/camera_ops.h"
 
 typedef struct {
-  wf_vec3 forward, up, right;
+  wf_vec3  forward, up, right;
+  wf_vec3* table; // directions at pixel corners, NULL until prepared
+  int      table_width, table_height;
 } spherical_priv_t;
 
 // spherical camera doesn't need extra parameter
@@ -38,7 +40,35 @@ static wf_vec3 spherical_get_ray_direction(const void* priv, float u, float v) {
   return v3_normalize(world_dir);
 }
 
+static bool spherical_prepare(void* priv, int width, int height) {
+  spherical_priv_t* p = (spherical_priv_t*)priv;
+  wf_vec3*          table =
+      camera_direction_table(p, spherical_get_ray_direction, width, height);
+  if (!table)
+    return false;
+  free(p->table);
+  p->table        = table;
+  p->table_width  = width;
+  p->table_height = height;
+  return true;
+}
+
+static void spherical_generate_rays(const void* priv, wf_vec3 pos,
+                                    const camera_sample_t* samples,
+                                    size_t count, const camera_rays_t* out) {
+  const spherical_priv_t* p = (const spherical_priv_t*)priv;
+  for (size_t i = 0; i < count; ++i) {
+    float   u = samples[i].u;
+    float   v = samples[i].v;
+    wf_vec3 d = p->table ? camera_table_lookup(p->table, p->table_width,
+                                               p->table_height, u, v)
+                         : spherical_get_ray_direction(p, u, v);
+    camera_rays_store(out, i, pos, d);
+  }
+}
+
 static void spherical_exit(void* priv) {
+  free(((spherical_priv_t*)priv)->table);
   free(priv);
 }
 
@@ -47,6 +77,8 @@ static struct camera_projection_ops spherical_ops = {
   .name              = "spherical",
   .init              = spherical_init,
   .get_ray_direction = spherical_get_ray_direction,
+  .generate_rays     = spherical_generate_rays,
+  .prepare           = spherical_prepare,
   .exit              = spherical_exit,
 };
 
@@ -0,0 +1,475 @@
+// parallel.c
+#include "parallel.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+  parallel_fn fn;
+  void*       arg;
+  unsigned    worker;
+  unsigned    worker_count;
+} worker_arg_t;
+
+static void* worker_main(void* p) {
+  worker_arg_t* w = (worker_arg_t*)p;
+  w->fn(w->arg, w->worker, w->worker_count);
+  return NULL;
+}
+
+unsigned parallel_cpu_count(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (unsigned)n : 1;
+}
+
+void parallel_run(unsigned workers, parallel_fn fn, void* arg) {
+  if (workers <= 1) {
+    fn(arg, 0, 1);
+    return;
+  }
+
+  pthread_t*    threads = malloc(workers * sizeof(pthread_t));
+  worker_arg_t* args    = malloc(workers * sizeof(worker_arg_t));
+  bool*         spawned = calloc(workers, sizeof(bool));
+  if (!threads || !args || !spawned) {
+    free(threads);
+    free(args);
+    free(spawned);
+    for (unsigned w = 0; w < workers; ++w)
+      fn(arg, w, workers);
+    return;
+  }
+
+  for (unsigned w = 0; w < workers; ++w) {
+    args[w] = (worker_arg_t){
+      .fn = fn, .arg = arg, .worker = w, .worker_count = workers
+    };
+  }
+  for (unsigned w = 1; w < workers; ++w) {
+    spawned[w] =
+        pthread_create(&threads[w], NULL, worker_main, &args[w]) == 0;
+  }
+
+  fn(arg, 0, workers);
+  for (unsigned w = 1; w < workers; ++w) {
+    if (spawned[w])
+      pthread_join(threads[w], NULL);
+    else
+      fn(arg, w, workers);
+  }
+
+  free(threads);
+  free(args);
+  free(spawned);
+}
+
+typedef struct {
+  parallel_range_fn fn;
+  void*             arg;
+  size_t            count;
+  size_t            grain;
+  size_t            next; // next unclaimed item, advanced atomically
+} for_ctx_t;
+
+static void for_worker(void* p, unsigned worker, unsigned worker_count) {
+  (void)worker;
+  (void)worker_count;
+  for_ctx_t* ctx = (for_ctx_t*)p;
+  for (;;) {
+    size_t begin = __atomic_fetch_add(&ctx->next, ctx->grain, __ATOMIC_RELAXED);
+    if (begin >= ctx->count)
+      break;
+    size_t end = begin + ctx->grain;
+    ctx->fn(ctx->arg, begin, end < ctx->count ? end : ctx->count);
+  }
+}
+
+void parallel_for(unsigned workers, size_t count, size_t grain,
+                  parallel_range_fn fn, void* arg) {
+  if (count == 0)
+    return;
+  if (grain == 0)
+    grain = 1;
+  if (workers <= 1 || count <= grain) {
+    fn(arg, 0, count);
+    return;
+  }
+
+  size_t chunks = (count + grain - 1) / grain;
+  if (workers > chunks)
+    workers = (unsigned)chunks;
+
+  for_ctx_t ctx = {
+    .fn = fn, .arg = arg, .count = count, .grain = grain, .next = 0
+  };
+  parallel_run(workers, for_worker, &ctx);
+}
+
+// A deque is the range [front, back) of task indices packed into one word,
+// so the owner's pop and a thief's steal are each a single CAS. Padded to
+// a cache line so workers do not share one.
+typedef struct {
+  uint64_t range; // front << 32 | back
+  char     pad[56];
+} pool_deque_t;
+
+typedef struct {
+  parallel_pool_t* pool;
+  unsigned         worker;
+} pool_thread_t;
+
+struct parallel_pool_s {
+  unsigned         workers;
+  pthread_t*       threads; // of workers 1..workers-1
+  pool_thread_t*   thread_args;
+  pool_deque_t*    deques;
+  pthread_mutex_t  lock;
+  pthread_cond_t   start;   // a batch is posted, or the pool stops
+  pthread_cond_t   done;    // the last worker finished the batch
+  uint64_t         batch;   // batches posted so far
+  unsigned         running; // threads still working on the batch
+  bool             stop;
+  parallel_task_fn fn;
+  void*            arg;
+};
+
+static inline uint64_t deque_pack(uint32_t front, uint32_t back) {
+  return (uint64_t)front << 32 | back;
+}
+
+static bool deque_pop(pool_deque_t* d, size_t* task) {
+  uint64_t r = __atomic_load_n(&d->range, __ATOMIC_ACQUIRE);
+  for (;;) {
+    uint32_t front = (uint32_t)(r >> 32);
+    uint32_t back  = (uint32_t)r;
+    if (front >= back)
+      return false;
+    if (__atomic_compare_exchange_n(&d->range, &r,
+                                    deque_pack(front + 1, back), false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      *task = front;
+      return true;
+    }
+  }
+}
+
+// Takes the back half of another worker's deque: runs the first task of
+// it right away and keeps the rest in its own, which is empty by now
+static bool pool_steal(parallel_pool_t* pool, unsigned worker, size_t* task) {
+  for (unsigned k = 1; k < pool->workers; ++k) {
+    pool_deque_t* victim = &pool->deques[(worker + k) % pool->workers];
+    uint64_t      r      = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+    for (;;) {
+      uint32_t front = (uint32_t)(r >> 32);
+      uint32_t back  = (uint32_t)r;
+      if (front >= back)
+        break;
+      uint32_t n = (back - front + 1) / 2;
+      if (!__atomic_compare_exchange_n(&victim->range, &r,
+                                       deque_pack(front, back - n), false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        continue;
+      __atomic_store_n(&pool->deques[worker].range,
+                       deque_pack(back - n + 1, back), __ATOMIC_RELEASE);
+      *task = back - n;
+      return true;
+    }
+  }
+  return false;
+}
+
+static void pool_work(parallel_pool_t* pool, unsigned worker) {
+  size_t task;
+  while (deque_pop(&pool->deques[worker], &task)
+         || pool_steal(pool, worker, &task))
+    pool->fn(pool->arg, task, worker);
+}
+
+static void* pool_main(void* p) {
+  pool_thread_t*   t    = (pool_thread_t*)p;
+  parallel_pool_t* pool = t->pool;
+  uint64_t         seen = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->stop && pool->batch == seen)
+      pthread_cond_wait(&pool->start, &pool->lock);
+    if (pool->stop)
+      break;
+    seen = pool->batch;
+    pthread_mutex_unlock(&pool->lock);
+
+    pool_work(pool, t->worker);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->running == 0)
+      pthread_cond_signal(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+parallel_pool_t* parallel_pool_create(unsigned workers) {
+  if (workers == 0)
+    workers = parallel_cpu_count();
+  parallel_pool_t* pool = calloc(1, sizeof(parallel_pool_t));
+  if (!pool)
+    return NULL;
+  pool->threads     = malloc(workers * sizeof(pthread_t));
+  pool->thread_args = malloc(workers * sizeof(pool_thread_t));
+  pool->deques      = calloc(workers, sizeof(pool_deque_t));
+  if (!pool->threads || !pool->thread_args || !pool->deques) {
+    free(pool->threads);
+    free(pool->thread_args);
+    free(pool->deques);
+    free(pool);
+    return NULL;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  // Worker w runs on threads[w]; stop at the first thread that fails
+  pool->workers = 1;
+  for (unsigned w = 1; w < workers; ++w) {
+    pool->thread_args[w] = (pool_thread_t){ .pool = pool, .worker = w };
+    if (pthread_create(&pool->threads[w], NULL, pool_main,
+                       &pool->thread_args[w])
+        != 0)
+      break;
+    pool->workers = w + 1;
+  }
+  return pool;
+}
+
+void parallel_pool_destroy(parallel_pool_t* pool) {
+  if (!pool)
+    return;
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+  for (unsigned w = 1; w < pool->workers; ++w)
+    pthread_join(pool->threads[w], NULL);
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->start);
+  pthread_cond_destroy(&pool->done);
+  free(pool->threads);
+  free(pool->thread_args);
+  free(pool->deques);
+  free(pool);
+}
+
+unsigned parallel_pool_workers(const parallel_pool_t* pool) {
+  return pool ? pool->workers : 1;
+}
+
+void parallel_pool_run(parallel_pool_t* pool, size_t count,
+                       parallel_task_fn fn, void* arg) {
+  if (!pool) {
+    for (size_t i = 0; i < count; ++i)
+      fn(arg, i, 0);
+    return;
+  }
+  if (count == 0)
+    return;
+
+  unsigned workers = pool->workers;
+  for (unsigned w = 0; w < workers; ++w) {
+    pool->deques[w].range =
+        deque_pack((uint32_t)(count * w / workers),
+                   (uint32_t)(count * (w + 1) / workers));
+  }
+  pool->fn  = fn;
+  pool->arg = arg;
+
+  // The deques and the task are published by the lock
+  pthread_mutex_lock(&pool->lock);
+  pool->running = workers - 1;
+  pool->batch++;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  pool_work(pool, 0);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->running > 0)
+    pthread_cond_wait(&pool->done, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+// Task t of a pooled loop is the chunk [t * grain, (t + 1) * grain)
+static void for_task(void* p, size_t task, unsigned worker) {
+  (void)worker;
+  for_ctx_t* ctx   = (for_ctx_t*)p;
+  size_t     begin = task * ctx->grain;
+  size_t     end   = begin + ctx->grain;
+  ctx->fn(ctx->arg, begin, end < ctx->count ? end : ctx->count);
+}
+
+void parallel_pool_for(parallel_pool_t* pool, size_t count, size_t grain,
+                       parallel_range_fn fn, void* arg) {
+  if (count == 0)
+    return;
+  if (grain == 0)
+    grain = 1;
+  if (parallel_pool_workers(pool) <= 1 || count <= grain) {
+    fn(arg, 0, count);
+    return;
+  }
+
+  for_ctx_t ctx = {
+    .fn = fn, .arg = arg, .count = count, .grain = grain, .next = 0
+  };
+  parallel_pool_run(pool, (count + grain - 1) / grain, for_task, &ctx);
+}
+
+#define RADIX_BITS    8
+#define RADIX_BUCKETS (1u << RADIX_BITS)
+
+typedef struct radix_pass_s radix_pass_t;
+typedef void (*radix_step_fn)(radix_pass_t* pass, unsigned block);
+
+struct radix_pass_s {
+  const uint64_t* keys_in;
+  const uint32_t* values_in;
+  uint64_t*       keys_out;
+  uint32_t*       values_out;
+  size_t          count;
+  unsigned        shift;
+  unsigned        blocks;
+  radix_step_fn   step;
+  size_t (*hist)[RADIX_BUCKETS]; // per block: digit counts, then offsets
+};
+
+// Each block is one contiguous range, which keeps the scatter stable
+static inline void radix_block(const radix_pass_t* pass, unsigned block,
+                               size_t* begin, size_t* end) {
+  *begin = pass->count * block / pass->blocks;
+  *end   = pass->count * (block + 1) / pass->blocks;
+}
+
+static void radix_histogram(radix_pass_t* pass, unsigned block) {
+  size_t* hist = pass->hist[block];
+  size_t  begin, end;
+  radix_block(pass, block, &begin, &end);
+
+  memset(hist, 0, RADIX_BUCKETS * sizeof(size_t));
+  for (size_t i = begin; i < end; ++i)
+    hist[(pass->keys_in[i] >> pass->shift) & (RADIX_BUCKETS - 1)]++;
+}
+
+static void radix_scatter(radix_pass_t* pass, unsigned block) {
+  size_t* hist = pass->hist[block];
+  size_t  begin, end;
+  radix_block(pass, block, &begin, &end);
+
+  for (size_t i = begin; i < end; ++i) {
+    uint64_t key = pass->keys_in[i];
+    size_t   dst = hist[(key >> pass->shift) & (RADIX_BUCKETS - 1)]++;
+    pass->keys_out[dst]   = key;
+    pass->values_out[dst] = pass->values_in[i];
+  }
+}
+
+static void radix_worker(void* p, unsigned worker, unsigned worker_count) {
+  (void)worker_count;
+  radix_pass_t* pass = (radix_pass_t*)p;
+  pass->step(pass, worker);
+}
+
+static void radix_task(void* p, size_t task, unsigned worker) {
+  (void)worker;
+  radix_pass_t* pass = (radix_pass_t*)p;
+  pass->step(pass, (unsigned)task);
+}
+
+// Runs step on every block, on the pool or else on fresh threads
+static void radix_run(radix_pass_t* pass, parallel_pool_t* pool,
+                      radix_step_fn step) {
+  pass->step = step;
+  if (pool)
+    parallel_pool_run(pool, pass->blocks, radix_task, pass);
+  else
+    parallel_run(pass->blocks, radix_worker, pass);
+}
+
+static bool radix_sort(parallel_pool_t* pool, unsigned blocks, uint64_t* keys,
+                       uint32_t* values, size_t count, unsigned key_bits) {
+  if (count <= 1)
+    return true;
+  if (blocks == 0)
+    blocks = 1;
+  if (blocks > count)
+    blocks = (unsigned)count;
+
+  uint64_t* tmp_keys   = malloc(count * sizeof(uint64_t));
+  uint32_t* tmp_values = malloc(count * sizeof(uint32_t));
+  size_t(*hist)[RADIX_BUCKETS] = malloc(blocks * sizeof(*hist));
+  if (!tmp_keys || !tmp_values || !hist) {
+    free(tmp_keys);
+    free(tmp_values);
+    free(hist);
+    return false;
+  }
+
+  radix_pass_t pass = {
+    .keys_in = keys, .values_in = values, .keys_out = tmp_keys,
+    .values_out = tmp_values, .count = count, .blocks = blocks, .hist = hist
+  };
+  for (unsigned shift = 0; shift < key_bits; shift += RADIX_BITS) {
+    pass.shift = shift;
+    radix_run(&pass, pool, radix_histogram);
+
+    // Turn the counts into per-block output offsets, digit-major so that
+    // equal digits keep their block order
+    size_t sum = 0;
+    bool   trivial = false;
+    for (unsigned d = 0; d < RADIX_BUCKETS && !trivial; ++d) {
+      size_t digit_count = 0;
+      for (unsigned b = 0; b < blocks; ++b) {
+        size_t n   = hist[b][d];
+        hist[b][d] = sum;
+        sum += n;
+        digit_count += n;
+      }
+      trivial = digit_count == count;
+    }
+    if (trivial)
+      continue; // every key has the same digit, nothing would move
+
+    radix_run(&pass, pool, radix_scatter);
+
+    // Output of this pass is the input of the next
+    const uint64_t* k = pass.keys_in;
+    const uint32_t* v = pass.values_in;
+    pass.keys_in      = pass.keys_out;
+    pass.values_in    = pass.values_out;
+    pass.keys_out     = (uint64_t*)k;
+    pass.values_out   = (uint32_t*)v;
+  }
+
+  if (pass.keys_in != keys) {
+    memcpy(keys, pass.keys_in, count * sizeof(uint64_t));
+    memcpy(values, pass.values_in, count * sizeof(uint32_t));
+  }
+  free(tmp_keys);
+  free(tmp_values);
+  free(hist);
+  return true;
+}
+
+bool parallel_radix_sort(unsigned workers, uint64_t* keys, uint32_t* values,
+                         size_t count, unsigned key_bits) {
+  return radix_sort(NULL, workers, keys, values, count, key_bits);
+}
+
+bool parallel_pool_radix_sort(parallel_pool_t* pool, uint64_t* keys,
+                              uint32_t* values, size_t count,
+                              unsigned key_bits) {
+  return radix_sort(pool, parallel_pool_workers(pool), keys, values, count,
+                    key_bits);
+}
@@ -2,12 +2,18 @@
 #include "raytracer.h"
 #include <math.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "algo.h"
+#include "bvh/bvh.h"
+#include "bvh/bvh_lod.h"
+#include "bvh/bvh_shape.h"
+#include "bvh/bvh_tlas.h"
 #include "camera/camera.h"
 #include "fileio.h"
 #include "log4c.h"
+#include "parallel.h"
 #include "rt_material.h"
 #include "rt_types.h"
 #include "sample/accumulator.h"
@@ -20,8 +26,18 @@ typedef struct {
   int     type; // 0: point light
 } light_t;
 
-static bool hit_scene(const ray_t* ray, const wf_face* tris, size_t tri_count,
-                      const wf_scene_t* scene, hit_record_t* rec);
+// What rays are traced against: one BVH over every triangle, or with
+// --two-level a BVH per object under a top-level tree
+typedef struct {
+  const bvh_tree_t* bvh;
+  const bvh_tlas_t* tlas;
+} scene_accel_t;
+
+static bool hit_scene(const ray_t* ray, const scene_accel_t* accel,
+                      hit_record_t* rec);
+static void hit_record_fill(const bvh_tree_t* bvh, const bvh_tlas_t* tlas,
+                            uint32_t instance, const ray_t* ray,
+                            const bvh_hit_t* hit, hit_record_t* rec);
 void        search_light(wf_scene_t* scene, wf_vec3* light_pos);
 static inline wf_vec3 v3_reflect(wf_vec3 I, wf_vec3 N) {
   float dot = v3_dot(I, N);
@@ -29,9 +45,10 @@ static inline wf_vec3 v3_reflect(wf_vec3 I, wf_vec3 N) {
                     I.z - 2.0f * dot * N.z };
 }
 
-static bool in_shadow(const wf_vec3* p, const wf_vec3* light_pos,
-                      const wf_face* tris, size_t tri_count,
-                      const wf_scene_t* scene) {
+// Ray from p toward the light, tested over (1e-4, *t_max); false if p is
+// at the light
+static bool shadow_ray(const wf_vec3* p, const wf_vec3* light_pos,
+                       ray_t* ray, float* t_max) {
   wf_vec3 dir  = { light_pos->x - p->x, light_pos->y - p->y,
                    light_pos->z - p->z };
   float   dist = sqrtf(dir.x * dir.x + dir.y * dir.y + dir.z * dir.z);
@@ -41,12 +58,28 @@ static bool in_shadow(const wf_vec3* p, const wf_vec3* light_pos,
   dir.y /= dist;
   dir.z /= dist;
 
-  ray_t        shadow_ray = { .origin = *p, .direction = dir };
-  hit_record_t shadow_rec;
-  if (hit_scene(&shadow_ray, tris, tri_count, scene, &shadow_rec)) {
-    return shadow_rec.t < dist - 1e-4f;
-  }
-  return false;
+  ray->origin      = *p;
+  ray->direction   = dir;
+  ray->cone_width  = 0.0f; // shadows are tested at full detail
+  ray->cone_spread = 0.0f;
+  *t_max           = dist - 1e-4f;
+  return true;
+}
+
+static bool occluded(const ray_t* ray, float t_max,
+                     const scene_accel_t* accel) {
+  if (accel->tlas)
+    return bvh_tlas_occluded(accel->tlas, ray, 1e-4f, t_max);
+  return bvh_occluded(accel->bvh, ray, 1e-4f, t_max);
+}
+
+static bool in_shadow(const wf_vec3* p, const wf_vec3* light_pos,
+                      const scene_accel_t* accel) {
+  ray_t ray;
+  float t_max;
+  if (!shadow_ray(p, light_pos, &ray, &t_max))
+    return false;
+  return occluded(&ray, t_max, accel);
 }
 
 /*
@@ -72,9 +105,80 @@ static void get_face_color(const wf_scene_t* scene, size_t face_idx, uint8_t* r,
 }
 */
 
+static wf_vec3 trace_ray(const ray_t* ray, const scene_accel_t* accel,
+                         rt_material_t** rt_materials, const light_t* lights,
+                         size_t num_lights, int depth, int max_depth);
+
+static inline wf_vec3 view_direction(const ray_t* ray) {
+  return v3_normalize(
+      (wf_vec3){ -ray->direction.x, -ray->direction.y, -ray->direction.z });
+}
+
+// The light's direct contribution at a hit if nothing blocks it; false if
+// the surface faces away from the light
+static bool light_radiance(const rt_material_t* mat, const hit_record_t* rec,
+                           const wf_vec3* view_dir, const light_t* light,
+                           wf_vec3* radiance) {
+  wf_vec3 wi   = v3_sub(light->position, rec->point);
+  wi           = v3_normalize(wi);
+  float ndotwi = v3_dot(rec->normal, wi);
+  if (ndotwi <= 0)
+    return false;
+
+  wf_vec3 fr  = mat->brdf->ops->eval(mat->brdf, &wi, view_dir, &rec->normal);
+  radiance->x = fr.x * light->color.x * ndotwi;
+  radiance->y = fr.y * light->color.y * ndotwi;
+  radiance->z = fr.z * light->color.z * ndotwi;
+  return true;
+}
+
+// Adds the light's direct contribution at an unshadowed hit
+static void add_direct(const rt_material_t* mat, const hit_record_t* rec,
+                       const wf_vec3* view_dir, const light_t* light,
+                       wf_vec3* color) {
+  wf_vec3 radiance;
+  if (light_radiance(mat, rec, view_dir, light, &radiance))
+    *color = v3_add(*color, radiance);
+}
+
+// Hardcoded reflectivity (could come from material)
+#define REFLECTIVITY 0.8f
+
+// Specular reflection (simple mirror-like) of ray at the hit. The mirror
+// ray stands in for the material's whole lobe, so its cone starts as wide
+// as the incoming one at the hit and spreads by the lobe's width too.
+static ray_t reflect_ray(const ray_t* ray, const hit_record_t* rec,
+                         const rt_material_t* mat) {
+  wf_vec3 reflect_dir = v3_reflect(ray->direction, rec->normal);
+  // Offset origin to avoid self-intersection
+  wf_vec3 offset_origin = { rec->point.x + rec->normal.x * 1e-4f,
+                            rec->point.y + rec->normal.y * 1e-4f,
+                            rec->point.z + rec->normal.z * 1e-4f };
+  return (ray_t){ .origin      = offset_origin,
+                  .direction   = reflect_dir,
+                  .cone_width  = ray->cone_width + ray->cone_spread * rec->t,
+                  .cone_spread = ray->cone_spread + mat->cone_spread };
+}
+
+// Adds the reflection, traced one level deeper
+static void add_reflection(const ray_t* ray, const hit_record_t* rec,
+                           const scene_accel_t* accel,
+                           rt_material_t** rt_materials, const light_t* lights,
+                           size_t num_lights, int depth, int max_depth,
+                           wf_vec3* color) {
+  const rt_material_t* mat = rt_materials[rec->material_idx];
+
+  ray_t   reflected_ray = reflect_ray(ray, rec, mat);
+  wf_vec3 reflected     = trace_ray(&reflected_ray, accel, rt_materials,
+                                    lights, num_lights, depth + 1, max_depth);
+
+  color->x += REFLECTIVITY * reflected.x;
+  color->y += REFLECTIVITY * reflected.y;
+  color->z += REFLECTIVITY * reflected.z;
+}
+
 // Recursive ray tracer
-static wf_vec3 trace_ray(const ray_t* ray, const wf_face* tris,
-                         size_t tri_count, const wf_scene_t* scene,
+static wf_vec3 trace_ray(const ray_t* ray, const scene_accel_t* accel,
                          rt_material_t** rt_materials, const light_t* lights,
                          size_t num_lights, int depth, int max_depth) {
   if (depth >= max_depth) {
@@ -82,60 +186,435 @@ static wf_vec3 trace_ray(const ray_t* ray, const wf_face* tris,
   }
 
   hit_record_t rec;
-  if (!hit_scene(ray, tris, tri_count, scene, &rec)) {
+  if (!hit_scene(ray, accel, &rec)) {
     return (wf_vec3){ 0, 0, 0 }; // background black
   }
 
   rt_material_t* mat      = rt_materials[rec.material_idx];
-  wf_vec3        view_dir = v3_normalize(
-      (wf_vec3){ -ray->direction.x, -ray->direction.y, -ray->direction.z });
+  wf_vec3        view_dir = view_direction(ray);
 
   // Direct lighting from all lights
   wf_vec3 color = { 0, 0, 0 };
   for (size_t li = 0; li < num_lights; ++li) {
-    if (in_shadow(&rec.point, &lights[li].position, tris, tri_count, scene))
-      continue;
+    if (!in_shadow(&rec.point, &lights[li].position, accel))
+      add_direct(mat, &rec, &view_dir, &lights[li], &color);
+  }
+
+  add_reflection(ray, &rec, accel, rt_materials, lights, num_lights, depth,
+                 max_depth, &color);
+  return color;
+}
+
+// trace_ray() for camera rays with similar directions (the samples of one
+// pixel): the primary rays, then for each light the shadow rays of every
+// hit, are traced as packets. Reflections and --two-level scenes go one ray
+// at a time. Colors come out the same as from trace_ray().
+static void trace_packet(const ray_t* rays, uint32_t count,
+                         const scene_accel_t* accel,
+                         rt_material_t** rt_materials, const light_t* lights,
+                         size_t num_lights, int max_depth, wf_vec3* colors) {
+  if (accel->tlas || max_depth <= 0) {
+    for (uint32_t k = 0; k < count; ++k)
+      colors[k] = trace_ray(&rays[k], accel, rt_materials, lights, num_lights,
+                            0, max_depth);
+    return;
+  }
+
+  float        t_max[BVH_PACKET_MAX];
+  bvh_hit_t    hits[BVH_PACKET_MAX];
+  hit_record_t recs[BVH_PACKET_MAX];
+  wf_vec3      view_dirs[BVH_PACKET_MAX];
+  for (uint32_t k = 0; k < count; ++k)
+    t_max[k] = INFINITY;
+  uint32_t hit_mask = bvh_intersect_packet(accel->bvh, rays, count, 1e-4f,
+                                           t_max, hits);
+  for (uint32_t k = 0; k < count; ++k) {
+    colors[k] = (wf_vec3){ 0, 0, 0 }; // background black
+    if (hit_mask & (1u << k)) {
+      hit_record_fill(accel->bvh, NULL, 0, &rays[k], &hits[k], &recs[k]);
+      view_dirs[k] = view_direction(&rays[k]);
+    }
+  }
+
+  // Direct lighting, one packet of shadow rays per light
+  for (size_t li = 0; li < num_lights; ++li) {
+    ray_t    shadow[BVH_PACKET_MAX];
+    uint32_t owner[BVH_PACKET_MAX];
+    uint32_t n = 0;
+    for (uint32_t m = hit_mask; m; m &= m - 1) {
+      uint32_t k = (uint32_t)__builtin_ctz(m);
+      if (shadow_ray(&recs[k].point, &lights[li].position, &shadow[n],
+                     &t_max[n]))
+        owner[n++] = k;
+    }
+    uint32_t occluded = bvh_occluded_packet(accel->bvh, shadow, n, 1e-4f,
+                                            t_max);
+    for (uint32_t i = 0; i < n; ++i) {
+      uint32_t k = owner[i];
+      if (!(occluded & (1u << i)))
+        add_direct(rt_materials[recs[k].material_idx], &recs[k],
+                   &view_dirs[k], &lights[li], &colors[k]);
+    }
+  }
+
+  for (uint32_t m = hit_mask; m; m &= m - 1) {
+    uint32_t k = (uint32_t)__builtin_ctz(m);
+    add_reflection(&rays[k], &recs[k], accel, rt_materials, lights,
+                   num_lights, 0, max_depth, &colors[k]);
+  }
+}
+
+// Wavefront integrator (--wavefront): the same image as trace_ray(), but
+// each bounce of a whole batch of samples runs as separate stages over
+// fixed pools (extend: closest hits; shade: materials grouped, producing
+// shadow rays and reflections; shadow: occlusion tests), so every stage
+// streams through one kind of work and spreads over worker threads. Rays
+// are reordered by direction octant and origin before each extension.
+#define WAVEFRONT_POOL_SIZE (1 << 16) // paths in flight
+#define WAVEFRONT_GRAIN     256       // paths per stage task
+#define WAVEFRONT_SORT_BITS 33        // octant and 30-bit Morton origin
+#define WAVEFRONT_STREAM    64        // rays per bvh_*_stream() query
+
+typedef struct {
+  ray_t    ray;
+  float    weight; // product of the reflectivities so far
+  uint32_t sample; // index into colors
+} wave_path_t;
+
+// A shadow ray of a hit and what it adds unless occluded
+typedef struct {
+  ray_t   ray;
+  float   t_max;
+  bool    active; // false: facing away from the light, nothing to add
+  bool    occluded;
+  wf_vec3 radiance; // already scaled by the path weight
+} wave_shadow_t;
+
+typedef struct {
+  const scene_accel_t* accel;
+  rt_material_t**      rt_materials;
+  size_t               material_count;
+  const light_t*       lights;
+  size_t               num_lights;
+  parallel_pool_t*     threads; // runs the stages of every bounce
+
+  size_t         capacity; // paths per pool
+  size_t         count;    // paths of the current bounce
+  size_t         hit_count;
+  wave_path_t*   paths;
+  wave_path_t*   next;     // reordered paths, then the next bounce
+  uint64_t*      keys;
+  uint32_t*      order;    // extend: sort permutation; shade: hits first
+  hit_record_t*  recs;
+  bool*          hit;
+  wave_shadow_t* shadows;  // num_lights per shaded hit
+  wf_vec3*       colors;   // per sample of the batch
+} wavefront_t;
+
+static void wavefront_free(wavefront_t* w) {
+  parallel_pool_destroy(w->threads);
+  free(w->paths);
+  free(w->next);
+  free(w->keys);
+  free(w->order);
+  free(w->recs);
+  free(w->hit);
+  free(w->shadows);
+  free(w->colors);
+}
+
+static bool wavefront_init(wavefront_t* w, size_t capacity,
+                           const scene_accel_t* accel,
+                           rt_material_t** rt_materials, size_t material_count,
+                           const light_t* lights, size_t num_lights,
+                           unsigned workers) {
+  memset(w, 0, sizeof(*w));
+  w->accel          = accel;
+  w->rt_materials   = rt_materials;
+  w->material_count = material_count;
+  w->lights         = lights;
+  w->num_lights     = num_lights;
+  w->threads        = parallel_pool_create(workers);
+  w->capacity       = capacity;
+  w->paths          = malloc(capacity * sizeof(wave_path_t));
+  w->next           = malloc(capacity * sizeof(wave_path_t));
+  w->keys           = malloc(capacity * sizeof(uint64_t));
+  w->order          = malloc(capacity * sizeof(uint32_t));
+  w->recs           = malloc(capacity * sizeof(hit_record_t));
+  w->hit            = malloc(capacity * sizeof(bool));
+  w->shadows        = malloc(capacity * (num_lights ? num_lights : 1)
+                             * sizeof(wave_shadow_t));
+  w->colors         = malloc(capacity * sizeof(wf_vec3));
+  if (!w->threads || !w->paths || !w->next || !w->keys || !w->order
+      || !w->recs || !w->hit || !w->shadows || !w->colors) {
+    wavefront_free(w);
+    return false;
+  }
+  return true;
+}
+
+// Spreads the low 10 bits of x to every third bit
+static inline uint64_t morton_spread(uint64_t x) {
+  x &= 0x3ff;
+  x = (x | (x << 16)) & 0x30000ff;
+  x = (x | (x << 8)) & 0x300f00f;
+  x = (x | (x << 4)) & 0x30c30c3;
+  x = (x | (x << 2)) & 0x9249249;
+  return x;
+}
+
+// Reorders the paths by direction octant, then by the Morton code of their
+// origin within the bounds of all origins. The sort is stable, so camera
+// rays keep their pixel order.
+static void wavefront_sort(wavefront_t* w) {
+  wf_vec3 lo = { INFINITY, INFINITY, INFINITY };
+  wf_vec3 hi = { -INFINITY, -INFINITY, -INFINITY };
+  for (size_t i = 0; i < w->count; ++i) {
+    const wf_vec3* o = &w->paths[i].ray.origin;
+    lo = (wf_vec3){ fminf(lo.x, o->x), fminf(lo.y, o->y), fminf(lo.z, o->z) };
+    hi = (wf_vec3){ fmaxf(hi.x, o->x), fmaxf(hi.y, o->y), fmaxf(hi.z, o->z) };
+  }
+  wf_vec3 scale = { hi.x > lo.x ? 1023.0f / (hi.x - lo.x) : 0.0f,
+                    hi.y > lo.y ? 1023.0f / (hi.y - lo.y) : 0.0f,
+                    hi.z > lo.z ? 1023.0f / (hi.z - lo.z) : 0.0f };
+
+  for (size_t i = 0; i < w->count; ++i) {
+    const ray_t* r      = &w->paths[i].ray;
+    uint64_t     octant = (uint64_t)(r->direction.x < 0.0f)
+                      | (uint64_t)(r->direction.y < 0.0f) << 1
+                      | (uint64_t)(r->direction.z < 0.0f) << 2;
+    uint64_t     x      = (uint64_t)((r->origin.x - lo.x) * scale.x);
+    uint64_t     y      = (uint64_t)((r->origin.y - lo.y) * scale.y);
+    uint64_t     z      = (uint64_t)((r->origin.z - lo.z) * scale.z);
+    w->keys[i]          = octant << 30 | morton_spread(x) << 2
+                 | morton_spread(y) << 1 | morton_spread(z);
+    w->order[i] = (uint32_t)i;
+  }
+  // Without scratch memory the paths are simply traced unsorted
+  if (!parallel_pool_radix_sort(w->threads, w->keys, w->order, w->count,
+                                WAVEFRONT_SORT_BITS))
+    return;
+
+  for (size_t i = 0; i < w->count; ++i)
+    w->next[i] = w->paths[w->order[i]];
+  wave_path_t* tmp = w->paths;
+  w->paths         = w->next;
+  w->next          = tmp;
+}
+
+// Single-tree scenes go through the stream queries, which keep several
+// rays in flight to hide the latency of node fetches
+static void wavefront_extend_range(void* arg, size_t begin, size_t end) {
+  wavefront_t* w = arg;
+  if (w->accel->tlas) {
+    for (size_t i = begin; i < end; ++i)
+      w->hit[i] = hit_scene(&w->paths[i].ray, w->accel, &w->recs[i]);
+    return;
+  }
+
+  for (size_t first = begin; first < end; first += WAVEFRONT_STREAM) {
+    ray_t     rays[WAVEFRONT_STREAM];
+    float     t_max[WAVEFRONT_STREAM];
+    bvh_hit_t hits[WAVEFRONT_STREAM];
+    size_t    n = end - first < WAVEFRONT_STREAM ? end - first
+                                                 : WAVEFRONT_STREAM;
+    for (size_t k = 0; k < n; ++k) {
+      rays[k]  = w->paths[first + k].ray;
+      t_max[k] = INFINITY;
+    }
+    bvh_intersect_stream(w->accel->bvh, rays, n, 1e-4f, t_max, hits,
+                         &w->hit[first]);
+    for (size_t k = 0; k < n; ++k) {
+      if (w->hit[first + k])
+        hit_record_fill(w->accel->bvh, NULL, 0, &rays[k], &hits[k],
+                        &w->recs[first + k]);
+    }
+  }
+}
 
-    wf_vec3 wi   = v3_sub(lights[li].position, rec.point);
-    wi           = v3_normalize(wi);
-    float ndotwi = v3_dot(rec.normal, wi);
-    if (ndotwi <= 0)
+// Groups the hits by material in order[0, hit_count)
+static void wavefront_group(wavefront_t* w) {
+  size_t   hits = 0;
+  unsigned bits = 1;
+  while (bits < 32 && ((size_t)1 << bits) < w->material_count)
+    ++bits;
+  for (size_t i = 0; i < w->count; ++i) {
+    if (!w->hit[i])
       continue;
+    w->keys[hits]    = w->recs[i].material_idx;
+    w->order[hits++] = (uint32_t)i;
+  }
+  w->hit_count = hits;
+  // Unsorted, the hits are still all there, just not grouped
+  parallel_pool_radix_sort(w->threads, w->keys, w->order, hits, bits);
+}
+
+// Shadow rays toward every light, and the reflected path, of hit j
+static void wavefront_shade_range(void* arg, size_t begin, size_t end) {
+  wavefront_t* w = arg;
+  for (size_t j = begin; j < end; ++j) {
+    const wave_path_t*   path = &w->paths[w->order[j]];
+    const hit_record_t*  rec  = &w->recs[w->order[j]];
+    const rt_material_t* mat  = w->rt_materials[rec->material_idx];
+    wf_vec3              view_dir = view_direction(&path->ray);
+
+    for (size_t li = 0; li < w->num_lights; ++li) {
+      wave_shadow_t* sh = &w->shadows[j * w->num_lights + li];
+      sh->occluded      = false;
+      sh->active =
+          light_radiance(mat, rec, &view_dir, &w->lights[li], &sh->radiance)
+          && shadow_ray(&rec->point, &w->lights[li].position, &sh->ray,
+                        &sh->t_max);
+      if (sh->active)
+        sh->radiance = v3_scale(path->weight, sh->radiance);
+    }
 
-    wf_vec3 fr = mat->brdf->ops->eval(mat->brdf, &wi, &view_dir, &rec.normal);
-    color.x += fr.x * lights[li].color.x * ndotwi;
-    color.y += fr.y * lights[li].color.y * ndotwi;
-    color.z += fr.z * lights[li].color.z * ndotwi;
+    w->next[j].ray    = reflect_ray(&path->ray, rec, mat);
+    w->next[j].weight = path->weight * REFLECTIVITY;
+    w->next[j].sample = path->sample;
   }
+}
 
-  // Specular reflection (simple mirror-like)
-  wf_vec3 reflect_dir = v3_reflect(ray->direction, rec.normal);
-  // Offset origin to avoid self-intersection
-  wf_vec3 offset_origin = { rec.point.x + rec.normal.x * 1e-4f,
-                            rec.point.y + rec.normal.y * 1e-4f,
-                            rec.point.z + rec.normal.z * 1e-4f };
-  ray_t   reflect_ray   = { .origin = offset_origin, .direction = reflect_dir };
+static void wavefront_shadow_range(void* arg, size_t begin, size_t end) {
+  wavefront_t* w = arg;
+  if (w->accel->tlas) {
+    for (size_t i = begin; i < end; ++i) {
+      wave_shadow_t* sh = &w->shadows[i];
+      if (sh->active)
+        sh->occluded = occluded(&sh->ray, sh->t_max, w->accel);
+    }
+    return;
+  }
+
+  ray_t    rays[WAVEFRONT_STREAM];
+  float    t_max[WAVEFRONT_STREAM];
+  bool     blocked[WAVEFRONT_STREAM];
+  uint32_t owner[WAVEFRONT_STREAM];
+  size_t   n = 0;
+  for (size_t i = begin; i < end; ++i) {
+    if (w->shadows[i].active) {
+      rays[n]    = w->shadows[i].ray;
+      t_max[n]   = w->shadows[i].t_max;
+      owner[n++] = (uint32_t)i;
+    }
+    if (n == WAVEFRONT_STREAM || (i + 1 == end && n > 0)) {
+      bvh_occluded_stream(w->accel->bvh, rays, n, 1e-4f, t_max, blocked);
+      for (size_t k = 0; k < n; ++k)
+        w->shadows[owner[k]].occluded = blocked[k];
+      n = 0;
+    }
+  }
+}
+
+// Adds the unoccluded light of hit j to its sample; a sample has at most
+// one path per bounce, so hits never share a color
+static void wavefront_gather_range(void* arg, size_t begin, size_t end) {
+  wavefront_t* w = arg;
+  for (size_t j = begin; j < end; ++j) {
+    wf_vec3* color = &w->colors[w->next[j].sample];
+    for (size_t li = 0; li < w->num_lights; ++li) {
+      const wave_shadow_t* sh = &w->shadows[j * w->num_lights + li];
+      if (sh->active && !sh->occluded)
+        *color = v3_add(*color, sh->radiance);
+    }
+  }
+}
 
-  wf_vec3 reflected =
-      trace_ray(&reflect_ray, tris, tri_count, scene, rt_materials, lights,
-                num_lights, depth + 1, max_depth);
+// Traces the w->count camera rays in w->paths (weight 1, sample i), adding
+// each sample's color to colors[sample], which start out black
+static void wavefront_trace(wavefront_t* w, int max_depth) {
+  for (size_t i = 0; i < w->count; ++i)
+    w->colors[i] = v3_zero();
 
-  // Hardcoded reflectivity (could come from material)
-  const float reflectivity = 0.8f;
-  color.x += reflectivity * reflected.x;
-  color.y += reflectivity * reflected.y;
-  color.z += reflectivity * reflected.z;
+  for (int depth = 0; depth < max_depth && w->count > 0; ++depth) {
+    wavefront_sort(w);
+    parallel_pool_for(w->threads, w->count, WAVEFRONT_GRAIN,
+                      wavefront_extend_range, w);
+    wavefront_group(w);
+    parallel_pool_for(w->threads, w->hit_count, WAVEFRONT_GRAIN,
+                      wavefront_shade_range, w);
+    parallel_pool_for(w->threads, w->hit_count * w->num_lights,
+                      WAVEFRONT_GRAIN, wavefront_shadow_range, w);
+    parallel_pool_for(w->threads, w->hit_count, WAVEFRONT_GRAIN,
+                      wavefront_gather_range, w);
 
-  return color;
+    // The reflections of the hits are the next bounce
+    wave_path_t* tmp = w->paths;
+    w->paths         = w->next;
+    w->next          = tmp;
+    w->count         = w->hit_count;
+  }
+}
+
+// Find the nearest hit through the BVH, then shade only that face
+static bool hit_scene(const ray_t* ray, const scene_accel_t* accel,
+                      hit_record_t* rec) {
+  bvh_hit_t         hit;
+  const bvh_tree_t* bvh = accel->bvh;
+  bvh_tlas_hit_t    tlas_hit;
+  if (accel->tlas) {
+    if (!bvh_tlas_intersect_closest(accel->tlas, ray, 1e-4f, INFINITY,
+                                    &tlas_hit))
+      return false;
+    hit = tlas_hit.hit;
+    bvh = bvh_tlas_hit_blas(accel->tlas, &tlas_hit);
+  } else if (!bvh_intersect_closest(bvh, ray, 1e-4f, INFINITY, &hit)) {
+    return false;
+  }
+
+  hit_record_fill(bvh, accel->tlas, accel->tlas ? tlas_hit.instance : 0, ray,
+                  &hit, rec);
+  return true;
 }
 
-// Test ray against all triangles
-// 在 raytracer.c 中
-static bool hit_scene(const ray_t* ray, const wf_face* tris, size_t tri_count,
-                      const wf_scene_t* scene, hit_record_t* rec) {
-  bool  hit       = false;
-  float closest_t = INFINITY;
+// Hit point, shading normal and material of a hit on bvh, which with tlas
+// set is the BLAS of the given instance
+static void hit_record_fill(const bvh_tree_t* bvh, const bvh_tlas_t* tlas,
+                            uint32_t instance, const ray_t* ray,
+                            const bvh_hit_t* hit, hit_record_t* rec) {
+  const wf_scene_t* scene = bvh->scene;
+  const wf_face*    face  = &bvh->faces[hit->face_idx];
+  const wf_vec3*    v0    = &scene->vertices[face->vertices[0].v_idx];
+  const wf_vec3*    v1    = &scene->vertices[face->vertices[1].v_idx];
+  const wf_vec3*    v2    = &scene->vertices[face->vertices[2].v_idx];
+  float             u     = hit->u;
+  float             v     = hit->v;
+
+  // 计算交点
+  rec->point = ray_at(*ray, hit->t);
+
+  const bvh_shape_t* shape = bvh_shape_of(bvh->shapes, hit->face_idx);
+  if (shape) {
+    // Shapes live in the BLAS's space, as the triangles do
+    wf_vec3 p = tlas ? bvh_tlas_point_to_object(tlas, instance, rec->point)
+                     : rec->point;
+    rec->normal = bvh_shape_normal(shape, &p);
+  } else if (face->vertices[0].vn_idx >= 0) {
+    // 插值法线
+    wf_vec3 n0    = scene->normals[face->vertices[0].vn_idx];
+    wf_vec3 n1    = scene->normals[face->vertices[1].vn_idx];
+    wf_vec3 n2    = scene->normals[face->vertices[2].vn_idx];
+    rec->normal.x = (1 - u - v) * n0.x + u * n1.x + v * n2.x;
+    rec->normal.y = (1 - u - v) * n0.y + u * n1.y + v * n2.y;
+    rec->normal.z = (1 - u - v) * n0.z + u * n1.z + v * n2.z;
+  } else {
+    // 面法线
+    rec->normal = v3_cross(v3_sub(*v1, *v0), v3_sub(*v2, *v0));
+  }
+  if (tlas)
+    rec->normal = bvh_tlas_normal_to_world(tlas, instance, rec->normal);
+  rec->normal = v3_normalize(rec->normal);
 
+  rec->hit          = true;
+  rec->t            = hit->t;
+  rec->material_idx = hit->material_idx;
+}
+
+// Light emitters are not occluders: keep them out of the acceleration
+// structure instead of skipping them on every intersection test.
+static size_t collect_occluders(const wf_scene_t* scene, const wf_face* tris,
+                                size_t tri_count, wf_face* out) {
+  size_t count = 0;
   for (size_t i = 0; i < tri_count; ++i) {
     const wf_face* face = &tris[i];
     if (face->material_idx >= 0) {
@@ -144,54 +623,589 @@ static bool hit_scene(const ray_t* ray, const wf_face* tris, size_t tri_count,
         continue;
       }
     }
-    const wf_vec3* v0 = &scene->vertices[face->vertices[0].v_idx];
-    const wf_vec3* v1 = &scene->vertices[face->vertices[1].v_idx];
-    const wf_vec3* v2 = &scene->vertices[face->vertices[2].v_idx];
+    out[count++] = *face;
+  }
+  return count;
+}
 
-    float t, u, v;
-    if (!ray_intersects_triangle(ray, v0, v1, v2, &t, &u, &v))
-      continue;
-    if (t <= 1e-4f || t >= closest_t)
+// The occluders of one object, triangulated through a one-object view of
+// the scene. With shapes_out set (--analytic) the triangles are merged into
+// the shapes they tessellate; *shapes_out stays NULL if there are none.
+static bool object_occluders(const wf_scene_t* scene, const wf_object_t* obj,
+                             wf_face** faces_out, bvh_shape_t** shapes_out,
+                             size_t* count_out) {
+  wf_scene_t  view = *scene;
+  wf_object_t one  = *obj;
+  one.next         = NULL;
+  view.objects     = &one;
+
+  wf_face* tris      = NULL;
+  size_t   tri_count = 0;
+  if (wf_scene_to_triangles(&view, &tris, &tri_count) != WF_SUCCESS)
+    return false;
+  size_t   n     = tri_count ? tri_count : 1;
+  wf_face* faces = malloc(n * sizeof(wf_face));
+  if (!faces) {
+    free(tris);
+    return false;
+  }
+  size_t count = collect_occluders(scene, tris, tri_count, faces);
+  free(tris);
+
+  if (shapes_out) {
+    wf_face*     merged = malloc(n * sizeof(wf_face));
+    bvh_shape_t* shapes = malloc(n * sizeof(bvh_shape_t));
+    if (!merged || !shapes) {
+      free(merged);
+      free(shapes);
+      free(faces);
+      return false;
+    }
+    count = bvh_shapes_detect(faces, count, scene, merged, shapes);
+    free(faces);
+    faces = merged;
+
+    // Without a single shape the object stays a plain triangle mesh
+    bool any = false;
+    for (size_t i = 0; i < count && !any; ++i)
+      any = shapes[i].type != BVH_SHAPE_TRIANGLE;
+    if (!any) {
+      free(shapes);
+      shapes = NULL;
+    }
+    *shapes_out = shapes;
+  }
+  *faces_out = faces;
+  *count_out = count;
+  return true;
+}
+
+// --analytic with a single BVH: the occluders rebuilt object by object,
+// replacing the `count` triangles in faces (room for `capacity`). Returns
+// the per-face shapes, NULL on failure.
+static bvh_shape_t* analytic_occluders(const wf_scene_t* scene,
+                                       wf_face* faces, size_t capacity,
+                                       size_t* count) {
+  bvh_shape_t* shapes =
+      malloc((capacity ? capacity : 1) * sizeof(bvh_shape_t));
+  if (!shapes)
+    return NULL;
+
+  size_t total = 0;
+  for (wf_object_t* obj = scene->objects; obj; obj = obj->next) {
+    wf_face*     obj_faces  = NULL;
+    bvh_shape_t* obj_shapes = NULL;
+    size_t       obj_count  = 0;
+    if (!object_occluders(scene, obj, &obj_faces, &obj_shapes, &obj_count)
+        || total + obj_count > capacity) {
+      free(obj_faces);
+      free(obj_shapes);
+      free(shapes);
+      return NULL;
+    }
+    memcpy(&faces[total], obj_faces, obj_count * sizeof(wf_face));
+    if (obj_shapes)
+      memcpy(&shapes[total], obj_shapes, obj_count * sizeof(bvh_shape_t));
+    else // all triangles
+      memset(&shapes[total], 0, obj_count * sizeof(bvh_shape_t));
+    total += obj_count;
+    free(obj_faces);
+    free(obj_shapes);
+  }
+  *count = total;
+  return shapes;
+}
+
+// --two-level: a BVH per object, placed by identity instances, with --lod
+// coarser levels of each triangle mesh
+typedef struct {
+  bvh_tree_t**    blas;
+  wf_face**       faces;  // per-object occluders, the trees point into them
+  bvh_shape_t**   shapes; // per-object shapes with --analytic, else NULL
+  bvh_lod_t**     lods;   // per-object LOD levels, NULL where there are none
+  bvh_instance_t* instances;
+  size_t          count;
+  bvh_tlas_t*     tlas;
+} two_level_t;
+
+static void two_level_free(two_level_t* tl) {
+  bvh_tlas_destroy(tl->tlas);
+  for (size_t i = 0; i < tl->count; ++i) {
+    bvh_destroy(tl->blas[i]);
+    free(tl->faces[i]);
+    free(tl->shapes[i]);
+    bvh_lod_destroy(tl->lods[i]);
+  }
+  free(tl->blas);
+  free(tl->faces);
+  free(tl->shapes);
+  free(tl->lods);
+  free(tl->instances);
+  memset(tl, 0, sizeof(*tl));
+}
+
+static bool two_level_build(const wf_scene_t* scene, const char* bvh_name,
+                            const bvh_build_params_t* params, bool analytic,
+                            uint32_t lod_levels, two_level_t* tl) {
+  size_t object_count = 0;
+  for (wf_object_t* obj = scene->objects; obj; obj = obj->next)
+    object_count++;
+
+  memset(tl, 0, sizeof(*tl));
+  size_t n      = object_count ? object_count : 1;
+  tl->blas      = calloc(n, sizeof(bvh_tree_t*));
+  tl->faces     = calloc(n, sizeof(wf_face*));
+  tl->shapes    = calloc(n, sizeof(bvh_shape_t*));
+  tl->lods      = calloc(n, sizeof(bvh_lod_t*));
+  tl->instances = calloc(n, sizeof(bvh_instance_t));
+  if (!tl->blas || !tl->faces || !tl->shapes || !tl->lods || !tl->instances) {
+    two_level_free(tl);
+    return false;
+  }
+
+  for (wf_object_t* obj = scene->objects; obj; obj = obj->next) {
+    wf_face*     faces  = NULL;
+    bvh_shape_t* shapes = NULL;
+    size_t       count  = 0;
+    if (!object_occluders(scene, obj, &faces, analytic ? &shapes : NULL,
+                          &count)) {
+      two_level_free(tl);
+      return false;
+    }
+    if (count == 0) {
+      free(faces);
+      free(shapes);
       continue;
-    closest_t = t;
-    hit       = true;
+    }
 
-    // 计算交点
-    rec->point.x = ray->origin.x + t * ray->direction.x;
-    rec->point.y = ray->origin.y + t * ray->direction.y;
-    rec->point.z = ray->origin.z + t * ray->direction.z;
+    bvh_build_params_t p = *params;
+    p.shapes             = shapes;
 
-    // 插值法线
-    if (face->vertices[0].vn_idx >= 0) {
-      wf_vec3 n0    = scene->normals[face->vertices[0].vn_idx];
-      wf_vec3 n1    = scene->normals[face->vertices[1].vn_idx];
-      wf_vec3 n2    = scene->normals[face->vertices[2].vn_idx];
-      rec->normal.x = (1 - u - v) * n0.x + u * n1.x + v * n2.x;
-      rec->normal.y = (1 - u - v) * n0.y + u * n1.y + v * n2.y;
-      rec->normal.z = (1 - u - v) * n0.z + u * n1.z + v * n2.z;
-    } else {
-      // 面法线
-      wf_vec3 e1    = { v1->x - v0->x, v1->y - v0->y, v1->z - v0->z };
-      wf_vec3 e2    = { v2->x - v0->x, v2->y - v0->y, v2->z - v0->z };
-      rec->normal.x = e1.y * e2.z - e1.z * e2.y;
-      rec->normal.y = e1.z * e2.x - e1.x * e2.z;
-      rec->normal.z = e1.x * e2.y - e1.y * e2.x;
+    bvh_tree_t* blas = bvh_create(bvh_name, faces, count, scene, &p);
+    if (!blas) {
+      free(faces);
+      free(shapes);
+      two_level_free(tl);
+      return false;
     }
-    rec->normal = v3_normalize(rec->normal);
+    // Shapes have no coarser versions; an object with any keeps one level
+    bvh_lod_t* lod = NULL;
+    if (lod_levels > 0 && !shapes)
+      lod = bvh_lod_create(bvh_name, faces, count, scene, params, lod_levels);
+    for (uint32_t k = 1; k <= bvh_lod_count(lod); ++k)
+      log_info("Object %zu LOD %u: %zu of %zu triangles", tl->count, k,
+               bvh_lod_level(lod, k)->face_count, count);
 
-    rec->t            = t;
-    rec->material_idx = face->material_idx;
+    tl->blas[tl->count]           = blas;
+    tl->faces[tl->count]          = faces;
+    tl->shapes[tl->count]         = shapes;
+    tl->lods[tl->count]           = lod;
+    tl->instances[tl->count].blas = blas;
+    tl->instances[tl->count].lod  = lod;
+    bvh_xform_identity(&tl->instances[tl->count].xform);
+    tl->count++;
   }
 
-  if (hit)
-    *rec = *rec; // ensure output
-  return hit;
+  tl->tlas = bvh_tlas_create(tl->instances, tl->count);
+  if (!tl->tlas) {
+    two_level_free(tl);
+    return false;
+  }
+  return true;
+}
+
+// Writes an RGBA pixel, clamping the color to [0, 1]
+static void store_pixel(uint8_t* image, size_t pixel, const wf_vec3* color) {
+  uint8_t r      = (uint8_t)(fminf(1.0f, fmaxf(0.0f, color->x)) * 255);
+  uint8_t g      = (uint8_t)(fminf(1.0f, fmaxf(0.0f, color->y)) * 255);
+  uint8_t b      = (uint8_t)(fminf(1.0f, fmaxf(0.0f, color->z)) * 255);
+  size_t  idx    = pixel * 4;
+  image[idx]     = r;
+  image[idx + 1] = g;
+  image[idx + 2] = b;
+  image[idx + 3] = 255;
 }
 
-static ray_t get_camera_ray(const camera_t* cam, float u, float v) {
+// Camera ray through (u, v), its cone spreading by `spread` (the angle a
+// pixel subtends)
+static ray_t get_camera_ray(const camera_t* cam, float u, float v,
+                            float spread) {
   wf_vec3 origin    = camera_get_position(cam);
   wf_vec3 direction = camera_get_ray_direction(cam, u, v);
-  return (ray_t){ .origin = origin, .direction = direction };
+  return (ray_t){ .origin      = origin,
+                  .direction   = direction,
+                  .cone_spread = spread };
+}
+
+// Camera rays of a tile or wavefront batch, made in one call: the samples
+// and the rays they turn into, with room for `capacity`
+typedef struct {
+  camera_sample_t* samples;
+  camera_rays_t    rays;
+  size_t           capacity;
+} camera_batch_t;
+
+static bool camera_batch_init(camera_batch_t* b, size_t capacity) {
+  float* f    = malloc(6 * capacity * sizeof(float));
+  b->samples  = malloc(capacity * sizeof(camera_sample_t));
+  b->rays     = (camera_rays_t){ .ox = f,
+                                 .oy = f + capacity,
+                                 .oz = f + 2 * capacity,
+                                 .dx = f + 3 * capacity,
+                                 .dy = f + 4 * capacity,
+                                 .dz = f + 5 * capacity };
+  b->capacity = capacity;
+  if (!f || !b->samples) {
+    free(f);
+    free(b->samples);
+    b->samples  = NULL;
+    b->rays.ox  = NULL;
+    b->capacity = 0;
+    return false;
+  }
+  return true;
+}
+
+static void camera_batch_free(camera_batch_t* b) {
+  free(b->samples);
+  free(b->rays.ox);
+}
+
+// Sample s of pixel (x, y): where it crosses the pixel and the lens
+static camera_sample_t pixel_sample(const sampler_t* sampler, int width,
+                                    int height, int x, int y, int s) {
+  size_t pixel = (size_t)y * width + x;
+  float  u_sub, v_sub;
+  sampler->generate(sampler, pixel, s, &u_sub, &v_sub);
+  return (camera_sample_t){
+    .u      = (x + u_sub) / (float)width,
+    .v      = 1.0f - (y + v_sub) / (float)height,
+    .lens_u = sampler_uniform(sampler->seed, (uint32_t)pixel, (uint32_t)s,
+                              SAMPLER_DIM_LENS_U),
+    .lens_v = sampler_uniform(sampler->seed, (uint32_t)pixel, (uint32_t)s,
+                              SAMPLER_DIM_LENS_V)
+  };
+}
+
+// Ray i of a batch, its cone spreading by `spread`
+static inline ray_t batch_ray(const camera_rays_t* rays, size_t i,
+                              float spread) {
+  return (ray_t){ .origin      = { rays->ox[i], rays->oy[i], rays->oz[i] },
+                  .direction   = { rays->dx[i], rays->dy[i], rays->dz[i] },
+                  .cone_spread = spread };
+}
+
+// Tile renderer: the image in TILE_SIZE squares, ordered along a Morton
+// curve and rendered as tasks of the work-stealing pool. Workers trace
+// with their own sampler, accumulators and camera batch, and tiles never
+// share a pixel. A tile is sampled in rounds: min_spp samples for every
+// pixel, then as many again for each pixel that is still active, up to
+// max_spp. Every round's camera rays are made in one batch. With a
+// threshold, a pixel stops once the 95% confidence interval of its color
+// is narrower than +-threshold in every channel. Samples are keyed on
+// their pixel, so the image is the same for any number of threads.
+#define TILE_SIZE   16
+#define TILE_PIXELS (TILE_SIZE * TILE_SIZE)
+
+typedef struct {
+  const camera_t*      cam;
+  const scene_accel_t* accel;
+  rt_material_t**      rt_materials;
+  const light_t*       lights;
+  size_t               num_lights;
+  int                  width;
+  int                  height;
+  int                  min_spp; // samples per round
+  int                  max_spp;
+  float                threshold; // 0 = always max_spp
+  int                  packet;    // samples traced together
+  int                  max_depth;
+  float                pixel_spread;
+  sampler_t**          samplers; // per worker
+  accumulator_t**      accs;     // per worker, TILE_PIXELS each
+  camera_batch_t*      batches;  // per worker, TILE_PIXELS * min_spp rays
+  size_t*              spent;    // per worker, samples traced
+  const uint32_t*      tiles;    // ty << 16 | tx, in Morton order
+  uint8_t*             image;
+} tile_render_t;
+
+// Gathers the even bits of x into the low 16
+static inline uint32_t morton_even_bits(uint32_t x) {
+  x &= 0x55555555;
+  x = (x | (x >> 1)) & 0x33333333;
+  x = (x | (x >> 2)) & 0x0f0f0f0f;
+  x = (x | (x >> 4)) & 0x00ff00ff;
+  x = (x | (x >> 8)) & 0x0000ffff;
+  return x;
+}
+
+// The tiles of a width x height image, walking the Morton curve over the
+// smallest power-of-two square of tiles that covers it
+static uint32_t* tile_order(int width, int height, size_t* count) {
+  uint32_t cols = (uint32_t)(width + TILE_SIZE - 1) / TILE_SIZE;
+  uint32_t rows = (uint32_t)(height + TILE_SIZE - 1) / TILE_SIZE;
+  uint32_t side = 1;
+  while (side < cols || side < rows)
+    side <<= 1;
+
+  uint32_t* tiles = malloc(((size_t)cols * rows + 1) * sizeof(uint32_t));
+  *count          = 0;
+  if (!tiles)
+    return NULL;
+  for (uint64_t code = 0; code < (uint64_t)side * side; ++code) {
+    uint32_t tx = morton_even_bits((uint32_t)code);
+    uint32_t ty = morton_even_bits((uint32_t)(code >> 1));
+    if (tx < cols && ty < rows)
+      tiles[(*count)++] = ty << 16 | tx;
+  }
+  return tiles;
+}
+
+// Traces `count` samples of a pixel, from sample index s0 and camera ray
+// `first`, into acc
+static void render_samples(const tile_render_t* r, const camera_rays_t* camera,
+                           size_t first, int s0, int count,
+                           accumulator_t* acc) {
+  for (int s = 0; s < count; s += r->packet) {
+    ray_t    rays[BVH_PACKET_MAX];
+    wf_vec3  colors[BVH_PACKET_MAX];
+    uint32_t n = (uint32_t)(count - s < r->packet ? count - s : r->packet);
+    for (uint32_t k = 0; k < n; ++k)
+      rays[k] = batch_ray(camera, first + s + k, r->pixel_spread);
+
+    if (r->packet > 1) {
+      trace_packet(rays, n, r->accel, r->rt_materials, r->lights,
+                   r->num_lights, r->max_depth, colors);
+    } else {
+      colors[0] = trace_ray(&rays[0], r->accel, r->rt_materials, r->lights,
+                            r->num_lights, 0, r->max_depth);
+    }
+    for (uint32_t k = 0; k < n; ++k)
+      acc->add(acc, &colors[k], s0 + s + (int)k);
+  }
+}
+
+// Whether the 95% confidence interval of the mean, 1.96 sigma / sqrt(n)
+// either side, is within +-threshold in every channel
+static bool pixel_converged(const accumulator_t* acc, float threshold) {
+  int     n   = acc->count(acc);
+  wf_vec3 var = acc->variance(acc);
+  float   max = fmaxf(var.x, fmaxf(var.y, var.z));
+  return n > 1 && 1.96f * 1.96f * max <= threshold * threshold * (float)n;
+}
+
+static void render_tile(void* arg, size_t task, unsigned worker) {
+  const tile_render_t* r       = arg;
+  const sampler_t*     sampler = r->samplers[worker];
+  camera_batch_t*      batch   = &r->batches[worker];
+  accumulator_t**      accs    = &r->accs[(size_t)worker * TILE_PIXELS];
+  int                  x0      = (int)(r->tiles[task] & 0xffff) * TILE_SIZE;
+  int                  y0      = (int)(r->tiles[task] >> 16) * TILE_SIZE;
+  int                  x1      = x0 + TILE_SIZE;
+  int                  y1      = y0 + TILE_SIZE;
+  x1                           = x1 < r->width ? x1 : r->width;
+  y1                           = y1 < r->height ? y1 : r->height;
+  int                  w       = x1 - x0;
+  int                  pixels  = w * (y1 - y0);
+
+  // active[0..left): the tile's pixels still sampling, as i = ty * w + tx
+  int    active[TILE_PIXELS];
+  int    left  = pixels;
+  size_t spent = 0;
+  for (int i = 0; i < pixels; ++i) {
+    active[i] = i;
+    accs[i]->init(accs[i], r->max_spp);
+  }
+
+  for (int s0 = 0; s0 < r->max_spp && left > 0; s0 += r->min_spp) {
+    int    count = r->max_spp - s0 < r->min_spp ? r->max_spp - s0 : r->min_spp;
+    size_t n     = 0;
+    for (int j = 0; j < left; ++j) {
+      int x = x0 + active[j] % w;
+      int y = y0 + active[j] / w;
+      for (int s = s0; s < s0 + count; ++s)
+        batch->samples[n++] = pixel_sample(sampler, r->width, r->height, x, y,
+                                           s);
+    }
+    camera_generate_rays(r->cam, batch->samples, n, &batch->rays);
+
+    int kept = 0;
+    for (int j = 0; j < left; ++j) {
+      accumulator_t* acc = accs[active[j]];
+      render_samples(r, &batch->rays, (size_t)j * count, s0, count, acc);
+      if (!(r->threshold > 0.0f && pixel_converged(acc, r->threshold)))
+        active[kept++] = active[j];
+    }
+    spent += (size_t)left * count;
+    left   = kept;
+  }
+
+  for (int i = 0; i < pixels; ++i) {
+    size_t  pixel       = (size_t)(y0 + i / w) * r->width + x0 + i % w;
+    wf_vec3 final_color = accs[i]->get(accs[i]);
+    store_pixel(r->image, pixel, &final_color);
+  }
+  r->spent[worker] += spent;
+}
+
+// Gives worker w its sampler, a clone of samplers[0] for w > 0, camera
+// batch and TILE_PIXELS accumulators. Returns false if memory runs out,
+// leaving what it got for render_tiles_free().
+static bool tile_worker_init(sampler_t** samplers, accumulator_t** accs,
+                             camera_batch_t* batches, size_t capacity,
+                             unsigned w) {
+  if (w > 0 && !(samplers[w] = sampler_clone(samplers[0])))
+    return false;
+  if (!camera_batch_init(&batches[w], capacity))
+    return false;
+  for (size_t i = 0; i < TILE_PIXELS; ++i) {
+    accumulator_t* acc = accumulator_create_average();
+    if (!acc)
+      return false;
+    accs[(size_t)w * TILE_PIXELS + i] = acc;
+  }
+  return true;
+}
+
+static void render_tiles_free(unsigned workers, sampler_t** samplers,
+                              accumulator_t** accs, camera_batch_t* batches) {
+  for (unsigned w = 0; w < workers; ++w) {
+    if (samplers && w > 0)
+      sampler_destroy(samplers[w]);
+    if (batches)
+      camera_batch_free(&batches[w]);
+    for (size_t i = 0; accs && i < TILE_PIXELS; ++i)
+      accumulator_destroy(accs[(size_t)w * TILE_PIXELS + i]);
+  }
+  free(samplers);
+  free(accs);
+  free(batches);
+}
+
+// Renders the image on a pool of `threads` workers, sampler serving worker
+// 0 and cloned for the others, and returns the samples traced. If memory
+// runs out for more workers it renders on the caller; returns 0 if there
+// is not even enough for that.
+static size_t render_tiles(tile_render_t* r, unsigned threads,
+                           sampler_t* sampler) {
+  size_t           tile_count = 0;
+  size_t           capacity   = (size_t)TILE_PIXELS * r->min_spp;
+  uint32_t*        tiles      = tile_order(r->width, r->height, &tile_count);
+  parallel_pool_t* pool       = tiles ? parallel_pool_create(threads) : NULL;
+  unsigned         workers    = parallel_pool_workers(pool);
+  size_t           acc_count  = (size_t)workers * TILE_PIXELS;
+  sampler_t**      samplers   = calloc(workers, sizeof(sampler_t*));
+  accumulator_t**  accs       = calloc(acc_count, sizeof(accumulator_t*));
+  camera_batch_t*  batches    = calloc(workers, sizeof(camera_batch_t));
+  size_t*          spent      = calloc(workers, sizeof(size_t));
+
+  unsigned ready = 0;
+  if (tiles && samplers && accs && batches && spent) {
+    samplers[0] = sampler;
+    while (ready < workers
+           && tile_worker_init(samplers, accs, batches, capacity, ready))
+      ++ready;
+  }
+  if (ready == 0) {
+    log_error("tile renderer setup failed");
+    render_tiles_free(workers, samplers, accs, batches);
+    parallel_pool_destroy(pool);
+    free(spent);
+    free(tiles);
+    return 0;
+  }
+  if (ready < workers) {
+    log_error("tile renderer setup failed, rendering on one thread");
+    parallel_pool_destroy(pool);
+    pool = NULL;
+  }
+
+  r->samplers = samplers;
+  r->accs     = accs;
+  r->batches  = batches;
+  r->spent    = spent;
+  r->tiles    = tiles;
+  parallel_pool_run(pool, tile_count, render_tile, r);
+  log_info("Rendered %zu tiles on %u threads", tile_count,
+           parallel_pool_workers(pool));
+
+  size_t total = 0;
+  for (unsigned w = 0; w < workers; ++w)
+    total += spent[w];
+  render_tiles_free(workers, samplers, accs, batches);
+  parallel_pool_destroy(pool);
+  free(spent);
+  free(tiles);
+  return total;
+}
+
+// Appends "key:count" for the non-empty buckets of a histogram; the last
+// bucket holds everything larger and is printed as "key+"
+static void format_histogram(char* buf, size_t size, const size_t* bins,
+                             size_t bin_count) {
+  size_t len = 0;
+  buf[0]     = '\0';
+  for (size_t i = 0; i < bin_count && len < size; ++i) {
+    if (bins[i] == 0)
+      continue;
+    int n = snprintf(buf + len, size - len, " %zu%s:%zu", i,
+                     i + 1 == bin_count ? "+" : "", bins[i]);
+    if (n < 0)
+      break;
+    len += (size_t)n;
+  }
+}
+
+// --bvh-stats: the quality report of one tree, with per-ray figures when
+// sample rays are given
+static void log_bvh_stats(const char* label, const bvh_tree_t* bvh,
+                          const ray_t* rays, size_t ray_count) {
+  bvh_stats_t stats;
+  if (!bvh_stats(bvh, &stats)) {
+    log_info("BVH stats [%s]: not available for this strategy", label);
+    return;
+  }
+  if (ray_count > 0)
+    bvh_stats_trace(bvh, rays, ray_count, &stats);
+
+  char hist[512];
+  log_info("BVH stats [%s]: %zu nodes, %zu leaves, max depth %zu, "
+           "%zu references to %zu faces",
+           label, stats.node_count, stats.leaf_count, stats.max_depth,
+           stats.reference_count, bvh->face_count);
+  log_info("BVH stats [%s]: SAH cost %.2f, surface area %.4g, %.1f KiB",
+           label, stats.sah_cost, stats.surface_area,
+           (double)stats.memory_bytes / 1024.0);
+  format_histogram(hist, sizeof(hist), stats.depth_histogram,
+                   BVH_STATS_DEPTHS);
+  log_info("BVH stats [%s]: leaves per depth%s", label, hist);
+  format_histogram(hist, sizeof(hist), stats.leaf_size_histogram,
+                   BVH_STATS_LEAF_SIZES);
+  log_info("BVH stats [%s]: leaves per size%s", label, hist);
+  if (stats.ray_count > 0)
+    log_info("BVH stats [%s]: %zu rays, %.1f nodes and %.1f triangles per ray",
+             label, stats.ray_count, stats.nodes_per_ray, stats.tris_per_ray);
+}
+
+// Camera rays through the centers of a regular grid over the image, at
+// least `count` (> 0) of them
+static ray_t* sample_camera_rays(const camera_t* cam, int width, int height,
+                                 size_t count, size_t* out_count) {
+  float  aspect = (float)width / (float)height;
+  size_t cols   = (size_t)ceilf(sqrtf((float)count * aspect));
+  size_t rows   = cols ? (count + cols - 1) / cols : 0;
+  ray_t* rays   = malloc(rows * cols * sizeof(ray_t));
+  *out_count    = 0;
+  if (!rays)
+    return NULL;
+  for (size_t j = 0; j < rows; ++j) {
+    for (size_t i = 0; i < cols; ++i) {
+      float u              = ((float)i + 0.5f) / (float)cols;
+      float v              = 1.0f - ((float)j + 0.5f) / (float)rows;
+      rays[(*out_count)++] = get_camera_ray(cam, u, v, 0.0f);
+    }
+  }
+  return rays;
 }
 
 void search_light(wf_scene_t* scene, wf_vec3* light_pos) {
@@ -247,6 +1261,76 @@ int render_scene(const rtCfg* cfg) {
     return 1;
   }
 
+  wf_face* occluders = malloc((triangle_count ? triangle_count : 1)
+                              * sizeof(wf_face));
+  if (!occluders) {
+    free(triangles);
+    wf_free_scene(&scene);
+    return 1;
+  }
+  size_t occluder_count =
+      collect_occluders(&scene, triangles, triangle_count, occluders);
+
+  bvh_shape_t* shapes = NULL;
+  if (cfg->analytic && !cfg->bvh_two_level && cfg->bvh_lod <= 0) {
+    size_t tri_count = occluder_count;
+    shapes = analytic_occluders(&scene, occluders, triangle_count,
+                                &occluder_count);
+    if (!shapes) {
+      log_error("Failed to find analytic shapes");
+      free(occluders);
+      free(triangles);
+      wf_free_scene(&scene);
+      return 1;
+    }
+    log_info("Analytic shapes: %zu primitives in place of %zu triangles",
+             occluder_count, tri_count);
+  }
+
+  const char*        bvh_name = cfg->bvh ? cfg->bvh : DEFAULT_BVH;
+  bvh_build_params_t bvh_params;
+  bvh_build_params_init(&bvh_params);
+  if (cfg->bvh_leaf_size > 0)
+    bvh_params.max_leaf_size = (uint32_t)cfg->bvh_leaf_size;
+  if (cfg->bvh_bins > 0)
+    bvh_params.bin_count = (uint32_t)cfg->bvh_bins;
+  if (cfg->bvh_split_budget >= 0.0f)
+    bvh_params.split_budget = cfg->bvh_split_budget;
+  bvh_params.shapes = shapes;
+
+  bvh_tree_t*   bvh   = NULL;
+  two_level_t   tl    = { 0 };
+  scene_accel_t accel = { 0 };
+  // Levels of detail are per object, so --lod builds two levels too
+  if (cfg->bvh_two_level || cfg->bvh_lod > 0) {
+    if (!two_level_build(&scene, bvh_name, &bvh_params, cfg->analytic,
+                         cfg->bvh_lod > 0 ? (uint32_t)cfg->bvh_lod : 0,
+                         &tl)) {
+      log_error("Failed to build two-level BVH [%s]", bvh_name);
+      free(shapes);
+      free(occluders);
+      free(triangles);
+      wf_free_scene(&scene);
+      return 1;
+    }
+    accel.tlas = tl.tlas;
+    log_info("BVH [%s] built for %zu objects over %zu triangles", bvh_name,
+             tl.count, occluder_count);
+  } else {
+    bvh = bvh_create_cached(cfg->bvh_cache, bvh_name, occluders,
+                            occluder_count, &scene, &bvh_params);
+    if (!bvh && occluder_count > 0) {
+      log_error("Failed to build BVH [%s]", bvh_name);
+      free(shapes);
+      free(occluders);
+      free(triangles);
+      wf_free_scene(&scene);
+      return 1;
+    }
+    accel.bvh = bvh;
+    log_info("BVH [%s] built over %zu triangles", bvh_name, occluder_count);
+  }
+
   wf_vec3 position = { 0.0f, 1.0f, 2.8f };
   wf_vec3 target   = { 0.0f, 1.0f, -1.0f };
   wf_vec3 up       = { 0.0f, 1.0f, 0.0f };
@@ -260,15 +1344,25 @@ int render_scene(const rtCfg* cfg) {
                     }){ fov_y, aspect });
   if (!cam) {
     log_error("create camera failed");
+    bvh_destroy(bvh);
+    two_level_free(&tl);
+    free(shapes);
+    free(occluders);
     free(triangles);
     wf_free_scene(&scene);
     return 1;
   }
 
+  camera_prepare(cam, cfg->width, cfg->height);
+
   size_t   size  = (size_t)cfg->width * cfg->height * 4;
   uint8_t* image = calloc(size, 1);
   if (!image) {
     camera_destroy(cam);
+    bvh_destroy(bvh);
+    two_level_free(&tl);
+    free(shapes);
+    free(occluders);
     free(triangles);
     wf_free_scene(&scene);
     return 1;
@@ -287,54 +1381,152 @@ int render_scene(const rtCfg* cfg) {
   };
   size_t num_lights = sizeof(lights) / sizeof(lights[0]);
 
-  int            spp     = 64;
+  // Samples per pixel: spp, or with --adaptive from min_spp up to spp
+  int   spp       = cfg->samples > 0 ? cfg->samples : DEFAULT_SPP;
+  float threshold = cfg->adaptive > 0.0f ? cfg->adaptive : 0.0f;
+  int   min_spp   = spp;
+  if (threshold > 0.0f) {
+    min_spp = cfg->min_samples > 0 ? cfg->min_samples : DEFAULT_MIN_SPP;
+    min_spp = min_spp < spp ? min_spp : spp;
+  }
   sampler_t*     sampler = sampler_create_jittered(spp);
   accumulator_t* acc     = accumulator_create_average();
+  bool           ready   = sampler && acc;
+  if (ready)
+    sampler->seed = cfg->seed;
+  else
+    log_error("oom when alloc for sampler");
 
   const int MAX_DEPTH = 3;
+  // Camera ray cones are a pixel wide
+  float pixel_spread = fov_y / (float)cfg->height;
+  // Samples of a pixel traced together, 1 = one ray at a time
+  int packet = cfg->packet_size;
+  if (packet < 1)
+    packet = 1;
+  else if (packet > BVH_PACKET_MAX)
+    packet = BVH_PACKET_MAX;
+  unsigned threads = cfg->threads > 0 ? (unsigned)cfg->threads
+                                      : parallel_cpu_count();
 
-  for (int y = 0; y < cfg->height; ++y) {
-    for (int x = 0; x < cfg->width; ++x) {
-      acc->init(acc, spp);
-      for (int s = 0; s < spp; ++s) {
-        float u_sub, v_sub;
-        sampler->generate(sampler, s, &u_sub, &v_sub);
-        float u   = (x + u_sub) / (float)cfg->width;
-        float v   = 1.0f - (y + v_sub) / (float)cfg->height;
-        ray_t ray = get_camera_ray(cam, u, v);
-
-        wf_vec3 sample_color =
-            trace_ray(&ray, triangles, triangle_count, &scene, rt_materials,
-                      lights, num_lights, 0, MAX_DEPTH);
-        acc->add(acc, &sample_color, s);
-      }
+  wavefront_t    wave;
+  camera_batch_t wave_camera;
+  bool           use_wavefront = false;
+  if (cfg->wavefront && ready) {
+    size_t capacity = WAVEFRONT_POOL_SIZE > spp ? WAVEFRONT_POOL_SIZE : spp;
+    use_wavefront   = wavefront_init(&wave, capacity, &accel, rt_materials,
+                                     scene.material_count, lights, num_lights,
+                                     threads);
+    if (use_wavefront && !camera_batch_init(&wave_camera, wave.capacity)) {
+      wavefront_free(&wave);
+      use_wavefront = false;
+    }
+    if (!use_wavefront)
+      log_error("wavefront pools failed, tracing rays one at a time");
+    else if (threshold > 0.0f)
+      log_info("--adaptive needs the tile renderer, wavefront takes %d "
+               "samples per pixel",
+               spp);
+  }
 
+  // Wavefront: batches of whole pixels, with the same samples as the tiles
+  size_t pixel_count = (size_t)cfg->width * cfg->height;
+  size_t batch       = use_wavefront ? wave.capacity / spp : 0;
+  for (size_t first = 0; use_wavefront && first < pixel_count;
+       first += batch) {
+    size_t last = first + batch < pixel_count ? first + batch : pixel_count;
+    size_t n    = 0;
+    for (size_t p = first; p < last; ++p) {
+      int x = (int)(p % cfg->width);
+      int y = (int)(p / cfg->width);
+      for (int s = 0; s < spp; ++s)
+        wave_camera.samples[n++] =
+            pixel_sample(sampler, cfg->width, cfg->height, x, y, s);
+    }
+    camera_generate_rays(cam, wave_camera.samples, n, &wave_camera.rays);
+    for (size_t i = 0; i < n; ++i) {
+      wave.paths[i].ray    = batch_ray(&wave_camera.rays, i, pixel_spread);
+      wave.paths[i].weight = 1.0f;
+      wave.paths[i].sample = (uint32_t)i;
+    }
+    wave.count = n;
+
+    wavefront_trace(&wave, MAX_DEPTH);
+    for (size_t p = first; p < last; ++p) {
+      acc->init(acc, spp);
+      for (int s = 0; s < spp; ++s)
+        acc->add(acc, &wave.colors[(p - first) * spp + s], s);
       wf_vec3 final_color = acc->get(acc);
-      uint8_t r      = (uint8_t)(fminf(1.0f, fmaxf(0.0f, final_color.x)) * 255);
-      uint8_t g      = (uint8_t)(fminf(1.0f, fmaxf(0.0f, final_color.y)) * 255);
-      uint8_t b      = (uint8_t)(fminf(1.0f, fmaxf(0.0f, final_color.z)) * 255);
-      size_t  idx    = (y * cfg->width + x) * 4;
-      image[idx]     = r;
-      image[idx + 1] = g;
-      image[idx + 2] = b;
-      image[idx + 3] = 255;
+      store_pixel(image, p, &final_color);
     }
   }
 
+  size_t spent = use_wavefront ? pixel_count * spp : 0;
+  if (!use_wavefront && ready) {
+    tile_render_t tiles = { .cam          = cam,
+                            .accel        = &accel,
+                            .rt_materials = rt_materials,
+                            .lights       = lights,
+                            .num_lights   = num_lights,
+                            .width        = cfg->width,
+                            .height       = cfg->height,
+                            .min_spp      = min_spp,
+                            .max_spp      = spp,
+                            .threshold    = threshold,
+                            .packet       = packet,
+                            .max_depth    = MAX_DEPTH,
+                            .pixel_spread = pixel_spread,
+                            .image        = image };
+    spent = render_tiles(&tiles, threads, sampler);
+  }
+  bool rendered = spent > 0;
+  if (rendered)
+    log_info("Traced %zu samples, %.2f per pixel (%d to %d)", spent,
+             (double)spent / (double)pixel_count, min_spp, spp);
+
+  // After rendering, so a lazy tree reports the part the rays built
+  if (cfg->bvh_stats) {
+    size_t ray_count = 0;
+    ray_t* rays      = NULL;
+    if (cfg->bvh_stats_rays > 0)
+      rays = sample_camera_rays(cam, cfg->width, cfg->height,
+                                (size_t)cfg->bvh_stats_rays, &ray_count);
+    if (bvh)
+      log_bvh_stats(bvh_name, bvh, rays, ray_count);
+    // BLASes live in object space, so sample rays go to the flat tree only
+    for (size_t i = 0; i < tl.count; ++i) {
+      char label[64];
+      snprintf(label, sizeof(label), "%s, object %zu", bvh_name, i);
+      log_bvh_stats(label, tl.blas[i], NULL, 0);
+    }
+    free(rays);
+  }
+
   // Cleanup
-  // sampler_destroy(sampler);
-  // accumulator_destroy(acc);
+  sampler_destroy(sampler);
+  accumulator_destroy(acc);
 
-  int result = save_png(cfg->output, cfg->width, cfg->height, image);
+  int result =
+      rendered ? save_png(cfg->output, cfg->width, cfg->height, image) : 0;
   for (size_t i = 0; i < scene.material_count; ++i) {
     rt_material_destroy(rt_materials[i]);
   }
   free(rt_materials);
+  if (use_wavefront) {
+    wavefront_free(&wave);
+    camera_batch_free(&wave_camera);
+  }
   free(image);
   camera_destroy(cam);
+  bvh_destroy(bvh);
+  two_level_free(&tl);
+  free(shapes);
+  free(occluders);
   free(triangles);
   wf_free_scene(&scene);
 
+  if (!rendered)
+    return 1;
   if (result != 0) {
     log_error("Failed to save PNG (code: %d)", result);
     return result;
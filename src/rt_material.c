@@ -33,9 +33,11 @@ rt_material_t* rt_material_from_wf(const wf_material_t* wf_mat) {
     params->albedo    = wf_mat->Kd;
     brdf_name         = "cook_torrance";
     brdf_params       = params;
+    mat->cone_spread  = params->roughness;
   } else {
     // defalut Lambert
-    brdf_params = (void*)&wf_mat->Kd;
+    brdf_params      = (void*)&wf_mat->Kd;
+    mat->cone_spread = 1.0f; // about the width of a diffuse lobe
   }
 
   mat->brdf = brdf_create(brdf_name, brdf_params);
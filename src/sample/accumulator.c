@@ -0,0 +1,10 @@
+// accumulator.c
+#include <stdlib.h>
+#include "sample/accumulator.h"
+
+void accumulator_destroy(accumulator_t* acc) {
+  if (!acc)
+    return;
+  free(acc->data);
+  free(acc);
+}
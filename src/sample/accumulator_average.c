@@ -1,41 +1,64 @@
 // accumulator_average.c
 #include <stdlib.h>
 #include <string.h>
+#include "algo.h"
 #include "sample/accumulator.h"
 
+// Welford: the running mean, and m2 the sum of squared distances from it
 typedef struct {
-  wf_vec3 sum;
+  wf_vec3 mean;
+  wf_vec3 m2;
   int     count;
 } avg_data_t;
 
 static void avg_init(accumulator_t* self, int spp) {
   avg_data_t* d = (avg_data_t*)self->data;
-  d->sum        = (wf_vec3){ 0, 0, 0 };
+  d->mean       = (wf_vec3){ 0, 0, 0 };
+  d->m2         = (wf_vec3){ 0, 0, 0 };
   d->count      = 0;
 }
 
 static void avg_add(accumulator_t* self, const wf_vec3* color, int index) {
   avg_data_t* d = (avg_data_t*)self->data;
-  d->sum.x += color->x;
-  d->sum.y += color->y;
-  d->sum.z += color->z;
   d->count++;
+  wf_vec3 delta = v3_sub(*color, d->mean);
+  d->mean       = v3_add(d->mean, v3_scale(1.0f / d->count, delta));
+  wf_vec3 after = v3_sub(*color, d->mean);
+  d->m2.x += delta.x * after.x;
+  d->m2.y += delta.y * after.y;
+  d->m2.z += delta.z * after.z;
 }
 
 static wf_vec3 avg_get(const accumulator_t* self) {
-  avg_data_t* d = (avg_data_t*)self->data;
-  if (d->count == 0)
+  const avg_data_t* d = (const avg_data_t*)self->data;
+  return d->mean;
+}
+
+static int avg_count(const accumulator_t* self) {
+  const avg_data_t* d = (const avg_data_t*)self->data;
+  return d->count;
+}
+
+static wf_vec3 avg_variance(const accumulator_t* self) {
+  const avg_data_t* d = (const avg_data_t*)self->data;
+  if (d->count < 2)
     return (wf_vec3){ 0, 0, 0 };
-  return (wf_vec3){ d->sum.x / d->count, d->sum.y / d->count,
-                    d->sum.z / d->count };
+  return v3_scale(1.0f / (d->count - 1), d->m2);
 }
 
 accumulator_t* accumulator_create_average(void) {
   accumulator_t* a = malloc(sizeof(accumulator_t));
   avg_data_t*    d = malloc(sizeof(avg_data_t));
+  if (!a || !d) {
+    free(a);
+    free(d);
+    return NULL;
+  }
   a->data          = d;
   a->init          = avg_init;
   a->add           = avg_add;
   a->get           = avg_get;
+  a->count         = avg_count;
+  a->variance      = avg_variance;
   return a;
 }
@@ -0,0 +1,17 @@
+// sampler.c
+#include <stdlib.h>
+#include "sample/sampler.h"
+
+sampler_t* sampler_clone(const sampler_t* sampler) {
+  sampler_t* s = sampler->create_like(sampler);
+  if (s)
+    s->seed = sampler->seed;
+  return s;
+}
+
+void sampler_destroy(sampler_t* sampler) {
+  if (!sampler)
+    return;
+  free(sampler->data);
+  free(sampler);
+}
@@ -3,30 +3,91 @@
 #include <stdlib.h>
 #include "sample/sampler.h"
 
+// Strata are visited in the order of the first two Sobol dimensions, a
+// (0,2)-sequence: every power-of-two prefix of a pixel's samples is
+// stratified along both axes, so a pixel may stop sampling early and
+// still have covered it.
 typedef struct {
-  int spp;
-  int grid_size;
+  int      spp;
+  int      grid_size;
+  uint32_t order[]; // grid_size^2 strata, gy * grid_size + gx
 } jittered_data_t;
 
-static void jittered_generate(const sampler_t* self, size_t idx, float* u,
-                              float* v) {
-  jittered_data_t* d        = (jittered_data_t*)self->data;
-  int              gx       = idx % d->grid_size;
-  int              gy       = idx / d->grid_size;
-  float            jitter_u = ((float)rand() / RAND_MAX) / d->grid_size;
-  float            jitter_v = ((float)rand() / RAND_MAX) / d->grid_size;
-  *u                        = (gx + jitter_u) / d->grid_size;
-  *v                        = (gy + jitter_v) / d->grid_size;
+static void jittered_generate(const sampler_t* self, size_t pixel, size_t idx,
+                              float* u, float* v) {
+  jittered_data_t* d       = (jittered_data_t*)self->data;
+  size_t           strata  = (size_t)d->grid_size * d->grid_size;
+  uint32_t         stratum = d->order[idx % strata];
+  int              gx      = (int)(stratum % d->grid_size);
+  int              gy      = (int)(stratum / d->grid_size);
+
+  uint32_t p  = (uint32_t)pixel;
+  uint32_t i  = (uint32_t)idx;
+  float    ju = sampler_uniform(self->seed, p, i, SAMPLER_DIM_PIXEL_U);
+  float    jv = sampler_uniform(self->seed, p, i, SAMPLER_DIM_PIXEL_V);
+  *u          = (gx + ju) / d->grid_size;
+  *v          = (gy + jv) / d->grid_size;
+}
+
+// Radical inverse of i in base 2, the first Sobol dimension, and the
+// second one; 32-bit fractions
+static uint32_t sobol_0(uint32_t i) {
+  i = (i << 16) | (i >> 16);
+  i = ((i & 0x00ff00ff) << 8) | ((i & 0xff00ff00) >> 8);
+  i = ((i & 0x0f0f0f0f) << 4) | ((i & 0xf0f0f0f0) >> 4);
+  i = ((i & 0x33333333) << 2) | ((i & 0xcccccccc) >> 2);
+  i = ((i & 0x55555555) << 1) | ((i & 0xaaaaaaaa) >> 1);
+  return i;
+}
+
+static uint32_t sobol_1(uint32_t i) {
+  uint32_t r = 0;
+  for (uint32_t v = 1u << 31; i; i >>= 1, v ^= v >> 1) {
+    if (i & 1)
+      r ^= v;
+  }
+  return r;
+}
+
+static sampler_t* jittered_create_like(const sampler_t* self) {
+  return sampler_create_jittered(((jittered_data_t*)self->data)->spp);
 }
 
 sampler_t* sampler_create_jittered(int spp) {
-  sampler_t*       s = malloc(sizeof(sampler_t));
-  jittered_data_t* d = malloc(sizeof(jittered_data_t));
-  d->spp             = spp;
-  d->grid_size       = (int)sqrtf(spp);
-  while (d->grid_size * d->grid_size < spp)
-    d->grid_size++;
-  s->data     = d;
-  s->generate = jittered_generate;
+  int grid_size = (int)sqrtf(spp);
+  while (grid_size * grid_size < spp)
+    grid_size++;
+  if (grid_size < 1)
+    grid_size = 1;
+  int bits = 0; // the power-of-two square the sequence stratifies
+  while ((1 << bits) < grid_size)
+    bits++;
+
+  size_t           strata = (size_t)grid_size * grid_size;
+  sampler_t*       s      = malloc(sizeof(sampler_t));
+  jittered_data_t* d =
+      malloc(sizeof(jittered_data_t) + strata * sizeof(uint32_t));
+  if (!s || !d) {
+    free(s);
+    free(d);
+    return NULL;
+  }
+  d->spp       = spp;
+  d->grid_size = grid_size;
+
+  // The first 4^bits points fall one per cell of that square; cells
+  // outside the grid are skipped, keeping the order of the rest
+  size_t n = 0;
+  for (uint32_t i = 0; n < strata; ++i) {
+    uint32_t gx = bits ? sobol_0(i) >> (32 - bits) : 0;
+    uint32_t gy = bits ? sobol_1(i) >> (32 - bits) : 0;
+    if (gx < (uint32_t)grid_size && gy < (uint32_t)grid_size)
+      d->order[n++] = gy * grid_size + gx;
+  }
+
+  s->data        = d;
+  s->generate    = jittered_generate;
+  s->create_like = jittered_create_like;
+  s->seed        = 0;
   return s;
 }
@@ -6,19 +6,30 @@ typedef struct {
   int spp;
 } random_data_t;
 
-static void random_generate(const sampler_t* self, size_t idx, float* u,
-                            float* v) {
-  (void)self;
-  (void)idx;
-  *u = (float)rand() / RAND_MAX;
-  *v = (float)rand() / RAND_MAX;
+static void random_generate(const sampler_t* self, size_t pixel, size_t idx,
+                            float* u, float* v) {
+  uint32_t p = (uint32_t)pixel;
+  uint32_t i = (uint32_t)idx;
+  *u         = sampler_uniform(self->seed, p, i, SAMPLER_DIM_PIXEL_U);
+  *v         = sampler_uniform(self->seed, p, i, SAMPLER_DIM_PIXEL_V);
+}
+
+static sampler_t* random_create_like(const sampler_t* self) {
+  return sampler_create_random(((random_data_t*)self->data)->spp);
 }
 
 sampler_t* sampler_create_random(int spp) {
   sampler_t*     s = malloc(sizeof(sampler_t));
   random_data_t* d = malloc(sizeof(random_data_t));
-  d->spp           = spp;
-  s->data          = d;
-  s->generate      = random_generate;
+  if (!s || !d) {
+    free(s);
+    free(d);
+    return NULL;
+  }
+  d->spp         = spp;
+  s->data        = d;
+  s->generate    = random_generate;
+  s->create_like = random_create_like;
+  s->seed        = 0;
   return s;
 }
@@ -8,8 +8,9 @@ typedef struct {
   int grid_size; // sqrt(spp)
 } regular_data_t;
 
-static void regular_generate(const sampler_t* self, size_t idx, float* u,
-                             float* v) {
+static void regular_generate(const sampler_t* self, size_t pixel, size_t idx,
+                             float* u, float* v) {
+  (void)pixel;
   regular_data_t* data = (regular_data_t*)self->data;
   int             gx   = idx % data->grid_size;
   int             gy   = idx / data->grid_size;
@@ -17,14 +18,25 @@ static void regular_generate(const sampler_t* self, size_t idx, float* u,
   *v                   = (gy + 0.5f) / data->grid_size;
 }
 
+static sampler_t* regular_create_like(const sampler_t* self) {
+  return sampler_create_regular_grid(((regular_data_t*)self->data)->spp);
+}
+
 sampler_t* sampler_create_regular_grid(int spp) {
   sampler_t*      s = malloc(sizeof(sampler_t));
   regular_data_t* d = malloc(sizeof(regular_data_t));
-  d->spp            = spp;
-  d->grid_size      = (int)sqrtf(spp);
+  if (!s || !d) {
+    free(s);
+    free(d);
+    return NULL;
+  }
+  d->spp       = spp;
+  d->grid_size = (int)sqrtf(spp);
   while (d->grid_size * d->grid_size < spp)
     d->grid_size++; // ensure >= spp
-  s->data     = d;
-  s->generate = regular_generate;
+  s->data        = d;
+  s->generate    = regular_generate;
+  s->create_like = regular_create_like;
+  s->seed        = 0;
   return s;
 }